@@ -0,0 +1,394 @@
+/** @file
+ * @brief accept connections of a listening socket
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "acceptor.h"
+#include "reactor_group.h"
+#include "log.h"
+#include "header.h"
+
+namespace libev {
+
+  static const int kDefaultBatch = 64;
+  static const int64_t kPauseMs = 100;// pause accepting when accept4 keeps failing
+
+  static int OpenSpareFd()
+  {
+    int fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+      EV_LOG(kWarning, "open(/dev/null): %s", strerror(errno));
+    return fd;
+  }
+
+  Acceptor::Acceptor()
+    : reactor_(0), fd_(-1), owns_fd_(0), spare_fd_(-1),
+    callback_(0), user_data_(0), batch_(kDefaultBatch),
+    accepted_(0), dropped_(0), bucket_(0), limiter_(0), throttled_(0), destroyed_(0)
+  {
+    wait_.callback = OnRefill;
+    wait_.user_data = this;
+  }
+
+  Acceptor::~Acceptor()
+  {
+    UnInit();
+  }
+
+  int Acceptor::Listen(Reactor * reactor, const struct sockaddr * addr, socklen_t addrlen,
+      accept_callback callback, void * user_data, int flags, int backlog)
+  {
+    if (reactor == 0 || addr == 0 || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "Acceptor(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    int fd = socket(addr->sa_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+      EV_LOG(kError, "socket: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+    {
+      EV_LOG(kError, "setsockopt(SO_REUSEADDR): %s", strerror(errno));
+      goto fail;
+    }
+
+    if ((flags & kAcceptReusePort)
+        && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+    {
+      EV_LOG(kError, "setsockopt(SO_REUSEPORT): %s", strerror(errno));
+      goto fail;
+    }
+
+    if (bind(fd, addr, addrlen) == -1)
+    {
+      EV_LOG(kError, "bind: %s", strerror(errno));
+      goto fail;
+    }
+
+    if (listen(fd, backlog) == -1)
+    {
+      EV_LOG(kError, "listen: %s", strerror(errno));
+      goto fail;
+    }
+
+    int ret;
+    if ((ret = Init(reactor, fd, callback, user_data)) != kEvOK)
+    {
+      (void)safe_close(fd);
+      return ret;
+    }
+    owns_fd_ = 1;
+    return kEvOK;
+
+fail:
+    int error = errno;
+    (void)safe_close(fd);
+    errno = error;
+    return kEvFailure;
+  }
+
+  int Acceptor::Init(Reactor * reactor, int fd, accept_callback callback, void * user_data)
+  {
+    if (reactor == 0 || fd < 0 || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "Acceptor(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      EV_LOG(kError, "fcntl: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    ev_.fd = fd;
+    ev_.event = kEvIn|kEvPersist;
+    ev_.callback = OnAccept;
+    ev_.user_data = this;
+    pause_ev_.event = kEvTimer;
+    pause_ev_.callback = OnResume;
+    pause_ev_.user_data = this;
+
+    int ret;
+    if ((ret = reactor->Add(&ev_)) != kEvOK)
+      return ret;
+
+    reactor_ = reactor;
+    fd_ = fd;
+    owns_fd_ = 0;
+    // failing to reserve the spare fd is not fatal, accepting is paused instead
+    spare_fd_ = OpenSpareFd();
+    callback_ = callback;
+    user_data_ = user_data;
+    accepted_ = 0;
+    dropped_ = 0;
+    return kEvOK;
+  }
+
+  void Acceptor::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    (void)ev_.Del();
+    (void)pause_ev_.Del();
+    if (throttled_)
+    {
+      limiter_->Cancel(&wait_);
+      throttled_ = 0;
+    }
+    if (spare_fd_ != -1)
+    {
+      (void)safe_close(spare_fd_);
+      spare_fd_ = -1;
+    }
+    if (owns_fd_)
+    {
+      (void)safe_close(fd_);
+      owns_fd_ = 0;
+    }
+    reactor_ = 0;
+    fd_ = -1;
+
+    // tell the callback invoker that the acceptor is gone
+    DestroyedGuard::Destroy(&destroyed_);
+  }
+
+  void Acceptor::SetBatch(int batch)
+  {
+    EV_ASSERT(batch > 0);
+    batch_ = batch;
+  }
+
+  int Acceptor::SetRateLimit(TokenBucket * bucket, RateLimiter * limiter)
+  {
+    if (bucket && limiter == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    // resume with the new limit
+    bucket_ = bucket;
+    if (throttled_)
+    {
+      limiter_->Cancel(&wait_);
+      OnRefill(this);
+    }
+    limiter_ = limiter;
+    return kEvOK;
+  }
+
+  int Acceptor::Drop()
+  {
+    int fd;
+
+    if (spare_fd_ == -1)
+      return kEvFailure;
+
+    // release the spare fd to accept the connection, and close it at once
+    (void)safe_close(spare_fd_);
+    do fd = accept(fd_, 0, 0);
+    while (fd == -1 && errno == EINTR);
+    if (fd != -1)
+    {
+      (void)safe_close(fd);
+      dropped_++;
+      EV_LOG(kDebug, "Acceptor(%p) runs out of fds, a connection is dropped", this);
+    }
+    spare_fd_ = OpenSpareFd();
+
+    if (fd == -1 && errno != EAGAIN && errno != EWOULDBLOCK
+        && errno != ECONNABORTED && errno != EPROTO)
+      return kEvFailure;
+    return kEvOK;
+  }
+
+  void Acceptor::Pause()
+  {
+    EV_LOG(kWarning, "Acceptor(%p) pauses accepting for %d ms", this, (int)kPauseMs);
+    (void)ev_.Del();
+    if (reactor_->AddTimer(&pause_ev_, kPauseMs) != kEvOK)
+    {
+      // keep accepting rather than stopping forever
+      (void)reactor_->Add(&ev_);
+    }
+  }
+
+  void Acceptor::Throttle()
+  {
+    (void)ev_.Del();
+    int64_t ms = bucket_->Delay(reactor_->Now(), 1);
+    if (limiter_->Wait(&wait_, (ms > 0)?(ms):(1)) == kEvOK)
+      throttled_ = 1;
+    else
+      (void)reactor_->Add(&ev_);
+  }
+
+  void Acceptor::OnRefill(void * user_data)
+  {
+    Acceptor * acceptor = (Acceptor *)user_data;
+
+    acceptor->throttled_ = 0;
+    if (acceptor->reactor_->Add(&acceptor->ev_) != kEvOK)
+      acceptor->Pause();
+  }
+
+  void Acceptor::OnResume(int /*fd*/, int event, void * user_data)
+  {
+    Acceptor * acceptor = (Acceptor *)user_data;
+
+    if (event & kEvCanceled)
+      return;
+
+    if (acceptor->spare_fd_ == -1)
+      acceptor->spare_fd_ = OpenSpareFd();
+    if (acceptor->reactor_->Add(&acceptor->ev_) != kEvOK)
+      acceptor->Pause();
+  }
+
+  void Acceptor::OnAccept(int /*fd*/, int event, void * user_data)
+  {
+    Acceptor * acceptor = (Acceptor *)user_data;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;
+
+    if (event & kEvCanceled)
+      return;
+
+    for (int i=0; i<acceptor->batch_; i++)
+    {
+      if (acceptor->bucket_ && acceptor->bucket_->Available(acceptor->reactor_->Now()) == 0)
+      {
+        acceptor->Throttle();
+        return;
+      }
+
+      addrlen = sizeof(addr);
+      do fd = accept4(acceptor->fd_, (struct sockaddr *)&addr, &addrlen,
+          SOCK_NONBLOCK|SOCK_CLOEXEC);
+      while (fd == -1 && errno == EINTR);
+
+      if (fd == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return;
+
+        if (errno == ECONNABORTED || errno == EPROTO || errno == EPERM)
+        {
+          // the connection has gone, or is rejected by the firewall
+          continue;
+        }
+
+        if ((errno == EMFILE || errno == ENFILE) && acceptor->Drop() == kEvOK)
+          continue;
+
+        // ENOBUFS, ENOMEM, or running out of fds without the spare fd
+        EV_LOG(kError, "accept4: %s", strerror(errno));
+        acceptor->Pause();
+        return;
+      }
+
+      acceptor->accepted_++;
+      if (acceptor->bucket_)
+        acceptor->bucket_->Take(1);
+
+      DestroyedGuard destroyed(&acceptor->destroyed_);
+      acceptor->callback_(acceptor, fd, (struct sockaddr *)&addr, addrlen, acceptor->user_data_);
+      if (destroyed.Leave())
+        return;
+    }
+  }
+
+  /************************************************************************/
+  AcceptorGroup::~AcceptorGroup()
+  {
+    UnInit();
+  }
+
+  int AcceptorGroup::Listen(ReactorGroup * group, const struct sockaddr * addr, socklen_t addrlen,
+      accept_callback callback, void * user_data, int backlog)
+  {
+    struct sockaddr_storage bound;
+
+    if (group == 0 || group->size() == 0 || addr == 0
+        || addrlen > sizeof(bound) || !acceptors_.empty())
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    memcpy(&bound, addr, addrlen);
+    for (int i=0; i<group->size(); i++)
+    {
+      Acceptor * acceptor = 0;
+      try
+      {
+        acceptor = new Acceptor;// may throw(caught)
+        acceptors_.push_back(acceptor);// may throw(caught)
+      }
+      catch (...)
+      {
+        delete acceptor;
+        UnInit();
+        return kEvNoMemory;
+      }
+
+      int ret;
+      if ((ret = acceptor->Listen(group->At(i), (struct sockaddr *)&bound, addrlen,
+              callback, user_data, kAcceptReusePort, backlog)) != kEvOK)
+      {
+        UnInit();
+        return ret;
+      }
+
+      if (i == 0)
+      {
+        // the port chosen by the first listener, if the port of 'addr' is 0
+        socklen_t len = sizeof(bound);
+        if (getsockname(acceptor->fd(), (struct sockaddr *)&bound, &len) == -1)
+        {
+          EV_LOG(kError, "getsockname: %s", strerror(errno));
+          UnInit();
+          return kEvFailure;
+        }
+      }
+    }
+    return kEvOK;
+  }
+
+  void AcceptorGroup::UnInit()
+  {
+    for (size_t i=0; i<acceptors_.size(); i++)
+      delete acceptors_[i];
+    acceptors_.clear();
+  }
+
+  Acceptor * AcceptorGroup::At(int index)
+  {
+    EV_ASSERT(index >= 0 && index < size());
+    return acceptors_[(size_t)index];
+  }
+}
@@ -0,0 +1,126 @@
+/** @file
+ * @brief accept connections of a listening socket
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_ACCEPTOR_H
+#define LIBEV_ACCEPTOR_H
+
+#include "ev.h"
+#include "rate_limiter.h"
+#include <sys/socket.h>
+#include <vector>
+
+namespace libev {
+
+  class ReactorGroup;
+  class Acceptor;
+
+  // 'fd' is a new nonblocking and close-on-exec connection, owned by the callback
+  typedef void (*accept_callback)(Acceptor * acceptor, int fd,
+      const struct sockaddr * addr, socklen_t addrlen, void * user_data);
+
+  enum AcceptorFlag
+  {
+    kAcceptReusePort = 0x01   // SO_REUSEPORT, so that several listeners share a port
+  };
+
+  // An acceptor accepts connections with accept4 when the listening socket is readable,
+  // at most 'batch' connections per readiness, so that other events are not starved.
+  // A spare fd is reserved. When the process runs out of fds(EMFILE/ENFILE),
+  // the spare fd is released to accept and close the pending connection,
+  // so that the level triggered listening socket does not stay readable forever.
+  // If that does not help either, accepting is paused for a while.
+  // The acceptor may be deleted inside its callback.
+  class Acceptor
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(Acceptor);
+
+      Reactor * reactor_;
+      int fd_;
+      int owns_fd_;// 'fd_' is created by 'Listen'
+      int spare_fd_;
+      Event ev_;
+      Event pause_ev_;// the timer resuming accepting
+      accept_callback callback_;
+      void * user_data_;
+      int batch_;
+      size_t accepted_;
+      size_t dropped_;
+      TokenBucket * bucket_;
+      RateLimiter * limiter_;
+      RateWait wait_;// resumes accepting when 'bucket_' is refilled
+      int throttled_;
+      int * destroyed_;// set to 1 if the acceptor is destroyed inside its callback
+
+      static void OnAccept(int fd, int event, void * user_data);
+      static void OnResume(int fd, int event, void * user_data);
+      static void OnRefill(void * user_data);
+
+      // accept and close a connection with the spare fd
+      // return kEvOK or kEvFailure
+      int Drop();
+      // stop accepting for a while
+      void Pause();
+      // stop accepting until 'bucket_' is refilled
+      void Throttle();
+
+    public:
+      Acceptor();
+      ~Acceptor();
+
+      // create a socket listening on 'addr', with SO_REUSEADDR,
+      // 'flags' is bit or of AcceptorFlag
+      int Listen(Reactor * reactor, const struct sockaddr * addr, socklen_t addrlen,
+          accept_callback callback, void * user_data,
+          int flags = 0, int backlog = SOMAXCONN);
+      // accept connections of the listening socket 'fd', which is not owned
+      int Init(Reactor * reactor, int fd, accept_callback callback, void * user_data);
+      void UnInit();
+
+      // accept at most 'batch' connections per readiness(64 by default)
+      void SetBatch(int batch);
+      // accept at most the tokens of 'bucket'(one per connection, 0: unlimited),
+      // connections are left in the backlog while it is empty,
+      // and accepting is resumed by the timer of 'limiter' of the same reactor
+      int SetRateLimit(TokenBucket * bucket, RateLimiter * limiter);
+
+      int fd()const {return fd_;}
+      Reactor * reactor()const {return reactor_;}
+      // the number of connections accepted
+      size_t accepted()const {return accepted_;}
+      // the number of connections closed for running out of fds
+      size_t dropped()const {return dropped_;}
+  };
+
+  // one SO_REUSEPORT listener per reactor of a group,
+  // the kernel distributes connections among them.
+  // The callback is invoked in the thread of each reactor.
+  class AcceptorGroup
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(AcceptorGroup);
+
+      std::vector<Acceptor *> acceptors_;
+
+    public:
+      AcceptorGroup() {}
+      ~AcceptorGroup();
+
+      // listen on 'addr' in every reactor of 'group',
+      // if the port of 'addr' is 0, all listeners share the port chosen by the first one.
+      // It must be called before 'ReactorGroup::Start'.
+      int Listen(ReactorGroup * group, const struct sockaddr * addr, socklen_t addrlen,
+          accept_callback callback, void * user_data, int backlog = SOMAXCONN);
+      // it must be called after 'ReactorGroup::Join'
+      void UnInit();
+
+      int size()const {return (int)acceptors_.size();}
+      Acceptor * At(int index);
+  };
+}
+
+#endif
@@ -0,0 +1,239 @@
+/** @file
+ * @brief test acceptors
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "acceptor.h"
+#include "reactor_group.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+#include <sys/resource.h>
+#include <vector>
+
+using namespace libev;
+
+static const int kClients = 32;
+
+static void LoopbackAddress(struct sockaddr_in * addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+// connect 'n' clients to the listening socket 'listener'
+static void Connect(int listener, int n, std::vector<int> * clients)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd;
+
+  EV_VERIFY(getsockname(listener, (struct sockaddr *)&addr, &len) == 0);
+  for (int i=0; i<n; i++)
+  {
+    EV_VERIFY((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    EV_VERIFY(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    clients->push_back(fd);
+  }
+}
+
+static std::vector<int> accepted_fds;
+
+static void Test1_Callback(Acceptor * acceptor, int fd,
+    const struct sockaddr * addr, socklen_t addrlen, void * /*user_data*/)
+{
+  const struct sockaddr_in * in = (const struct sockaddr_in *)addr;
+
+  EV_VERIFY(acceptor->fd() != -1);
+  EV_VERIFY(addrlen == sizeof(struct sockaddr_in));
+  EV_VERIFY(in->sin_family == AF_INET);
+  EV_VERIFY(in->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+  EV_VERIFY(fcntl(fd, F_GETFL) & O_NONBLOCK);
+  EV_VERIFY(fcntl(fd, F_GETFD) & FD_CLOEXEC);
+  accepted_fds.push_back(fd);
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: accept in batches");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Acceptor acceptor;
+  struct sockaddr_in addr;
+  std::vector<int> clients;
+  size_t last;
+
+  LoopbackAddress(&addr);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(acceptor.Listen(reactor.get(), (struct sockaddr *)&addr, sizeof(addr),
+        Test1_Callback, 0) == kEvOK);
+  acceptor.SetBatch(4);
+
+  Connect(acceptor.fd(), kClients, &clients);
+
+  // every readiness accepts at most 4 connections
+  while (accepted_fds.size() < (size_t)kClients)
+  {
+    last = accepted_fds.size();
+    EV_VERIFY(reactor->PollOne() == 1);
+    EV_VERIFY(accepted_fds.size() - last <= 4);
+  }
+  EV_VERIFY(acceptor.accepted() == (size_t)kClients);
+  EV_VERIFY(acceptor.dropped() == 0);
+
+  acceptor.UnInit();
+  CloseAll(&clients);
+  CloseAll(&accepted_fds);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test2_Callback(Acceptor * /*acceptor*/, int fd,
+    const struct sockaddr * /*addr*/, socklen_t /*addrlen*/, void * /*user_data*/)
+{
+  // keep the fd, until fds run out
+  accepted_fds.push_back(fd);
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: survive running out of fds");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Acceptor acceptor;
+  struct sockaddr_in addr;
+  std::vector<int> clients;
+  struct rlimit old_limit, limit;
+  char c;
+  int fd, polls = 0;
+
+  LoopbackAddress(&addr);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(acceptor.Listen(reactor.get(), (struct sockaddr *)&addr, sizeof(addr),
+        Test2_Callback, 0) == kEvOK);
+  Connect(acceptor.fd(), kClients, &clients);
+
+  // only 2 more fds can be opened
+  EV_VERIFY((fd = dup(0)) != -1);
+  EV_VERIFY(getrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+  limit = old_limit;
+  limit.rlim_cur = (rlim_t)fd + 2;
+  safe_close(fd);
+  EV_VERIFY(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+  // the listen queue is drained without busy looping
+  while (acceptor.accepted() + acceptor.dropped() < (size_t)kClients)
+  {
+    EV_VERIFY(reactor->PollOne() == 1);
+    polls++;
+  }
+  EV_VERIFY(setrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+
+  EV_LOG(kInfo, "%d connections accepted, %d dropped in %d polls",
+      (int)acceptor.accepted(), (int)acceptor.dropped(), polls);
+  EV_VERIFY(acceptor.accepted() == 2);
+  EV_VERIFY(acceptor.dropped() == (size_t)kClients - 2);
+  EV_VERIFY(polls == 1);
+
+  // dropped connections are closed
+  EV_VERIFY(read(clients.back(), &c, 1) == 0);
+  // and the acceptor still works after fds are available again
+  CloseAll(&accepted_fds);
+  Connect(acceptor.fd(), 1, &clients);
+  EV_VERIFY(reactor->PollOne() == 1);
+  EV_VERIFY(acceptor.accepted() == 3);
+
+  acceptor.UnInit();
+  CloseAll(&clients);
+  CloseAll(&accepted_fds);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static const int kLoops = 2;
+static int counter;
+static int loop_counter[kLoops];
+
+struct Test3_Helper
+{
+  ReactorGroup * group;
+  AcceptorGroup * acceptors;
+};
+
+static void Test3_Callback(Acceptor * acceptor, int fd,
+    const struct sockaddr * /*addr*/, socklen_t /*addrlen*/, void * user_data)
+{
+  Test3_Helper * helper = (Test3_Helper *)user_data;
+
+  for (int i=0; i<kLoops; i++)
+  {
+    if (helper->acceptors->At(i) == acceptor)
+    {
+      EV_VERIFY(acceptor->reactor() == helper->group->At(i));
+      __sync_add_and_fetch(&loop_counter[i], 1);
+    }
+  }
+
+  safe_close(fd);
+  if (__sync_add_and_fetch(&counter, 1) == kClients)
+    EV_VERIFY(helper->group->Stop() == kEvOK);
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: one SO_REUSEPORT listener per reactor");
+
+  ReactorGroup group;
+  AcceptorGroup acceptors;
+  Test3_Helper helper;
+  struct sockaddr_in addr;
+  std::vector<int> clients;
+
+  counter = 0;
+  helper.group = &group;
+  helper.acceptors = &acceptors;
+
+  LoopbackAddress(&addr);
+  EV_VERIFY(group.Init(kLoops, 0) == kEvOK);
+  EV_VERIFY(acceptors.Listen(&group, (struct sockaddr *)&addr, sizeof(addr),
+        Test3_Callback, &helper) == kEvOK);
+  EV_VERIFY(acceptors.size() == kLoops);
+
+  // all listeners share one port
+  for (int i=0; i<kLoops; i++)
+  {
+    struct sockaddr_in bound[2];
+    socklen_t len = sizeof(bound[0]);
+    EV_VERIFY(getsockname(acceptors.At(0)->fd(), (struct sockaddr *)&bound[0], &len) == 0);
+    EV_VERIFY(getsockname(acceptors.At(i)->fd(), (struct sockaddr *)&bound[1], &len) == 0);
+    EV_VERIFY(bound[0].sin_port == bound[1].sin_port);
+  }
+
+  Connect(acceptors.At(0)->fd(), kClients, &clients);
+  EV_VERIFY(group.Run() == kEvOK);
+
+  for (int i=0; i<kLoops; i++)
+    EV_LOG(kInfo, "reactor %d accepted %d connections", i, loop_counter[i]);
+  EV_VERIFY(counter == kClients);
+  EV_VERIFY(loop_counter[0] + loop_counter[1] == kClients);
+
+  acceptors.UnInit();
+  CloseAll(&clients);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  return 0;
+}
@@ -0,0 +1,59 @@
+/** @file
+ * @brief backends polling fds and the timer for reactor
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_BACKEND_H
+#define LIBEV_BACKEND_H
+
+#include "ev-internal.h"
+#include "header.h"
+
+namespace libev {
+
+  class Backend
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(Backend);
+
+    public:
+      Backend() {}
+      virtual ~Backend() {}
+
+      virtual int Init() = 0;
+
+      // change the events of 'fd' from 'old_events' to 'new_events',
+      // which are bit or of EPOLLIN, EPOLLOUT and EPOLLET.
+      // 'old_events' == 0 means 'fd' is not registered,
+      // 'new_events' == 0 means 'fd' is to be unregistered.
+      // If 'old_events' == 'new_events', 'fd' may have been closed
+      // and its number may have been reused, so it must be registered again.
+      virtual int Ctl(int fd, int old_events, int new_events) = 0;
+
+      // arm the timer to expire at the absolute and monotonic 'deadline'
+      virtual void SetTimer(const timespec * deadline) = 0;
+
+      // wait for ready fds,
+      // if 'blocking' == 0, return immediately,
+      // if 'blocking' == 1, wait until any fd is ready or the timer expires.
+      // Set '*timer_expired' to 1 if the timer expires.
+      // return the number of ready fds filled in 'events()', or kEvFailure
+      virtual int Wait(int blocking, int * timer_expired) = 0;
+
+      // ready fds(epoll_event.data.fd) and their events(EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP)
+      // filled by the last 'Wait'
+      virtual const epoll_event * events()const = 0;
+
+      // backend name for logging
+      virtual const char * name()const = 0;
+  };
+
+  // create backends, return 0 if not supported
+  // 'flags' is bit or of InitFlag
+  Backend * NewEpollBackend(int flags);
+  Backend * NewIOUringBackend();
+}
+
+#endif
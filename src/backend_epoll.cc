@@ -0,0 +1,345 @@
+/** @file
+ * @brief epoll backend
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "backend.h"
+#include "ev.h"
+#include "log.h"
+#include <vector>
+
+namespace libev {
+
+  static const int kEpollSize = 20480;
+  static const int kEpollEventsSize = 32;
+  static const int kEpollEventsMaxSize = 10240;
+
+  // 0 if epoll_pwait2 is not supported by the kernel
+  static int has_epoll_pwait2 = 1;
+
+  class EpollBackend : public Backend
+  {
+    private:
+      int epfd_;
+      int timerfd_;
+      std::vector<epoll_event> ep_ev_;// for epoll_wait
+      int grow_;// 'ep_ev_' was filled up by the last epoll_wait
+
+      // kEvNoTimerFd: the timer is not a timerfd,
+      // the timeout of epoll_wait is derived from 'deadline_'
+      int use_timerfd_;
+      int has_deadline_;
+      timespec deadline_;
+      int clamped_;// the timeout of the last epoll_wait was clamped before 'deadline_'
+
+      void OnTimerReadable();
+      int WaitDeadline(int blocking);
+
+    public:
+      explicit EpollBackend(int use_timerfd)
+        : epfd_(-1), timerfd_(-1), grow_(0),
+        use_timerfd_(use_timerfd), has_deadline_(0), clamped_(0) {}
+      virtual ~EpollBackend();
+
+      virtual int Init();
+      virtual int Ctl(int fd, int old_events, int new_events);
+      virtual void SetTimer(const timespec * deadline);
+      virtual int Wait(int blocking, int * timer_expired);
+      virtual const epoll_event * events()const {return &ep_ev_[0];}
+      virtual const char * name()const {return "epoll";}
+  };
+
+
+  /************************************************************************/
+  EpollBackend::~EpollBackend()
+  {
+    if (epfd_ != -1)
+      safe_close(epfd_);
+    if (timerfd_ != -1)
+      safe_close(timerfd_);
+  }
+
+  int EpollBackend::Init()
+  {
+    try
+    {
+      ep_ev_.resize(kEpollEventsSize);// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+
+
+    if (use_timerfd_)
+    {
+      timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+      if (timerfd_ == -1)
+      {
+        EV_LOG(kError, "timerfd_create: %s", strerror(errno));
+        return kEvFailure;
+      }
+    }
+
+
+    epfd_ = epoll_create(kEpollSize);
+    if (epfd_ == -1)
+    {
+      EV_LOG(kError, "epoll_create: %s", strerror(errno));
+      return kEvFailure;
+    }
+    // close after execve
+    if (fcntl(epfd_, F_SETFD, 1) == -1)
+    {
+      EV_LOG(kWarning, "fcntl: %s", strerror(errno));
+      // ignore the failure of fcntl
+    }
+
+
+    if (timerfd_ != -1)
+    {
+      epoll_event epev;
+      epev.data.u64 = 0;// suppress valgrind warnings
+      epev.data.fd = timerfd_;
+      epev.events = EPOLLIN|EPOLLET;
+      if (epoll_ctl(epfd_, EPOLL_CTL_ADD, timerfd_, &epev) == -1)
+      {
+        EV_LOG(kError, "epoll_ctl: %s", strerror(errno));
+        return kEvFailure;
+      }
+    }
+
+    return kEvOK;
+  }
+
+  int EpollBackend::Ctl(int fd, int old_events, int new_events)
+  {
+    int op;
+    if (new_events == 0)
+      op = EPOLL_CTL_DEL;
+    else if (old_events == 0)
+      op = EPOLL_CTL_ADD;
+    else
+      op = EPOLL_CTL_MOD;
+
+    epoll_event epev;
+    epev.data.u64 = 0;// suppress valgrind warnings
+    epev.data.fd = fd;
+    epev.events = (uint32_t)new_events;
+    EV_LOG(kDebug, "epoll_ctl: op=%d fd=%d", op, fd);
+    int result = epoll_ctl(epfd_, op, fd, &epev);
+    if (result == -1 && op == EPOLL_CTL_MOD && errno == ENOENT)
+    {
+      // the fd has been closed and its number has been reused
+      EV_LOG(kDebug, "epoll_ctl: op=%d fd=%d", EPOLL_CTL_ADD, fd);
+      result = epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &epev);
+    }
+
+    if (result == -1)
+    {
+      if (op != EPOLL_CTL_DEL)
+        EV_LOG(kError, "epoll_ctl: %s", strerror(errno));
+      return kEvFailure;
+    }
+    return kEvOK;
+  }
+
+  void EpollBackend::SetTimer(const timespec * deadline)
+  {
+    if (timerfd_ == -1)
+    {
+      // no syscall, the next epoll_wait will use it
+      deadline_ = *deadline;
+      has_deadline_ = 1;
+      return;
+    }
+
+    itimerspec timerspec;
+    timerspec.it_value = *deadline;
+    timerspec.it_interval.tv_sec = 0;
+    timerspec.it_interval.tv_nsec = 0;
+
+    EV_LOG(kDebug, "timerfd_settime: seconds=%ld nanoseconds=%ld",
+        (long)timerspec.it_value.tv_sec, (long)timerspec.it_value.tv_nsec);
+    EV_VERIFY(timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &timerspec, 0) != -1);
+  }
+
+  void EpollBackend::OnTimerReadable()
+  {
+    int result;
+    uint64_t expire;
+
+    for (;;)
+    {
+      do result = read(timerfd_, &expire, sizeof(expire));
+      while (result == -1 && errno == EINTR);
+
+      if (result == -1 && errno == EAGAIN)
+        break;
+    }
+  }
+
+  int EpollBackend::WaitDeadline(int blocking)
+  {
+    int epevents_size = (int)ep_ev_.size();
+    timespec now, timeout;
+    timespec * timeout_ptr;
+    int result;
+
+    for (;;)
+    {
+      // compute the relative timeout again after being interrupted
+      timeout_ptr = &timeout;
+      if (!blocking)
+      {
+        timespec_clear(&timeout);
+      }
+      else if (has_deadline_)
+      {
+        EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+        timeout = deadline_;
+        timespec_subto(&timeout, &now);
+        if (timeout.tv_sec < 0)
+          timespec_clear(&timeout);
+      }
+      else
+      {
+        timeout_ptr = 0;
+      }
+
+#if defined SYS_epoll_pwait2
+      if (has_epoll_pwait2)
+      {
+        EV_LOG(kDebug, "epoll_pwait2");
+        result = (int)syscall(SYS_epoll_pwait2, epfd_, &ep_ev_[0], epevents_size,
+            timeout_ptr, (void *)0, (size_t)0);
+        EV_LOG(kDebug, "after epoll_pwait2");
+        if (result == -1 && errno == ENOSYS)
+        {
+          EV_LOG(kInfo, "epoll_pwait2 is not supported, use epoll_wait");
+          has_epoll_pwait2 = 0;
+          continue;
+        }
+      }
+      else
+#endif
+      {
+        // round up to milliseconds, never wake up before 'deadline_',
+        // and clamp deadlines beyond INT_MAX milliseconds(about 24.8 days),
+        // whose negative timeouts would block forever
+        int timeout_ms = -1;
+        clamped_ = 0;
+        if (timeout_ptr)
+        {
+          if (timeout.tv_sec >= (time_t)(INT_MAX / 1000))
+          {
+            timeout_ms = INT_MAX;
+            clamped_ = 1;
+          }
+          else
+          {
+            timeout_ms = (int)(timeout.tv_sec * 1000 + (timeout.tv_nsec + 999999) / 1000000);
+          }
+        }
+
+        EV_LOG(kDebug, "epoll_wait");
+        result = epoll_wait(epfd_, &ep_ev_[0], epevents_size, timeout_ms);
+        EV_LOG(kDebug, "after epoll_wait");
+      }
+
+      if (result == -1 && errno == EINTR)
+        continue;
+      return result;
+    }
+  }
+
+  int EpollBackend::Wait(int blocking, int * timer_expired)
+  {
+    // check and resize 'ep_ev_' to make epoll_wait get more results
+    if (grow_)
+    {
+      grow_ = 0;
+      try
+      {
+        ep_ev_.resize(ep_ev_.size() * 2);// may throw(caught)
+      }
+      catch (...)
+      {
+      }
+    }
+
+    int epevents_size = (int)ep_ev_.size();
+    int result;
+
+    *timer_expired = 0;
+    if (timerfd_ == -1)
+    {
+      result = WaitDeadline(blocking);
+      if (result == -1)
+        return kEvFailure;
+
+      if (result == epevents_size && epevents_size < kEpollEventsMaxSize)
+        grow_ = 1;
+
+      if (has_deadline_)
+      {
+        // a blocking wait returning nothing has reached the deadline, unless it was clamped
+        if (blocking && result == 0 && !clamped_)
+        {
+          *timer_expired = 1;
+        }
+        else
+        {
+          timespec now;
+          EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+          *timer_expired = timespec_le(&deadline_, &now);
+        }
+
+        if (*timer_expired)
+          has_deadline_ = 0;
+      }
+      return result;
+    }
+
+    EV_LOG(kDebug, "epoll_wait");
+    do result = epoll_wait(epfd_, &ep_ev_[0], epevents_size, (blocking)?(-1):(0));
+    while (result == -1 && errno == EINTR);
+    EV_LOG(kDebug, "after epoll_wait");
+
+    if (result == -1)
+      return kEvFailure;
+
+    if (result == epevents_size && epevents_size < kEpollEventsMaxSize)
+      grow_ = 1;
+
+    for (int i=0; i<result; i++)
+    {
+      if (ep_ev_[(size_t)i].data.fd == timerfd_)
+      {
+        OnTimerReadable();
+        *timer_expired = 1;
+        ep_ev_[(size_t)i] = ep_ev_[(size_t)result - 1];
+        result--;
+        break;
+      }
+    }
+
+    return result;
+  }
+
+
+  /************************************************************************/
+  Backend * NewEpollBackend(int flags)
+  {
+    try
+    {
+      return new EpollBackend((flags & kEvNoTimerFd) == 0);// may throw(caught)
+    }
+    catch (...)
+    {
+      return 0;
+    }
+  }
+}
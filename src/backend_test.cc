@@ -0,0 +1,341 @@
+/** @file
+ * @brief test reactor backends
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <pthread.h>
+
+using namespace libev;
+
+static const int kTimes = 100;
+static int counter;
+
+static const int kBackends[] = {kEvBackendEpoll, kEvBackendEpoll|kEvNoTimerFd, kEvBackendIOUring};
+static const char * const kBackendNames[] = {"epoll", "epoll without timerfd", "io_uring"};
+
+// return 0 if 'flags' is not supported by the kernel
+// set 'ts' to 'usec' microseconds later
+static void After(timespec * ts, long usec)
+{
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, ts) != -1);
+  ts->tv_nsec += usec * 1000;
+  ts->tv_sec += ts->tv_nsec / 1000000000;
+  ts->tv_nsec %= 1000000000;
+}
+
+static Reactor * NewReactor(int flags)
+{
+  Reactor * reactor = new Reactor;
+  if (reactor->Init(flags) != kEvOK)
+  {
+    delete reactor;
+    return 0;
+  }
+  return reactor;
+}
+
+
+static void Test0_Callback(int /*fd*/, int event, void * user_data)
+{
+  const timespec * timeout = (const timespec *)user_data;
+  timespec now;
+
+  // timers never expire early
+  EV_VERIFY(event & kEvTimer);
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  EV_VERIFY(timespec_le(timeout, &now));
+  counter++;
+}
+
+static void Test0(int flags)
+{
+  EV_LOG(kInfo, "Test 0: timers expire in order");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(NewReactor(flags));
+  if (reactor.get() == 0)
+    return;
+
+  Event ev[kTimes];
+  timespec begin, end;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &begin) != -1);
+  for (int i=0; i<kTimes; i++)
+  {
+    ev[i].fd = -1;
+    ev[i].event = kEvTimer;
+    ev[i].callback = Test0_Callback;
+    ev[i].user_data = &ev[i].timeout;
+    After(&ev[i].timeout, (kTimes - i) * 100);// 0.1ms ~ 10ms
+    EV_VERIFY(reactor->Add(&ev[i]) == kEvOK);
+  }
+
+  (void)reactor->Run();
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &end) != -1);
+  EV_VERIFY(counter == kTimes);
+
+  long elapsed_ms = (long)(end.tv_sec - begin.tv_sec) * 1000
+    + (end.tv_nsec - begin.tv_nsec) / 1000000;
+  EV_LOG(kInfo, "elapsed: %ldms", elapsed_ms);
+  EV_VERIFY(elapsed_ms >= 9);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+struct Test1_Helper
+{
+  Reactor * reactor;
+  Event ev_in;
+  Event ev_out;
+  int fd[2];
+};
+
+static void Test1_InCallback(int fd, int event, void * user_data)
+{
+  Test1_Helper * helper = (Test1_Helper *)user_data;
+  char c;
+
+  // level-triggered: the event keeps firing until the fd is drained,
+  // so read only one byte each time
+  EV_VERIFY(event & kEvIn);
+  EV_VERIFY(read(fd, &c, 1) == 1);
+  if (++counter == kTimes)
+    EV_VERIFY(helper->ev_in.Del() == kEvOK);
+}
+
+static void Test1_OutCallback(int /*fd*/, int event, void * user_data)
+{
+  Test1_Helper * helper = (Test1_Helper *)user_data;
+  char buf[kTimes];
+
+  EV_VERIFY(event & kEvOut);
+  memset(buf, 'x', sizeof(buf));
+  EV_VERIFY(write(helper->fd[1], buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+}
+
+static void Test1(int flags)
+{
+  EV_LOG(kInfo, "Test 1: level-triggered persistent events and one-shot events");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(NewReactor(flags));
+  if (reactor.get() == 0)
+    return;
+
+  Test1_Helper helper;
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, helper.fd) == 0);
+  helper.reactor = reactor.get();
+  helper.ev_in.fd = helper.fd[0];
+  helper.ev_in.event = kEvIn|kEvPersist;
+  helper.ev_in.callback = Test1_InCallback;
+  helper.ev_in.user_data = &helper;
+  helper.ev_out.fd = helper.fd[1];
+  helper.ev_out.event = kEvOut;
+  helper.ev_out.callback = Test1_OutCallback;
+  helper.ev_out.user_data = &helper;
+
+  EV_VERIFY(reactor->Add(&helper.ev_in) == kEvOK);
+  EV_VERIFY(reactor->Add(&helper.ev_out) == kEvOK);
+  (void)reactor->Run();
+  EV_VERIFY(counter == kTimes);
+
+  reactor.reset();
+  safe_close(helper.fd[0]);
+  safe_close(helper.fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+struct Test2_Helper
+{
+  Reactor * reactor;
+  Event ev;
+  Event timer;
+  int fd[2];
+};
+
+static void Test2_Callback(int fd, int event, void * /*user_data*/)
+{
+  char buf[64];
+
+  // edge-triggered: drain the fd
+  EV_VERIFY(event & kEvIn);
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  EV_VERIFY(errno == EAGAIN);
+  counter++;
+}
+
+static void Test2_TimerCallback(int /*fd*/, int /*event*/, void * user_data)
+{
+  Test2_Helper * helper = (Test2_Helper *)user_data;
+
+  if (counter < kTimes)
+  {
+    EV_VERIFY(write(helper->fd[1], "x", 1) == 1);
+    After(&helper->timer.timeout, 100);// 0.1ms
+    EV_VERIFY(helper->reactor->Add(&helper->timer) == kEvOK);
+  }
+  else
+  {
+    EV_VERIFY(helper->ev.Del() == kEvOK);
+  }
+}
+
+static void Test2(int flags)
+{
+  EV_LOG(kInfo, "Test 2: edge-triggered events");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(NewReactor(flags));
+  if (reactor.get() == 0)
+    return;
+
+  Test2_Helper helper;
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, helper.fd) == 0);
+  EV_VERIFY(fcntl(helper.fd[0], F_SETFL, O_NONBLOCK) == 0);
+  helper.reactor = reactor.get();
+  helper.ev.fd = helper.fd[0];
+  helper.ev.event = kEvIn|kEvPersist|kEvET;
+  helper.ev.callback = Test2_Callback;
+  helper.ev.user_data = &helper;
+  helper.timer.fd = -1;
+  helper.timer.event = kEvTimer;
+  helper.timer.callback = Test2_TimerCallback;
+  helper.timer.user_data = &helper;
+  After(&helper.timer.timeout, 100);// 0.1ms
+
+  EV_VERIFY(reactor->Add(&helper.ev) == kEvOK);
+  EV_VERIFY(reactor->Add(&helper.timer) == kEvOK);
+  (void)reactor->Run();
+  // every write triggers exactly one edge
+  EV_VERIFY(counter == kTimes);
+
+  reactor.reset();
+  safe_close(helper.fd[0]);
+  safe_close(helper.fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test3_Callback(void * user_data)
+{
+  Reactor * reactor = (Reactor *)user_data;
+  if (++counter == kTimes)
+    EV_VERIFY(reactor->Stop() == kEvOK);
+}
+
+static void * Test3_ThreadFunc(void * arg)
+{
+  Reactor * reactor = (Reactor *)arg;
+  for (int i=0; i<kTimes; i++)
+  {
+    EV_VERIFY(reactor->Post(Test3_Callback, reactor) == kEvOK);
+    usleep(100);
+  }
+  return 0;
+}
+
+static void Test3(int flags)
+{
+  EV_LOG(kInfo, "Test 3: posted tasks wake the reactor up");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(NewReactor(flags));
+  if (reactor.get() == 0)
+    return;
+
+  pthread_t tid;
+  reactor->Ref();
+  EV_VERIFY(pthread_create(&tid, 0, Test3_ThreadFunc, reactor.get()) == 0);
+  (void)reactor->Run();
+  EV_VERIFY(pthread_join(tid, 0) == 0);
+  reactor->Unref();
+  EV_VERIFY(counter == kTimes);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test4_Callback(void * user_data)
+{
+  Reactor * reactor = (Reactor *)user_data;
+  EV_VERIFY(reactor->Stop() == kEvOK);
+}
+
+static void * Test4_ThreadFunc(void * arg)
+{
+  Reactor * reactor = (Reactor *)arg;
+  usleep(300 * 1000);
+  EV_VERIFY(reactor->Post(Test4_Callback, reactor) == kEvOK);
+  return 0;
+}
+
+static void Test4(int flags)
+{
+  EV_LOG(kInfo, "Test 4: timers far in the future");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(NewReactor(flags));
+  if (reactor.get() == 0)
+    return;
+
+  // 2^32 milliseconds and 100 milliseconds later,
+  // whose timeout in int milliseconds would wrap to 100
+  Event ev;
+  ev.fd = -1;
+  ev.event = kEvTimer;
+  ev.callback = Test0_Callback;
+  ev.user_data = &ev.timeout;
+  After(&ev.timeout, (long)((1LL << 32) + 100) * 1000);
+  EV_VERIFY(reactor->Add(&ev) == kEvOK);
+
+  pthread_t tid;
+  EV_VERIFY(pthread_create(&tid, 0, Test4_ThreadFunc, reactor.get()) == 0);
+  (void)reactor->Run();
+  EV_VERIFY(pthread_join(tid, 0) == 0);
+  EV_VERIFY(counter == 0);
+  EV_VERIFY(reactor->Del(&ev) == kEvOK);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+int main()
+{
+  for (size_t i=0; i<sizeof(kBackends)/sizeof(kBackends[0]); i++)
+  {
+    ScopedPtr<Reactor> reactor(NewReactor(kBackends[i]));
+    if (reactor.get() == 0)
+    {
+      EV_LOG(kWarning, "%s is not supported, skipped", kBackendNames[i]);
+      continue;
+    }
+    reactor.reset();
+
+    EV_LOG(kInfo, "Backend: %s", kBackendNames[i]);
+    Test0(kBackends[i]);
+    Test1(kBackends[i]);
+    Test2(kBackends[i]);
+    Test3(kBackends[i]);
+    Test4(kBackends[i]);
+  }
+
+  // kEvBackendAuto must always work
+  ScopedPtr<Reactor> reactor(NewReactor(kEvBackendAuto));
+  EV_VERIFY(reactor.get() != 0);
+  return 0;
+}
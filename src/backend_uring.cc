@@ -0,0 +1,514 @@
+/** @file
+ * @brief io_uring backend
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "backend.h"
+#include "ev.h"
+#include "log.h"
+#include <vector>
+
+#if defined HAVE_LINUX_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+#endif
+
+namespace libev {
+
+#if defined HAVE_LINUX_IO_URING
+
+  static const unsigned kUringEntries = 1024;
+  static const size_t kUringPollsSize = 32;
+
+  // user_data of requests whose completions are ignored(removals)
+  static const uint64_t kIgnoredTag = ~(uint64_t)0;
+  // user_data of timeout requests: kTimerTag | generation
+  static const uint64_t kTimerTag = (uint64_t)1 << 63;
+  // user_data of poll requests: (generation << 32) | fd, generation < 2^31
+
+  inline int io_uring_setup(unsigned entries, io_uring_params * p)
+  {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+  }
+
+  inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+  {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+  }
+
+  class UringBackend : public Backend
+  {
+    private:
+      struct Poll
+      {
+        int events;// registered events
+        uint32_t gen;// generation, changed every time the poll request is replaced
+        int armed;// a poll request is in flight
+        int result;// index in 'results_' filled by the current 'Wait', or -1
+        Poll() : events(0), gen(0), armed(0), result(-1) {}
+      };
+
+      int ring_fd_;
+      void * sq_ring_;
+      size_t sq_ring_size_;
+      void * cq_ring_;
+      size_t cq_ring_size_;
+      io_uring_sqe * sqes_;
+      size_t sqes_size_;
+
+      unsigned * sq_head_;
+      unsigned * sq_tail_;
+      unsigned * sq_array_;
+      unsigned sq_mask_;
+      unsigned sq_entries_;
+      unsigned sq_local_tail_;// tail including prepared requests
+      unsigned to_submit_;// prepared but not submitted requests
+
+      unsigned * cq_head_;
+      unsigned * cq_tail_;
+      unsigned cq_mask_;
+      io_uring_cqe * cqes_;
+
+      std::vector<Poll> polls_;// fd to Poll array
+      std::vector<int> rearms_;// fds whose one-shot poll requests have completed
+      std::vector<epoll_event> results_;
+
+      timespec deadline_;
+      __kernel_timespec timer_ts_;// referred by the timeout request
+      uint32_t timer_gen_;
+      int timer_armed_;
+      int timer_dirty_;
+
+      static uint64_t PollTag(int fd, uint32_t gen)
+      {
+        return ((uint64_t)gen << 32) | (uint32_t)fd;
+      }
+
+      int ResizePolls(int fd);
+      // get a free submission queue entry, submit prepared requests if it is full
+      io_uring_sqe * GetSqe();
+      int Submit(unsigned min_complete, unsigned flags);
+      int Arm(int fd);
+      int ArmTimer();
+      void OnCompletion(const io_uring_cqe * cqe, int * nresults, int * timer_expired);
+
+    public:
+      UringBackend() : ring_fd_(-1), sq_ring_(MAP_FAILED), sq_ring_size_(0),
+        cq_ring_(MAP_FAILED), cq_ring_size_(0), sqes_((io_uring_sqe *)MAP_FAILED), sqes_size_(0),
+        sq_head_(0), sq_tail_(0), sq_array_(0), sq_mask_(0), sq_entries_(0),
+        sq_local_tail_(0), to_submit_(0), cq_head_(0), cq_tail_(0), cq_mask_(0), cqes_(0),
+        timer_gen_(0), timer_armed_(0), timer_dirty_(0)
+      {
+        timespec_clear(&deadline_);
+      }
+      virtual ~UringBackend();
+
+      virtual int Init();
+      virtual int Ctl(int fd, int old_events, int new_events);
+      virtual void SetTimer(const timespec * deadline);
+      virtual int Wait(int blocking, int * timer_expired);
+      virtual const epoll_event * events()const {return &results_[0];}
+      virtual const char * name()const {return "io_uring";}
+  };
+
+
+  /************************************************************************/
+  UringBackend::~UringBackend()
+  {
+    if (sqes_ != MAP_FAILED)
+      munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+      munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED)
+      munmap(sq_ring_, sq_ring_size_);
+    if (ring_fd_ != -1)
+      safe_close(ring_fd_);
+  }
+
+  int UringBackend::Init()
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd_ = io_uring_setup(kUringEntries, &params);
+    if (ring_fd_ == -1)
+    {
+      EV_LOG(kWarning, "io_uring_setup: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    // EPOLLET in poll masks needs IORING_FEAT_POLL_32BITS(Linux 5.9),
+    // multishot poll requests need Linux 5.13, which brings IORING_FEAT_RSRC_TAGS
+    if ((params.features & IORING_FEAT_POLL_32BITS) == 0
+        || (params.features & IORING_FEAT_RSRC_TAGS) == 0
+        || (params.features & IORING_FEAT_NODROP) == 0)
+    {
+      EV_LOG(kWarning, "io_uring: features(%#x) are not supported", params.features);
+      errno = ENOSYS;
+      return kEvFailure;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (cq_ring_size_ > sq_ring_size_)
+        sq_ring_size_ = cq_ring_size_;
+      cq_ring_size_ = sq_ring_size_;
+    }
+
+    sq_ring_ = mmap(0, sq_ring_size_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+    {
+      EV_LOG(kError, "mmap: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      cq_ring_ = sq_ring_;
+    }
+    else
+    {
+      cq_ring_ = mmap(0, cq_ring_size_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+          ring_fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED)
+      {
+        EV_LOG(kError, "mmap: %s", strerror(errno));
+        return kEvFailure;
+      }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *)mmap(0, sqes_size_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+    {
+      EV_LOG(kError, "mmap: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    char * sq = (char *)sq_ring_;
+    sq_head_ = (unsigned *)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+    sq_array_ = (unsigned *)(sq + params.sq_off.array);
+    sq_mask_ = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_entries_ = *(unsigned *)(sq + params.sq_off.ring_entries);
+    sq_local_tail_ = *sq_tail_;
+
+    char * cq = (char *)cq_ring_;
+    cq_head_ = (unsigned *)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    try
+    {
+      polls_.resize(kUringPollsSize);// may throw(caught)
+      rearms_.reserve(kUringPollsSize);// may throw(caught)
+      results_.resize(kUringPollsSize);// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+
+    return kEvOK;
+  }
+
+  int UringBackend::ResizePolls(int fd)
+  {
+    size_t sfd = (size_t)fd;
+    size_t new_size = polls_.size();
+    if (sfd < new_size)
+      return kEvOK;
+
+    while (new_size <= sfd)
+      new_size <<= 1;
+
+    try
+    {
+      // every fd has at most one result and one re-arm per 'Wait',
+      // so 'results_' and 'rearms_' never overflow
+      results_.resize(new_size);// may throw(caught)
+      rearms_.reserve(new_size);// may throw(caught)
+      polls_.resize(new_size);// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+    return kEvOK;
+  }
+
+  io_uring_sqe * UringBackend::GetSqe()
+  {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_local_tail_ - head == sq_entries_)
+    {
+      if (Submit(0, 0) != kEvOK)
+        return 0;
+      head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+      if (sq_local_tail_ - head == sq_entries_)
+      {
+        errno = EBUSY;
+        return 0;
+      }
+    }
+
+    unsigned index = sq_local_tail_ & sq_mask_;
+    io_uring_sqe * sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sq_local_tail_++;
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    to_submit_++;
+    return sqe;
+  }
+
+  int UringBackend::Submit(unsigned min_complete, unsigned flags)
+  {
+    int result;
+
+    do result = io_uring_enter(ring_fd_, to_submit_, min_complete, flags);
+    while (result == -1 && errno == EINTR && to_submit_ != 0);
+
+    if (result == -1)
+    {
+      // EINTR: interrupted while waiting
+      // EBUSY, EAGAIN: completions are to be reaped first
+      if (errno == EINTR || errno == EBUSY || errno == EAGAIN)
+        return kEvOK;
+      EV_LOG(kError, "io_uring_enter: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    EV_ASSERT((unsigned)result <= to_submit_);
+    to_submit_ -= (unsigned)result;
+    return kEvOK;
+  }
+
+  int UringBackend::Arm(int fd)
+  {
+    Poll * poll = &polls_[(size_t)fd];
+    io_uring_sqe * sqe = GetSqe();
+    if (sqe == 0)
+      return kEvFailure;
+
+    // Level-triggered polls are one-shot and re-armed before every 'Wait',
+    // which reports fds that are still ready.
+    // Edge-triggered polls are multishot.
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = (uint32_t)poll->events;
+    if (poll->events & EPOLLET)
+      sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = PollTag(fd, poll->gen);
+    poll->armed = 1;
+    return kEvOK;
+  }
+
+  int UringBackend::ArmTimer()
+  {
+    io_uring_sqe * sqe;
+
+    if (timer_armed_)
+    {
+      if ((sqe = GetSqe()) == 0)
+        return kEvFailure;
+      sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = kTimerTag | timer_gen_;
+      sqe->user_data = kIgnoredTag;
+      timer_armed_ = 0;
+    }
+
+    if ((sqe = GetSqe()) == 0)
+      return kEvFailure;
+    timer_gen_++;
+    timer_ts_.tv_sec = deadline_.tv_sec;
+    timer_ts_.tv_nsec = deadline_.tv_nsec;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&timer_ts_;
+    sqe->len = 1;
+    sqe->off = 0;// expire by time only
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;// CLOCK_MONOTONIC
+    sqe->user_data = kTimerTag | timer_gen_;
+    timer_armed_ = 1;
+    return kEvOK;
+  }
+
+  int UringBackend::Ctl(int fd, int old_events, int new_events)
+  {
+    int ret;
+    if ((ret = ResizePolls(fd)) != kEvOK)
+      return ret;
+
+    Poll * poll = &polls_[(size_t)fd];
+    (void)old_events;
+
+    if (poll->armed)
+    {
+      io_uring_sqe * sqe = GetSqe();
+      if (sqe == 0)
+        return kEvFailure;
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = PollTag(fd, poll->gen);
+      sqe->user_data = kIgnoredTag;
+      poll->armed = 0;
+    }
+
+    // completions of the replaced request are ignored
+    poll->gen = (poll->gen + 1) & 0x7fffffff;
+    poll->events = new_events;
+    if (new_events)
+      return Arm(fd);
+    return kEvOK;
+  }
+
+  void UringBackend::SetTimer(const timespec * deadline)
+  {
+    EV_LOG(kDebug, "io_uring timeout: seconds=%ld nanoseconds=%ld",
+        (long)deadline->tv_sec, (long)deadline->tv_nsec);
+    deadline_ = *deadline;
+    timer_dirty_ = 1;
+  }
+
+  void UringBackend::OnCompletion(const io_uring_cqe * cqe, int * nresults, int * timer_expired)
+  {
+    uint64_t user_data = cqe->user_data;
+
+    if (user_data == kIgnoredTag)
+      return;
+
+    if (user_data & kTimerTag)
+    {
+      if ((uint32_t)user_data == timer_gen_ && cqe->res == -ETIME)
+      {
+        timer_armed_ = 0;
+        *timer_expired = 1;
+      }
+      return;
+    }
+
+    size_t fd = (size_t)(uint32_t)user_data;
+    uint32_t gen = (uint32_t)(user_data >> 32);
+    if (fd >= polls_.size() || polls_[fd].gen != gen)
+      return;// a replaced request
+
+    Poll * poll = &polls_[fd];
+    int events;
+    if (cqe->res < 0)
+    {
+      // such as EBADF, do not re-arm
+      EV_LOG(kDebug, "io_uring poll: fd=%d %s", (int)fd, strerror(-cqe->res));
+      poll->armed = 0;
+      events = EPOLLERR;
+    }
+    else
+    {
+      if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+      {
+        poll->armed = 0;
+        if (poll->events)
+          rearms_.push_back((int)fd);
+      }
+      events = cqe->res & (EPOLLIN|EPOLLOUT|EPOLLERR|EPOLLHUP);
+    }
+
+    // merge multiple completions of a multishot request
+    if (poll->result >= 0 && poll->result < *nresults
+        && results_[(size_t)poll->result].data.fd == (int)fd)
+    {
+      results_[(size_t)poll->result].events |= (uint32_t)events;
+      return;
+    }
+
+    EV_ASSERT((size_t)*nresults < results_.size());
+    epoll_event * result = &results_[(size_t)*nresults];
+    result->data.u64 = 0;
+    result->data.fd = (int)fd;
+    result->events = (uint32_t)events;
+    poll->result = (*nresults)++;
+  }
+
+  int UringBackend::Wait(int blocking, int * timer_expired)
+  {
+    int nresults = 0;
+    *timer_expired = 0;
+
+    // re-arm one-shot polls
+    for (size_t i=0; i<rearms_.size(); i++)
+    {
+      int fd = rearms_[i];
+      Poll * poll = &polls_[(size_t)fd];
+      if (!poll->armed && poll->events && Arm(fd) != kEvOK)
+        return kEvFailure;
+    }
+    rearms_.clear();
+
+    if (timer_dirty_)
+    {
+      timer_dirty_ = 0;
+      if (ArmTimer() != kEvOK)
+        return kEvFailure;
+    }
+
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+    // submit all prepared requests and wait for completions in one syscall
+    if (blocking && head == tail)
+    {
+      EV_LOG(kDebug, "io_uring_enter");
+      if (Submit(1, IORING_ENTER_GETEVENTS) != kEvOK)
+        return kEvFailure;
+      EV_LOG(kDebug, "after io_uring_enter");
+      tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    }
+    else if (to_submit_)
+    {
+      if (Submit(0, 0) != kEvOK)
+        return kEvFailure;
+      tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    }
+
+    while (head != tail)
+    {
+      OnCompletion(&cqes_[head & cq_mask_], &nresults, timer_expired);
+      head++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    return nresults;
+  }
+
+
+  /************************************************************************/
+  Backend * NewIOUringBackend()
+  {
+    try
+    {
+      return new UringBackend;// may throw(caught)
+    }
+    catch (...)
+    {
+      return 0;
+    }
+  }
+
+#else/*HAVE_LINUX_IO_URING*/
+
+  Backend * NewIOUringBackend()
+  {
+    errno = ENOSYS;
+    return 0;
+  }
+
+#endif/*HAVE_LINUX_IO_URING*/
+}
@@ -0,0 +1,313 @@
+/** @file
+ * @brief byte buffers of pooled blocks
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "buffer.h"
+#include "ev.h"
+#include "log.h"
+#include "header.h"
+
+namespace libev {
+
+  BlockPool::BlockPool(size_t block_size, size_t max_free)
+    : block_size_(block_size), max_free_(max_free), free_count_(0), free_(0)
+  {
+    EV_ASSERT(block_size_ != 0);
+  }
+
+  BlockPool::~BlockPool()
+  {
+    Block * block;
+    while (free_)
+    {
+      block = free_;
+      free_ = block->next;
+      free(block);
+    }
+  }
+
+  Block * BlockPool::Get()
+  {
+    Block * block = free_;
+    if (block)
+    {
+      free_ = block->next;
+      free_count_--;
+    }
+    else
+    {
+      block = (Block *)malloc(ev_offsetof(Block, data) + block_size_);
+      if (block == 0)
+        return 0;
+    }
+
+    block->next = 0;
+    block->begin = 0;
+    block->end = 0;
+    return block;
+  }
+
+  void BlockPool::Put(Block * block)
+  {
+    if (free_count_ >= max_free_)
+    {
+      free(block);
+      return;
+    }
+
+    block->next = free_;
+    free_ = block;
+    free_count_++;
+  }
+
+
+  /************************************************************************/
+  Buffer::Buffer(BlockPool * pool)
+    : pool_(pool), head_(0), tail_(0), size_(0), spare_count_(0)
+  {
+  }
+
+  Buffer::~Buffer()
+  {
+    Clear();
+    ReleaseSpare(0);
+  }
+
+  void Buffer::Push(Block * block)
+  {
+    block->next = 0;
+    if (tail_)
+      tail_->next = block;
+    else
+      head_ = block;
+    tail_ = block;
+  }
+
+  void Buffer::ReleaseSpare(int from)
+  {
+    for (int i=from; i<spare_count_; i++)
+      pool_->Put(spare_[i]);
+    spare_count_ = from;
+  }
+
+  int Buffer::Append(const void * data, size_t size)
+  {
+    const char * p = (const char *)data;
+    size_t block_size = pool_->block_size();
+    size_t n;
+
+    while (size)
+    {
+      if (tail_ == 0 || tail_->end == block_size)
+      {
+        Block * block = pool_->Get();
+        if (block == 0)
+          return kEvNoMemory;
+        Push(block);
+      }
+
+      n = block_size - tail_->end;
+      if (n > size)
+        n = size;
+      memcpy(tail_->data + tail_->end, p, n);
+      tail_->end += n;
+      size_ += n;
+      p += n;
+      size -= n;
+    }
+    return kEvOK;
+  }
+
+  size_t Buffer::Copy(void * data, size_t size)const
+  {
+    char * p = (char *)data;
+    size_t copied = 0;
+    size_t n;
+
+    for (const Block * block = head_; block && copied < size; block = block->next)
+    {
+      n = block->end - block->begin;
+      if (n > size - copied)
+        n = size - copied;
+      memcpy(p + copied, block->data + block->begin, n);
+      copied += n;
+    }
+    return copied;
+  }
+
+  size_t Buffer::Read(void * data, size_t size)
+  {
+    size_t n = Copy(data, size);
+    Consume(n);
+    return n;
+  }
+
+  void Buffer::Consume(size_t size)
+  {
+    EV_ASSERT(size <= size_);
+    size_t n;
+
+    while (size)
+    {
+      n = head_->end - head_->begin;
+      if (n > size)
+      {
+        head_->begin += size;
+        size_ -= size;
+        return;
+      }
+
+      size_ -= n;
+      size -= n;
+      if (head_ == tail_)
+      {
+        // keep the last block for later appending
+        head_->begin = head_->end = 0;
+        return;
+      }
+
+      Block * block = head_;
+      head_ = block->next;
+      pool_->Put(block);
+    }
+  }
+
+  const char * Buffer::Pullup(size_t size)
+  {
+    EV_ASSERT(size > 0 && size <= size_);
+    size_t block_size = pool_->block_size();
+    Block * head = head_;
+    size_t n = head->end - head->begin;
+
+    if (n >= size)
+      return head->data + head->begin;
+    if (size > block_size)
+      return 0;
+
+    // move the data to the front of the block if the rest can not fit after it
+    if (block_size - head->begin < size)
+    {
+      memmove(head->data, head->data + head->begin, n);
+      head->begin = 0;
+      head->end = n;
+    }
+
+    // move the data of the following blocks into the head block
+    while (n < size)
+    {
+      Block * next = head->next;
+      size_t m = next->end - next->begin;
+      if (m > size - n)
+        m = size - n;
+      memcpy(head->data + head->end, next->data + next->begin, m);
+      head->end += m;
+      next->begin += m;
+      n += m;
+
+      if (next->begin == next->end)
+      {
+        head->next = next->next;
+        if (tail_ == next)
+          tail_ = head;
+        pool_->Put(next);
+      }
+    }
+    return head->data + head->begin;
+  }
+
+  void Buffer::Clear()
+  {
+    Block * block;
+    while (head_)
+    {
+      block = head_;
+      head_ = block->next;
+      pool_->Put(block);
+    }
+    tail_ = 0;
+    size_ = 0;
+  }
+
+  int Buffer::GetIovec(struct iovec * iov, int iovcnt)const
+  {
+    int i = 0;
+    for (const Block * block = head_; block && i < iovcnt; block = block->next)
+    {
+      if (block->end == block->begin)
+        continue;
+      iov[i].iov_base = (void *)(block->data + block->begin);
+      iov[i].iov_len = block->end - block->begin;
+      i++;
+    }
+    return i;
+  }
+
+  int Buffer::Prepare(size_t size, struct iovec * iov, int iovcnt)
+  {
+    EV_ASSERT(spare_count_ == 0);
+    EV_ASSERT(iovcnt > 0);
+
+    size_t block_size = pool_->block_size();
+    size_t prepared = 0;
+    int i = 0;
+
+    if (tail_ && tail_->end < block_size)
+    {
+      iov[i].iov_base = tail_->data + tail_->end;
+      iov[i].iov_len = block_size - tail_->end;
+      prepared += iov[i].iov_len;
+      i++;
+    }
+
+    while (prepared < size && i < iovcnt && spare_count_ < kMaxSpare)
+    {
+      Block * block = pool_->Get();
+      if (block == 0)
+      {
+        ReleaseSpare(0);
+        return kEvNoMemory;
+      }
+      spare_[spare_count_++] = block;
+      iov[i].iov_base = block->data;
+      iov[i].iov_len = block_size;
+      prepared += block_size;
+      i++;
+    }
+    return i;
+  }
+
+  void Buffer::Commit(size_t size)
+  {
+    size_t block_size = pool_->block_size();
+    size_t n;
+    int used = 0;
+
+    if (tail_ && tail_->end < block_size)
+    {
+      n = block_size - tail_->end;
+      if (n > size)
+        n = size;
+      tail_->end += n;
+      size_ += n;
+      size -= n;
+    }
+
+    while (size)
+    {
+      EV_ASSERT(used < spare_count_);
+      Block * block = spare_[used++];
+      n = (size < block_size)?(size):(block_size);
+      block->end = n;
+      Push(block);
+      size_ += n;
+      size -= n;
+    }
+
+    // release spare blocks not written
+    ReleaseSpare(used);
+    spare_count_ = 0;
+  }
+}
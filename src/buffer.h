@@ -0,0 +1,105 @@
+/** @file
+ * @brief byte buffers of pooled blocks
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_BUFFER_H
+#define LIBEV_BUFFER_H
+
+#include "ev-internal.h"
+#include <stddef.h>
+#include <sys/uio.h>
+
+namespace libev {
+
+  struct Block
+  {
+    Block * next;
+    size_t begin;// the first byte of data
+    size_t end;// the byte after the last byte of data
+    char data[1];
+  };
+
+  // a free list of fixed size blocks,
+  // which is not thread safe and is to be shared by buffers of one reactor
+  class BlockPool
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(BlockPool);
+
+      size_t block_size_;
+      size_t max_free_;// the max number of free blocks kept
+      size_t free_count_;
+      Block * free_;
+
+    public:
+      explicit BlockPool(size_t block_size = 16384, size_t max_free = 1024);
+      ~BlockPool();
+
+      size_t block_size()const {return block_size_;}
+
+      // return 0 if no memory
+      Block * Get();
+      void Put(Block * block);
+  };
+
+  // a FIFO byte queue of linked blocks,
+  // blocks are taken from and returned to the pool as the queue grows and shrinks
+  class Buffer
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(Buffer);
+
+      enum {kMaxSpare = 4};
+
+      BlockPool * pool_;
+      Block * head_;
+      Block * tail_;
+      size_t size_;
+      Block * spare_[kMaxSpare];// blocks prepared by 'Prepare'
+      int spare_count_;
+
+      void Push(Block * block);
+      void ReleaseSpare(int from);
+
+    public:
+      explicit Buffer(BlockPool * pool);
+      ~Buffer();
+
+      size_t size()const {return size_;}
+      bool empty()const {return size_ == 0;}
+      BlockPool * pool()const {return pool_;}
+
+      // append 'size' bytes of 'data'
+      int Append(const void * data, size_t size);
+      // copy at most 'size' bytes to 'data' without consuming them
+      // return the number of bytes copied
+      size_t Copy(void * data, size_t size)const;
+      // copy and consume at most 'size' bytes
+      // return the number of bytes read
+      size_t Read(void * data, size_t size);
+      // discard the first 'size' bytes
+      void Consume(size_t size);
+      // make the first 'size'(0 < 'size' <= 'size()') bytes contiguous(e.g. for parsing),
+      // which copies only if they span blocks
+      // return the bytes, or 0 if 'size' is larger than the block size
+      const char * Pullup(size_t size);
+      void Clear();
+
+      // fill at most 'iovcnt' 'iov' with the data(e.g. for writev)
+      // return the number of 'iov' filled
+      int GetIovec(struct iovec * iov, int iovcnt)const;
+
+      // fill 'iov' with free space of at least 'size' bytes(e.g. for readv),
+      // at most 'iovcnt'(<= 4 + 1) 'iov' are filled,
+      // 'Commit' must be called after the space is written.
+      // return the number of 'iov' filled, or kEvNoMemory
+      int Prepare(size_t size, struct iovec * iov, int iovcnt);
+      // 'size' bytes of the space prepared have been written
+      void Commit(size_t size);
+  };
+}
+
+#endif
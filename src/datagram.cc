@@ -0,0 +1,604 @@
+/** @file
+ * @brief datagram sockets with batched IO
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "datagram.h"
+#include "log.h"
+#include "header.h"
+#include <netinet/udp.h>
+
+namespace libev {
+
+  static const int kMaxSend = 64;// messages per sendmmsg
+  static const size_t kMaxIovecs = 1024;// iovecs per sendmmsg
+  static const size_t kMaxSegments = 64;// datagrams per GSO message(UDP_MAX_SEGMENTS)
+  static const size_t kMaxGSOBytes = 65507;// bytes per GSO message
+  static const size_t kControlSize = CMSG_SPACE(sizeof(int));
+  static const size_t kDefaultMaxQueue = 4 * 1024 * 1024;
+
+  DatagramSocket::DatagramSocket(int batch, size_t max_size)
+    : reactor_(0), fd_(-1), owns_fd_(0), callback_(0), user_data_(0),
+    batch_(batch), max_size_(max_size), slab_(0), recv_msgs_(0), recv_iov_(0),
+    recv_addr_(0), recv_control_(0), gro_(0),
+    sent_(0), max_queue_(kDefaultMaxQueue), flush_task_(0), writing_(0), gso_(0),
+    dropped_(0), destroyed_(0)
+  {
+    EV_ASSERT(batch > 0);
+    EV_ASSERT(max_size > 0);
+  }
+
+  DatagramSocket::~DatagramSocket()
+  {
+    UnInit();
+  }
+
+  int DatagramSocket::Allocate()
+  {
+    try
+    {
+      slab_ = new char[(size_t)batch_ * max_size_];// may throw(caught)
+      recv_msgs_ = new struct mmsghdr[(size_t)batch_];// may throw(caught)
+      recv_iov_ = new struct iovec[(size_t)batch_];// may throw(caught)
+      recv_addr_ = new struct sockaddr_storage[(size_t)batch_];// may throw(caught)
+      recv_control_ = new char[(size_t)batch_ * kControlSize];// may throw(caught)
+      datagrams_.reserve((size_t)batch_);// may throw(caught)
+      flush_task_ = new FlushTask;// may throw(caught)
+    }
+    catch (...)
+    {
+      Free();
+      return kEvNoMemory;
+    }
+
+    flush_task_->socket = this;
+    flush_task_->posted = 0;
+    return kEvOK;
+  }
+
+  void DatagramSocket::Free()
+  {
+    delete [] slab_;
+    delete [] recv_msgs_;
+    delete [] recv_iov_;
+    delete [] recv_addr_;
+    delete [] recv_control_;
+    slab_ = 0;
+    recv_msgs_ = 0;
+    recv_iov_ = 0;
+    recv_addr_ = 0;
+    recv_control_ = 0;
+    datagrams_.clear();
+
+    if (flush_task_)
+    {
+      // a posted task deletes itself
+      if (flush_task_->posted)
+        flush_task_->socket = 0;
+      else
+        delete flush_task_;
+      flush_task_ = 0;
+    }
+  }
+
+  int DatagramSocket::Bind(Reactor * reactor, const struct sockaddr * addr, socklen_t addrlen,
+      datagram_callback callback, void * user_data)
+  {
+    if (reactor == 0 || addr == 0 || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "DatagramSocket(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    int fd = socket(addr->sa_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+      EV_LOG(kError, "socket: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    if (bind(fd, addr, addrlen) == -1)
+    {
+      int error = errno;
+      EV_LOG(kError, "bind: %s", strerror(errno));
+      (void)safe_close(fd);
+      errno = error;
+      return kEvFailure;
+    }
+
+    int ret;
+    if ((ret = Init(reactor, fd, callback, user_data)) != kEvOK)
+    {
+      (void)safe_close(fd);
+      return ret;
+    }
+    owns_fd_ = 1;
+    return kEvOK;
+  }
+
+  int DatagramSocket::Init(Reactor * reactor, int fd, datagram_callback callback, void * user_data)
+  {
+    if (reactor == 0 || fd < 0 || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "DatagramSocket(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      EV_LOG(kError, "fcntl: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    int ret;
+    if ((ret = Allocate()) != kEvOK)
+      return ret;
+
+    ev_in_.fd = fd;
+    ev_in_.event = kEvIn|kEvPersist;
+    ev_in_.callback = OnIn;
+    ev_in_.user_data = this;
+    ev_out_.fd = fd;
+    ev_out_.event = kEvOut|kEvPersist;
+    ev_out_.callback = OnOut;
+    ev_out_.user_data = this;
+
+    if ((ret = reactor->Add(&ev_in_)) != kEvOK)
+    {
+      Free();
+      return ret;
+    }
+
+    reactor_ = reactor;
+    fd_ = fd;
+    owns_fd_ = 0;
+    callback_ = callback;
+    user_data_ = user_data;
+    gro_ = 0;
+    gso_ = 0;
+    writing_ = 0;
+    sent_ = 0;
+    dropped_ = 0;
+    return kEvOK;
+  }
+
+  void DatagramSocket::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    (void)ev_in_.Del();
+    if (writing_)
+    {
+      (void)ev_out_.Del();
+      writing_ = 0;
+    }
+    Free();
+    send_buffer_.clear();
+    packets_.clear();
+    sent_ = 0;
+    if (owns_fd_)
+    {
+      (void)safe_close(fd_);
+      owns_fd_ = 0;
+    }
+    reactor_ = 0;
+    fd_ = -1;
+
+    // tell the callback invoker that the socket is gone
+    DestroyedGuard::Destroy(&destroyed_);
+  }
+
+  int DatagramSocket::EnableGRO()
+  {
+    if (reactor_ == 0 || max_size_ < 65535)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+#ifdef UDP_GRO
+    int on = 1;
+    if (setsockopt(fd_, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+    {
+      EV_LOG(kError, "setsockopt(UDP_GRO): %s", strerror(errno));
+      return kEvFailure;
+    }
+    gro_ = 1;
+    return kEvOK;
+#else
+    errno = EOPNOTSUPP;
+    return kEvFailure;
+#endif
+  }
+
+  int DatagramSocket::EnableGSO()
+  {
+    if (reactor_ == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+#ifdef UDP_SEGMENT
+    // probe the kernel support
+    int size;
+    socklen_t len = sizeof(size);
+    if (getsockopt(fd_, IPPROTO_UDP, UDP_SEGMENT, &size, &len) == -1)
+    {
+      EV_LOG(kError, "getsockopt(UDP_SEGMENT): %s", strerror(errno));
+      return kEvFailure;
+    }
+    gso_ = 1;
+    return kEvOK;
+#else
+    errno = EOPNOTSUPP;
+    return kEvFailure;
+#endif
+  }
+
+  int DatagramSocket::Split(int i)
+  {
+    const struct msghdr * msg = &recv_msgs_[i].msg_hdr;
+    size_t size = recv_msgs_[i].msg_len;
+    size_t segment = size;
+    Datagram datagram;
+
+#ifdef UDP_GRO
+    if (gro_)
+    {
+      for (struct cmsghdr * cmsg=CMSG_FIRSTHDR(msg); cmsg;
+          cmsg=CMSG_NXTHDR((struct msghdr *)msg, cmsg))
+      {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+          int gso_size;
+          memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+          if (gso_size > 0)
+            segment = (size_t)gso_size;
+        }
+      }
+    }
+#endif
+
+    datagram.data = slab_ + (size_t)i * max_size_;
+    datagram.addr = (const struct sockaddr *)&recv_addr_[i];
+    datagram.addrlen = msg->msg_namelen;
+    datagram.truncated = (msg->msg_flags & MSG_TRUNC) != 0;
+
+    try
+    {
+      // an empty datagram is also delivered
+      do
+      {
+        datagram.size = (size < segment)?(size):(segment);
+        datagrams_.push_back(datagram);// may throw(caught)
+        datagram.data += datagram.size;
+        size -= datagram.size;
+      } while (size);
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+    return kEvOK;
+  }
+
+  void DatagramSocket::OnIn(int /*fd*/, int event, void * user_data)
+  {
+    DatagramSocket * socket = (DatagramSocket *)user_data;
+    int n;
+
+    if (event & kEvCanceled)
+      return;
+
+    for (int i=0; i<socket->batch_; i++)
+    {
+      struct msghdr * msg = &socket->recv_msgs_[i].msg_hdr;
+      socket->recv_iov_[i].iov_base = socket->slab_ + (size_t)i * socket->max_size_;
+      socket->recv_iov_[i].iov_len = socket->max_size_;
+      msg->msg_name = &socket->recv_addr_[i];
+      msg->msg_namelen = sizeof(socket->recv_addr_[i]);
+      msg->msg_iov = &socket->recv_iov_[i];
+      msg->msg_iovlen = 1;
+      msg->msg_control = (socket->gro_)?(socket->recv_control_ + (size_t)i * kControlSize):(0);
+      msg->msg_controllen = (socket->gro_)?(kControlSize):(0);
+      msg->msg_flags = 0;
+    }
+
+    do n = recvmmsg(socket->fd_, socket->recv_msgs_, (unsigned int)socket->batch_, MSG_DONTWAIT, 0);
+    while (n == -1 && errno == EINTR);
+
+    if (n == -1)
+    {
+      // e.g. ECONNREFUSED of a connected socket, which is cleared once reported
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        EV_LOG(kDebug, "recvmmsg: %s", strerror(errno));
+      return;
+    }
+
+    socket->datagrams_.clear();
+    for (int i=0; i<n; i++)
+    {
+      if (socket->Split(i) != kEvOK)
+      {
+        EV_LOG(kError, "DatagramSocket(%p) drops datagrams for no memory", socket);
+        break;
+      }
+    }
+
+    if (socket->datagrams_.empty())
+      return;
+
+    DestroyedGuard destroyed(&socket->destroyed_);
+    socket->callback_(socket, &socket->datagrams_[0], (int)socket->datagrams_.size(),
+        socket->user_data_);
+    if (destroyed.Leave())
+      return;
+  }
+
+  void DatagramSocket::OnOut(int /*fd*/, int event, void * user_data)
+  {
+    DatagramSocket * socket = (DatagramSocket *)user_data;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      socket->writing_ = 0;
+      return;
+    }
+
+    (void)socket->Flush();
+  }
+
+  void DatagramSocket::OnFlush(void * user_data)
+  {
+    FlushTask * task = (FlushTask *)user_data;
+
+    task->posted = 0;
+    if (task->socket == 0)
+    {
+      // the socket has been uninitialized
+      delete task;
+      return;
+    }
+
+    (void)task->socket->Flush();
+  }
+
+  int DatagramSocket::Queue(const void * data, size_t size,
+      const struct sockaddr * addr, socklen_t addrlen)
+  {
+    if (reactor_ == 0)
+    {
+      errno = EPIPE;
+      return kEvFailure;
+    }
+
+    if ((data == 0 && size) || addrlen > sizeof(struct sockaddr_storage))
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (send_buffer_.size() + size > max_queue_)
+    {
+      errno = EAGAIN;
+      return kEvFailure;
+    }
+
+    Packet packet;
+    packet.offset = send_buffer_.size();
+    packet.size = size;
+    packet.addrlen = addrlen;
+    if (addrlen)
+      memcpy(&packet.addr, addr, addrlen);
+
+    try
+    {
+      send_buffer_.insert(send_buffer_.end(),
+          (const char *)data, (const char *)data + size);// may throw(caught)
+      packets_.push_back(packet);// may throw(caught)
+    }
+    catch (...)
+    {
+      send_buffer_.resize(packet.offset);
+      return kEvNoMemory;
+    }
+
+    // flush once after the ready events of this loop iteration
+    if (!writing_ && !flush_task_->posted)
+    {
+      if (reactor_->Post(OnFlush, flush_task_) == kEvOK)
+        flush_task_->posted = 1;
+      else
+        return Flush();
+    }
+    return kEvOK;
+  }
+
+  int DatagramSocket::SendTo(const void * data, size_t size,
+      const struct sockaddr * addr, socklen_t addrlen)
+  {
+    if (addr == 0 || addrlen == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+    return Queue(data, size, addr, addrlen);
+  }
+
+  int DatagramSocket::Send(const void * data, size_t size)
+  {
+    return Queue(data, size, 0, 0);
+  }
+
+  size_t DatagramSocket::Coalesce(size_t first, size_t * gso_size)const
+  {
+    const Packet * packet = &packets_[first];
+    const Packet * next;
+    size_t count = 1;
+    size_t total = packet->size;
+
+    *gso_size = packet->size;
+    if (packet->size == 0)
+      return 1;
+
+    // datagrams of the same size, and the last one may be smaller
+    while (first + count < packets_.size() && count < kMaxSegments)
+    {
+      next = &packets_[first + count];
+      if (next->size == 0 || next->size > packet->size
+          || total + next->size > kMaxGSOBytes
+          || next->addrlen != packet->addrlen
+          || memcmp(&next->addr, &packet->addr, packet->addrlen) != 0)
+        break;
+
+      count++;
+      total += next->size;
+      if (next->size < packet->size)
+        break;
+    }
+    return count;
+  }
+
+  int DatagramSocket::Flush()
+  {
+    struct mmsghdr msgs[kMaxSend];
+    struct iovec iov[kMaxIovecs];
+    char control[kMaxSend][CMSG_SPACE(sizeof(uint16_t))];
+    size_t counts[kMaxSend];
+    int ret = kEvOK;
+    int nmsgs, n;
+
+    if (reactor_ == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    while (sent_ < packets_.size())
+    {
+      size_t next = sent_;
+      size_t iovcnt = 0;
+      // empty if all queued datagrams are empty
+      char * base = (send_buffer_.empty())?(0):(&send_buffer_[0]);
+
+      for (nmsgs=0; nmsgs<kMaxSend && next<packets_.size(); nmsgs++)
+      {
+        size_t gso_size = 0;
+        size_t count = (gso_)?(Coalesce(next, &gso_size)):(1);
+        if (iovcnt + count > kMaxIovecs)
+          break;
+
+        const Packet * packet = &packets_[next];
+        struct msghdr * msg = &msgs[nmsgs].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        for (size_t j=0; j<count; j++)
+        {
+          iov[iovcnt + j].iov_base = base + packets_[next + j].offset;
+          iov[iovcnt + j].iov_len = packets_[next + j].size;
+        }
+        msg->msg_iov = &iov[iovcnt];
+        msg->msg_iovlen = count;
+        if (packet->addrlen)
+        {
+          msg->msg_name = (void *)&packet->addr;
+          msg->msg_namelen = packet->addrlen;
+        }
+
+#ifdef UDP_SEGMENT
+        if (count > 1)
+        {
+          uint16_t segment = (uint16_t)gso_size;
+          msg->msg_control = control[nmsgs];
+          msg->msg_controllen = sizeof(control[nmsgs]);
+          struct cmsghdr * cmsg = CMSG_FIRSTHDR(msg);
+          cmsg->cmsg_level = IPPROTO_UDP;
+          cmsg->cmsg_type = UDP_SEGMENT;
+          cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+          memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+#endif
+
+        counts[nmsgs] = count;
+        iovcnt += count;
+        next += count;
+      }
+
+      do n = sendmmsg(fd_, msgs, (unsigned int)nmsgs, 0);
+      while (n == -1 && errno == EINTR);
+
+      if (n == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          // the rest are sent when kEvOut is ready
+          if (!writing_)
+          {
+            if ((ret = reactor_->Add(&ev_out_)) == kEvOK)
+              writing_ = 1;
+          }
+          break;
+        }
+
+        if (counts[0] > 1 && (errno == EIO || errno == EINVAL))
+        {
+          // the device does not support GSO
+          EV_LOG(kWarning, "DatagramSocket(%p) disables GSO: %s", this, strerror(errno));
+          gso_ = 0;
+          continue;
+        }
+
+        // drop the first message, e.g. EMSGSIZE, ECONNREFUSED,
+        // or ENOBUFS for a full device queue, where the socket is still writable
+        // and waiting for kEvOut would spin
+        EV_LOG(kDebug, "sendmmsg: %s", strerror(errno));
+        dropped_ += counts[0];
+        sent_ += counts[0];
+        continue;
+      }
+
+      for (int i=0; i<n; i++)
+        sent_ += counts[i];
+    }
+
+    if (sent_ == packets_.size())
+    {
+      send_buffer_.clear();
+      packets_.clear();
+      sent_ = 0;
+      if (writing_)
+      {
+        (void)ev_out_.Del();
+        writing_ = 0;
+      }
+    }
+    else if (sent_)
+    {
+      // discard the datagrams sent
+      size_t offset = packets_[sent_].offset;
+      send_buffer_.erase(send_buffer_.begin(), send_buffer_.begin() + (ptrdiff_t)offset);
+      packets_.erase(packets_.begin(), packets_.begin() + (ptrdiff_t)sent_);
+      for (size_t i=0; i<packets_.size(); i++)
+        packets_[i].offset -= offset;
+      sent_ = 0;
+    }
+    return ret;
+  }
+}
@@ -0,0 +1,145 @@
+/** @file
+ * @brief datagram sockets with batched IO
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_DATAGRAM_H
+#define LIBEV_DATAGRAM_H
+
+#include "ev.h"
+#include <sys/socket.h>
+#include <vector>
+
+namespace libev {
+
+  struct Datagram
+  {
+    char * data;
+    size_t size;
+    int truncated;// the datagram is larger than 'max_size' of the socket
+    const struct sockaddr * addr;// the source address
+    socklen_t addrlen;
+  };
+
+  class DatagramSocket;
+  // 'datagrams' are valid only inside the callback
+  typedef void (*datagram_callback)(DatagramSocket * socket,
+      Datagram * datagrams, int count, void * user_data);
+
+  // A datagram socket receives at most 'batch' datagrams per readiness
+  // with one recvmmsg into a preallocated slab.
+  // Datagrams to be sent are queued, and flushed with sendmmsg
+  // after the ready events of the current loop iteration are handled(by 'Reactor::Post').
+  // With GSO, consecutive datagrams of the same size to the same address
+  // are sent as one UDP_SEGMENT message.
+  // With GRO, coalesced datagrams received are split before the callback.
+  // The socket may be deleted inside its callback.
+  class DatagramSocket
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(DatagramSocket);
+
+      struct Packet
+      {
+        size_t offset;// in 'send_buffer_'
+        size_t size;
+        socklen_t addrlen;// 0 for the connected address
+        struct sockaddr_storage addr;
+      };
+
+      // posted to flush the queue, which outlives the socket if it is uninitialized
+      struct FlushTask
+      {
+        DatagramSocket * socket;
+        int posted;
+      };
+
+      Reactor * reactor_;
+      int fd_;
+      int owns_fd_;// 'fd_' is created by 'Bind'
+      Event ev_in_;
+      Event ev_out_;
+      datagram_callback callback_;
+      void * user_data_;
+
+      // receiving
+      int batch_;
+      size_t max_size_;
+      char * slab_;// 'batch_' buffers of 'max_size_' bytes
+      struct mmsghdr * recv_msgs_;
+      struct iovec * recv_iov_;
+      struct sockaddr_storage * recv_addr_;
+      char * recv_control_;// cmsg buffers for UDP_GRO
+      std::vector<Datagram> datagrams_;
+      int gro_;
+
+      // sending
+      std::vector<char> send_buffer_;
+      std::vector<Packet> packets_;
+      size_t sent_;// packets of 'packets_' sent
+      size_t max_queue_;// the max bytes queued
+      FlushTask * flush_task_;
+      int writing_;// 'ev_out_' is added
+      int gso_;
+      size_t dropped_;
+
+      int * destroyed_;// set to 1 if the socket is destroyed inside its callback
+
+      static void OnIn(int fd, int event, void * user_data);
+      static void OnOut(int fd, int event, void * user_data);
+      static void OnFlush(void * user_data);
+
+      // allocate the receiving slab
+      int Allocate();
+      void Free();
+      // split the i-th message received into 'datagrams_'
+      // return kEvOK or kEvNoMemory
+      int Split(int i);
+      // queue a datagram, and post 'OnFlush' if it is the first one
+      int Queue(const void * data, size_t size, const struct sockaddr * addr, socklen_t addrlen);
+      // the number of packets from 'first' that can be sent as one GSO message
+      size_t Coalesce(size_t first, size_t * gso_size)const;
+
+    public:
+      // receive at most 'batch' datagrams of at most 'max_size' bytes per readiness
+      explicit DatagramSocket(int batch = 64, size_t max_size = 2048);
+      ~DatagramSocket();
+
+      // create a UDP socket bound to 'addr'
+      int Bind(Reactor * reactor, const struct sockaddr * addr, socklen_t addrlen,
+          datagram_callback callback, void * user_data);
+      // poll the datagram socket 'fd', which is not owned
+      int Init(Reactor * reactor, int fd, datagram_callback callback, void * user_data);
+      // datagrams queued are discarded, 'Flush' before if needed
+      void UnInit();
+
+      // receive coalesced datagrams(UDP_GRO, Linux 5.0 or later),
+      // 'max_size' must be at least 65535
+      int EnableGRO();
+      // send datagrams of the same size to the same address as one message
+      // (UDP_SEGMENT, Linux 4.18 or later)
+      int EnableGSO();
+      // the max bytes queued(4MB by default),
+      // 'SendTo' fails with EAGAIN beyond it
+      void SetMaxQueue(size_t max_queue) {max_queue_ = max_queue;}
+
+      // queue a datagram to 'addr'
+      int SendTo(const void * data, size_t size, const struct sockaddr * addr, socklen_t addrlen);
+      // queue a datagram to the connected address
+      int Send(const void * data, size_t size);
+      // send the datagrams queued right now, the rest are sent when kEvOut is ready
+      // return kEvOK or kEvFailure
+      int Flush();
+
+      int fd()const {return fd_;}
+      Reactor * reactor()const {return reactor_;}
+      // the number of datagrams queued but not sent
+      size_t queued()const {return packets_.size() - sent_;}
+      // the number of datagrams dropped for send errors(e.g. EMSGSIZE, ECONNREFUSED, ENOBUFS)
+      size_t dropped()const {return dropped_;}
+  };
+}
+
+#endif
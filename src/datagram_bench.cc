@@ -0,0 +1,218 @@
+/** @file
+ * @brief benchmark batched datagram IO against one recvfrom/sendto per datagram
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "datagram.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <vector>
+
+using namespace libev;
+
+static const int kWindow = 256;// datagrams in flight
+static const int64_t kStallMs = 10;
+
+struct BenchHelper
+{
+  Reactor * reactor;
+  int total;
+  size_t size;
+  int sent;
+  int received;
+  int lost;
+  int last_received;// 'received' at the last check of stalls
+  std::vector<char> data;
+  struct sockaddr_in to;
+
+  // plain sockets
+  int sender_fd;
+  int receiver_fd;
+  // batched sockets
+  DatagramSocket * sender;
+  DatagramSocket * receiver;
+};
+
+static double Now()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+static int Done(const BenchHelper * helper)
+{
+  return helper->received + helper->lost >= helper->total;
+}
+
+// send until 'kWindow' datagrams are in flight
+static void SendMore(BenchHelper * helper)
+{
+  while (helper->sent < helper->total
+      && helper->sent - helper->received - helper->lost < kWindow)
+  {
+    if (helper->sender)
+    {
+      EV_VERIFY(helper->sender->SendTo(&helper->data[0], helper->size,
+            (struct sockaddr *)&helper->to, sizeof(helper->to)) == kEvOK);
+    }
+    else
+    {
+      EV_VERIFY(sendto(helper->sender_fd, &helper->data[0], helper->size, 0,
+            (struct sockaddr *)&helper->to, sizeof(helper->to)) == (ssize_t)helper->size);
+    }
+    helper->sent++;
+  }
+}
+
+static void OnStall(int /*fd*/, int /*event*/, void * user_data)
+{
+  BenchHelper * helper = (BenchHelper *)user_data;
+
+  // datagrams dropped by the receive buffer never arrive
+  if (helper->received == helper->last_received)
+  {
+    helper->lost = helper->sent - helper->received;
+    SendMore(helper);
+  }
+  helper->last_received = helper->received;
+}
+
+static void OnRecvfrom(int fd, int /*event*/, void * user_data)
+{
+  BenchHelper * helper = (BenchHelper *)user_data;
+  char buf[65536];
+
+  // one datagram per readiness
+  if (recvfrom(fd, buf, sizeof(buf), 0, 0, 0) >= 0)
+    helper->received++;
+  if (!Done(helper))
+    SendMore(helper);
+}
+
+static void OnDatagrams(DatagramSocket * /*socket*/, Datagram * /*datagrams*/, int count,
+    void * user_data)
+{
+  BenchHelper * helper = (BenchHelper *)user_data;
+
+  helper->received += count;
+  if (!Done(helper))
+    SendMore(helper);
+}
+
+static int Udp(struct sockaddr_in * addr)
+{
+  socklen_t len = sizeof(*addr);
+  int buffer = 4 * 1024 * 1024;
+  int fd;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EV_VERIFY((fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK, 0)) != -1);
+  EV_VERIFY(bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+  EV_VERIFY(getsockname(fd, (struct sockaddr *)addr, &len) == 0);
+  (void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+  (void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+  return fd;
+}
+
+// 'batched': 0 for recvfrom/sendto, 1 for recvmmsg/sendmmsg, 2 for also GSO/GRO
+static void Bench(const char * name, int total, size_t size, int batched)
+{
+  ScopedPtr<Reactor> reactor(new Reactor);
+  DatagramSocket sender;
+  DatagramSocket receiver(64, (batched == 2)?(65535):(2048));
+  BenchHelper helper;
+  struct sockaddr_in from;
+  Event ev, stall;
+  double begin, elapsed;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  helper.reactor = reactor.get();
+  helper.total = total;
+  helper.size = size;
+  helper.sent = 0;
+  helper.received = 0;
+  helper.lost = 0;
+  helper.last_received = 0;
+  helper.data.resize(size);
+  helper.sender_fd = Udp(&from);
+  helper.receiver_fd = Udp(&helper.to);
+  helper.sender = 0;
+  helper.receiver = 0;
+
+  if (batched)
+  {
+    EV_VERIFY(sender.Init(reactor.get(), helper.sender_fd, OnDatagrams, &helper) == kEvOK);
+    EV_VERIFY(receiver.Init(reactor.get(), helper.receiver_fd, OnDatagrams, &helper) == kEvOK);
+    helper.sender = &sender;
+    helper.receiver = &receiver;
+    if (batched == 2 && (sender.EnableGSO() != kEvOK || receiver.EnableGRO() != kEvOK))
+    {
+      printf("%-20s: GSO/GRO is not supported\n", name);
+      helper.total = 0;
+    }
+  }
+  else
+  {
+    ev.fd = helper.receiver_fd;
+    ev.event = kEvIn|kEvPersist;
+    ev.callback = OnRecvfrom;
+    ev.user_data = &helper;
+    EV_VERIFY(reactor->Add(&ev) == kEvOK);
+  }
+
+  stall.event = kEvTimer|kEvPersist;
+  stall.interval.tv_sec = 0;
+  stall.interval.tv_nsec = kStallMs * 1000000;
+  stall.callback = OnStall;
+  stall.user_data = &helper;
+  EV_VERIFY(reactor->AddTimer(&stall, kStallMs) == kEvOK);
+
+  begin = Now();
+  SendMore(&helper);
+  while (!Done(&helper))
+    (void)reactor->RunOne();
+  elapsed = Now() - begin;
+
+  if (helper.total)
+    printf("%-20s %4d bytes: %9.0f datagrams/s, %d lost\n",
+        name, (int)size, helper.received / elapsed, helper.lost);
+
+  (void)stall.Del();
+  (void)ev.Del();
+  sender.UnInit();
+  receiver.UnInit();
+  reactor.reset();
+  safe_close(helper.sender_fd);
+  safe_close(helper.receiver_fd);
+}
+
+int main(int argc, char ** argv)
+{
+  int total = 500000;
+  size_t size = 64;
+
+  GlobalLog().SetLevel(kWarning);
+
+  if (argc > 1)
+  {
+    total = atoi(argv[1]);
+    EV_VERIFY(total > 0);
+  }
+  if (argc > 2)
+  {
+    size = (size_t)atoi(argv[2]);
+    EV_VERIFY(size > 0 && size <= 1400);
+  }
+
+  Bench("recvfrom/sendto", total, size, 0);
+  Bench("recvmmsg/sendmmsg", total, size, 1);
+  Bench("+GSO/GRO", total, size, 2);
+  return 0;
+}
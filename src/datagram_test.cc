@@ -0,0 +1,281 @@
+/** @file
+ * @brief test datagram sockets
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "datagram.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+// errno of the next sendmmsg call made by the socket, or 0 to send
+static int sendmmsg_error;
+
+extern "C" int sendmmsg(int fd, struct mmsghdr * msgvec, unsigned int vlen, int flags)
+{
+  if (sendmmsg_error)
+  {
+    errno = sendmmsg_error;
+    sendmmsg_error = 0;
+    return -1;
+  }
+  return (int)syscall(SYS_sendmmsg, fd, msgvec, vlen, flags);
+}
+
+static void LoopbackAddress(struct sockaddr_in * addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+// the address bound by 'fd'
+static void BoundAddress(int fd, struct sockaddr_in * addr)
+{
+  socklen_t len = sizeof(*addr);
+  EV_VERIFY(getsockname(fd, (struct sockaddr *)addr, &len) == 0);
+}
+
+static int Udp()
+{
+  struct sockaddr_in addr;
+  int fd;
+
+  LoopbackAddress(&addr);
+  EV_VERIFY((fd = socket(AF_INET, SOCK_DGRAM, 0)) != -1);
+  EV_VERIFY(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  return fd;
+}
+
+static std::vector<std::string> received;
+static int callbacks;
+
+static void Test_Callback(DatagramSocket * /*socket*/, Datagram * datagrams, int count,
+    void * user_data)
+{
+  const struct sockaddr_in * from = (const struct sockaddr_in *)user_data;
+
+  callbacks++;
+  for (int i=0; i<count; i++)
+  {
+    const struct sockaddr_in * in = (const struct sockaddr_in *)datagrams[i].addr;
+    EV_VERIFY(!datagrams[i].truncated);
+    EV_VERIFY(datagrams[i].addrlen == sizeof(*in));
+    if (from)
+      EV_VERIFY(in->sin_port == from->sin_port);
+    received.push_back(std::string(datagrams[i].data, datagrams[i].size));
+  }
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: receive in batches");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  DatagramSocket socket(8);
+  struct sockaddr_in addr, from;
+  int fd = Udp();
+  char buf[32];
+  int polls = 0;
+
+  received.clear();
+  callbacks = 0;
+
+  LoopbackAddress(&addr);
+  BoundAddress(fd, &from);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socket.Bind(reactor.get(), (struct sockaddr *)&addr, sizeof(addr),
+        Test_Callback, &from) == kEvOK);
+  BoundAddress(socket.fd(), &addr);
+
+  for (int i=0; i<100; i++)
+  {
+    snprintf(buf, sizeof(buf), "datagram %d", i);
+    EV_VERIFY(sendto(fd, buf, strlen(buf), 0, (struct sockaddr *)&addr, sizeof(addr))
+        == (ssize_t)strlen(buf));
+  }
+  // an empty datagram
+  EV_VERIFY(sendto(fd, buf, 0, 0, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+  // 8 datagrams per readiness
+  while (received.size() < 101)
+  {
+    EV_VERIFY(reactor->PollOne() == 1);
+    polls++;
+  }
+  EV_VERIFY(polls == 13);
+  EV_VERIFY(callbacks == 13);
+  for (int i=0; i<100; i++)
+  {
+    snprintf(buf, sizeof(buf), "datagram %d", i);
+    EV_VERIFY(received[(size_t)i] == buf);
+  }
+  EV_VERIFY(received[100].empty());
+
+  socket.UnInit();
+  safe_close(fd);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static int Test2_TimerFired;
+
+static void Test2_Timer(int /*fd*/, int /*event*/, void * user_data)
+{
+  DatagramSocket * socket = (DatagramSocket *)user_data;
+  char buf[32];
+
+  // datagrams queued inside callbacks are flushed at the end of the loop iteration
+  Test2_TimerFired = 1;
+  for (int i=0; i<10; i++)
+  {
+    snprintf(buf, sizeof(buf), "datagram %d", i);
+    EV_VERIFY(socket->Send(buf, strlen(buf)) == kEvOK);
+  }
+  EV_VERIFY(socket->queued() == 10);
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: send in batches at the end of the loop iteration");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  DatagramSocket socket;
+  struct sockaddr_in addr;
+  Event timer;
+  int fd = Udp();
+  char buf[32];
+  char big[4096];
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  BoundAddress(fd, &addr);
+  EV_VERIFY((socket.Init(reactor.get(), Udp(), Test_Callback, 0)) == kEvOK);
+  EV_VERIFY(connect(socket.fd(), (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+  timer.event = kEvTimer;
+  timer.callback = Test2_Timer;
+  timer.user_data = &socket;
+  Test2_TimerFired = 0;
+  EV_VERIFY(reactor->AddTimer(&timer, 1) == kEvOK);
+  while (!Test2_TimerFired)
+    (void)reactor->RunOne();
+  EV_VERIFY(socket.queued() == 10);
+  (void)reactor->Poll();
+  EV_VERIFY(socket.queued() == 0);
+
+  for (int i=0; i<10; i++)
+  {
+    snprintf(buf, sizeof(buf), "datagram %d", i);
+    EV_VERIFY(recv(fd, big, sizeof(big), 0) == (ssize_t)strlen(buf));
+    EV_VERIFY(memcmp(big, buf, strlen(buf)) == 0);
+  }
+
+  // too large datagrams are dropped
+  std::string huge(70000, 'x');
+  EV_VERIFY(socket.SendTo(huge.data(), huge.size(),
+        (struct sockaddr *)&addr, sizeof(addr)) == kEvOK);
+  EV_VERIFY(socket.SendTo("after", 5, (struct sockaddr *)&addr, sizeof(addr)) == kEvOK);
+  EV_VERIFY(socket.Flush() == kEvOK);
+  EV_VERIFY(socket.dropped() == 1);
+  EV_VERIFY(recv(fd, big, sizeof(big), 0) == 5);
+
+  // only empty datagrams are queued
+  EV_VERIFY(socket.Send("", 0) == kEvOK);
+  EV_VERIFY(socket.Send("", 0) == kEvOK);
+  EV_VERIFY(socket.Flush() == kEvOK);
+  EV_VERIFY(socket.queued() == 0);
+  EV_VERIFY(recv(fd, big, sizeof(big), 0) == 0);
+  EV_VERIFY(recv(fd, big, sizeof(big), 0) == 0);
+
+  // ENOBUFS drops the datagram instead of waiting for kEvOut
+  size_t dropped = socket.dropped();
+  EV_VERIFY(socket.Send("lost", 4) == kEvOK);
+  EV_VERIFY(socket.Send("kept", 4) == kEvOK);
+  sendmmsg_error = ENOBUFS;
+  EV_VERIFY(socket.Flush() == kEvOK);
+  EV_VERIFY(socket.queued() == 0);
+  EV_VERIFY(socket.dropped() == dropped + 1);
+  EV_VERIFY(recv(fd, big, sizeof(big), 0) == 4);
+  EV_VERIFY(memcmp(big, "kept", 4) == 0);
+
+  // the queue is limited
+  socket.SetMaxQueue(100);
+  EV_VERIFY(socket.Send(big, 101) == kEvFailure && errno == EAGAIN);
+
+  int socket_fd = socket.fd();
+  socket.UnInit();
+  // the posted flush outlives the socket
+  (void)reactor->Poll();
+  safe_close(socket_fd);
+  safe_close(fd);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: GSO and GRO");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  DatagramSocket sender;
+  DatagramSocket receiver(64, 65535);
+  struct sockaddr_in addr;
+  std::vector<std::string> sent;
+
+  received.clear();
+  callbacks = 0;
+
+  LoopbackAddress(&addr);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(receiver.Bind(reactor.get(), (struct sockaddr *)&addr, sizeof(addr),
+        Test_Callback, 0) == kEvOK);
+  EV_VERIFY(sender.Bind(reactor.get(), (struct sockaddr *)&addr, sizeof(addr),
+        Test_Callback, 0) == kEvOK);
+  BoundAddress(receiver.fd(), &addr);
+
+  if (sender.EnableGSO() != kEvOK || receiver.EnableGRO() != kEvOK)
+  {
+    EV_LOG(kWarning, "GSO or GRO is not supported: %s", strerror(errno));
+    return;
+  }
+
+  // 3 runs of the same size, the last datagram of each run is smaller,
+  // which fit in the receive buffer
+  for (int i=0; i<90; i++)
+  {
+    std::string data((i % 30 == 29)?(100):(1000), (char)('a' + i % 26));
+    EV_VERIFY(sender.SendTo(data.data(), data.size(),
+          (struct sockaddr *)&addr, sizeof(addr)) == kEvOK);
+    sent.push_back(data);
+  }
+  EV_VERIFY(sender.Flush() == kEvOK);
+  EV_VERIFY(sender.queued() == 0);
+
+  while (received.size() < sent.size())
+    (void)reactor->RunOne();
+
+  EV_LOG(kInfo, "%d datagrams received in %d callbacks", (int)received.size(), callbacks);
+  EV_VERIFY(received == sent);
+
+  sender.UnInit();
+  receiver.UnInit();
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  return 0;
+}
@@ -16,4 +16,56 @@
 #define DISALLOW_COPY_AND_ASSIGN(TypeName) \
   TypeName(const TypeName&); TypeName& operator=(const TypeName&)
 
+namespace libev {
+
+  // Detects an object destroyed inside a callback invoked by itself.
+  // The object keeps 'int * destroyed_'(0 initially), and its 'UnInit' calls 'Destroy'.
+  // Invokers may be nested, e.g. a callback invoking a method which invokes another callback.
+  //
+  //   DestroyedGuard destroyed(&destroyed_);
+  //   callback_(this, user_data_);
+  //   if (destroyed.Leave())
+  //     return;// members must not be touched
+  class DestroyedGuard
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(DestroyedGuard);
+
+      int ** slot_;
+      int * outer_;
+      int destroyed_;
+
+    public:
+      explicit DestroyedGuard(int ** slot)
+        : slot_(slot), outer_(*slot), destroyed_(0)
+      {
+        *slot_ = &destroyed_;
+      }
+
+      // call once after the callback returns
+      // return 1 if the object is destroyed, and also tell the outer invoker
+      int Leave()
+      {
+        if (destroyed_)
+        {
+          if (outer_)
+            *outer_ = 1;
+          return 1;
+        }
+        *slot_ = outer_;
+        return 0;
+      }
+
+      // tell the invoker(if any) that the object is gone
+      static void Destroy(int ** slot)
+      {
+        if (*slot)
+        {
+          **slot = 1;
+          *slot = 0;
+        }
+      }
+  };
+}
+
 #endif
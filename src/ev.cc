@@ -13,12 +13,14 @@ namespace libev {
 
   Event::Event() : real_event(0), triggered_times(0), flags(0), reactor(0)
   {
+    timespec_clear(&interval);
   }
 
   Event::Event(int _fd, int _event, ev_callback _callback, void * _udata)
     : fd(_fd), event(_event), callback(_callback), user_data(_udata),
     real_event(0), triggered_times(0), flags(0), reactor(0)
   {
+    timespec_clear(&interval);
   }
 
   Event::Event(const timespec * _timeout, ev_callback _callback, void * _udata)
@@ -26,6 +28,7 @@ namespace libev {
     real_event(0), triggered_times(0), flags(0), reactor(0)
   {
     timeout = *_timeout;
+    timespec_clear(&interval);
   }
 
   void Event::AddToList(List * list)
@@ -104,6 +107,12 @@ einval:
     if ((ret = CheckInputEventFlag(ev->event)) != kEvOK)
       return ret;
 
+    if ((ev->event & kEvWheel) && !(ev->event & kEvTimer))
+      EV_LOG(kWarning, "kEvWheel on a non-Timer Event(%p) is ignored", ev);
+
+    if ((ev->event & kEvErrQueue) && !(ev->event & kEvIO))
+      EV_LOG(kWarning, "kEvErrQueue on a non-IO Event(%p) is ignored", ev);
+
     if (ev->event & kEvIO)
     {
       if (ev->fd < 0)
@@ -127,8 +136,15 @@ einval:
     {
       if (ev->event & kEvET)
         EV_LOG(kWarning, "kEvET on a Timer Event(%p) is ignored", ev);
-      if (ev->event & kEvPersist)
-        EV_LOG(kWarning, "kEvPersist on a Timer Event(%p) is ignored", ev);
+      if ((ev->event & kEvPersist) && !timespec_isset(&ev->interval))
+        EV_LOG(kWarning, "kEvPersist on a Timer Event(%p) without interval is ignored", ev);
+
+      if (ev->interval.tv_sec < 0 || ev->interval.tv_nsec < 0
+          || ev->interval.tv_nsec >= 1000000000)
+      {
+        EV_LOG(kError, "Timer Event(%p) has an invalid interval", ev);
+        goto einval;
+      }
 
       if (!timespec_isset(&ev->timeout))
       {
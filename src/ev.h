@@ -11,6 +11,7 @@
 #include "ev-internal.h"
 #include "list.h"
 #include <time.h>//struct timespec
+#include <stdint.h>//int64_t
 
 namespace libev {
 
@@ -35,13 +36,36 @@ namespace libev {
     //   because kEvIn and kEvOut, which can be set to poll simultaneously,
     //   may not be triggered simultaneously.
     //   kEvSignal and kEvTimer need not to be checked in callback(2nd parameter).
+    // 6.A repeating timer is rescheduled 'interval' later in place when it expires,
+    //   and Event.timeout is its next timeout in callback.
+    //   If several intervals are missed, its callback is invoked once for every interval,
+    //   or only once with kEvSkipMissed.
+    // 7.Adding the first IO event of an fd registers it to the backend immediately,
+    //   and deleting the last one unregisters it immediately,
+    //   so the fd may be closed right after 'Del' even if its file is still open elsewhere.
+    //   A non-persistent IO event which is the last one of its fd is unregistered
+    //   after its callback instead, and re-adding it inside the callback costs no syscall,
+    //   the fd must not be closed and its number reused for the same event inside the callback.
+    //   Other changes of IO events(modifications) are deferred and flushed right before waiting,
+    //   so changes that cancel out(e.g. deleting and re-adding kEvOut) cost no syscall.
+    //   Failures of deferred changes are reported to the events with kEvErr.
+    //   An fd closed before its events are deleted may stay polled if its file is still open
+    //   elsewhere, it is unregistered when it is ready.
+    // 8.EPOLLERR also means the socket error queue is readable(e.g. MSG_ZEROCOPY completions).
+    //   If kEvErrQueue is set in any IO event of an fd, EPOLLERR without EPOLLHUP
+    //   is reported to it as kEvErrQueue instead of kEvErr,
+    //   and the callback must drain the error queue(recvmsg with MSG_ERRQUEUE)
+    //   and check SO_ERROR for a pending socket error.
     kEvIn = 0x01,             // fd/socket event: fd can be read(EPOLLIN)
     kEvOut = 0x02,            // fd/socket event: fd can be write(EPOLLOUT)
     kEvIO = kEvIn|kEvOut,
     kEvSignal = 0x04,         // signal event
-    kEvTimer = 0x08,          // timer event(on which kEvPersist is ignored)
+    kEvTimer = 0x08,          // timer event(repeating with kEvPersist and Event.interval)
     kEvPersist = 0x10,        // persistent event
     kEvET = 0x20,             // use edge trigger(EPOLLET)
+    kEvWheel = 0x40,          // timer event: use the timing wheel(see kEvTimerWheel)
+    kEvSkipMissed = 0x80,     // repeating timer event: skip missed intervals instead of catching up
+    kEvErrQueue = 0x100,      // fd/socket event: the error queue is readable(also checked in callback)
 
 
     // The following event flag must not be set in Event.event,
@@ -51,6 +75,31 @@ namespace libev {
   };
 
 
+  enum InitFlag
+  {
+    // The following flags select the backend of Reactor(Reactor::Init).
+    // If both are set, io_uring is preferred and epoll is the fallback
+    // on kernels without io_uring(Linux 5.13 or later is required),
+    // or if it was built with headers older than Linux 5.13.
+    kEvBackendEpoll = 0x01,   // epoll(default)
+    kEvBackendIOUring = 0x02, // io_uring, poll requests and timeout requests
+    kEvBackendAuto = kEvBackendEpoll|kEvBackendIOUring,
+
+    // epoll backend: do not use timerfd, derive the timeout of epoll_wait
+    // from the nearest timer instead(epoll_pwait2 for nanosecond precision
+    // if supported, or epoll_wait rounded up to milliseconds),
+    // which saves the syscalls of arming and reading timerfd.
+    // The io_uring backend always uses timeout requests and ignores it.
+    kEvNoTimerFd = 0x04,
+
+    // All timers use the hierarchical timing wheel instead of the min heap.
+    // Adding and deleting a timer of the wheel are O(1),
+    // but it may expire 1 tick(Reactor::SetTimerWheelTick) later than its timeout.
+    // Set kEvWheel in Event.event to use the wheel for some timers only.
+    kEvTimerWheel = 0x08
+  };
+
+
   enum
   {
     // The following event flag are private. No attention please.
@@ -60,17 +109,20 @@ namespace libev {
   };
 
   typedef void (*ev_callback)(int fd, int event, void * user_data);
+  typedef void (*ev_task_callback)(void * user_data);
 
 
   class ReactorImpl;
+  class TimerWheel;
 
   struct Event
   {
     public:
       // The following members are required fields,
       // but they can not be modified after being added to reactor.
-      int fd;                   // fd(kEvIn, kEvOut), signal number(kEvSignal), heap index(kEvTimer)
+      int fd;                   // fd(kEvIn, kEvOut), signal number(kEvSignal), heap index or wheel level(kEvTimer)
       timespec timeout;         // absolute and monotonic timeout(kEvTimer)
+      timespec interval;        // interval of repeating timers(kEvTimer|kEvPersist), 0 by default
       int event;                // event flags(bit or of EventFlag)
       ev_callback callback;     // callback
       void * user_data;         // user data
@@ -85,9 +137,11 @@ namespace libev {
     private:
       DISALLOW_COPY_AND_ASSIGN(Event);
       friend class ReactorImpl;
+      friend class TimerWheel;
 
       ListNode _all;// node in all event list
       ListNode _active;// node in active event list
+      ListNode _timer;// node in timing wheel
 
       int real_event;// the real event to be passed to callback
       int triggered_times;// the times that the signal is triggered but pending(signal events)
@@ -125,7 +179,8 @@ namespace libev {
       Reactor();
       ~Reactor();
 
-      int Init();
+      // 'flags' is bit or of InitFlag
+      int Init(int flags = kEvBackendEpoll);
       void UnInit();
 
       int Add(Event * ev);
@@ -152,7 +207,40 @@ namespace libev {
       // if 'limit' == 0, execute all events, or until interrupted
       // return the number of executed event
       int Run(int limit);
+      // it may be called from any thread
       int Stop();
+
+      // run 'callback' with 'user_data' in the thread polling or running the reactor,
+      // it may be called from any thread.
+      // A burst of posts costs at most one wakeup of the reactor.
+      // Tasks posted before 'UnInit' are run inside it.
+      int Post(ev_task_callback callback, void * user_data);
+
+      // a referenced reactor does not quit 'Run' for no events,
+      // 'Ref' and 'Unref' must be paired
+      void Ref();
+      void Unref();
+      // the number of added events, which may be read from other threads as a load hint
+      int Load()const;
+
+      // set the tick of the timing wheel(1ms by default),
+      // it can not be changed if any timer is in the wheel.
+      int SetTimerWheelTick(const timespec * tick);
+
+      // set the slack of timers(0 by default).
+      // Timers may expire at most 'slack' later than their timeouts,
+      // so that timers expiring within 'slack' share one wakeup.
+      int SetTimerSlack(const timespec * slack);
+
+      // the monotonic clock cached once per loop iteration(right after waiting),
+      // which is cheaper than clock_gettime in callbacks
+      const timespec * Now()const;
+      // update the cached clock, e.g. after a long callback
+      void UpdateNow();
+      // set 'ev->timeout' to 'after'/'ms' milliseconds later than 'Now' and add 'ev',
+      // 'ev->event' must have kEvTimer
+      int AddTimer(Event * ev, const timespec * after);
+      int AddTimer(Event * ev, int64_t ms);
   };
 }
 
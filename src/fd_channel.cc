@@ -0,0 +1,485 @@
+/** @file
+ * @brief pass file descriptors with messages over unix domain sockets
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "fd_channel.h"
+#include "log.h"
+#include "header.h"
+
+namespace libev {
+
+  static const int kIovecSize = 64;// messages per sendmsg
+  static const int kMaxReads = 16;// recvmsg calls per readable event
+  static const size_t kHeaderSize = 8;// the payload size and the number of fds, in host order
+  static const size_t kDefaultMaxPending = 1024;
+
+  const size_t FdChannel::kMaxFdPayload;
+  const int FdChannel::kMaxFdsPerMessage;
+
+  // a cmsg buffer for the most fds, aligned for cmsghdr
+  union FdControl
+  {
+    char buf[CMSG_SPACE(sizeof(int) * FdChannel::kMaxFdsPerMessage)];
+    struct cmsghdr align;
+  };
+
+  static void CloseFds(const int * fds, size_t nfds)
+  {
+    for (size_t i=0; i<nfds; i++)
+      (void)safe_close(fds[i]);
+  }
+
+  FdChannel::FdChannel()
+    : reactor_(0), fd_(-1), callback_(0), user_data_(0),
+    reading_(0), writing_(0), blocked_(0), eof_(0), error_(0),
+    max_pending_(kDefaultMaxPending), destroyed_(0), sent_(0)
+  {
+  }
+
+  FdChannel::~FdChannel()
+  {
+    UnInit();
+  }
+
+  int FdChannel::Init(Reactor * reactor, int fd, fd_channel_callback callback, void * user_data)
+  {
+    if (reactor == 0 || fd < 0 || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "FdChannel(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      EV_LOG(kError, "fcntl: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    ev_in_.fd = fd;
+    ev_in_.event = kEvIn|kEvPersist;
+    ev_in_.callback = OnIn;
+    ev_in_.user_data = this;
+    ev_out_.fd = fd;
+    ev_out_.event = kEvOut|kEvPersist;
+    ev_out_.callback = OnOut;
+    ev_out_.user_data = this;
+
+    int ret;
+    if ((ret = reactor->Add(&ev_in_)) != kEvOK)
+      return ret;
+
+    reactor_ = reactor;
+    fd_ = fd;
+    callback_ = callback;
+    user_data_ = user_data;
+    reading_ = 1;
+    writing_ = 0;
+    blocked_ = 0;
+    eof_ = 0;
+    error_ = 0;
+    return kEvOK;
+  }
+
+  void FdChannel::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    Stop();
+    reactor_ = 0;
+    fd_ = -1;
+
+    // tell the callback invoker that the channel is gone
+    DestroyedGuard::Destroy(&destroyed_);
+  }
+
+  void FdChannel::Stop()
+  {
+    if (reading_)
+    {
+      (void)ev_in_.Del();
+      reading_ = 0;
+    }
+    if (writing_)
+    {
+      (void)ev_out_.Del();
+      writing_ = 0;
+    }
+
+    for (size_t i=0; i<output_.size(); i++)
+    {
+      if (!output_[i].fds.empty())
+        CloseFds(&output_[i].fds[0], output_[i].fds.size());
+    }
+    output_.clear();
+    sent_ = 0;
+    for (size_t i=0; i<received_fds_.size(); i++)
+      (void)safe_close(received_fds_[i]);
+    received_fds_.clear();
+    input_.clear();
+  }
+
+  void FdChannel::Fail(int error)
+  {
+    EV_LOG(kDebug, "FdChannel(%p) failed: %s", this, strerror(error));
+    error_ = error;
+    Stop();
+    (void)Invoke(kFdChannelError, 0, 0, 0, 0);
+  }
+
+  int FdChannel::Invoke(int event, const void * data, size_t size, const int * fds, int nfds)
+  {
+    DestroyedGuard destroyed(&destroyed_);
+    callback_(this, event, data, size, fds, nfds, user_data_);
+    return destroyed.Leave();
+  }
+
+  void FdChannel::SetMaxPending(size_t max_pending)
+  {
+    max_pending_ = (max_pending)?(max_pending):(1);
+  }
+
+  void FdChannel::Pause()
+  {
+    if (reading_)
+    {
+      (void)ev_in_.Del();
+      reading_ = 0;
+    }
+  }
+
+  void FdChannel::Resume()
+  {
+    if (reactor_ && !reading_ && !eof_ && !error_)
+    {
+      if (reactor_->Add(&ev_in_) == kEvOK)
+        reading_ = 1;
+      else
+        EV_LOG(kError, "FdChannel(%p) fails to resume receiving", this);
+    }
+  }
+
+  int FdChannel::Send(const void * data, size_t size, const int * fds, int nfds)
+  {
+    if (reactor_ == 0 || eof_ || error_)
+    {
+      errno = EPIPE;
+      return kEvFailure;
+    }
+
+    if (size > kMaxFdPayload || nfds < 0 || nfds > kMaxFdsPerMessage
+        || (size && data == 0) || (nfds && fds == 0))
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (output_.size() >= max_pending_)
+    {
+      blocked_ = 1;
+      errno = EAGAIN;
+      return kEvFailure;
+    }
+
+    uint32_t header[2];
+    int queued = 0;
+    header[0] = (uint32_t)size;
+    header[1] = (uint32_t)nfds;
+    try
+    {
+      output_.push_back(Message());// may throw(caught)
+      queued = 1;
+      Message& message = output_.back();
+      message.data.reserve(kHeaderSize + size);// may throw(caught)
+      message.data.append((const char *)header, kHeaderSize);
+      message.data.append((const char *)data, size);
+      message.fds.assign(fds, fds + nfds);// may throw(caught)
+    }
+    catch (...)
+    {
+      if (queued)
+        output_.pop_back();
+      return kEvNoMemory;
+    }
+
+    // flushed when kEvOut is ready, with other messages sent in this loop iteration
+    if (!writing_)
+    {
+      int ret;
+      if ((ret = reactor_->Add(&ev_out_)) != kEvOK)
+      {
+        output_.pop_back();
+        return ret;
+      }
+      writing_ = 1;
+    }
+    return kEvOK;
+  }
+
+  int FdChannel::Flush()
+  {
+    struct iovec iov[kIovecSize];
+    FdControl control;
+    struct msghdr msg;
+    int * fds = (int *)(void *)CMSG_DATA(&control.align);
+    int iovcnt, nfds;
+    size_t count;
+    ssize_t n;
+
+    while (!output_.empty())
+    {
+      // fds of a message are sent with or before its first byte,
+      // so they are received before its header
+      iovcnt = 0;
+      nfds = 0;
+      for (count=0; count<output_.size() && iovcnt<kIovecSize; count++)
+      {
+        Message * message = &output_[count];
+        size_t offset = (count == 0)?(sent_):(0);
+
+        if (nfds + (int)message->fds.size() > kMaxFdsPerMessage)
+          break;
+        if (!message->fds.empty())
+        {
+          memcpy(fds + nfds, &message->fds[0], sizeof(int) * message->fds.size());
+          nfds += (int)message->fds.size();
+        }
+        iov[iovcnt].iov_base = (void *)(message->data.data() + offset);
+        iov[iovcnt].iov_len = message->data.size() - offset;
+        iovcnt++;
+      }
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = (size_t)iovcnt;
+      if (nfds)
+      {
+        struct cmsghdr * cmsg = &control.align;
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)nfds);
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+      }
+
+      do n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+      while (n == -1 && errno == EINTR);
+
+      if (n == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return kEvOK;
+        return kEvFailure;
+      }
+
+      // all fds have been sent with the first byte, the kernel holds them in flight
+      for (size_t i=0; i<count; i++)
+      {
+        Message * message = &output_[i];
+        if (!message->fds.empty())
+        {
+          CloseFds(&message->fds[0], message->fds.size());
+          message->fds.clear();
+        }
+      }
+
+      size_t left = (size_t)n;
+      while (left)
+      {
+        size_t unsent = output_.front().data.size() - sent_;
+        if (left < unsent)
+        {
+          sent_ += left;
+          break;
+        }
+        left -= unsent;
+        output_.pop_front();
+        sent_ = 0;
+      }
+    }
+    return kEvOK;
+  }
+
+  void FdChannel::OnOut(int /*fd*/, int event, void * user_data)
+  {
+    FdChannel * channel = (FdChannel *)user_data;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      channel->writing_ = 0;
+      return;
+    }
+
+    if (channel->Flush() != kEvOK)
+    {
+      channel->Fail(errno);
+      return;
+    }
+
+    if (channel->output_.empty())
+    {
+      // nothing pending, stop polling kEvOut
+      (void)channel->ev_out_.Del();
+      channel->writing_ = 0;
+
+      if (channel->blocked_)
+      {
+        channel->blocked_ = 0;
+        (void)channel->Invoke(kFdChannelDrained, 0, 0, 0, 0);
+      }
+    }
+  }
+
+  int FdChannel::Receive()
+  {
+    int fds[kMaxFdsPerMessage];
+    uint32_t header[2];
+    size_t offset = 0;
+    int ret = 0;
+
+    while (input_.size() - offset >= kHeaderSize)
+    {
+      memcpy(header, input_.data() + offset, kHeaderSize);
+      if (header[0] > kMaxFdPayload || header[1] > (uint32_t)kMaxFdsPerMessage
+          || header[1] > received_fds_.size())
+      {
+        errno = EPROTO;
+        ret = -1;
+        break;
+      }
+      if (input_.size() - offset - kHeaderSize < header[0])
+        break;
+
+      int nfds = (int)header[1];
+      for (int i=0; i<nfds; i++)
+      {
+        fds[i] = received_fds_.front();
+        received_fds_.pop_front();
+      }
+      const char * data = input_.data() + offset + kHeaderSize;
+      offset += kHeaderSize + header[0];
+      if (Invoke(kFdChannelMessage, data, header[0], fds, nfds))
+        return 1;
+    }
+
+    input_.erase(0, offset);
+    return ret;
+  }
+
+  void FdChannel::OnIn(int /*fd*/, int event, void * user_data)
+  {
+    FdChannel * channel = (FdChannel *)user_data;
+    char buf[16384];
+    FdControl control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr * cmsg;
+    ssize_t n;
+    int eof = 0, error = 0;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      channel->reading_ = 0;
+      return;
+    }
+
+    for (int i=0; i<kMaxReads; i++)
+    {
+      iov.iov_base = buf;
+      iov.iov_len = sizeof(buf);
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      do n = recvmsg(channel->fd_, &msg, MSG_CMSG_CLOEXEC);
+      while (n == -1 && errno == EINTR);
+
+      if (n == -1)
+      {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          error = errno;
+        break;
+      }
+
+      // the fds are kept before anything fails, so that they are closed
+      for (cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg))
+      {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+
+        const int * fds = (const int *)(void *)CMSG_DATA(cmsg);
+        size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t j=0; j<nfds; j++)
+        {
+          try
+          {
+            channel->received_fds_.push_back(fds[j]);// may throw(caught)
+          }
+          catch (...)
+          {
+            CloseFds(fds + j, nfds - j);
+            error = ENOMEM;
+            break;
+          }
+        }
+      }
+
+      if (error)
+        break;
+
+      if (msg.msg_flags & MSG_CTRUNC)
+      {
+        // fds have been lost
+        error = EPROTO;
+        break;
+      }
+
+      if (n == 0)
+      {
+        eof = 1;
+        break;
+      }
+
+      try
+      {
+        channel->input_.append(buf, (size_t)n);// may throw(caught)
+      }
+      catch (...)
+      {
+        error = ENOMEM;
+        break;
+      }
+    }
+
+    int ret = channel->Receive();
+    if (ret == 1)
+      return;
+    if (ret == -1 && error == 0)
+      error = errno;
+
+    if (error)
+    {
+      channel->Fail(error);
+    }
+    else if (eof)
+    {
+      EV_LOG(kDebug, "FdChannel(%p) reaches EOF", channel);
+      channel->eof_ = 1;
+      channel->Stop();
+      (void)channel->Invoke(kFdChannelEOF, 0, 0, 0, 0);
+    }
+  }
+}
@@ -0,0 +1,128 @@
+/** @file
+ * @brief pass file descriptors with messages over unix domain sockets
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_FD_CHANNEL_H
+#define LIBEV_FD_CHANNEL_H
+
+#include "ev.h"
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace libev {
+
+  // events passed to fd_channel_callback
+  enum FdChannelEvent
+  {
+    kFdChannelMessage = 0x01, // a message is received
+    kFdChannelDrained = 0x02, // the queue has drained after 'Send' failed with EAGAIN
+    kFdChannelEOF = 0x04,     // the peer has closed, the channel stops
+    kFdChannelError = 0x08    // an error occurred(refer to 'error'), the channel stops
+  };
+
+  class FdChannel;
+  // 'data' and 'fds' of kFdChannelMessage are valid only inside the callback,
+  // 'fds' are new close-on-exec fds owned by the callback
+  typedef void (*fd_channel_callback)(FdChannel * channel, int event,
+      const void * data, size_t size, const int * fds, int nfds, void * user_data);
+
+  // A fd channel sends messages, each of a small payload and a batch of fds,
+  // over a connected AF_UNIX SOCK_STREAM socket with SCM_RIGHTS,
+  // e.g. from a master accepting connections to its workers,
+  // or listening sockets from an old process to a new one in a hot restart.
+  // Messages sent are queued and flushed when kEvOut is ready,
+  // so that messages sent in one loop iteration share one sendmsg.
+  // At most 'max_pending' messages are queued, then 'Send' fails with EAGAIN,
+  // and kFdChannelDrained is reported when the queue drains.
+  // The channel may be deleted inside its callback.
+  class FdChannel
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(FdChannel);
+
+      struct Message
+      {
+        std::string data;// the header and the payload
+        std::vector<int> fds;// closed when sent
+      };
+
+      Reactor * reactor_;
+      int fd_;
+      Event ev_in_;
+      Event ev_out_;
+      fd_channel_callback callback_;
+      void * user_data_;
+      int reading_;// 'ev_in_' is added
+      int writing_;// 'ev_out_' is added
+      int blocked_;// 'Send' has failed with EAGAIN
+      int eof_;
+      int error_;
+      size_t max_pending_;
+      int * destroyed_;// set to 1 if the channel is destroyed inside its callback
+
+      // sending
+      std::deque<Message> output_;
+      size_t sent_;// bytes of the first message sent
+
+      // receiving
+      std::string input_;
+      std::deque<int> received_fds_;// fds of messages not parsed
+
+      static void OnIn(int fd, int event, void * user_data);
+      static void OnOut(int fd, int event, void * user_data);
+
+      // return 1 if the channel is destroyed
+      int Invoke(int event, const void * data, size_t size, const int * fds, int nfds);
+      // send queued messages until they are drained or the socket would block
+      // return kEvOK or kEvFailure
+      int Flush();
+      // report messages received in 'input_'
+      // return 1 if the channel is destroyed, -1 for malformed messages
+      int Receive();
+      // stop polling, and close fds not sent or not reported
+      void Stop();
+      // stop and report kFdChannelError
+      void Fail(int error);
+
+    public:
+      FdChannel();
+      ~FdChannel();
+
+      // 'fd' is a connected AF_UNIX SOCK_STREAM socket(e.g. of socketpair),
+      // set to be nonblocking and polled by 'reactor', which is not owned
+      int Init(Reactor * reactor, int fd, fd_channel_callback callback, void * user_data);
+      // fds not sent or not reported are closed
+      void UnInit();
+
+      // queue a message of 'size' bytes of 'data' and 'nfds' 'fds',
+      // 'size' is at most kMaxFdPayload and 'nfds' is at most kMaxFdsPerMessage.
+      // 'fds' are owned by the channel if it returns kEvOK, and closed when they are sent,
+      // dup them to keep them(e.g. listening sockets handed over).
+      // Events of fds polled by a reactor must be deleted first.
+      int Send(const void * data, size_t size, const int * fds, int nfds);
+
+      // stop receiving, so that the peer is pushed back
+      void Pause();
+      void Resume();
+
+      // at most 'max_pending' messages are queued(1024 by default)
+      void SetMaxPending(size_t max_pending);
+
+      int fd()const {return fd_;}
+      Reactor * reactor()const {return reactor_;}
+      // the number of messages queued
+      size_t pending()const {return output_.size();}
+      // the errno of kFdChannelError
+      int error()const {return error_;}
+
+      static const size_t kMaxFdPayload = 65536;
+      static const int kMaxFdsPerMessage = 253;// SCM_MAX_FD
+  };
+}
+
+#endif
@@ -0,0 +1,376 @@
+/** @file
+ * @brief test fd channels
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "fd_channel.h"
+#include "acceptor.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+struct Helper
+{
+  int messages;
+  int fds;
+  int drained;
+  int eof;
+  int error;
+  std::vector<std::string> payloads;
+  std::vector<int> received;// fds kept by the callback
+};
+
+static void ResetHelper(Helper * helper)
+{
+  helper->messages = 0;
+  helper->fds = 0;
+  helper->drained = 0;
+  helper->eof = 0;
+  helper->error = 0;
+  helper->payloads.clear();
+  helper->received.clear();
+}
+
+static void Callback(FdChannel * channel, int event,
+    const void * data, size_t size, const int * fds, int nfds, void * user_data)
+{
+  Helper * helper = (Helper *)user_data;
+
+  if (event & kFdChannelMessage)
+  {
+    helper->messages++;
+    helper->fds += nfds;
+    helper->payloads.push_back(std::string((const char *)data, size));
+    for (int i=0; i<nfds; i++)
+    {
+      EV_VERIFY(fcntl(fds[i], F_GETFD) & FD_CLOEXEC);
+      helper->received.push_back(fds[i]);
+    }
+  }
+  if (event & kFdChannelDrained)
+    helper->drained++;
+  if (event & kFdChannelEOF)
+    helper->eof++;
+  if (event & kFdChannelError)
+  {
+    EV_VERIFY(channel->error() != 0);
+    helper->error = channel->error();
+  }
+}
+
+static void RunUntil(Reactor * reactor, const int * counter, int n)
+{
+  while (*counter < n)
+    EV_VERIFY(reactor->RunOne() >= 0);
+}
+
+static const int kMessages = 100;
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: send messages with fds");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  FdChannel sender, receiver;
+  Helper sent, received;
+  int sv[2], p[2];
+  std::vector<int> readers;
+  char buf[64];
+
+  ResetHelper(&sent);
+  ResetHelper(&received);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == 0);
+  EV_VERIFY(sender.Init(reactor.get(), sv[0], Callback, &sent) == kEvOK);
+  EV_VERIFY(sender.Init(reactor.get(), sv[0], Callback, &sent) == kEvExists);
+  EV_VERIFY(receiver.Init(reactor.get(), sv[1], Callback, &received) == kEvOK);
+
+  // queued in one loop iteration, and sent together
+  for (int i=0; i<kMessages; i++)
+  {
+    EV_VERIFY(pipe2(p, O_CLOEXEC) == 0);
+    readers.push_back(p[0]);
+    snprintf(buf, sizeof(buf), "message %d", i);
+    EV_VERIFY(sender.Send(buf, strlen(buf), &p[1], 1) == kEvOK);
+  }
+  EV_VERIFY(sender.Send(0, 0, 0, 0) == kEvOK);
+  EV_VERIFY(sender.pending() == kMessages + 1);
+  EV_VERIFY(sender.Send(0, FdChannel::kMaxFdPayload + 1, 0, 0) == kEvFailure);
+  EV_VERIFY(sender.Send(0, 0, 0, FdChannel::kMaxFdsPerMessage + 1) == kEvFailure);
+
+  RunUntil(reactor.get(), &received.messages, kMessages + 1);
+  EV_VERIFY(sender.pending() == 0);
+  EV_VERIFY(received.fds == kMessages);
+  EV_VERIFY(received.payloads[kMessages].empty());
+  for (int i=0; i<kMessages; i++)
+  {
+    snprintf(buf, sizeof(buf), "message %d", i);
+    EV_VERIFY(received.payloads[(size_t)i] == buf);
+    EV_VERIFY(write(received.received[(size_t)i], buf, 1) == 1);
+  }
+  CloseAll(&received.received);
+
+  // the write ends are closed by the sender after being sent, and by the receiver
+  for (int i=0; i<kMessages; i++)
+  {
+    EV_VERIFY(read(readers[(size_t)i], buf, sizeof(buf)) == 1);
+    EV_VERIFY(read(readers[(size_t)i], buf, sizeof(buf)) == 0);
+  }
+  CloseAll(&readers);
+
+  sender.UnInit();
+  receiver.UnInit();
+  safe_close(sv[0]);
+  safe_close(sv[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static const int kBatches = 100;
+static const int kFdsPerBatch = 3;
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: send more fds than a sendmsg carries");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  FdChannel sender, receiver;
+  Helper sent, received;
+  int sv[2], fds[FdChannel::kMaxFdsPerMessage];
+  std::string payload(FdChannel::kMaxFdPayload, 'z');
+
+  ResetHelper(&sent);
+  ResetHelper(&received);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == 0);
+  EV_VERIFY(sender.Init(reactor.get(), sv[0], Callback, &sent) == kEvOK);
+  EV_VERIFY(receiver.Init(reactor.get(), sv[1], Callback, &received) == kEvOK);
+
+  for (int i=0; i<FdChannel::kMaxFdsPerMessage; i++)
+    EV_VERIFY((fds[i] = open("/dev/null", O_RDONLY|O_CLOEXEC)) != -1);
+  EV_VERIFY(sender.Send(payload.data(), payload.size(), fds,
+        FdChannel::kMaxFdsPerMessage) == kEvOK);
+  for (int i=0; i<kBatches; i++)
+  {
+    for (int j=0; j<kFdsPerBatch; j++)
+      EV_VERIFY((fds[j] = open("/dev/null", O_RDONLY|O_CLOEXEC)) != -1);
+    EV_VERIFY(sender.Send(&i, sizeof(i), fds, kFdsPerBatch) == kEvOK);
+  }
+
+  RunUntil(reactor.get(), &received.messages, kBatches + 1);
+  EV_VERIFY(received.fds == FdChannel::kMaxFdsPerMessage + kBatches * kFdsPerBatch);
+  EV_VERIFY(received.payloads[0] == payload);
+  for (int i=0; i<kBatches; i++)
+  {
+    int n;
+    EV_VERIFY(received.payloads[(size_t)i + 1].size() == sizeof(n));
+    memcpy(&n, received.payloads[(size_t)i + 1].data(), sizeof(n));
+    EV_VERIFY(n == i);
+  }
+  CloseAll(&received.received);
+
+  sender.UnInit();
+  receiver.UnInit();
+  safe_close(sv[0]);
+  safe_close(sv[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: backpressure");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  FdChannel sender, receiver;
+  Helper sent, received;
+  int sv[2], fd;
+
+  ResetHelper(&sent);
+  ResetHelper(&received);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == 0);
+  EV_VERIFY(sender.Init(reactor.get(), sv[0], Callback, &sent) == kEvOK);
+  EV_VERIFY(receiver.Init(reactor.get(), sv[1], Callback, &received) == kEvOK);
+  sender.SetMaxPending(8);
+
+  for (int i=0; i<8; i++)
+  {
+    EV_VERIFY((fd = open("/dev/null", O_RDONLY|O_CLOEXEC)) != -1);
+    EV_VERIFY(sender.Send("x", 1, &fd, 1) == kEvOK);
+  }
+  // 'fd' is still owned by the caller
+  EV_VERIFY((fd = open("/dev/null", O_RDONLY|O_CLOEXEC)) != -1);
+  EV_VERIFY(sender.Send("x", 1, &fd, 1) == kEvFailure);
+  EV_VERIFY(errno == EAGAIN);
+  safe_close(fd);
+
+  RunUntil(reactor.get(), &sent.drained, 1);
+  EV_VERIFY(sender.pending() == 0);
+  RunUntil(reactor.get(), &received.messages, 8);
+
+  // a paused receiver pushes the sender back by the socket buffer
+  receiver.Pause();
+  for (int i=0; i<4; i++)
+    EV_VERIFY(sender.Send("y", 1, 0, 0) == kEvOK);
+  for (int i=0; i<8; i++)
+    EV_VERIFY(reactor->Poll() >= 0);
+  EV_VERIFY(sender.pending() == 0);
+  EV_VERIFY(received.messages == 8);
+  receiver.Resume();
+  RunUntil(reactor.get(), &received.messages, 12);
+  EV_VERIFY(received.payloads.back() == "y");
+  EV_VERIFY(sent.drained == 1);
+  CloseAll(&received.received);
+
+  sender.UnInit();
+  receiver.UnInit();
+  safe_close(sv[0]);
+  safe_close(sv[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static const int kClients = 8;
+static std::vector<int> accepted_fds;
+
+static void Test4_Callback(Acceptor * /*acceptor*/, int fd,
+    const struct sockaddr * /*addr*/, socklen_t /*addrlen*/, void * /*user_data*/)
+{
+  accepted_fds.push_back(fd);
+}
+
+static void Connect(const struct sockaddr_in * addr, int n, std::vector<int> * clients)
+{
+  int fd;
+  for (int i=0; i<n; i++)
+  {
+    EV_VERIFY((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    EV_VERIFY(connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0);
+    clients->push_back(fd);
+  }
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: hand a listening socket over");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  FdChannel old_channel, new_channel;
+  Acceptor old_acceptor, new_acceptor;
+  Helper sent, received;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  std::vector<int> clients;
+  int sv[2];
+
+  ResetHelper(&sent);
+  ResetHelper(&received);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(old_acceptor.Listen(reactor.get(), (struct sockaddr *)&addr, sizeof(addr),
+        Test4_Callback, 0) == kEvOK);
+  EV_VERIFY(getsockname(old_acceptor.fd(), (struct sockaddr *)&addr, &len) == 0);
+
+  // connections wait in the backlog during the restart
+  Connect(&addr, kClients, &clients);
+
+  // the old process hands a dup of its listening socket over and stops accepting
+  int fd = dup(old_acceptor.fd());
+  EV_VERIFY(fd != -1);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == 0);
+  EV_VERIFY(old_channel.Init(reactor.get(), sv[0], Callback, &sent) == kEvOK);
+  EV_VERIFY(new_channel.Init(reactor.get(), sv[1], Callback, &received) == kEvOK);
+  EV_VERIFY(old_channel.Send("listener", 8, &fd, 1) == kEvOK);
+  old_acceptor.UnInit();
+
+  RunUntil(reactor.get(), &received.messages, 1);
+  old_channel.UnInit();
+  EV_VERIFY(accepted_fds.empty());
+  EV_VERIFY(received.payloads[0] == "listener");
+  EV_VERIFY(received.received.size() == 1);
+  EV_VERIFY(new_acceptor.Init(reactor.get(), received.received[0], Test4_Callback, 0) == kEvOK);
+
+  // no connection is dropped
+  Connect(&addr, kClients, &clients);
+  while (accepted_fds.size() < 2 * kClients)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(new_acceptor.accepted() == 2 * kClients);
+
+  new_acceptor.UnInit();
+  new_channel.UnInit();
+  CloseAll(&received.received);
+  CloseAll(&accepted_fds);
+  CloseAll(&clients);
+  safe_close(sv[0]);
+  safe_close(sv[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test5()
+{
+  EV_LOG(kInfo, "Test 5: EOF, errors and cleanup");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  FdChannel sender, receiver;
+  Helper sent, received;
+  int sv[2], p[2];
+  char buf[16];
+
+  ResetHelper(&sent);
+  ResetHelper(&received);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == 0);
+  EV_VERIFY(sender.Init(reactor.get(), sv[0], Callback, &sent) == kEvOK);
+  EV_VERIFY(receiver.Init(reactor.get(), sv[1], Callback, &received) == kEvOK);
+
+  // fds not sent are closed
+  EV_VERIFY(pipe2(p, O_CLOEXEC) == 0);
+  EV_VERIFY(sender.Send("z", 1, &p[1], 1) == kEvOK);
+  sender.UnInit();
+  EV_VERIFY(read(p[0], buf, sizeof(buf)) == 0);
+  safe_close(p[0]);
+  EV_VERIFY(sender.Send("z", 1, 0, 0) == kEvFailure);
+
+  safe_close(sv[0]);
+  RunUntil(reactor.get(), &received.eof, 1);
+  EV_VERIFY(received.messages == 0);
+  EV_VERIFY(receiver.Send("z", 1, 0, 0) == kEvFailure);
+  receiver.UnInit();
+  safe_close(sv[1]);
+
+  // malformed messages
+  uint32_t header[2] = {0xffffffff, 0};
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == 0);
+  EV_VERIFY(receiver.Init(reactor.get(), sv[1], Callback, &received) == kEvOK);
+  EV_VERIFY(write(sv[0], header, sizeof(header)) == sizeof(header));
+  while (received.error == 0)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(received.error == EPROTO);
+  receiver.UnInit();
+  safe_close(sv[0]);
+  safe_close(sv[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  Test5();
+  return 0;
+}
@@ -0,0 +1,683 @@
+/** @file
+ * @brief asynchronous file IO completed in the reactor thread
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "file_io.h"
+#include "log.h"
+#include "header.h"
+
+#if defined HAVE_LINUX_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+#endif
+
+namespace libev {
+
+#if defined HAVE_LINUX_IO_URING
+
+  static const unsigned kRingEntries = 256;
+
+  // a ring for file requests only, whose completions signal an eventfd
+  struct FileIO::Ring
+  {
+    int fd;
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    io_uring_sqe * sqes;
+    size_t sqes_size;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned to_submit;// in the submission queue but not submitted
+
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe * cqes;
+
+    unsigned inflight;// submitted but not reaped
+
+    Ring() : fd(-1), sq_ring(MAP_FAILED), sq_ring_size(0),
+      cq_ring(MAP_FAILED), cq_ring_size(0), sqes((io_uring_sqe *)MAP_FAILED), sqes_size(0),
+      sq_head(0), sq_tail(0), sq_array(0), sq_mask(0), sq_entries(0), to_submit(0),
+      cq_head(0), cq_tail(0), cq_mask(0), cqes(0), inflight(0) {}
+    ~Ring();
+
+    // return kEvOK, or kEvFailure if io_uring or any op is not supported
+    int Init(int eventfd);
+    // return kEvOK or kEvFailure
+    int Enter(unsigned min_complete);
+  };
+
+  FileIO::Ring::~Ring()
+  {
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+      munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+      munmap(sq_ring, sq_ring_size);
+    if (fd != -1)
+      safe_close(fd);
+  }
+
+  int FileIO::Ring::Init(int eventfd)
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd = (int)syscall(__NR_io_uring_setup, kRingEntries, &params);
+    if (fd == -1)
+    {
+      EV_LOG(kWarning, "io_uring_setup: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    if ((params.features & IORING_FEAT_NODROP) == 0)
+    {
+      EV_LOG(kWarning, "io_uring: features(%#x) are not supported", params.features);
+      errno = ENOSYS;
+      return kEvFailure;
+    }
+
+    // IORING_OP_OPENAT, IORING_OP_READ and IORING_OP_WRITE need Linux 5.6
+    const int kOps[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC};
+    const int kMaxOps = 256;
+    size_t probe_size = sizeof(io_uring_probe) + kMaxOps * sizeof(io_uring_probe_op);
+    io_uring_probe * probe = (io_uring_probe *)calloc(1, probe_size);
+    if (probe == 0)
+      return kEvFailure;
+    int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, kMaxOps) == 0;
+    for (size_t i=0; supported && i<sizeof(kOps)/sizeof(kOps[0]); i++)
+    {
+      if (kOps[i] > probe->last_op || (probe->ops[kOps[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+        supported = 0;
+    }
+    free(probe);
+    if (!supported)
+    {
+      EV_LOG(kWarning, "io_uring: file ops are not supported");
+      errno = ENOSYS;
+      return kEvFailure;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (cq_ring_size > sq_ring_size)
+        sq_ring_size = cq_ring_size;
+      cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring = mmap(0, sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+      EV_LOG(kError, "mmap: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      cq_ring = sq_ring;
+    }
+    else
+    {
+      cq_ring = mmap(0, cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+          fd, IORING_OFF_CQ_RING);
+      if (cq_ring == MAP_FAILED)
+      {
+        EV_LOG(kError, "mmap: %s", strerror(errno));
+        return kEvFailure;
+      }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(0, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+      EV_LOG(kError, "mmap: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    char * sq = (char *)sq_ring;
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+
+    char * cq = (char *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // completions are reported through 'eventfd' like those of the threads
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &eventfd, 1) == -1)
+    {
+      EV_LOG(kWarning, "io_uring_register: %s", strerror(errno));
+      return kEvFailure;
+    }
+    return kEvOK;
+  }
+
+  int FileIO::Ring::Enter(unsigned min_complete)
+  {
+    unsigned flags = (min_complete)?(IORING_ENTER_GETEVENTS):(0);
+    int result;
+
+    do result = (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+    while (result == -1 && errno == EINTR);
+
+    if (result == -1)
+    {
+      // EBUSY, EAGAIN: submitted later
+      if (errno == EBUSY || errno == EAGAIN)
+        return kEvOK;
+      EV_LOG(kError, "io_uring_enter: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    EV_ASSERT((unsigned)result <= to_submit);
+    to_submit -= (unsigned)result;
+    return kEvOK;
+  }
+
+  int FileIO::SubmitUring(FileRequest * req)
+  {
+    if (ring_ == 0 || req->op == kFileStat || ring_->inflight == ring_->sq_entries)
+      return kEvFailure;
+    // 'len' of sqes is 32 bits, and the result of cqes is an int
+    if ((req->op == kFileRead || req->op == kFileWrite) && req->size > (size_t)INT_MAX)
+      return kEvFailure;
+
+    Ring * ring = ring_;
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+      return kEvFailure;
+
+    unsigned index = tail & ring->sq_mask;
+    io_uring_sqe * sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    switch (req->op)
+    {
+    case kFileOpen:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uint64_t)(uintptr_t)req->path;
+      sqe->len = req->mode;
+      sqe->open_flags = (uint32_t)req->flags;
+      break;
+    case kFileRead:
+    case kFileWrite:
+      sqe->opcode = (req->op == kFileRead)?(IORING_OP_READ):(IORING_OP_WRITE);
+      sqe->fd = req->fd;
+      sqe->addr = (uint64_t)(uintptr_t)req->buf;
+      sqe->len = (uint32_t)req->size;
+      sqe->off = (uint64_t)req->offset;
+      break;
+    case kFileFsync:
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fd = req->fd;
+      break;
+    default:
+      EV_ASSERT(0);
+      return kEvFailure;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    ring->inflight++;
+    req->uring_ = 1;
+
+    // a request not submitted now is submitted by a later one or 'ReapUring'
+    if (ring->Enter(0) != kEvOK)
+      EV_LOG(kWarning, "FileIO(%p) fails to submit to io_uring", this);
+    return kEvOK;
+  }
+
+  void FileIO::ReapUring()
+  {
+    if (ring_ == 0)
+      return;
+
+    Ring * ring = ring_;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+      const io_uring_cqe * cqe = &ring->cqes[head & ring->cq_mask];
+      FileRequest * req = (FileRequest *)(uintptr_t)cqe->user_data;
+      if (cqe->res < 0)
+      {
+        req->result = -1;
+        req->error = -cqe->res;
+      }
+      else
+      {
+        req->result = cqe->res;
+        req->error = 0;
+      }
+      ring->inflight--;
+      completed_.push(&req->node_);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (ring->to_submit)
+      (void)ring->Enter(0);
+  }
+
+#else
+
+  struct FileIO::Ring
+  {
+  };
+
+  int FileIO::SubmitUring(FileRequest * /*req*/)
+  {
+    return kEvFailure;
+  }
+
+  void FileIO::ReapUring()
+  {
+  }
+
+#endif
+
+
+  /************************************************************************/
+  FileRequest::FileRequest()
+    : op(kFileRead), fd(-1), path(0), flags(0), mode(0),
+    buf(0), size(0), offset(0), st(0), callback(0), user_data(0),
+    result(-1), error(0), uring_(0)
+  {
+    node_.next = 0;
+    node_.callback = 0;
+    node_.user_data = this;
+  }
+
+
+  /************************************************************************/
+  FileIO::FileIO()
+    : reactor_(0), pending_(0), pending_tail_(0), stopping_(0), signaled_(0),
+    polling_(0), ring_(0), inflight_(0), delivering_(0), destroyed_(0)
+  {
+    EV_VERIFY(pthread_mutex_init(&mutex_, 0) == 0);
+    EV_VERIFY(pthread_cond_init(&cond_, 0) == 0);
+  }
+
+  FileIO::~FileIO()
+  {
+    UnInit();
+    (void)pthread_cond_destroy(&cond_);
+    (void)pthread_mutex_destroy(&mutex_);
+  }
+
+  int FileIO::Init(Reactor * reactor, int threads, int flags)
+  {
+    if (reactor == 0 || threads < 1)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "FileIO(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    try
+    {
+      threads_.reserve((size_t)threads);// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+
+    int ret;
+    if ((ret = interrupter_.Init()) != kEvOK)
+      return ret;
+
+    ev_.fd = interrupter_.fd();
+    ev_.event = kEvIn|kEvPersist;
+    ev_.callback = OnCompleted;
+    ev_.user_data = this;
+    polling_ = 0;
+
+#if defined HAVE_LINUX_IO_URING
+    if (flags & kFileIOUring)
+    {
+      try
+      {
+        ring_ = new Ring;// may throw(caught)
+      }
+      catch (...)
+      {
+        ring_ = 0;
+      }
+      if (ring_ && ring_->Init(interrupter_.fd()) != kEvOK)
+      {
+        delete ring_;
+        ring_ = 0;
+      }
+      if (ring_ == 0)
+        EV_LOG(kWarning, "FileIO(%p) falls back to threads", this);
+    }
+#else
+    (void)flags;
+#endif
+
+    stopping_ = 0;
+    for (int i=0; i<threads; i++)
+    {
+      pthread_t thread;
+      if ((ret = pthread_create(&thread, 0, ThreadFunc, this)) != 0)
+      {
+        EV_LOG(kError, "pthread_create: %s", strerror(ret));
+        errno = ret;
+        reactor_ = reactor;
+        UnInit();
+        return kEvFailure;
+      }
+      threads_.push_back(thread);
+    }
+
+    reactor_ = reactor;
+    inflight_ = 0;
+    EV_LOG(kDebug, "FileIO(%p) runs %d threads%s", this, threads, (ring_)?(" and io_uring"):(""));
+    return kEvOK;
+  }
+
+  void FileIO::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    // stop the threads after their running requests, and take requests not started
+    EV_VERIFY(pthread_mutex_lock(&mutex_) == 0);
+    stopping_ = 1;
+    TaskNode * pending = pending_;
+    pending_ = pending_tail_ = 0;
+    EV_VERIFY(pthread_cond_broadcast(&cond_) == 0);
+    EV_VERIFY(pthread_mutex_unlock(&mutex_) == 0);
+    for (size_t i=0; i<threads_.size(); i++)
+      EV_VERIFY(pthread_join(threads_[i], 0) == 0);
+    threads_.clear();
+
+#if defined HAVE_LINUX_IO_URING
+    // requests submitted can not be taken back
+    while (ring_ && ring_->inflight)
+    {
+      if (ring_->Enter(1) != kEvOK)
+        break;
+      ReapUring();
+    }
+    delete ring_;
+    ring_ = 0;
+#endif
+
+    if (polling_)
+    {
+      (void)ev_.Del();
+      polling_ = 0;
+    }
+    interrupter_.UnInit();
+
+    for (TaskNode * node = pending, * next; node; node = next)
+    {
+      next = node->next;
+      FileRequest * req = (FileRequest *)node->user_data;
+      req->result = -1;
+      req->error = ECANCELED;
+      completed_.push(node);
+    }
+
+    // tell the callback invoker that the file io is gone
+    DestroyedGuard::Destroy(&destroyed_);
+
+    if (Deliver())
+      return;
+
+    reactor_ = 0;
+    stopping_ = 0;
+    signaled_ = 0;
+  }
+
+  void * FileIO::ThreadFunc(void * arg)
+  {
+    FileIO * io = (FileIO *)arg;
+    TaskNode * node;
+
+    EV_VERIFY(pthread_mutex_lock(&io->mutex_) == 0);
+    for (;;)
+    {
+      while (io->pending_ == 0 && !io->stopping_)
+        EV_VERIFY(pthread_cond_wait(&io->cond_, &io->mutex_) == 0);
+      if (io->stopping_)
+        break;
+
+      node = io->pending_;
+      io->pending_ = node->next;
+      if (io->pending_ == 0)
+        io->pending_tail_ = 0;
+      EV_VERIFY(pthread_mutex_unlock(&io->mutex_) == 0);
+
+      FileRequest * req = (FileRequest *)node->user_data;
+      Run(req);
+      io->Complete(req);
+
+      EV_VERIFY(pthread_mutex_lock(&io->mutex_) == 0);
+    }
+    EV_VERIFY(pthread_mutex_unlock(&io->mutex_) == 0);
+    return 0;
+  }
+
+  void FileIO::Run(FileRequest * req)
+  {
+    ssize_t n;
+
+    switch (req->op)
+    {
+    case kFileOpen:
+      do n = open(req->path, req->flags, req->mode);
+      while (n == -1 && errno == EINTR);
+      break;
+    case kFileRead:
+      do n = pread(req->fd, req->buf, req->size, req->offset);
+      while (n == -1 && errno == EINTR);
+      break;
+    case kFileWrite:
+      do n = pwrite(req->fd, req->buf, req->size, req->offset);
+      while (n == -1 && errno == EINTR);
+      break;
+    case kFileFsync:
+      n = fsync(req->fd);
+      break;
+    case kFileStat:
+      n = stat(req->path, req->st);
+      break;
+    default:
+      n = -1;
+      errno = EINVAL;
+      break;
+    }
+
+    req->result = n;
+    req->error = (n == -1)?(errno):(0);
+  }
+
+  void FileIO::Complete(FileRequest * req)
+  {
+    completed_.push(&req->node_);
+    // only the first completion after the reactor resets the eventfd signals it
+    if (__sync_lock_test_and_set(&signaled_, 1) == 0)
+      (void)interrupter_.Interrupt();
+  }
+
+  void FileIO::OnCompleted(int /*fd*/, int event, void * user_data)
+  {
+    FileIO * io = (FileIO *)user_data;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      io->polling_ = 0;
+      return;
+    }
+
+    io->interrupter_.Reset();
+    __sync_lock_release(&io->signaled_);
+    io->ReapUring();
+    if (io->Deliver())
+      return;
+
+    if (io->inflight_ == 0 && io->polling_)
+    {
+      (void)io->ev_.Del();
+      io->polling_ = 0;
+    }
+  }
+
+  int FileIO::Deliver()
+  {
+    // completions taken are kept in 'delivering_',
+    // so that they are still delivered if the file io is uninitialized by a callback
+    TaskNode * node = completed_.pop_all();
+    if (node)
+    {
+      TaskNode ** tail = &delivering_;
+      while (*tail)
+        tail = &(*tail)->next;
+      *tail = node;
+    }
+
+    while (delivering_)
+    {
+      node = delivering_;
+      delivering_ = node->next;
+      node->next = 0;
+
+      FileRequest * req = (FileRequest *)node->user_data;
+      req->uring_ = 0;
+      inflight_--;
+
+      DestroyedGuard destroyed(&destroyed_);
+      req->callback(req, req->user_data);
+      if (destroyed.Leave())
+        return 1;
+    }
+    return 0;
+  }
+
+  int FileIO::Submit(FileRequest * req)
+  {
+    if (reactor_ == 0 || stopping_ || req->callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    // the eventfd is polled only while requests are in flight,
+    // so that an idle file io does not keep the reactor running
+    if (!polling_)
+    {
+      int ret;
+      if ((ret = reactor_->Add(&ev_)) != kEvOK)
+        return ret;
+      polling_ = 1;
+    }
+
+    req->result = -1;
+    req->error = 0;
+    req->node_.next = 0;
+
+    if (SubmitUring(req) != kEvOK)
+    {
+      EV_VERIFY(pthread_mutex_lock(&mutex_) == 0);
+      if (pending_tail_)
+        pending_tail_->next = &req->node_;
+      else
+        pending_ = &req->node_;
+      pending_tail_ = &req->node_;
+      EV_VERIFY(pthread_cond_signal(&cond_) == 0);
+      EV_VERIFY(pthread_mutex_unlock(&mutex_) == 0);
+    }
+
+    inflight_++;
+    return kEvOK;
+  }
+
+  int FileIO::Open(FileRequest * req, const char * path, int flags, mode_t mode,
+      file_callback callback, void * user_data)
+  {
+    req->op = kFileOpen;
+    req->path = path;
+    req->flags = flags;
+    req->mode = mode;
+    req->callback = callback;
+    req->user_data = user_data;
+    return Submit(req);
+  }
+
+  int FileIO::Read(FileRequest * req, int fd, void * buf, size_t size, off_t offset,
+      file_callback callback, void * user_data)
+  {
+    req->op = kFileRead;
+    req->fd = fd;
+    req->buf = buf;
+    req->size = size;
+    req->offset = offset;
+    req->callback = callback;
+    req->user_data = user_data;
+    return Submit(req);
+  }
+
+  int FileIO::Write(FileRequest * req, int fd, const void * buf, size_t size, off_t offset,
+      file_callback callback, void * user_data)
+  {
+    req->op = kFileWrite;
+    req->fd = fd;
+    req->buf = (void *)buf;
+    req->size = size;
+    req->offset = offset;
+    req->callback = callback;
+    req->user_data = user_data;
+    return Submit(req);
+  }
+
+  int FileIO::Fsync(FileRequest * req, int fd, file_callback callback, void * user_data)
+  {
+    req->op = kFileFsync;
+    req->fd = fd;
+    req->callback = callback;
+    req->user_data = user_data;
+    return Submit(req);
+  }
+
+  int FileIO::Stat(FileRequest * req, const char * path, struct stat * st,
+      file_callback callback, void * user_data)
+  {
+    req->op = kFileStat;
+    req->path = path;
+    req->st = st;
+    req->callback = callback;
+    req->user_data = user_data;
+    return Submit(req);
+  }
+}
@@ -0,0 +1,156 @@
+/** @file
+ * @brief asynchronous file IO completed in the reactor thread
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_FILE_IO_H
+#define LIBEV_FILE_IO_H
+
+#include "ev.h"
+#include "interrupter.h"
+#include "task_queue.h"
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <vector>
+
+namespace libev {
+
+  enum FileOp
+  {
+    kFileOpen,
+    kFileRead,
+    kFileWrite,
+    kFileFsync,
+    kFileStat
+  };
+
+  // flags of 'FileIO::Init'
+  enum FileIOFlag
+  {
+    kFileIOUring = 0x01   // submit requests to io_uring if it is supported
+  };
+
+  struct FileRequest;
+  typedef void (*file_callback)(FileRequest * req, void * user_data);
+
+  // a request owned by the caller, which must be kept until its callback is invoked
+  struct FileRequest
+  {
+    public:
+      // set by the helpers of FileIO
+      int op;                   // FileOp
+      int fd;                   // kFileRead, kFileWrite, kFileFsync
+      const char * path;        // kFileOpen, kFileStat
+      int flags;                // kFileOpen
+      mode_t mode;              // kFileOpen
+      void * buf;               // kFileRead, kFileWrite
+      size_t size;              // kFileRead, kFileWrite
+      off_t offset;             // kFileRead, kFileWrite
+      struct stat * st;         // kFileStat
+      file_callback callback;
+      void * user_data;
+
+      // results
+      ssize_t result;           // bytes read or written, the fd opened, or 0, -1 if failed
+      int error;                // errno if failed
+
+    public:
+      FileRequest();
+
+    private:
+      DISALLOW_COPY_AND_ASSIGN(FileRequest);
+      friend class FileIO;
+
+      TaskNode node_;// in the completion queue, or the pending list(node_.next)
+      int uring_;// submitted to io_uring
+  };
+
+  // Regular files are always ready for epoll, so reading or writing them in callbacks
+  // blocks the reactor(e.g. on page faults).
+  // FileIO runs file requests on a bounded pool of threads,
+  // or on an io_uring of its own(kFileIOUring) if supported,
+  // and invokes their callbacks in the reactor thread.
+  // Both report completions through one eventfd polled by the reactor,
+  // and a burst of completions costs at most one wakeup.
+  // kFileStat, and reads or writes larger than INT_MAX bytes, always run on the threads.
+  // The eventfd is polled only while requests are in flight,
+  // so the reactor quits 'Run' for no events once they are all delivered.
+  // Requests are submitted in the reactor thread only.
+  // The file io may be deleted inside its callbacks.
+  class FileIO
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(FileIO);
+
+      struct Ring;
+
+      Reactor * reactor_;
+      std::vector<pthread_t> threads_;
+      pthread_mutex_t mutex_;
+      pthread_cond_t cond_;
+      TaskNode * pending_;// requests to be run by the threads, protected by 'mutex_'
+      TaskNode * pending_tail_;
+      int stopping_;// protected by 'mutex_'
+      TaskQueue completed_;// requests completed by the threads
+      int signaled_;// 'interrupter_' has been signaled but not reset
+      Interrupter interrupter_;
+      Event ev_;
+      int polling_;// 'ev_' is added
+      Ring * ring_;
+      int inflight_;// requests not delivered
+      TaskNode * delivering_;// completions taken but not delivered
+      int * destroyed_;// set to 1 if the file io is destroyed inside its callback
+
+      static void * ThreadFunc(void * arg);
+      static void OnCompleted(int fd, int event, void * user_data);
+
+      // run 'req' in the calling thread
+      static void Run(FileRequest * req);
+      // complete 'req' from any thread
+      void Complete(FileRequest * req);
+      // return kEvOK, or kEvFailure if 'req' should run on the threads
+      int SubmitUring(FileRequest * req);
+      // move completions of io_uring to 'completed_'
+      void ReapUring();
+      // invoke callbacks of completed requests
+      // return 1 if the file io is destroyed
+      int Deliver();
+
+    public:
+      FileIO();
+      ~FileIO();
+
+      // start 'threads'(>= 1) threads, and set up io_uring if kFileIOUring is in 'flags'
+      int Init(Reactor * reactor, int threads = 4, int flags = 0);
+      // wait for requests running, and cancel requests not started(ECANCELED),
+      // whose callbacks are all invoked before it returns
+      void UnInit();
+
+      // submit 'req', whose callback is invoked later in the reactor thread
+      int Submit(FileRequest * req);
+
+      // fill 'req' and submit it, 'req->result' is the fd opened
+      int Open(FileRequest * req, const char * path, int flags, mode_t mode,
+          file_callback callback, void * user_data);
+      // 'req->result' is bytes read
+      int Read(FileRequest * req, int fd, void * buf, size_t size, off_t offset,
+          file_callback callback, void * user_data);
+      // 'req->result' is bytes written
+      int Write(FileRequest * req, int fd, const void * buf, size_t size, off_t offset,
+          file_callback callback, void * user_data);
+      int Fsync(FileRequest * req, int fd, file_callback callback, void * user_data);
+      int Stat(FileRequest * req, const char * path, struct stat * st,
+          file_callback callback, void * user_data);
+
+      Reactor * reactor()const {return reactor_;}
+      // io_uring is used
+      int uring()const {return ring_ != 0;}
+      // requests whose callbacks have not been invoked
+      int inflight()const {return inflight_;}
+  };
+}
+
+#endif
@@ -0,0 +1,299 @@
+/** @file
+ * @brief test asynchronous file IO
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "file_io.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+#include <pthread.h>
+#include <string>
+
+using namespace libev;
+
+struct Context
+{
+  pthread_t reactor_thread;
+  int completed;
+  int canceled;
+  int wrong_thread;
+  FileIO * io;// deleted when a request completes
+};
+
+static void InitContext(Context * context)
+{
+  context->reactor_thread = pthread_self();
+  context->completed = 0;
+  context->canceled = 0;
+  context->wrong_thread = 0;
+  context->io = 0;
+}
+
+static void OnRequest(FileRequest * req, void * user_data)
+{
+  Context * context = (Context *)user_data;
+
+  if (!pthread_equal(context->reactor_thread, pthread_self()))
+    context->wrong_thread++;
+  if (req->result == -1 && req->error == ECANCELED)
+    context->canceled++;
+  context->completed++;
+
+  if (context->io)
+  {
+    // other callbacks are invoked inside the delete
+    FileIO * io = context->io;
+    context->io = 0;
+    delete io;
+  }
+}
+
+// run the reactor until 'count' requests are completed
+static void Wait(Reactor * reactor, Context * context, int count)
+{
+  while (context->completed < count)
+    EV_VERIFY(reactor->RunOne() >= 0);
+}
+
+static std::string TempPath(const char * name)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "/tmp/file_io_test_%d_%s", (int)getpid(), name);
+  return path;
+}
+
+static void TestFile(int flags)
+{
+  ScopedPtr<Reactor> reactor(new Reactor);
+  FileIO io;
+  Context context;
+  FileRequest req;
+  std::string path = TempPath("a");
+  std::string data = Payload(100000, 1);
+  std::string read_data(data.size(), '\0');
+  struct stat st;
+  int fd;
+
+  InitContext(&context);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(io.Submit(&req) == kEvFailure && errno == EINVAL);
+  EV_VERIFY(io.Init(0) == kEvFailure && errno == EINVAL);
+  EV_VERIFY(io.Init(reactor.get(), 0) == kEvFailure && errno == EINVAL);
+  EV_VERIFY(io.Init(reactor.get(), 2, flags) == kEvOK);
+  EV_VERIFY(io.Init(reactor.get(), 2, flags) == kEvExists);
+  EV_LOG(kInfo, "io_uring is %s", (io.uring())?("used"):("not used"));
+
+  // open
+  EV_VERIFY(io.Open(&req, path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644,
+        OnRequest, &context) == kEvOK);
+  EV_VERIFY(io.inflight() == 1);
+  Wait(reactor.get(), &context, 1);
+  EV_VERIFY(io.inflight() == 0);
+  EV_VERIFY(req.result >= 0 && req.error == 0);
+  fd = (int)req.result;
+
+  // write, fsync
+  EV_VERIFY(io.Write(&req, fd, data.data(), data.size(), 0, OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 2);
+  EV_VERIFY(req.result == (ssize_t)data.size());
+  EV_VERIFY(io.Fsync(&req, fd, OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 3);
+  EV_VERIFY(req.result == 0);
+
+  // stat
+  EV_VERIFY(io.Stat(&req, path.c_str(), &st, OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 4);
+  EV_VERIFY(req.result == 0);
+  EV_VERIFY(st.st_size == (off_t)data.size());
+
+  // read at an offset
+  EV_VERIFY(io.Read(&req, fd, &read_data[0], read_data.size(), 1000, OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 5);
+  EV_VERIFY(req.result == (ssize_t)data.size() - 1000);
+  EV_VERIFY(read_data.compare(0, data.size() - 1000, data, 1000, std::string::npos) == 0);
+
+  // a read larger than INT_MAX bytes, of which only the last 1000 bytes exist
+  EV_VERIFY(io.Read(&req, fd, &read_data[0], (size_t)INT_MAX + 1, data.size() - 1000,
+        OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 6);
+  EV_VERIFY(req.result == 1000);
+  EV_VERIFY(read_data.compare(0, 1000, data, data.size() - 1000, 1000) == 0);
+
+  // errors
+  EV_VERIFY(io.Read(&req, -1, &read_data[0], 1, 0, OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 7);
+  EV_VERIFY(req.result == -1 && req.error == EBADF);
+  EV_VERIFY(io.Open(&req, "/nonexistent/file_io_test", O_RDONLY, 0, OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 8);
+  EV_VERIFY(req.result == -1 && req.error == ENOENT);
+  EV_VERIFY(io.Stat(&req, "/nonexistent/file_io_test", &st, OnRequest, &context) == kEvOK);
+  Wait(reactor.get(), &context, 9);
+  EV_VERIFY(req.result == -1 && req.error == ENOENT);
+
+  EV_VERIFY(context.wrong_thread == 0);
+  EV_VERIFY(context.canceled == 0);
+
+  io.UnInit();
+  EV_VERIFY(io.reactor() == 0);
+  safe_close(fd);
+  unlink(path.c_str());
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: requests on threads");
+  TestFile(0);
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: requests on io_uring");
+  TestFile(kFileIOUring);
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: concurrent requests");
+
+  const int kRequests = 1000;
+  const size_t kBlockSize = 4096;
+
+  for (int flags=0; flags<=kFileIOUring; flags+=kFileIOUring)
+  {
+    ScopedPtr<Reactor> reactor(new Reactor);
+    FileIO io;
+    Context context;
+    FileRequest * reqs = new FileRequest[kRequests];
+    std::string path = TempPath("b");
+    std::string data = Payload(kRequests * kBlockSize, 3);
+    std::string read_data(data.size(), '\0');
+    int fd;
+
+    InitContext(&context);
+    EV_VERIFY(reactor->Init() == kEvOK);
+    EV_VERIFY(io.Init(reactor.get(), 4, flags) == kEvOK);
+    fd = open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    EV_VERIFY(fd != -1);
+    EV_VERIFY(write(fd, data.data(), data.size()) == (ssize_t)data.size());
+
+    for (int i=0; i<kRequests; i++)
+      EV_VERIFY(io.Read(&reqs[i], fd, &read_data[i * kBlockSize], kBlockSize,
+            (off_t)(i * kBlockSize), OnRequest, &context) == kEvOK);
+    EV_VERIFY(io.inflight() == kRequests);
+
+    // Run does not quit while requests are in flight
+    EV_VERIFY(reactor->Run() >= 0);
+    EV_VERIFY(context.completed == kRequests);
+    EV_VERIFY(io.inflight() == 0);
+    for (int i=0; i<kRequests; i++)
+      EV_VERIFY(reqs[i].result == (ssize_t)kBlockSize);
+    EV_VERIFY(read_data == data);
+    EV_VERIFY(context.wrong_thread == 0);
+
+    io.UnInit();
+    delete [] reqs;
+    safe_close(fd);
+    unlink(path.c_str());
+  }
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+// open the fifo 'arg' for writing later, which unblocks opening it for reading
+static void * OpenLater(void * arg)
+{
+  const char * path = (const char *)arg;
+  usleep(100 * 1000);
+  // ENXIO: opening it for reading has been canceled
+  int fd = open(path, O_WRONLY|O_NONBLOCK|O_CLOEXEC);
+  EV_VERIFY(fd != -1 || errno == ENXIO);
+  if (fd != -1)
+    safe_close(fd);
+  return 0;
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: uninitialization");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Context context;
+  FileRequest reqs[100];
+  const int kRequests = (int)(sizeof(reqs) / sizeof(reqs[0]));
+  FileRequest blocked;
+  struct stat st;
+  std::string path = TempPath("c");
+  char c;
+  int fd;
+  pthread_t thread;
+
+  // the running request is waited for, and requests not started are canceled
+  {
+    FileIO io;
+    InitContext(&context);
+    EV_VERIFY(reactor->Init() == kEvOK);
+    EV_VERIFY(io.Init(reactor.get(), 1) == kEvOK);
+    EV_VERIFY(mkfifo(path.c_str(), 0644) == 0);
+    EV_VERIFY(io.Open(&blocked, path.c_str(), O_RDONLY|O_CLOEXEC, 0, OnRequest, &context) == kEvOK);
+    for (int i=0; i<kRequests; i++)
+      EV_VERIFY(io.Stat(&reqs[i], "/", &st, OnRequest, &context) == kEvOK);
+    EV_VERIFY(pthread_create(&thread, 0, OpenLater, (void *)path.c_str()) == 0);
+    io.UnInit();
+    EV_VERIFY(pthread_join(thread, 0) == 0);
+    EV_VERIFY(context.completed == kRequests + 1);
+    if (blocked.result == -1)
+      EV_VERIFY(context.canceled == kRequests + 1);
+    else
+      EV_VERIFY(context.canceled == kRequests);
+    EV_VERIFY(context.wrong_thread == 0);
+    EV_VERIFY(io.Stat(&reqs[0], "/", &st, OnRequest, &context) == kEvFailure);
+    // the reactor is unreferenced
+    EV_VERIFY(reactor->Run() >= 0);
+    if (blocked.result != -1)
+      safe_close((int)blocked.result);
+    unlink(path.c_str());
+  }
+
+  // deleted inside the callback
+  fd = open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  EV_VERIFY(fd != -1);
+  for (int flags=0; flags<=kFileIOUring; flags+=kFileIOUring)
+  {
+    FileIO * io = new FileIO;
+    InitContext(&context);
+    EV_VERIFY(io->Init(reactor.get(), 2, flags) == kEvOK);
+    for (int i=0; i<kRequests; i++)
+    {
+      if (i % 2)
+        EV_VERIFY(io->Stat(&reqs[i], "/", &st, OnRequest, &context) == kEvOK);
+      else
+        EV_VERIFY(io->Read(&reqs[i], fd, &c, 1, 0, OnRequest, &context) == kEvOK);
+    }
+    context.io = io;
+    Wait(reactor.get(), &context, 1);
+    // others are completed or canceled inside the delete
+    EV_VERIFY(context.io == 0);
+    EV_VERIFY(context.completed == kRequests);
+    EV_VERIFY(reactor->Run() >= 0);
+  }
+  safe_close(fd);
+  unlink(path.c_str());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  return 0;
+}
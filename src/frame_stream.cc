@@ -0,0 +1,446 @@
+/** @file
+ * @brief length-prefixed message framing on a nonblocking fd
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "frame_stream.h"
+#include "log.h"
+#include "header.h"
+
+namespace libev {
+
+  static const int kIovecSize = 64;// iovecs per writev
+  static const int kMaxReads = 16;// readv calls per readable event
+  static const size_t kHeaderSize = 4;
+  static const size_t kMinClone = 256;// smaller payloads are copied rather than shared
+
+  FrameStream::FrameStream(IOBufPool * pool)
+    : reactor_(0), fd_(-1), is_socket_(0),
+    input_(pool), output_(pool), scanned_(0), max_frame_size_(16 * 1024 * 1024),
+    callback_(0), user_data_(0),
+    reading_(0), writing_(0), dispatching_(0), shutdown_(0), error_(0), destroyed_(0)
+  {
+  }
+
+  FrameStream::~FrameStream()
+  {
+    UnInit();
+  }
+
+  int FrameStream::Init(Reactor * reactor, int fd, frame_callback callback, void * user_data)
+  {
+    if (reactor == 0 || fd < 0 || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "FrameStream(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      EV_LOG(kError, "fcntl: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+      EV_LOG(kError, "fstat: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    ev_in_.fd = fd;
+    ev_in_.event = kEvIn|kEvPersist;
+    ev_in_.callback = OnIn;
+    ev_in_.user_data = this;
+    ev_out_.fd = fd;
+    ev_out_.event = kEvOut|kEvPersist;
+    ev_out_.callback = OnOut;
+    ev_out_.user_data = this;
+
+    int ret;
+    if ((ret = reactor->Add(&ev_in_)) != kEvOK)
+      return ret;
+
+    reactor_ = reactor;
+    fd_ = fd;
+    is_socket_ = S_ISSOCK(st.st_mode);
+    callback_ = callback;
+    user_data_ = user_data;
+    reading_ = 1;
+    writing_ = 0;
+    dispatching_ = 0;
+    shutdown_ = 0;
+    error_ = 0;
+    return kEvOK;
+  }
+
+  void FrameStream::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    Stop();
+    input_.Clear();
+    output_.Clear();
+    frames_.clear();
+    scanned_ = 0;
+    dispatching_ = 0;
+    reactor_ = 0;
+    fd_ = -1;
+
+    // tell the callback invoker that the stream is gone
+    DestroyedGuard::Destroy(&destroyed_);
+  }
+
+  void FrameStream::Stop()
+  {
+    if (reading_)
+    {
+      (void)ev_in_.Del();
+      reading_ = 0;
+    }
+    if (writing_)
+    {
+      (void)ev_out_.Del();
+      writing_ = 0;
+    }
+  }
+
+  void FrameStream::Fail(int error)
+  {
+    EV_LOG(kDebug, "FrameStream(%p) failed: %s", this, strerror(error));
+    error_ = error;
+    Stop();
+    (void)Invoke(kFrameError);
+  }
+
+  int FrameStream::Invoke(int event)
+  {
+    DestroyedGuard destroyed(&destroyed_);
+    if (event & kFrameRead)
+      callback_(this, event, &frames_[0], (int)frames_.size(), user_data_);
+    else
+      callback_(this, event, 0, 0, user_data_);
+    return destroyed.Leave();
+  }
+
+  int FrameStream::Split()
+  {
+    size_t size = input_.size();
+    uint32_t length;
+    Frame frame;
+
+    while (size - scanned_ >= kHeaderSize)
+    {
+      (void)input_.Copy(&length, kHeaderSize, scanned_);
+      length = ntohl(length);
+      if (length > max_frame_size_)
+      {
+        EV_LOG(kError, "FrameStream(%p) reads a frame of %lu bytes", this, (unsigned long)length);
+        errno = EMSGSIZE;
+        return kEvFailure;
+      }
+      if (size - scanned_ - kHeaderSize < length)
+        break;
+
+      frame.offset = scanned_ + kHeaderSize;
+      frame.size = length;
+      try
+      {
+        frames_.push_back(frame);// may throw(caught)
+      }
+      catch (...)
+      {
+        errno = ENOMEM;
+        return kEvFailure;
+      }
+      scanned_ = frame.offset + length;
+    }
+    return kEvOK;
+  }
+
+  int FrameStream::FlushOutput()
+  {
+    struct iovec iov[kIovecSize];
+    int iovcnt;
+    ssize_t n;
+
+    while (!output_.empty())
+    {
+      iovcnt = output_.GetIovec(iov, kIovecSize);
+      if (is_socket_)
+      {
+        // no SIGPIPE
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+        do n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+        while (n == -1 && errno == EINTR);
+      }
+      else
+      {
+        do n = writev(fd_, iov, iovcnt);
+        while (n == -1 && errno == EINTR);
+      }
+
+      if (n == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        return kEvFailure;
+      }
+      output_.Consume((size_t)n);
+    }
+
+    if (output_.empty())
+    {
+      // nothing pending, stop polling kEvOut
+      if (writing_)
+      {
+        (void)ev_out_.Del();
+        writing_ = 0;
+      }
+      if (shutdown_ == 1)
+      {
+        (void)shutdown(fd_, SHUT_WR);
+        shutdown_ = 2;
+      }
+    }
+    else if (!writing_)
+    {
+      int ret;
+      if ((ret = reactor_->Add(&ev_out_)) != kEvOK)
+      {
+        if (ret == kEvNoMemory)
+          errno = ENOMEM;
+        return kEvFailure;
+      }
+      writing_ = 1;
+    }
+    return kEvOK;
+  }
+
+  void FrameStream::OnIn(int /*fd*/, int event, void * user_data)
+  {
+    FrameStream * stream = (FrameStream *)user_data;
+    IOBuf * input = &stream->input_;
+    struct iovec iov[5];
+    int iovcnt;
+    size_t capacity, total = 0;
+    ssize_t n;
+    int eof = 0, error = 0;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      stream->reading_ = 0;
+      return;
+    }
+
+    for (int i=0; i<kMaxReads; i++)
+    {
+      iovcnt = input->Prepare(input->pool()->block_size() * 4, iov, 5);
+      if (iovcnt == kEvNoMemory)
+      {
+        error = ENOMEM;
+        break;
+      }
+
+      capacity = 0;
+      for (int j=0; j<iovcnt; j++)
+        capacity += iov[j].iov_len;
+
+      do n = readv(stream->fd_, iov, iovcnt);
+      while (n == -1 && errno == EINTR);
+
+      if (n > 0)
+      {
+        input->Commit((size_t)n);
+        total += (size_t)n;
+        // drained
+        if ((size_t)n < capacity)
+          break;
+        continue;
+      }
+
+      input->Commit(0);
+      if (n == 0)
+      {
+        eof = 1;
+      }
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (event & kEvErr)
+        {
+          socklen_t len = sizeof(error);
+          if (getsockopt(stream->fd_, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error == 0)
+            error = EIO;
+        }
+      }
+      else
+      {
+        error = errno;
+      }
+      break;
+    }
+
+    if (total)
+    {
+      if (stream->Split() != kEvOK)
+      {
+        stream->Fail(errno);
+        return;
+      }
+
+      if (!stream->frames_.empty())
+      {
+        // one report for all frames, and one flush for all frames written by the callback
+        stream->dispatching_ = 1;
+        if (stream->Invoke(kFrameRead))
+          return;
+        stream->dispatching_ = 0;
+        input->Consume(stream->scanned_);
+        stream->scanned_ = 0;
+        stream->frames_.clear();
+
+        if (stream->FlushOutput() != kEvOK)
+        {
+          stream->Fail(errno);
+          return;
+        }
+      }
+    }
+
+    if (error)
+    {
+      stream->Fail(error);
+    }
+    else if (eof)
+    {
+      // a partial frame is left in 'input'
+      EV_LOG(kDebug, "FrameStream(%p) reaches EOF", stream);
+      if (stream->reading_)
+      {
+        (void)stream->ev_in_.Del();
+        stream->reading_ = 0;
+      }
+      (void)stream->Invoke(kFrameEOF);
+    }
+  }
+
+  void FrameStream::OnOut(int /*fd*/, int event, void * user_data)
+  {
+    FrameStream * stream = (FrameStream *)user_data;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      stream->writing_ = 0;
+      return;
+    }
+
+    if (stream->FlushOutput() != kEvOK)
+      stream->Fail(errno);
+  }
+
+  int FrameStream::CheckWrite(size_t size)
+  {
+    if (reactor_ == 0 || error_ || shutdown_)
+    {
+      errno = EPIPE;
+      return kEvFailure;
+    }
+
+    if (size > max_frame_size_ || size > 0xffffffff)
+    {
+      errno = EMSGSIZE;
+      return kEvFailure;
+    }
+    return kEvOK;
+  }
+
+  int FrameStream::Queued()
+  {
+    // flushed after the callback returns
+    if (dispatching_ || writing_)
+      return kEvOK;
+
+    int ret;
+    if ((ret = reactor_->Add(&ev_out_)) != kEvOK)
+      return ret;
+    writing_ = 1;
+    return kEvOK;
+  }
+
+  int FrameStream::Write(const void * data, size_t size)
+  {
+    if (CheckWrite(size) != kEvOK)
+      return kEvFailure;
+
+    // roll back a partial frame, which would misframe all later frames
+    size_t queued = output_.size();
+    uint32_t length = htonl((uint32_t)size);
+    if (output_.Append(&length, kHeaderSize) != kEvOK || output_.Append(data, size) != kEvOK)
+    {
+      output_.Truncate(queued);
+      return kEvNoMemory;
+    }
+    return Queued();
+  }
+
+  int FrameStream::Write(const IOBuf& payload)
+  {
+    size_t size = payload.size();
+    if (size < kMinClone)
+    {
+      char data[kMinClone];
+      (void)payload.Copy(data, size);
+      return Write(data, size);
+    }
+
+    if (CheckWrite(size) != kEvOK)
+      return kEvFailure;
+
+    size_t queued = output_.size();
+    uint32_t length = htonl((uint32_t)size);
+    if (output_.Append(&length, kHeaderSize) != kEvOK || output_.Append(payload) != kEvOK)
+    {
+      output_.Truncate(queued);
+      return kEvNoMemory;
+    }
+    return Queued();
+  }
+
+  int FrameStream::Shutdown()
+  {
+    if (reactor_ == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (shutdown_)
+      return kEvOK;
+
+    if (!output_.empty())
+    {
+      shutdown_ = 1;
+      return kEvOK;
+    }
+
+    shutdown_ = 2;
+    if (shutdown(fd_, SHUT_WR) == -1)
+      return kEvFailure;
+    return kEvOK;
+  }
+}
@@ -0,0 +1,122 @@
+/** @file
+ * @brief length-prefixed message framing on a nonblocking fd
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_FRAME_STREAM_H
+#define LIBEV_FRAME_STREAM_H
+
+#include "ev.h"
+#include "iobuf.h"
+#include <stdint.h>
+#include <vector>
+
+namespace libev {
+
+  // events passed to frame_callback
+  enum FrameStreamEvent
+  {
+    kFrameRead = 0x01,    // complete frames have been read
+    kFrameEOF = 0x02,     // the peer has closed, reading stops
+    kFrameError = 0x04    // an error occurred(refer to 'error'), the stream stops
+  };
+
+  // the payload of a frame is 'size' bytes of 'input' from 'offset'
+  struct Frame
+  {
+    size_t offset;
+    size_t size;
+  };
+
+  class FrameStream;
+  // 'frames' and 'count' are valid only for kFrameRead
+  typedef void (*frame_callback)(FrameStream * stream, int event,
+      const Frame * frames, int count, void * user_data);
+
+  // A frame stream exchanges frames of [u32 length in network byte order][payload].
+  // It reads all available data into 'input' per readable event,
+  // and reports every complete frame with one kFrameRead,
+  // whose payloads are not copied out of 'input',
+  // and are consumed after the callback returns(clone them to keep them).
+  // Frames written are queued into 'output',
+  // and are gathered into as few writev as possible:
+  // frames written inside the callback are flushed once it returns,
+  // and other frames when the fd is writable.
+  // The stream may be deleted inside its callback.
+  class FrameStream
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(FrameStream);
+
+      Reactor * reactor_;
+      int fd_;
+      int is_socket_;
+      Event ev_in_;
+      Event ev_out_;
+      IOBuf input_;
+      IOBuf output_;
+      std::vector<Frame> frames_;
+      size_t scanned_;// bytes of 'input' split into 'frames_'
+      size_t max_frame_size_;
+      frame_callback callback_;
+      void * user_data_;
+
+      int reading_;// 'ev_in_' is added
+      int writing_;// 'ev_out_' is added
+      int dispatching_;// kFrameRead is being reported
+      int shutdown_;// 1: shut down writing after 'output' is drained, 2: shut down
+      int error_;
+      int * destroyed_;// set to 1 if the stream is destroyed inside its callback
+
+      static void OnIn(int fd, int event, void * user_data);
+      static void OnOut(int fd, int event, void * user_data);
+
+      // return 1 if the stream is destroyed
+      int Invoke(int event);
+      // split complete frames of 'input' into 'frames_'
+      // return kEvOK, or kEvFailure if a frame is too large
+      int Split();
+      // write 'output' until it is drained or the fd would block,
+      // and poll kEvOut only if it is not drained
+      // return kEvOK or kEvFailure
+      int FlushOutput();
+      // return kEvOK, or kEvFailure if a frame of 'size' bytes can not be written
+      int CheckWrite(size_t size);
+      // poll kEvOut for frames queued, unless they are flushed after the callback
+      int Queued();
+      // stop polling
+      void Stop();
+      // stop and report kFrameError
+      void Fail(int error);
+
+    public:
+      explicit FrameStream(IOBufPool * pool);
+      ~FrameStream();
+
+      // 'fd' is set to be nonblocking and polled by 'reactor',
+      // the stream does not own 'fd'
+      int Init(Reactor * reactor, int fd, frame_callback callback, void * user_data);
+      void UnInit();
+
+      // queue a frame of 'size' bytes of 'data'
+      int Write(const void * data, size_t size);
+      // queue a frame of 'payload' without copying it, unless it is small
+      int Write(const IOBuf& payload);
+      // shut down writing after 'output' is drained
+      int Shutdown();
+
+      // frames larger than 'size' fail the stream with EMSGSIZE, 16MB by default
+      void SetMaxFrameSize(size_t size) {max_frame_size_ = size;}
+
+      int fd()const {return fd_;}
+      Reactor * reactor()const {return reactor_;}
+      IOBuf * input() {return &input_;}
+      IOBuf * output() {return &output_;}
+      // the errno of kFrameError
+      int error()const {return error_;}
+  };
+}
+
+#endif
@@ -0,0 +1,281 @@
+/** @file
+ * @brief test frame streams
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "frame_stream.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+struct Receiver
+{
+  std::vector<std::string> frames;
+  int batches;
+  int eof;
+  int error;
+  int echo;// write frames back
+  int uninit;// uninitialize the stream when a frame is read
+};
+
+static void ReceiverCallback(FrameStream * stream, int event,
+    const Frame * frames, int count, void * user_data)
+{
+  Receiver * receiver = (Receiver *)user_data;
+  IOBuf * input = stream->input();
+
+  if (event & kFrameRead)
+  {
+    EV_VERIFY(count > 0);
+    receiver->batches++;
+    for (int i=0; i<count; i++)
+    {
+      std::string frame(frames[i].size, '\0');
+      if (frames[i].size)
+      {
+        const char * data = input->Peek(frames[i].offset, frames[i].size);
+        if (data)
+          memcpy(&frame[0], data, frame.size());
+        else
+          EV_VERIFY(input->Copy(&frame[0], frame.size(), frames[i].offset) == frame.size());
+      }
+      receiver->frames.push_back(frame);
+
+      if (receiver->echo)
+      {
+        // share the payload
+        IOBuf payload(input->pool());
+        EV_VERIFY(input->Slice(frames[i].offset, frames[i].size, &payload) == kEvOK);
+        EV_VERIFY(stream->Write(payload) == kEvOK);
+      }
+    }
+
+    if (receiver->uninit)
+      stream->UnInit();
+  }
+  if (event & kFrameEOF)
+    receiver->eof = 1;
+  if (event & kFrameError)
+    receiver->error = stream->error();
+}
+
+static void InitReceiver(Receiver * receiver)
+{
+  receiver->batches = 0;
+  receiver->eof = 0;
+  receiver->error = 0;
+  receiver->echo = 0;
+  receiver->uninit = 0;
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: frames are read in batches");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  IOBufPool pool;
+  FrameStream a(&pool);
+  FrameStream b(&pool);
+  Receiver ra, rb;
+  std::vector<std::string> sent;
+  int fds[2];
+
+  InitReceiver(&ra);
+  InitReceiver(&rb);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  EV_VERIFY(a.Init(reactor.get(), fds[0], ReceiverCallback, &ra) == kEvOK);
+  EV_VERIFY(b.Init(reactor.get(), fds[1], ReceiverCallback, &rb) == kEvOK);
+  EV_VERIFY(a.Init(reactor.get(), fds[0], ReceiverCallback, &ra) == kEvExists);
+
+  // small frames, an empty frame and a large frame
+  for (int i=0; i<1000; i++)
+    sent.push_back(Payload((size_t)(i % 100), i));
+  sent.push_back("");
+  sent.push_back(Payload(100000, 1));
+  for (size_t i=0; i<sent.size(); i++)
+    EV_VERIFY(a.Write(sent[i].data(), sent[i].size()) == kEvOK);
+  EV_VERIFY(a.output()->size() > 100000);
+
+  // queued frames are flushed when writable
+  while (rb.frames.size() < sent.size())
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_LOG(kInfo, "%d frames are read in %d batches", (int)rb.frames.size(), rb.batches);
+  EV_VERIFY(rb.frames == sent);
+  EV_VERIFY(rb.batches < 20);
+  EV_VERIFY(a.output()->empty());
+  EV_VERIFY(b.input()->empty());
+
+  // EOF
+  EV_VERIFY(a.Shutdown() == kEvOK);
+  EV_VERIFY(a.Write("x", 1) == kEvFailure && errno == EPIPE);
+  while (!rb.eof)
+    EV_VERIFY(reactor->RunOne() >= 0);
+
+  a.UnInit();
+  b.UnInit();
+  safe_close(fds[0]);
+  safe_close(fds[1]);
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: echo frames written inside the callback");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  IOBufPool pool(4096);
+  FrameStream client(&pool);
+  FrameStream server(&pool);
+  Receiver rc, rs;
+  std::vector<std::string> sent;
+  int fds[2];
+
+  InitReceiver(&rc);
+  InitReceiver(&rs);
+  rs.echo = 1;
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  EV_VERIFY(client.Init(reactor.get(), fds[0], ReceiverCallback, &rc) == kEvOK);
+  EV_VERIFY(server.Init(reactor.get(), fds[1], ReceiverCallback, &rs) == kEvOK);
+
+  for (int i=0; i<300; i++)
+  {
+    sent.push_back(Payload((size_t)(i * 37 % 10000), i));
+    EV_VERIFY(client.Write(sent.back().data(), sent.back().size()) == kEvOK);
+  }
+
+  while (rc.frames.size() < sent.size())
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_LOG(kInfo, "%d frames are echoed in %d batches", (int)rs.frames.size(), rs.batches);
+  EV_VERIFY(rs.frames == sent);
+  EV_VERIFY(rc.frames == sent);
+  EV_VERIFY(rc.batches < 100);
+
+  client.UnInit();
+  server.UnInit();
+  safe_close(fds[0]);
+  safe_close(fds[1]);
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: partial frames");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  IOBufPool pool(16);
+  FrameStream stream(&pool);
+  Receiver receiver;
+  std::string wire;
+  int fds[2];
+
+  InitReceiver(&receiver);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  EV_VERIFY(stream.Init(reactor.get(), fds[1], ReceiverCallback, &receiver) == kEvOK);
+
+  // two frames across blocks, and a partial header
+  wire.append("\0\0\0\x05hello\0\0\0\x14", 13);
+  wire.append(Payload(20, 3));
+  wire.append("\0\0", 2);
+
+  for (size_t i=0; i<wire.size(); i++)
+  {
+    EV_VERIFY(write(fds[0], &wire[i], 1) == 1);
+    EV_VERIFY(reactor->Poll() >= 0);
+    if (i < 8)
+      EV_VERIFY(receiver.frames.empty());
+  }
+  EV_VERIFY(receiver.frames.size() == 2);
+  EV_VERIFY(receiver.frames[0] == "hello");
+  EV_VERIFY(receiver.frames[1] == Payload(20, 3));
+  EV_VERIFY(stream.input()->size() == 2);
+
+  // EOF with a partial frame
+  safe_close(fds[0]);
+  while (!receiver.eof)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(stream.input()->size() == 2);
+
+  stream.UnInit();
+  safe_close(fds[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: errors");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  IOBufPool pool;
+  FrameStream a(&pool);
+  FrameStream b(&pool);
+  Receiver ra, rb;
+  std::string data(2000, 'x');
+  int fds[2];
+
+  InitReceiver(&ra);
+  InitReceiver(&rb);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  EV_VERIFY(a.Init(reactor.get(), fds[0], ReceiverCallback, &ra) == kEvOK);
+  EV_VERIFY(b.Init(reactor.get(), fds[1], ReceiverCallback, &rb) == kEvOK);
+
+  // too large to write
+  a.SetMaxFrameSize(1000);
+  EV_VERIFY(a.Write(data.data(), data.size()) == kEvFailure && errno == EMSGSIZE);
+
+  // too large to read
+  b.SetMaxFrameSize(1000);
+  a.SetMaxFrameSize(data.size());
+  EV_VERIFY(a.Write("ok", 2) == kEvOK);
+  EV_VERIFY(a.Write(data.data(), data.size()) == kEvOK);
+  while (!rb.error)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(rb.error == EMSGSIZE);
+  EV_VERIFY(rb.frames.empty());
+  a.UnInit();
+  b.UnInit();
+  safe_close(fds[0]);
+  safe_close(fds[1]);
+
+  // uninitialized inside the callback
+  InitReceiver(&rb);
+  rb.uninit = 1;
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  EV_VERIFY(a.Init(reactor.get(), fds[0], ReceiverCallback, &ra) == kEvOK);
+  EV_VERIFY(b.Init(reactor.get(), fds[1], ReceiverCallback, &rb) == kEvOK);
+  EV_VERIFY(a.Write("bye", 3) == kEvOK);
+  while (rb.frames.empty())
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(b.reactor() == 0);
+
+  a.UnInit();
+  safe_close(fds[0]);
+  safe_close(fds[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  return 0;
+}
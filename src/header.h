@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stddef.h>
 #include <errno.h>
 #include <time.h>
@@ -207,6 +208,11 @@ inline int eventfd(unsigned int initval, int flags)
 #define timespec_subto_ms(a, b) (((a).tv_sec - (b).tv_sec)*1000 + ((a).tv_nsec - (b).tv_nsec)/1000)
 #define timespec_subto_ns(a, b) (((a).tv_sec - (b).tv_sec)*1000000 + ((a).tv_nsec - (b).tv_nsec))
 
+inline int64_t timespec_to_ns(const struct timespec * tv)
+{
+  return (int64_t)tv->tv_sec * 1000000000 + tv->tv_nsec;
+}
+
 inline void timespec_fix(struct timespec * tv)
 {
   while (tv->tv_nsec < 0)
@@ -15,45 +15,71 @@
 
 namespace libev {
 
+  // A 4-ary heap of deadlines in nanoseconds and events.
+  // Deadlines are stored inline, so comparisons never touch events,
+  // and children of a node are adjacent in memory.
+  // The index of an event in the heap is kept in Event.fd for 'erase'.
   class Heap
   {
     private:
       DISALLOW_COPY_AND_ASSIGN(Heap);
 
-      std::vector<Event *> heap_;
+      struct Entry
+      {
+        int64_t deadline;
+        Event * node;
+      };
+
+      enum {kArity = 4};
+
+      std::vector<Entry> heap_;
 
     private:
-      static bool greater(const Event * a, const Event * b)
+      void set(size_t index, const Entry& entry)
       {
-        return timespec_greater(&a->timeout, &b->timeout);
+        heap_[index] = entry;
+        entry.node->fd = (int)index;
       }
 
-      void shift_up(size_t hole_index, Event * node)
+      void shift_up(size_t hole_index, const Entry& entry)
       {
-        size_t parent = (hole_index - 1) >> 1;
-        while (hole_index && greater(heap_[parent], node))
+        size_t parent;
+        while (hole_index)
         {
-          (heap_[hole_index] = heap_[parent])->fd = (int)hole_index;
+          parent = (hole_index - 1) / kArity;
+          if (heap_[parent].deadline <= entry.deadline)
+            break;
+          set(hole_index, heap_[parent]);
           hole_index = parent;
-          parent = (hole_index - 1) >> 1;
         }
-        (heap_[hole_index] = node)->fd = (int)hole_index;
+        set(hole_index, entry);
       }
 
-      void shift_down(size_t hole_index, Event * node)
+      void shift_down(size_t hole_index, const Entry& entry)
       {
-        size_t min_child = (hole_index + 1) << 1;
-        while (min_child <= heap_.size())
+        size_t size = heap_.size();
+        size_t child, last_child, min_child;
+        for (;;)
         {
-          min_child -= /*lint --e(514) */(min_child == heap_.size()
-              || greater(heap_[min_child], heap_[min_child - 1]));
-          if(!(greater(node, heap_[min_child])))
+          child = hole_index * kArity + 1;
+          if (child >= size)
             break;
-          (heap_[hole_index] = heap_[min_child])->fd = (int)hole_index;
+
+          last_child = child + kArity;
+          if (last_child > size)
+            last_child = size;
+          for (min_child = child++; child < last_child; child++)
+          {
+            if (heap_[child].deadline < heap_[min_child].deadline)
+              min_child = child;
+          }
+
+          if (entry.deadline <= heap_[min_child].deadline)
+            break;
+          set(hole_index, heap_[min_child]);
           hole_index = min_child;
-          min_child = (hole_index + 1) << 1;
         }
-        shift_up(hole_index,  node);
+        set(hole_index, entry);
       }
 
     public:
@@ -77,13 +103,20 @@ namespace libev {
       Event * top()
       {
         EV_ASSERT(!heap_.empty());
-        return heap_[0];
+        return heap_[0].node;
       }
 
       const Event * top()const
       {
         EV_ASSERT(!heap_.empty());
-        return heap_[0];
+        return heap_[0].node;
+      }
+
+      // the deadline of 'top' in nanoseconds
+      int64_t top_deadline()const
+      {
+        EV_ASSERT(!heap_.empty());
+        return heap_[0].deadline;
       }
 
       void push(Event * node)
@@ -91,35 +124,53 @@ namespace libev {
         EV_ASSERT(timespec_isset(&node->timeout));
         EV_ASSERT(node->fd == -1);
 
-        heap_.push_back(node);// may throw(caught)
-        shift_up(heap_.size()-1, node);
+        Entry entry;
+        entry.deadline = timespec_to_ns(&node->timeout);
+        entry.node = node;
+        heap_.push_back(entry);// may throw(caught)
+        shift_up(heap_.size()-1, entry);
       }
 
       void pop()
       {
         EV_ASSERT(!heap_.empty());
-        Event * node = heap_[0];
-        shift_down(0, heap_[heap_.size()-1]);
+        Event * node = heap_[0].node;
+        Entry last = heap_.back();
         heap_.pop_back();
+        if (!heap_.empty())
+          shift_down(0, last);
         EV_ASSERT(timespec_isset(&node->timeout));
         EV_ASSERT(node->fd != -1);
         node->fd = -1;
       }
 
+      // move 'top' down after its timeout is increased
+      void adjust_top()
+      {
+        EV_ASSERT(!heap_.empty());
+        Entry entry = heap_[0];
+        entry.deadline = timespec_to_ns(&entry.node->timeout);
+        shift_down(0, entry);
+      }
+
       void erase(Event * node)
       {
         EV_ASSERT(timespec_isset(&node->timeout));
         EV_ASSERT(node->fd != -1);
         EV_ASSERT(!heap_.empty());
 
-        Event * last = heap_.back();
+        size_t index = (size_t)node->fd;
+        EV_ASSERT(heap_[index].node == node);
+        Entry last = heap_.back();
         heap_.pop_back();
-        size_t parent = ((size_t)node->fd - 1) << 1;
-        if (node->fd > 0 && greater(heap_[parent], last))
-          shift_up((size_t)node->fd, last);
-        else
-          shift_down((size_t)node->fd, last);
         node->fd = -1;
+        if (index == heap_.size())
+          return;
+
+        if (index > 0 && heap_[(index - 1) / kArity].deadline > last.deadline)
+          shift_up(index, last);
+        else
+          shift_down(index, last);
       }
   };
 
@@ -0,0 +1,195 @@
+/** @file
+ * @brief benchmark the 4-ary heap against the binary heap of Event pointers
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "heap.h"
+#include "ev.h"
+#include "log.h"
+#include "header.h"
+#include <algorithm>
+#include <vector>
+
+using namespace libev;
+
+// the previous binary heap, which compares timeouts through Event pointers
+class BinaryHeap
+{
+  private:
+    DISALLOW_COPY_AND_ASSIGN(BinaryHeap);
+
+    std::vector<Event *> heap_;
+
+  private:
+    static bool greater(const Event * a, const Event * b)
+    {
+      return timespec_greater(&a->timeout, &b->timeout);
+    }
+
+    void shift_up(size_t hole_index, Event * node)
+    {
+      size_t parent = (hole_index - 1) >> 1;
+      while (hole_index && greater(heap_[parent], node))
+      {
+        (heap_[hole_index] = heap_[parent])->fd = (int)hole_index;
+        hole_index = parent;
+        parent = (hole_index - 1) >> 1;
+      }
+      (heap_[hole_index] = node)->fd = (int)hole_index;
+    }
+
+    void shift_down(size_t hole_index, Event * node)
+    {
+      size_t min_child = (hole_index + 1) << 1;
+      while (min_child <= heap_.size())
+      {
+        min_child -= /*lint --e(514) */(min_child == heap_.size()
+            || greater(heap_[min_child], heap_[min_child - 1]));
+        if(!(greater(node, heap_[min_child])))
+          break;
+        (heap_[hole_index] = heap_[min_child])->fd = (int)hole_index;
+        hole_index = min_child;
+        min_child = (hole_index + 1) << 1;
+      }
+      shift_up(hole_index,  node);
+    }
+
+  public:
+    BinaryHeap() {}
+
+    bool empty()const
+    {
+      return heap_.empty();
+    }
+
+    Event * top()
+    {
+      return heap_[0];
+    }
+
+    void push(Event * node)
+    {
+      heap_.push_back(node);
+      shift_up(heap_.size()-1, node);
+    }
+
+    void pop()
+    {
+      Event * node = heap_[0];
+      shift_down(0, heap_[heap_.size()-1]);
+      heap_.pop_back();
+      node->fd = -1;
+    }
+
+    void erase(Event * node)
+    {
+      Event * last = heap_.back();
+      heap_.pop_back();
+      if (last == node)
+      {
+        node->fd = -1;
+        return;
+      }
+
+      size_t parent = ((size_t)node->fd - 1) >> 1;
+      if (node->fd > 0 && greater(heap_[parent], last))
+        shift_up((size_t)node->fd, last);
+      else
+        shift_down((size_t)node->fd, last);
+      node->fd = -1;
+    }
+};
+
+static double Now()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+static void RandomTimeout(timespec * ts)
+{
+  ts->tv_sec = 1 + rand() % 1000;
+  ts->tv_nsec = rand() % 1000000000;
+}
+
+template <class HeapType>
+static void Bench(const char * name, int n)
+{
+  HeapType heap;
+  Event * ev = new Event[n];
+  std::vector<Event *> order((size_t)n);
+  double begin, push, pop, erase, hold;
+  int i;
+
+  // push events in a random order to scatter them in memory
+  for (i=0; i<n; i++)
+  {
+    ev[i].fd = -1;
+    RandomTimeout(&ev[i].timeout);
+    order[(size_t)i] = &ev[i];
+  }
+  std::random_shuffle(order.begin(), order.end());
+
+  begin = Now();
+  for (i=0; i<n; i++)
+    heap.push(order[(size_t)i]);
+  push = Now() - begin;
+
+  begin = Now();
+  while (!heap.empty())
+    heap.pop();
+  pop = Now() - begin;
+
+  for (i=0; i<n; i++)
+    heap.push(order[(size_t)i]);
+  std::random_shuffle(order.begin(), order.end());
+  begin = Now();
+  for (i=0; i<n; i++)
+    heap.erase(order[(size_t)i]);
+  erase = Now() - begin;
+
+  // the steady state of a reactor: the nearest timer expires and a new one is added
+  for (i=0; i<n; i++)
+    heap.push(order[(size_t)i]);
+  begin = Now();
+  for (i=0; i<n; i++)
+  {
+    Event * top = heap.top();
+    heap.pop();
+    top->timeout.tv_sec += 1 + rand() % 1000;
+    heap.push(top);
+  }
+  hold = Now() - begin;
+
+  printf("%-12s %8d timers: push %7.1f ns/op, pop %7.1f ns/op, erase %7.1f ns/op, pop+push %7.1f ns/op\n",
+      name, n, push * 1e9 / n, pop * 1e9 / n, erase * 1e9 / n, hold * 1e9 / n);
+
+  delete [] ev;
+}
+
+int main(int argc, char ** argv)
+{
+  static const int kSizes[] = {1000, 100000, 1000000};
+
+  GlobalLog().SetLevel(kWarning);
+  srand(0);
+
+  if (argc > 1)
+  {
+    int n = atoi(argv[1]);
+    EV_VERIFY(n > 0);
+    Bench<BinaryHeap>("binary heap", n);
+    Bench<Heap>("4-ary heap", n);
+    return 0;
+  }
+
+  for (size_t i=0; i<sizeof(kSizes)/sizeof(kSizes[0]); i++)
+  {
+    Bench<BinaryHeap>("binary heap", kSizes[i]);
+    Bench<Heap>("4-ary heap", kSizes[i]);
+  }
+  return 0;
+}
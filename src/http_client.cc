@@ -0,0 +1,715 @@
+/** @file
+ * @brief HTTP/1.1 client with keep-alive connection pools
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "http_client.h"
+#include "ev-internal.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+
+namespace libev {
+
+  // point 'slice' parsed in 'from' into the copy 'to'
+  static void Rebase(HttpSlice * slice, const char * from, const char * to)
+  {
+    if (slice->size)
+      slice->data = to + (slice->data - from);
+    else
+      slice->data = to;
+  }
+
+  static void RebaseMessage(HttpMessage * message, const char * from, const char * to)
+  {
+    Rebase(&message->method, from, to);
+    Rebase(&message->target, from, to);
+    Rebase(&message->reason, from, to);
+    for (int i=0; i<message->header_count; i++)
+    {
+      Rebase(&message->headers[i].name, from, to);
+      Rebase(&message->headers[i].value, from, to);
+    }
+  }
+
+  // methods that may be retried automatically(RFC 9110 9.2.2)
+  static int IsIdempotent(const char * method)
+  {
+    static const char * const kMethods[] = {"GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"};
+    for (size_t i=0; i<sizeof(kMethods)/sizeof(kMethods[0]); i++)
+    {
+      if (strcasecmp(method, kMethods[i]) == 0)
+        return 1;
+    }
+    return 0;
+  }
+
+  HttpClient::HttpClient()
+    : reactor_(0), pool_(0), idle_count_(0), connects_(0),
+    max_idle_(64), idle_timeout_(60000), max_connections_(8), max_pipeline_(1),
+    destroyed_(0)
+  {
+  }
+
+  HttpClient::~HttpClient()
+  {
+    UnInit();
+  }
+
+  int HttpClient::Init(Reactor * reactor, BlockPool * pool)
+  {
+    if (reactor == 0 || pool == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "HttpClient(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    reactor_ = reactor;
+    pool_ = pool;
+    return kEvOK;
+  }
+
+  void HttpClient::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    std::deque<Call *> calls;
+    std::map<std::string, Host *>::iterator it;
+    std::set<Connection *>::iterator c;
+
+    for (it=hosts_.begin(); it!=hosts_.end(); ++it)
+    {
+      Host * host = it->second;
+      for (c=host->connections.begin(); c!=host->connections.end(); ++c)
+      {
+        Connection * conn = *c;
+        if (conn->idle)
+          DelIdle(conn);
+        for (size_t i=0; i<conn->calls.size(); i++)
+        {
+          try
+          {
+            calls.push_back(conn->calls[i]);// may throw(caught)
+          }
+          catch (...)
+          {
+            delete conn->calls[i];
+          }
+        }
+        Disconnect(conn);
+        delete conn;
+      }
+
+      for (size_t i=0; i<host->waiting.size(); i++)
+      {
+        try
+        {
+          calls.push_back(host->waiting[i]);// may throw(caught)
+        }
+        catch (...)
+        {
+          delete host->waiting[i];
+        }
+      }
+      delete host;
+    }
+    hosts_.clear();
+    reactor_ = 0;
+    pool_ = 0;
+
+    // tell the callback invoker that the client is gone
+    DestroyedGuard::Destroy(&destroyed_);
+
+    // the client may be deleted by these callbacks, so only 'calls' is touched
+    for (size_t i=0; i<calls.size(); i++)
+    {
+      calls[i]->callback(ECANCELED, 0, 0, 0, calls[i]->user_data);
+      delete calls[i];
+    }
+  }
+
+  void HttpClient::SetMaxConnections(size_t max_connections)
+  {
+    max_connections_ = (max_connections)?(max_connections):(1);
+  }
+
+  void HttpClient::SetMaxPipeline(size_t max_pipeline)
+  {
+    max_pipeline_ = (max_pipeline)?(max_pipeline):(1);
+  }
+
+  HttpClient::Host * HttpClient::GetHost(const struct sockaddr * addr, socklen_t addrlen)
+  {
+    char ip[INET6_ADDRSTRLEN];
+    char name[INET6_ADDRSTRLEN + 16];
+
+    if (addr->sa_family == AF_INET && addrlen >= (socklen_t)sizeof(struct sockaddr_in))
+    {
+      const struct sockaddr_in * in = (const struct sockaddr_in *)addr;
+      (void)inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+      snprintf(name, sizeof(name), "%s:%u", ip, (unsigned int)ntohs(in->sin_port));
+    }
+    else if (addr->sa_family == AF_INET6 && addrlen >= (socklen_t)sizeof(struct sockaddr_in6))
+    {
+      const struct sockaddr_in6 * in6 = (const struct sockaddr_in6 *)addr;
+      (void)inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+      snprintf(name, sizeof(name), "[%s]:%u", ip, (unsigned int)ntohs(in6->sin6_port));
+    }
+    else
+    {
+      errno = EAFNOSUPPORT;
+      return 0;
+    }
+
+    std::map<std::string, Host *>::iterator it = hosts_.find(name);
+    if (it != hosts_.end())
+      return it->second;
+
+    Host * host = 0;
+    try
+    {
+      host = new Host;// may throw(caught)
+      host->name = name;// may throw(caught)
+      hosts_[host->name] = host;// may throw(caught)
+    }
+    catch (...)
+    {
+      delete host;
+      errno = ENOMEM;
+      return 0;
+    }
+    memcpy(&host->addr, addr, addrlen);
+    host->addrlen = addrlen;
+    return host;
+  }
+
+  void HttpClient::PutHost(Host * host)
+  {
+    if (host->connections.empty() && host->waiting.empty())
+    {
+      hosts_.erase(host->name);
+      delete host;
+    }
+  }
+
+  HttpClient::Connection * HttpClient::Connect(Host * host)
+  {
+    int fd = socket(host->addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+      EV_LOG(kError, "socket: %s", strerror(errno));
+      return 0;
+    }
+
+    // requests are written in one piece
+    int on = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(fd, (const struct sockaddr *)&host->addr, host->addrlen) == -1
+        && errno != EINPROGRESS)
+    {
+      int error = errno;
+      EV_LOG(kDebug, "connect %s: %s", host->name.c_str(), strerror(errno));
+      (void)safe_close(fd);
+      errno = error;
+      return 0;
+    }
+
+    Connection * conn = 0;
+    try
+    {
+      conn = new Connection(pool_);// may throw(caught)
+      host->connections.insert(conn);// may throw(caught)
+    }
+    catch (...)
+    {
+      delete conn;
+      (void)safe_close(fd);
+      errno = ENOMEM;
+      return 0;
+    }
+
+    conn->client = this;
+    conn->host = host;
+    conn->reused = 0;
+    conn->receiving = 0;
+    conn->closing = 0;
+    conn->error = 0;
+    conn->idle = 0;
+    conn->timer.event = kEvTimer;
+    conn->timer.callback = OnTimer;
+    conn->timer.user_data = conn;
+    // a head must fit in a block to be parsed in place
+    conn->parser.SetMaxHeadSize(pool_->block_size());
+
+    // writes before connected are queued by the stream
+    if (conn->stream.Init(reactor_, fd, OnStream, conn) != kEvOK)
+    {
+      int error = errno;
+      host->connections.erase(conn);
+      delete conn;
+      (void)safe_close(fd);
+      errno = error;
+      return 0;
+    }
+
+    connects_++;
+    EV_LOG(kDebug, "HttpClient(%p) connects to %s", this, host->name.c_str());
+    return conn;
+  }
+
+  void HttpClient::Disconnect(Connection * conn)
+  {
+    int fd = conn->stream.fd();
+
+    conn->stream.UnInit();
+    (void)conn->timer.Del();
+    if (fd != -1)
+      (void)safe_close(fd);
+  }
+
+  HttpClient::Connection * HttpClient::Pick(Host * host)
+  {
+    errno = 0;
+    if (!host->idle.empty())
+      return ev_container_of(host->idle.front(), Connection, host_idle);
+
+    if (host->connections.size() < max_connections_)
+      return Connect(host);
+
+    // the least loaded one
+    Connection * best = 0;
+    std::set<Connection *>::iterator it;
+    for (it=host->connections.begin(); it!=host->connections.end(); ++it)
+    {
+      Connection * conn = *it;
+      if (!conn->closing && conn->calls.size() < max_pipeline_
+          && (best == 0 || conn->calls.size() < best->calls.size()))
+        best = conn;
+    }
+    return best;
+  }
+
+  int HttpClient::Send(Connection * conn, Call * call)
+  {
+    try
+    {
+      conn->calls.push_back(call);// may throw(caught)
+    }
+    catch (...)
+    {
+      // do not leak a new connection
+      if (conn->calls.empty() && !conn->idle)
+        AddIdle(conn);
+      return kEvNoMemory;
+    }
+
+    if (conn->idle)
+      DelIdle(conn);
+
+    // the stream may have failed before its callback, close it later
+    // so that callbacks are not invoked inside 'Request'
+    int ret = conn->stream.Write(call->request.data(), call->request.size());
+    if (ret != kEvOK)
+      Defer(conn, (ret == kEvNoMemory)?(ENOMEM):(errno));
+    return kEvOK;
+  }
+
+  int HttpClient::Drain(Host * host)
+  {
+    while (!host->waiting.empty())
+    {
+      Connection * conn = Pick(host);
+      if (conn == 0 && errno == 0)
+        return 0;
+
+      Call * call = host->waiting.front();
+      host->waiting.pop_front();
+
+      int error = (conn)?(0):(errno);
+      if (conn && Send(conn, call) != kEvOK)
+        error = ENOMEM;
+      if (error && Invoke(call, error, 0, 0, 0))
+        return 1;
+    }
+    return 0;
+  }
+
+  void HttpClient::AddIdle(Connection * conn)
+  {
+    EV_ASSERT(!conn->idle);
+    idle_.push_front(&conn->lru);
+    conn->host->idle.push_front(&conn->host_idle);
+    conn->idle = 1;
+    idle_count_++;
+    if (reactor_->AddTimer(&conn->timer, idle_timeout_) != kEvOK)
+      EV_LOG(kError, "HttpClient(%p) fails to add the idle timer", this);
+  }
+
+  void HttpClient::DelIdle(Connection * conn)
+  {
+    EV_ASSERT(conn->idle);
+    List::erase(&conn->lru);
+    List::erase(&conn->host_idle);
+    conn->idle = 0;
+    idle_count_--;
+    (void)conn->timer.Del();
+  }
+
+  void HttpClient::Defer(Connection * conn, int error)
+  {
+    if (conn->closing)
+      return;
+
+    conn->closing = 1;
+    conn->error = error;
+    if (conn->idle)
+      DelIdle(conn);
+    (void)conn->timer.Del();
+    if (reactor_->AddTimer(&conn->timer, (int64_t)0) != kEvOK)
+      EV_LOG(kError, "HttpClient(%p) fails to add the closing timer", this);
+  }
+
+  void HttpClient::OnTimer(int /*fd*/, int event, void * user_data)
+  {
+    if (event & kEvCanceled)
+      return;
+
+    Connection * conn = (Connection *)user_data;
+    if (conn->idle)
+      EV_LOG(kDebug, "HttpClient(%p) closes an idle connection to %s",
+          conn->client, conn->host->name.c_str());
+    (void)conn->client->Close(conn, conn->error);
+  }
+
+  void HttpClient::OnStream(Stream * stream, int event, void * user_data)
+  {
+    Connection * conn = (Connection *)user_data;
+    HttpClient * client = conn->client;
+
+    if (event & kStreamRead)
+    {
+      (void)client->Receive(conn);
+    }
+    else if (event & kStreamEOF)
+    {
+      // it completes a body until EOF
+      if (!conn->calls.empty() && conn->parser.head_parsed() && conn->parser.Eof() == kEvOK)
+      {
+        if (client->Finish(conn))
+          return;
+      }
+      (void)client->Close(conn, ECONNRESET);
+    }
+    else if (event & kStreamError)
+    {
+      (void)client->Close(conn, stream->error());
+    }
+  }
+
+  int HttpClient::Receive(Connection * conn)
+  {
+    Buffer * input = conn->stream.input();
+    size_t block_size = pool_->block_size();
+    HttpSlice slice;
+    const char * p;
+    size_t size;
+    ssize_t n;
+
+    while (!input->empty())
+    {
+      if (conn->calls.empty())
+      {
+        // nothing is expected on an idle connection
+        (void)Close(conn, 0);
+        return 1;
+      }
+
+      conn->receiving = 1;
+      size = (input->size() < block_size)?(input->size()):(block_size);
+      p = input->Pullup(size);
+
+      if (!conn->parser.head_parsed())
+      {
+        n = conn->parser.ParseHead(p, size);
+        if (n == kEvFailure)
+        {
+          (void)Close(conn, errno);
+          return 1;
+        }
+        if (n == 0)
+          return 0;
+
+        // keep the head, for the body may arrive in several reads
+        try
+        {
+          conn->head.assign(p, (size_t)n);// may throw(caught)
+        }
+        catch (...)
+        {
+          (void)Close(conn, ENOMEM);
+          return 1;
+        }
+        conn->response = *conn->parser.message();
+        RebaseMessage(&conn->response, p, conn->head.data());
+        input->Consume((size_t)n);
+        if (conn->calls.front()->head)
+          conn->parser.SkipBody();
+      }
+      else
+      {
+        n = conn->parser.ParseBody(p, size, &slice);
+        if (n == kEvFailure)
+        {
+          (void)Close(conn, errno);
+          return 1;
+        }
+        if (n == 0)
+        {
+          // a line of the chunked coding does not fit in a block
+          if (size < input->size())
+          {
+            (void)Close(conn, EPROTO);
+            return 1;
+          }
+          return 0;
+        }
+
+        try
+        {
+          conn->body.append(slice.data, slice.size);// may throw(caught)
+        }
+        catch (...)
+        {
+          (void)Close(conn, ENOMEM);
+          return 1;
+        }
+        input->Consume((size_t)n);
+      }
+
+      if (conn->parser.done() && Finish(conn))
+        return 1;
+    }
+    return 0;
+  }
+
+  int HttpClient::Finish(Connection * conn)
+  {
+    Host * host = conn->host;
+    Call * call = conn->calls.front();
+    HttpMessage response = conn->response;
+    std::string head, body;
+    const char * from = conn->head.data();
+
+    // the connection may be reused inside the callback, so the response is taken out
+    conn->calls.pop_front();
+    head.swap(conn->head);
+    body.swap(conn->body);
+    RebaseMessage(&response, from, head.data());
+    conn->parser.Reset();
+    conn->receiving = 0;
+    conn->reused = 1;
+
+    if (!response.keep_alive)
+    {
+      conn->closing = 1;
+    }
+    else if (conn->calls.empty() && !conn->closing && max_idle_)
+    {
+      AddIdle(conn);
+    }
+
+    if (Invoke(call, 0, &response, body.data(), body.size()))
+      return 1;
+
+    // the pipelined requests left are retried
+    if (!response.keep_alive || (conn->calls.empty() && !conn->idle && !conn->closing))
+    {
+      (void)Close(conn, ECONNRESET);
+      return 1;
+    }
+    if (Drain(host))
+      return 1;
+
+    // close the least recently used ones, which are not 'conn' and have no callback,
+    // for hosts with idle connections have no waiting requests
+    while (idle_count_ > max_idle_)
+      (void)Close(ev_container_of(idle_.back(), Connection, lru), 0);
+    return 0;
+  }
+
+  int HttpClient::Close(Connection * conn, int error)
+  {
+    Host * host = conn->host;
+    std::deque<Call *> calls;
+    std::deque<Call *> retries;
+
+    EV_LOG(kDebug, "HttpClient(%p) closes a connection to %s", this, host->name.c_str());
+
+    // it stays in 'host' until its callbacks return,
+    // so that the host is kept and no request is sent on it
+    conn->closing = 1;
+    if (conn->idle)
+      DelIdle(conn);
+    calls.swap(conn->calls);
+    Disconnect(conn);
+
+    if (error == 0)
+      error = ECONNRESET;
+
+    // a reused connection may be closed by the server when the requests are sent,
+    // retry them before waiting requests, in order
+    for (size_t i=calls.size(); i>0; i--)
+    {
+      Call * call = calls[i-1];
+      if (conn->reused && call->idempotent && !call->retried && !(i == 1 && conn->receiving))
+      {
+        try
+        {
+          host->waiting.push_front(call);// may throw(caught)
+          call->retried = 1;
+          calls[i-1] = 0;
+        }
+        catch (...)
+        {
+        }
+      }
+    }
+
+    for (size_t i=0; i<calls.size(); i++)
+    {
+      if (calls[i] && Invoke(calls[i], error, 0, 0, 0))
+      {
+        // the client is gone
+        for (i++; i<calls.size(); i++)
+        {
+          if (calls[i] == 0)
+            continue;
+          calls[i]->callback(ECANCELED, 0, 0, 0, calls[i]->user_data);
+          delete calls[i];
+        }
+        return 1;
+      }
+    }
+
+    host->connections.erase(conn);
+    delete conn;
+    if (Drain(host))
+      return 1;
+    PutHost(host);
+    return 0;
+  }
+
+  int HttpClient::Invoke(Call * call, int error, const HttpMessage * response,
+      const char * body, size_t body_size)
+  {
+    ScopedPtr<Call> guard(call);
+    DestroyedGuard destroyed(&destroyed_);
+    call->callback(error, response, body, body_size, call->user_data);
+    return destroyed.Leave();
+  }
+
+  int HttpClient::Request(const struct sockaddr * addr, socklen_t addrlen,
+      const HttpRequest * request, http_callback callback, void * user_data)
+  {
+    if (addr == 0 || request == 0 || request->method == 0 || request->target == 0
+        || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_ == 0)
+    {
+      EV_LOG(kError, "HttpClient(%p) is not initialized", this);
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    Host * host = GetHost(addr, addrlen);
+    if (host == 0)
+      return (errno == ENOMEM)?(kEvNoMemory):(kEvFailure);
+
+    Call * call = 0;
+    try
+    {
+      call = new Call;// may throw(caught)
+      std::string& s = call->request;
+      s.reserve(128 + strlen(request->target) + request->body_size);// may throw(caught)
+      s += request->method;
+      s += ' ';
+      s += request->target;
+      s += " HTTP/1.1\r\nHost: ";
+      s += (request->host)?(request->host):(host->name.c_str());
+      s += "\r\n";
+      if (request->headers)
+        s += request->headers;
+      if (request->body)
+      {
+        char length[64];
+        snprintf(length, sizeof(length), "Content-Length: %lu\r\n",
+            (unsigned long)request->body_size);
+        s += length;
+      }
+      s += "\r\n";
+      if (request->body)
+        s.append((const char *)request->body, request->body_size);
+    }
+    catch (...)
+    {
+      delete call;
+      PutHost(host);
+      return kEvNoMemory;
+    }
+    call->head = (strcasecmp(request->method, "HEAD") == 0);
+    call->idempotent = IsIdempotent(request->method);
+    call->retried = 0;
+    call->callback = callback;
+    call->user_data = user_data;
+
+    // requests are sent in order
+    Connection * conn = 0;
+    int ret = kEvOK;
+    errno = 0;
+    if (host->waiting.empty())
+      conn = Pick(host);
+
+    if (conn)
+    {
+      ret = Send(conn, call);
+    }
+    else if (errno)
+    {
+      ret = kEvFailure;
+    }
+    else
+    {
+      try
+      {
+        host->waiting.push_back(call);// may throw(caught)
+      }
+      catch (...)
+      {
+        ret = kEvNoMemory;
+      }
+    }
+
+    if (ret != kEvOK)
+    {
+      int error = errno;
+      delete call;
+      PutHost(host);
+      errno = error;
+    }
+    return ret;
+  }
+}
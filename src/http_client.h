@@ -0,0 +1,190 @@
+/** @file
+ * @brief HTTP/1.1 client with keep-alive connection pools
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_HTTP_CLIENT_H
+#define LIBEV_HTTP_CLIENT_H
+
+#include "ev.h"
+#include "list.h"
+#include "buffer.h"
+#include "stream.h"
+#include "http_parser.h"
+#include <sys/socket.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+
+namespace libev {
+
+  struct HttpRequest
+  {
+    const char * method;      // e.g. "GET"
+    const char * target;      // e.g. "/index.html?q=libev"
+    const char * host;        // the Host header, or 0 for the address(e.g. "127.0.0.1:8080")
+    const char * headers;     // other header lines ending with "\r\n", or 0
+    const void * body;        // Content-Length is added unless it is 0
+    size_t body_size;
+  };
+
+  // 'error' is 0 if a response is received, or
+  //   an errno of connecting, writing or reading(e.g. ECONNREFUSED)
+  //   ECONNRESET: the connection is closed before the response is complete
+  //   EPROTO: the response is malformed
+  //   EMSGSIZE: the head of the response is larger than a block of the pool
+  //   ECANCELED: the client is uninitialized
+  // 'response' and 'body' are valid only inside the callback
+  typedef void (*http_callback)(int error, const HttpMessage * response,
+      const char * body, size_t body_size, void * user_data);
+
+  // An HTTP/1.1 client keeping idle keep-alive connections per host(address and port),
+  // so that requests to the same host skip TCP handshakes.
+  // A host has at most 'max_connections' connections,
+  // and at most 'max_pipeline' requests are pipelined on each of them.
+  // Requests beyond that wait in FIFO order.
+  // Idle connections are closed after the idle timeout,
+  // and the least recently used ones are closed when there are more than 'max_idle'.
+  // An idempotent request(GET, HEAD, PUT, DELETE, OPTIONS or TRACE) sent on a reused connection,
+  // which is closed by the server before any byte of the response,
+  // is retried once on a new connection(RFC 9110 9.2.2),
+  // other requests fail with ECONNRESET.
+  // The client may be deleted inside its callback.
+  class HttpClient
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(HttpClient);
+
+      struct Host;
+
+      struct Call
+      {
+        std::string request;// serialized
+        int head;// a HEAD request, whose response has no body
+        int idempotent;// it may be retried
+        int retried;
+        http_callback callback;
+        void * user_data;
+      };
+
+      struct Connection
+      {
+        HttpClient * client;
+        Host * host;
+        Stream stream;
+        HttpParser parser;
+        std::deque<Call *> calls;// sent, to be responded in order
+        HttpMessage response;// slices point into 'head'
+        std::string head;
+        std::string body;
+        int reused;// a response has been received
+        int receiving;// bytes of the response of 'calls.front()' have been received
+        int closing;// no more requests are sent on it
+        int error;// of a failed write, 'timer' closes it with 'error'
+        int idle;// in 'idle_' and 'host->idle'
+        Event timer;// the idle timeout, or closing
+        ListNode lru;
+        ListNode host_idle;
+
+        explicit Connection(BlockPool * pool) : stream(pool), parser(kHttpResponse) {}
+      };
+
+      struct Host
+      {
+        std::string name;// "address:port", the key of 'hosts_'
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        std::set<Connection *> connections;
+        List idle;// the most recently used first
+        std::deque<Call *> waiting;
+      };
+
+      Reactor * reactor_;
+      BlockPool * pool_;
+      std::map<std::string, Host *> hosts_;
+      List idle_;// idle connections of all hosts, the most recently used first
+      size_t idle_count_;
+      size_t connects_;
+      size_t max_idle_;
+      int64_t idle_timeout_;// ms
+      size_t max_connections_;
+      size_t max_pipeline_;
+      int * destroyed_;// set to 1 if the client is destroyed inside its callback
+
+      static void OnStream(Stream * stream, int event, void * user_data);
+      static void OnTimer(int fd, int event, void * user_data);
+
+      // find or add the host of 'addr'
+      // return 0 and set errno if failed
+      Host * GetHost(const struct sockaddr * addr, socklen_t addrlen);
+      // delete the host if it has nothing
+      void PutHost(Host * host);
+      // open a connection to 'host'
+      // return 0 and set errno if failed
+      Connection * Connect(Host * host);
+      // an idle connection, a new one or one to pipeline on,
+      // return 0 if the host has no room(errno is 0), or failed
+      Connection * Pick(Host * host);
+      // send 'call' on 'conn', write failures are handled later by 'timer'
+      // return kEvOK or kEvNoMemory
+      int Send(Connection * conn, Call * call);
+      // send waiting requests of 'host' while there is room
+      // return 1 if the client is destroyed
+      int Drain(Host * host);
+      void AddIdle(Connection * conn);
+      void DelIdle(Connection * conn);
+      // close 'conn' later with 'error'
+      void Defer(Connection * conn, int error);
+      // handle input of 'conn'
+      // return 1 if the client is destroyed, or 'conn' is closed
+      int Receive(Connection * conn);
+      // the response of 'calls.front()' is complete
+      // return 1 if the client is destroyed, or 'conn' is closed
+      int Finish(Connection * conn);
+      // close 'conn', its requests are retried or fail with 'error'
+      // return 1 if the client is destroyed
+      int Close(Connection * conn, int error);
+      // stop polling and close the fd of 'conn'
+      static void Disconnect(Connection * conn);
+      // run the callback of a detached call and delete it,
+      // return 1 if the client is destroyed
+      int Invoke(Call * call, int error, const HttpMessage * response,
+          const char * body, size_t body_size);
+
+    public:
+      HttpClient();
+      ~HttpClient();
+
+      // buffers of connections are taken from 'pool',
+      // whose block size limits the head of responses
+      int Init(Reactor * reactor, BlockPool * pool);
+      // close all connections, pending requests fail with ECANCELED
+      void UnInit();
+
+      // the max number of idle connections of all hosts(64 by default),
+      // the least recently used ones are closed as connections become idle
+      void SetMaxIdle(size_t max_idle) {max_idle_ = max_idle;}
+      // idle connections are closed after 'ms' milliseconds(60000 by default)
+      void SetIdleTimeout(int64_t ms) {idle_timeout_ = ms;}
+      // the max number of connections per host(8 by default)
+      void SetMaxConnections(size_t max_connections);
+      // the max number of requests in flight per connection(1 by default, no pipelining)
+      void SetMaxPipeline(size_t max_pipeline);
+
+      // send 'request' to the host at 'addr'(AF_INET or AF_INET6),
+      // 'request' is copied. 'callback' is not invoked inside 'Request'.
+      int Request(const struct sockaddr * addr, socklen_t addrlen,
+          const HttpRequest * request, http_callback callback, void * user_data);
+
+      Reactor * reactor()const {return reactor_;}
+      // the number of idle connections
+      size_t idle()const {return idle_count_;}
+      // the number of connections opened
+      size_t connects()const {return connects_;}
+  };
+}
+
+#endif
@@ -0,0 +1,582 @@
+/** @file
+ * @brief test the HTTP client against a local server
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "http_client.h"
+#include "acceptor.h"
+#include "stream.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+static std::string ToString(const HttpSlice& slice)
+{
+  return std::string(slice.data, slice.size);
+}
+
+/************************************************************************/
+// a keep-alive server responding the target, or echoing the body
+struct Server;
+
+struct ServerConnection
+{
+  Server * server;
+  Stream stream;
+  HttpParser parser;
+  std::string method;
+  std::string target;
+  std::string body;
+  int responses;
+
+  explicit ServerConnection(BlockPool * pool) : stream(pool), parser(kHttpRequest) {}
+};
+
+struct Server
+{
+  Reactor * reactor;
+  BlockPool * pool;
+  Acceptor acceptor;
+  struct sockaddr_in addr;
+  std::set<ServerConnection *> connections;
+  int max_connections;// the most connections open at the same time
+  int max_batch;// the most requests read at once
+  int close_after;// close silently after so many responses on a connection, 0 for never
+  int requests;
+};
+
+static void ServerClose(ServerConnection * conn)
+{
+  int fd = conn->stream.fd();
+  conn->stream.UnInit();
+  safe_close(fd);
+  conn->server->connections.erase(conn);
+  delete conn;
+}
+
+// return 1 if 'conn' is closed
+static int ServerRespond(ServerConnection * conn)
+{
+  Server * server = conn->server;
+  std::string body = (conn->body.empty())?(conn->target):(conn->body);
+  std::string response;
+  char length[64];
+
+  server->requests++;
+  conn->responses++;
+
+  if (conn->target == "/chunked")
+  {
+    response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    snprintf(length, sizeof(length), "%x\r\n", (unsigned int)body.size());
+    for (int i=0; i<2; i++)
+    {
+      response += length;
+      response += body;
+      response += "\r\n";
+    }
+    response += "0\r\n\r\n";
+  }
+  else
+  {
+    snprintf(length, sizeof(length), "Content-Length: %u\r\n", (unsigned int)body.size());
+    response = "HTTP/1.1 200 OK\r\n";
+    response += length;
+    if (conn->target == "/close")
+      response += "Connection: close\r\n";
+    response += "\r\n";
+    if (conn->method != "HEAD")
+      response += body;
+  }
+  EV_VERIFY(conn->stream.Write(response.data(), response.size()) == kEvOK);
+
+  if (server->close_after && conn->responses == server->close_after)
+  {
+    ServerClose(conn);
+    return 1;
+  }
+  if (conn->target == "/close")
+    EV_VERIFY(conn->stream.Shutdown() == kEvOK);
+  return 0;
+}
+
+static void ServerOnStream(Stream * stream, int event, void * user_data)
+{
+  ServerConnection * conn = (ServerConnection *)user_data;
+  Buffer * input = stream->input();
+  HttpSlice slice;
+  int batch = 0;
+  ssize_t n;
+
+  if (!(event & kStreamRead))
+  {
+    if (event & (kStreamEOF|kStreamError))
+      ServerClose(conn);
+    return;
+  }
+
+  while (!input->empty())
+  {
+    size_t size = (input->size() < 4096)?(input->size()):(4096);
+    const char * p = input->Pullup(size);
+
+    if (!conn->parser.head_parsed())
+    {
+      n = conn->parser.ParseHead(p, size);
+      EV_VERIFY(n >= 0);
+      if (n == 0)
+        break;
+      conn->method = ToString(conn->parser.message()->method);
+      conn->target = ToString(conn->parser.message()->target);
+      conn->body.clear();
+    }
+    else
+    {
+      n = conn->parser.ParseBody(p, size, &slice);
+      EV_VERIFY(n >= 0);
+      if (n == 0)
+        break;
+      conn->body.append(slice.data, slice.size);
+    }
+    input->Consume((size_t)n);
+
+    if (conn->parser.done())
+    {
+      conn->parser.Reset();
+      batch++;
+      if (batch > conn->server->max_batch)
+        conn->server->max_batch = batch;
+      if (ServerRespond(conn))
+        return;
+    }
+  }
+}
+
+static void ServerOnAccept(Acceptor * /*acceptor*/, int fd,
+    const struct sockaddr * /*addr*/, socklen_t /*addrlen*/, void * user_data)
+{
+  Server * server = (Server *)user_data;
+  ServerConnection * conn = new ServerConnection(server->pool);
+
+  conn->server = server;
+  conn->responses = 0;
+  EV_VERIFY(conn->stream.Init(server->reactor, fd, ServerOnStream, conn) == kEvOK);
+  server->connections.insert(conn);
+  if ((int)server->connections.size() > server->max_connections)
+    server->max_connections = (int)server->connections.size();
+}
+
+static void ServerStart(Server * server, Reactor * reactor, BlockPool * pool)
+{
+  socklen_t len = sizeof(server->addr);
+
+  server->reactor = reactor;
+  server->pool = pool;
+  server->max_connections = 0;
+  server->max_batch = 0;
+  server->close_after = 0;
+  server->requests = 0;
+  memset(&server->addr, 0, sizeof(server->addr));
+  server->addr.sin_family = AF_INET;
+  server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EV_VERIFY(server->acceptor.Listen(reactor, (struct sockaddr *)&server->addr,
+        sizeof(server->addr), ServerOnAccept, server) == kEvOK);
+  EV_VERIFY(getsockname(server->acceptor.fd(), (struct sockaddr *)&server->addr, &len) == 0);
+}
+
+static void ServerStop(Server * server)
+{
+  server->acceptor.UnInit();
+  while (!server->connections.empty())
+    ServerClose(*server->connections.begin());
+}
+
+/************************************************************************/
+struct Result
+{
+  int error;
+  int status;
+  int keep_alive;
+  std::string body;
+  int done;
+};
+
+static void OnResponse(int error, const HttpMessage * response,
+    const char * body, size_t body_size, void * user_data)
+{
+  Result * result = (Result *)user_data;
+
+  result->error = error;
+  result->done = 1;
+  if (error == 0)
+  {
+    result->status = response->status;
+    result->keep_alive = response->keep_alive;
+    result->body.assign(body, body_size);
+  }
+}
+
+static HttpRequest MakeRequest(const char * method, const char * target)
+{
+  HttpRequest request;
+  memset(&request, 0, sizeof(request));
+  request.method = method;
+  request.target = target;
+  return request;
+}
+
+static void Request(HttpClient * client, const Server * server,
+    const HttpRequest * request, Result * result)
+{
+  result->done = 0;
+  EV_VERIFY(client->Request((const struct sockaddr *)&server->addr, sizeof(server->addr),
+        request, OnResponse, result) == kEvOK);
+}
+
+static void Wait(Reactor * reactor, const Result * result)
+{
+  while (!result->done)
+    (void)reactor->RunOne();
+}
+
+/************************************************************************/
+static HttpClient * test1_client;
+static const Server * test1_server;
+static std::vector<std::string> test1_targets;
+static std::vector<std::string> test1_bodies;
+
+static void Test1_Callback(int error, const HttpMessage * response,
+    const char * body, size_t body_size, void * /*user_data*/)
+{
+  EV_VERIFY(error == 0);
+  EV_VERIFY(response->status == 200 && response->keep_alive);
+  test1_bodies.push_back(std::string(body, body_size));
+
+  // the next request reuses the connection, inside the callback
+  if (test1_bodies.size() < test1_targets.size())
+  {
+    HttpRequest request = MakeRequest("GET", test1_targets[test1_bodies.size()].c_str());
+    EV_VERIFY(test1_client->Request((const struct sockaddr *)&test1_server->addr,
+          sizeof(test1_server->addr), &request, Test1_Callback, 0) == kEvOK);
+  }
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: keep-alive connections are reused");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Server server;
+  HttpClient client;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  ServerStart(&server, reactor.get(), &pool);
+  EV_VERIFY(client.Init(reactor.get(), &pool) == kEvOK);
+  client.SetIdleTimeout(50);
+
+  for (int i=0; i<10; i++)
+  {
+    char target[32];
+    snprintf(target, sizeof(target), "/%d", i);
+    test1_targets.push_back(target);
+  }
+  test1_client = &client;
+  test1_server = &server;
+
+  HttpRequest request = MakeRequest("GET", test1_targets[0].c_str());
+  EV_VERIFY(client.Request((const struct sockaddr *)&server.addr, sizeof(server.addr),
+        &request, Test1_Callback, 0) == kEvOK);
+  while (test1_bodies.size() < test1_targets.size())
+    (void)reactor->RunOne();
+
+  EV_VERIFY(test1_bodies == test1_targets);
+  EV_VERIFY(client.connects() == 1);
+  EV_VERIFY(server.max_connections == 1);
+  EV_VERIFY(client.idle() == 1);
+
+  // closed by the idle timeout
+  while (!server.connections.empty())
+    (void)reactor->RunOne();
+  EV_VERIFY(client.idle() == 0);
+
+  client.UnInit();
+  ServerStop(&server);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: responses");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Server server;
+  HttpClient client;
+  HttpRequest request;
+  Result result;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  ServerStart(&server, reactor.get(), &pool);
+  EV_VERIFY(client.Init(reactor.get(), &pool) == kEvOK);
+
+  request = MakeRequest("GET", "/chunked");
+  Request(&client, &server, &request, &result);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == 0 && result.body == "/chunked/chunked");
+
+  request = MakeRequest("HEAD", "/head");
+  Request(&client, &server, &request, &result);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == 0 && result.body.empty() && result.keep_alive);
+
+  request = MakeRequest("POST", "/echo");
+  request.headers = "Content-Type: text/plain\r\n";
+  request.body = "hello world";
+  request.body_size = 11;
+  Request(&client, &server, &request, &result);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == 0 && result.body == "hello world");
+  EV_VERIFY(client.connects() == 1);
+
+  // not reused
+  request = MakeRequest("GET", "/close");
+  Request(&client, &server, &request, &result);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == 0 && result.body == "/close" && !result.keep_alive);
+  EV_VERIFY(client.idle() == 0);
+
+  request = MakeRequest("GET", "/after");
+  Request(&client, &server, &request, &result);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == 0 && result.body == "/after");
+  EV_VERIFY(client.connects() == 2);
+
+  client.UnInit();
+  ServerStop(&server);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: limits of connections and pipelining");
+
+  static const int kRequests = 10;
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  char targets[kRequests][16];
+  Result results[kRequests];
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+
+  for (size_t pipeline=1; pipeline<=4; pipeline+=3)
+  {
+    Server server;
+    HttpClient client;
+
+    ServerStart(&server, reactor.get(), &pool);
+    EV_VERIFY(client.Init(reactor.get(), &pool) == kEvOK);
+    client.SetMaxConnections(2);
+    client.SetMaxPipeline(pipeline);
+
+    for (int i=0; i<kRequests; i++)
+    {
+      snprintf(targets[i], sizeof(targets[i]), "/%d", i);
+      HttpRequest request = MakeRequest("GET", targets[i]);
+      Request(&client, &server, &request, &results[i]);
+    }
+    for (int i=0; i<kRequests; i++)
+    {
+      Wait(reactor.get(), &results[i]);
+      EV_VERIFY(results[i].error == 0 && results[i].body == targets[i]);
+    }
+
+    EV_LOG(kInfo, "pipeline %d: %d requests are read at once at most",
+        (int)pipeline, server.max_batch);
+    EV_VERIFY(client.connects() == 2);
+    EV_VERIFY(server.max_connections == 2);
+    EV_VERIFY(client.idle() == 2);
+    if (pipeline == 1)
+      EV_VERIFY(server.max_batch == 1);
+    else
+      EV_VERIFY(server.max_batch > 1 && server.max_batch <= (int)pipeline);
+
+    client.UnInit();
+    ServerStop(&server);
+  }
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: the least recently used idle connections are closed");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Server servers[3];
+  HttpClient client;
+  HttpRequest request = MakeRequest("GET", "/");
+  Result result;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(client.Init(reactor.get(), &pool) == kEvOK);
+  client.SetMaxIdle(2);
+
+  for (int i=0; i<3; i++)
+  {
+    ServerStart(&servers[i], reactor.get(), &pool);
+    Request(&client, &servers[i], &request, &result);
+    Wait(reactor.get(), &result);
+    EV_VERIFY(result.error == 0);
+  }
+  EV_VERIFY(client.idle() == 2);
+  while (!servers[0].connections.empty())
+    (void)reactor->RunOne();
+  EV_VERIFY(servers[1].connections.size() == 1);
+  EV_VERIFY(servers[2].connections.size() == 1);
+
+  // still pooled
+  Request(&client, &servers[1], &request, &result);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == 0);
+  EV_VERIFY(client.connects() == 3);
+
+  client.UnInit();
+  for (int i=0; i<3; i++)
+    ServerStop(&servers[i]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static HttpClient * test5_client;
+static const Server * test5_server;
+static int test5_responses;
+
+static void Test5_Callback(int error, const HttpMessage * /*response*/,
+    const char * /*body*/, size_t /*body_size*/, void * /*user_data*/)
+{
+  EV_VERIFY(error == 0);
+  if (++test5_responses < 5)
+  {
+    // sent on the connection being closed by the server, and retried
+    HttpRequest request = MakeRequest("GET", "/again");
+    EV_VERIFY(test5_client->Request((const struct sockaddr *)&test5_server->addr,
+          sizeof(test5_server->addr), &request, Test5_Callback, 0) == kEvOK);
+  }
+}
+
+static void Test5_Delete(int error, const HttpMessage * /*response*/,
+    const char * /*body*/, size_t /*body_size*/, void * user_data)
+{
+  int * errors = (int *)user_data;
+
+  if (error == 0)
+  {
+    delete test5_client;
+    test5_client = 0;
+  }
+  else
+  {
+    EV_VERIFY(error == ECANCELED);
+    (*errors)++;
+  }
+}
+
+// send a POST on the connection being closed by the server
+static void Test5_Post(int error, const HttpMessage * /*response*/,
+    const char * /*body*/, size_t /*body_size*/, void * user_data)
+{
+  EV_VERIFY(error == 0);
+  HttpRequest request = MakeRequest("POST", "/post");
+  Request(test5_client, test5_server, &request, (Result *)user_data);
+}
+
+static void Test5()
+{
+  EV_LOG(kInfo, "Test 5: retries and failures");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Server server;
+  HttpClient client;
+  HttpRequest request = MakeRequest("GET", "/");
+  Result result;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  ServerStart(&server, reactor.get(), &pool);
+  EV_VERIFY(client.Init(reactor.get(), &pool) == kEvOK);
+
+  // the server closes connections silently after every response
+  server.close_after = 1;
+  test5_client = &client;
+  test5_server = &server;
+  EV_VERIFY(client.Request((const struct sockaddr *)&server.addr, sizeof(server.addr),
+        &request, Test5_Callback, 0) == kEvOK);
+  while (test5_responses < 5)
+    (void)reactor->RunOne();
+  EV_VERIFY(client.connects() == 5);
+  EV_VERIFY(server.requests == 5);
+
+  // non-idempotent requests are not retried
+  result.done = 0;
+  EV_VERIFY(client.Request((const struct sockaddr *)&server.addr, sizeof(server.addr),
+        &request, Test5_Post, &result) == kEvOK);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == ECONNRESET);
+  EV_VERIFY(server.requests == 6);
+
+  // refused
+  ServerStop(&server);
+  Request(&client, &server, &request, &result);
+  Wait(reactor.get(), &result);
+  EV_VERIFY(result.error == ECONNREFUSED);
+
+  // canceled
+  ServerStart(&server, reactor.get(), &pool);
+  Request(&client, &server, &request, &result);
+  client.UnInit();
+  EV_VERIFY(result.done && result.error == ECANCELED);
+
+  // deleted inside the callback
+  int errors = 0;
+  test5_client = new HttpClient;
+  EV_VERIFY(test5_client->Init(reactor.get(), &pool) == kEvOK);
+  test5_client->SetMaxConnections(1);
+  for (int i=0; i<4; i++)
+  {
+    EV_VERIFY(test5_client->Request((const struct sockaddr *)&server.addr, sizeof(server.addr),
+          &request, Test5_Delete, &errors) == kEvOK);
+  }
+  while (test5_client)
+    (void)reactor->RunOne();
+  EV_VERIFY(errors == 3);
+
+  ServerStop(&server);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  Test5();
+  return 0;
+}
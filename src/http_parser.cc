@@ -0,0 +1,837 @@
+/** @file
+ * @brief incremental HTTP/1.x parser
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "http_parser.h"
+#include "log.h"
+#include "header.h"
+
+#if defined __SSE2__
+# include <emmintrin.h>
+# define HTTP_HAVE_SSE2
+#endif
+
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__ && __GNUC__ >= 5
+# include <immintrin.h>
+# define HTTP_HAVE_AVX2
+#endif
+
+namespace libev {
+
+  enum ChunkState
+  {
+    kChunkSize,               // the chunk size line
+    kChunkData,               // 'remaining_' bytes of chunk data
+    kChunkDataEnd,            // CRLF after chunk data
+    kChunkTrailer             // trailer fields after the last chunk
+  };
+
+  static const size_t kDefaultMaxHead = 64 * 1024;
+  static const size_t kMaxChunkLine = 4096;// the chunk size and extensions
+  static const size_t kMaxChunkDigits = 15;
+  static const uint64_t kMaxContentLength = (uint64_t)1 << 62;
+
+  // tchar of RFC 7230
+  static const unsigned char kTokenChars[256] =
+  {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,1,0,1,1,1,1,1,0,0,1,1,0,1,1,0,
+    1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+    0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+    1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,1,
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+    1,1,1,1,1,1,1,1,1,1,1,0,1,0,1,0
+  };
+
+  /************************************************************************/
+  // the first byte in [p, end) which is not a token char
+  static const char * ScanTokenScalar(const char * p, const char * end)
+  {
+    while (p < end && kTokenChars[(unsigned char)*p])
+      p++;
+    return p;
+  }
+
+  // the first byte in [p, end) which is CTL except HT(e.g. CR or LF), or SP if 'space' is set
+  static const char * ScanFieldScalar(const char * p, const char * end, int space)
+  {
+    for (; p < end; p++)
+    {
+      unsigned char c = (unsigned char)*p;
+      if ((c < 0x20 && c != '\t') || c == 0x7f || (space && c == ' '))
+        break;
+    }
+    return p;
+  }
+
+#ifdef HTTP_HAVE_SSE2
+  // bytes in ['lo', 'hi']
+  static inline __m128i InRange(__m128i v, char lo, char hi)
+  {
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8((char)(hi - lo))), t);
+  }
+
+  static const char * ScanTokenSSE2(const char * p, const char * end)
+  {
+    while (end - p >= 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      __m128i m = InRange(v, 0x00, ' ');
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+      m = _mm_or_si128(m, InRange(v, '(', ')'));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+      m = _mm_or_si128(m, InRange(v, ':', '@'));
+      m = _mm_or_si128(m, InRange(v, '[', ']'));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+      m = _mm_or_si128(m, InRange(v, 0x7f, (char)0xff));
+
+      int mask = _mm_movemask_epi8(m);
+      if (mask)
+        return p + __builtin_ctz((unsigned int)mask);
+      p += 16;
+    }
+    return ScanTokenScalar(p, end);
+  }
+
+  static const char * ScanFieldSSE2(const char * p, const char * end, int space)
+  {
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i sp = _mm_set1_epi8((space)?(' '):(0x7f));
+
+    while (end - p >= 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      __m128i m = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab),
+          _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, del));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, sp));
+
+      int mask = _mm_movemask_epi8(m);
+      if (mask)
+        return p + __builtin_ctz((unsigned int)mask);
+      p += 16;
+    }
+    return ScanFieldScalar(p, end, space);
+  }
+#endif
+
+#ifdef HTTP_HAVE_AVX2
+  // A byte 'c' is a token char if bit ('c' >> 4) of 'lo_table'['c' & 15] is set,
+  // both nibbles are looked up by shuffles.
+  __attribute__((target("avx2")))
+  static const char * ScanTokenAVX2(const char * p, const char * end)
+  {
+    const __m256i lo_table = _mm256_setr_epi8(
+        (char)0xe8, (char)0xfc, (char)0xf8, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc,
+        (char)0xf8, (char)0xf8, (char)0xf4, 0x54, (char)0xd0, 0x54, (char)0xf4, 0x70,
+        (char)0xe8, (char)0xfc, (char)0xf8, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc,
+        (char)0xf8, (char)0xf8, (char)0xf4, 0x54, (char)0xd0, 0x54, (char)0xf4, 0x70);
+    const __m256i hi_table = _mm256_setr_epi8(
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (end - p >= 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *)p);
+      __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+      __m256i hi = _mm256_shuffle_epi8(hi_table,
+          _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+      __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero);
+
+      unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+      if (mask)
+        return p + __builtin_ctz(mask);
+      p += 32;
+    }
+    return ScanTokenScalar(p, end);
+  }
+
+  __attribute__((target("avx2")))
+  static const char * ScanFieldAVX2(const char * p, const char * end, int space)
+  {
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i sp = _mm256_set1_epi8((space)?(' '):(0x7f));
+
+    while (end - p >= 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *)p);
+      __m256i m = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab),
+          _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, del));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, sp));
+
+      unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+      if (mask)
+        return p + __builtin_ctz(mask);
+      p += 32;
+    }
+    return ScanFieldScalar(p, end, space);
+  }
+#endif
+
+  // scalar until the best supported scanner is selected by the static initializer
+  static int scanner_type = kHttpScanScalar;
+  static const char * (*ScanToken)(const char * p, const char * end) = ScanTokenScalar;
+  static const char * (*ScanField)(const char * p, const char * end, int space) = ScanFieldScalar;
+
+  static int IsScannerSupported(int scanner)
+  {
+    switch (scanner)
+    {
+      case kHttpScanScalar:
+        return 1;
+#ifdef HTTP_HAVE_SSE2
+      case kHttpScanSSE2:
+        return 1;
+#endif
+#ifdef HTTP_HAVE_AVX2
+      case kHttpScanAVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+      default:
+        return 0;
+    }
+  }
+
+  int SetHttpScanner(int scanner)
+  {
+    if (!IsScannerSupported(scanner))
+    {
+      errno = EOPNOTSUPP;
+      return kEvFailure;
+    }
+
+    switch (scanner)
+    {
+#ifdef HTTP_HAVE_AVX2
+      case kHttpScanAVX2:
+        ScanToken = ScanTokenAVX2;
+        ScanField = ScanFieldAVX2;
+        break;
+#endif
+#ifdef HTTP_HAVE_SSE2
+      case kHttpScanSSE2:
+        ScanToken = ScanTokenSSE2;
+        ScanField = ScanFieldSSE2;
+        break;
+#endif
+      default:
+        ScanToken = ScanTokenScalar;
+        ScanField = ScanFieldScalar;
+        break;
+    }
+    scanner_type = scanner;
+    return kEvOK;
+  }
+
+  int GetHttpScanner()
+  {
+    return scanner_type;
+  }
+
+  static int SelectBestScanner()
+  {
+    if (SetHttpScanner(kHttpScanAVX2) != kEvOK && SetHttpScanner(kHttpScanSSE2) != kEvOK)
+      (void)SetHttpScanner(kHttpScanScalar);
+    return scanner_type;
+  }
+
+  static const int best_scanner = SelectBestScanner();
+
+  /************************************************************************/
+  static int SliceEqual(const char * data, size_t size, const char * name)
+  {
+    size_t len = strlen(name);
+    return size == len && strncasecmp(data, name, len) == 0;
+  }
+
+  static int IsWhitespace(char c)
+  {
+    return c == ' ' || c == '\t';
+  }
+
+  // move '*p' past CRLF or LF
+  // return 0 if it is not at the end of a line
+  static int EatEol(const char ** p, const char * end)
+  {
+    const char * q = *p;
+    if (q < end && *q == '\r')
+      q++;
+    if (q == end || *q != '\n')
+      return 0;
+    *p = q + 1;
+    return 1;
+  }
+
+  // "HTTP/1.x"
+  static int ParseVersion(const char ** p, const char * end, int * minor_version)
+  {
+    const char * q = *p;
+    if (end - q < 8 || memcmp(q, "HTTP/1.", 7) != 0 || q[7] < '0' || q[7] > '9')
+      return 0;
+    *minor_version = q[7] - '0';
+    *p = q + 8;
+    return 1;
+  }
+
+  static int ParseContentLength(const HttpSlice * value, uint64_t * length)
+  {
+    uint64_t n = 0;
+
+    if (value->size == 0)
+      return 0;
+    for (size_t i=0; i<value->size; i++)
+    {
+      char c = value->data[i];
+      if (c < '0' || c > '9')
+        return 0;
+      n = n * 10 + (uint64_t)(c - '0');
+      if (n > kMaxContentLength)
+        return 0;
+    }
+    *length = n;
+    return 1;
+  }
+
+  // call 'callback' with every element of a comma separated list
+  template<class Callback>
+    static void ForEachElement(const HttpSlice * value, Callback * callback)
+    {
+      const char * p = value->data;
+      const char * end = p + value->size;
+
+      while (p < end)
+      {
+        const char * comma = (const char *)memchr(p, ',', (size_t)(end - p));
+        const char * e = (comma)?(comma):(end);
+        const char * b = p;
+        while (b < e && IsWhitespace(*b))
+          b++;
+        const char * t = e;
+        while (t > b && IsWhitespace(t[-1]))
+          t--;
+        if (t > b)
+          (*callback)(b, (size_t)(t - b));
+        p = e + 1;
+      }
+    }
+
+  struct ConnectionOptions
+  {
+    int close;
+    int keep_alive;
+
+    void operator()(const char * data, size_t size)
+    {
+      if (SliceEqual(data, size, "close"))
+        close = 1;
+      else if (SliceEqual(data, size, "keep-alive"))
+        keep_alive = 1;
+    }
+  };
+
+  struct LastCoding
+  {
+    int chunked;
+
+    void operator()(const char * data, size_t size)
+    {
+      chunked = SliceEqual(data, size, "chunked");
+    }
+  };
+
+  // whether the connection persists after the message, by the version and Connection
+  static int KeepAlive(const HttpMessage * message)
+  {
+    ConnectionOptions connection = {0, 0};
+
+    for (int i=0; i<message->header_count; i++)
+    {
+      const HttpHeader * header = &message->headers[i];
+      if (SliceEqual(header->name.data, header->name.size, "connection"))
+        ForEachElement(&header->value, &connection);
+    }
+
+    if (message->minor_version >= 1)
+      return !connection.close;
+    return connection.keep_alive && !connection.close;
+  }
+
+  const HttpSlice * FindHttpHeader(const HttpMessage * message, const char * name)
+  {
+    for (int i=0; i<message->header_count; i++)
+    {
+      const HttpHeader * header = &message->headers[i];
+      if (SliceEqual(header->name.data, header->name.size, name))
+        return &header->value;
+    }
+    return 0;
+  }
+
+  /************************************************************************/
+  HttpParser::HttpParser(int type)
+    : type_(type), max_head_(kDefaultMaxHead)
+  {
+    EV_ASSERT(type == kHttpRequest || type == kHttpResponse);
+    Reset();
+  }
+
+  void HttpParser::Reset()
+  {
+    scanned_ = 0;
+    head_parsed_ = 0;
+    done_ = 0;
+    framing_conflict_ = 0;
+    chunk_state_ = kChunkSize;
+    remaining_ = 0;
+
+    memset(&message_.method, 0, sizeof(message_.method));
+    memset(&message_.target, 0, sizeof(message_.target));
+    memset(&message_.reason, 0, sizeof(message_.reason));
+    message_.status = 0;
+    message_.minor_version = 0;
+    message_.header_count = 0;
+    message_.body = kHttpBodyNone;
+    message_.content_length = 0;
+    message_.keep_alive = 0;
+  }
+
+  int HttpParser::ParseStartLine(const char ** p, const char * end)
+  {
+    const char * q = *p;
+    const char * t;
+
+    if (type_ == kHttpRequest)
+    {
+      // method SP request-target SP HTTP-version CRLF
+      t = ScanToken(q, end);
+      if (t == q || t == end || *t != ' ')
+        goto fail;
+      message_.method.data = q;
+      message_.method.size = (size_t)(t - q);
+
+      q = t + 1;
+      t = ScanField(q, end, 1);
+      if (t == q || t == end || *t != ' ')
+        goto fail;
+      message_.target.data = q;
+      message_.target.size = (size_t)(t - q);
+
+      q = t + 1;
+      if (!ParseVersion(&q, end, &message_.minor_version) || !EatEol(&q, end))
+        goto fail;
+    }
+    else
+    {
+      // HTTP-version SP status-code SP reason-phrase CRLF
+      if (!ParseVersion(&q, end, &message_.minor_version)
+          || end - q < 4 || *q != ' '
+          || q[1] < '1' || q[1] > '9' || q[2] < '0' || q[2] > '9' || q[3] < '0' || q[3] > '9')
+        goto fail;
+      message_.status = (q[1] - '0') * 100 + (q[2] - '0') * 10 + (q[3] - '0');
+
+      q += 4;
+      // the reason phrase may be empty, and so may the SP before it
+      if (q < end && *q == ' ')
+        q++;
+      t = ScanField(q, end, 0);
+      message_.reason.data = q;
+      message_.reason.size = (size_t)(t - q);
+      q = t;
+      if (!EatEol(&q, end))
+        goto fail;
+    }
+
+    *p = q;
+    return kEvOK;
+
+fail:
+    errno = EPROTO;
+    return kEvFailure;
+  }
+
+  int HttpParser::ParseHeaders(const char ** p, const char * end)
+  {
+    const char * q = *p;
+    const char * t;
+
+    for (;;)
+    {
+      // the empty line
+      if (EatEol(&q, end))
+        break;
+
+      // obsolete line folding is rejected(RFC 7230 3.2.4)
+      if (IsWhitespace(*q))
+        goto fail;
+
+      if (message_.header_count == kHttpMaxHeaders)
+      {
+        errno = EMSGSIZE;
+        return kEvFailure;
+      }
+      HttpHeader * header = &message_.headers[message_.header_count];
+
+      // field-name ":" OWS field-value OWS CRLF
+      t = ScanToken(q, end);
+      if (t == q || t == end || *t != ':')
+        goto fail;
+      header->name.data = q;
+      header->name.size = (size_t)(t - q);
+
+      q = t + 1;
+      while (q < end && IsWhitespace(*q))
+        q++;
+      t = ScanField(q, end, 0);
+      const char * value_end = t;
+      while (value_end > q && IsWhitespace(value_end[-1]))
+        value_end--;
+      header->value.data = q;
+      header->value.size = (size_t)(value_end - q);
+
+      // other control chars than CR and LF stop the scan too
+      q = t;
+      if (!EatEol(&q, end))
+        goto fail;
+      message_.header_count++;
+    }
+
+    *p = q;
+    return kEvOK;
+
+fail:
+    errno = EPROTO;
+    return kEvFailure;
+  }
+
+  int HttpParser::ProcessHeaders()
+  {
+    LastCoding coding = {0};
+    int transfer_encoding = 0;
+    int content_length = 0;
+    uint64_t length = 0;
+
+    for (int i=0; i<message_.header_count; i++)
+    {
+      const HttpHeader * header = &message_.headers[i];
+      const char * name = header->name.data;
+      size_t size = header->name.size;
+
+      if (SliceEqual(name, size, "content-length"))
+      {
+        uint64_t n;
+        // conflicting lengths may smuggle messages
+        if (!ParseContentLength(&header->value, &n) || (content_length && n != length))
+          goto fail;
+        content_length = 1;
+        length = n;
+      }
+      else if (SliceEqual(name, size, "transfer-encoding"))
+      {
+        transfer_encoding = 1;
+        ForEachElement(&header->value, &coding);
+      }
+    }
+
+    message_.keep_alive = KeepAlive(&message_);
+
+    if (type_ == kHttpResponse
+        && (message_.status / 100 == 1 || message_.status == 204 || message_.status == 304))
+    {
+      message_.body = kHttpBodyNone;
+    }
+    else if (transfer_encoding)
+    {
+      // Transfer-Encoding overrides Content-Length(RFC 7230 3.3.3),
+      // but a message with both may be framed differently by an intermediary(request smuggling),
+      // so reject the request, or close the connection after the response(RFC 9112 6.1)
+      if (content_length)
+      {
+        if (type_ == kHttpRequest)
+          goto fail;
+        framing_conflict_ = 1;
+        message_.keep_alive = 0;
+      }
+
+      if (coding.chunked)
+        message_.body = kHttpBodyChunked;
+      else if (type_ == kHttpRequest)
+        goto fail;
+      else
+        message_.body = kHttpBodyEOF;
+    }
+    else if (content_length)
+    {
+      message_.body = kHttpBodyLength;
+      message_.content_length = length;
+    }
+    else if (type_ == kHttpRequest)
+    {
+      message_.body = kHttpBodyNone;
+    }
+    else
+    {
+      message_.body = kHttpBodyEOF;
+    }
+
+    if (message_.body == kHttpBodyEOF)
+      message_.keep_alive = 0;
+    remaining_ = message_.content_length;
+    done_ = message_.body == kHttpBodyNone
+      || (message_.body == kHttpBodyLength && remaining_ == 0);
+    return kEvOK;
+
+fail:
+    errno = EPROTO;
+    return kEvFailure;
+  }
+
+  ssize_t HttpParser::ParseHead(const char * data, size_t size)
+  {
+    EV_ASSERT(!head_parsed_);
+
+    size_t limit = (size < max_head_)?(size):(max_head_);
+    const char * p = data + scanned_;
+    const char * end = data + limit;
+    size_t head_size = 0;
+
+    // search the empty line from where the last search stopped
+    while (p < end)
+    {
+      const char * lf = (const char *)memchr(p, '\n', (size_t)(end - p));
+      if (lf == 0)
+      {
+        p = end;
+        break;
+      }
+
+      if (lf + 1 == end || (lf + 2 == end && lf[1] == '\r'))
+      {
+        // search this line feed again with more data
+        p = lf;
+        break;
+      }
+
+      if (lf[1] == '\n')
+      {
+        head_size = (size_t)(lf + 2 - data);
+        break;
+      }
+      if (lf[1] == '\r' && lf[2] == '\n')
+      {
+        head_size = (size_t)(lf + 3 - data);
+        break;
+      }
+      p = lf + 1;
+    }
+
+    if (head_size == 0)
+    {
+      scanned_ = (size_t)(p - data);
+      if (size >= max_head_)
+      {
+        errno = EMSGSIZE;
+        return kEvFailure;
+      }
+      return 0;
+    }
+
+    p = data;
+    end = data + head_size;
+    // empty lines before the start line are ignored(RFC 7230 3.5)
+    while (p < end && (*p == '\r' || *p == '\n'))
+      p++;
+
+    if (ParseStartLine(&p, end) != kEvOK
+        || ParseHeaders(&p, end) != kEvOK
+        || ProcessHeaders() != kEvOK)
+      return kEvFailure;
+
+    head_parsed_ = 1;
+    scanned_ = 0;
+    return (ssize_t)head_size;
+  }
+
+  ssize_t HttpParser::ParseChunked(const char * data, size_t size, HttpSlice * body)
+  {
+    const char * p = data;
+    const char * end = data + size;
+    const char * lf;
+
+    for (;;)
+    {
+      switch (chunk_state_)
+      {
+        case kChunkSize:
+          {
+            // chunk-size [ chunk-ext ] CRLF
+            lf = (const char *)memchr(p, '\n', (size_t)(end - p));
+            if (lf == 0)
+            {
+              if ((size_t)(end - p) > kMaxChunkLine)
+                goto fail;
+              return p - data;
+            }
+
+            uint64_t n = 0;
+            const char * q = p;
+            for (; q < lf; q++)
+            {
+              int digit;
+              if (*q >= '0' && *q <= '9')
+                digit = *q - '0';
+              else if (*q >= 'a' && *q <= 'f')
+                digit = *q - 'a' + 10;
+              else if (*q >= 'A' && *q <= 'F')
+                digit = *q - 'A' + 10;
+              else
+                break;
+              if ((size_t)(q - p) == kMaxChunkDigits)
+                goto fail;
+              n = (n << 4) | (uint64_t)digit;
+            }
+            if (q == p || (*q != ';' && *q != '\r' && *q != '\n' && !IsWhitespace(*q)))
+              goto fail;
+
+            p = lf + 1;
+            remaining_ = n;
+            chunk_state_ = (n)?(kChunkData):(kChunkTrailer);
+            break;
+          }
+
+        case kChunkData:
+          {
+            // one slice of chunk data per call
+            size_t n = (size_t)(end - p);
+            if (n > remaining_)
+              n = (size_t)remaining_;
+            body->data = p;
+            body->size = n;
+            p += n;
+            remaining_ -= n;
+            if (remaining_ == 0)
+              chunk_state_ = kChunkDataEnd;
+            return p - data;
+          }
+
+        case kChunkDataEnd:
+          {
+            const char * q = p;
+            if (q < end && *q == '\r')
+              q++;
+            if (q == end)
+              return p - data;
+            if (*q != '\n')
+              goto fail;
+            p = q + 1;
+            chunk_state_ = kChunkSize;
+            break;
+          }
+
+        case kChunkTrailer:
+          {
+            // trailer fields are ignored until the empty line
+            lf = (const char *)memchr(p, '\n', (size_t)(end - p));
+            if (lf == 0)
+            {
+              if ((size_t)(end - p) > kMaxChunkLine)
+                goto fail;
+              return p - data;
+            }
+
+            int empty = lf == p || (lf == p + 1 && *p == '\r');
+            p = lf + 1;
+            if (empty)
+            {
+              done_ = 1;
+              return p - data;
+            }
+            break;
+          }
+
+        default:
+          EV_ASSERT(0);
+          goto fail;
+      }
+    }
+
+fail:
+    errno = EPROTO;
+    return kEvFailure;
+  }
+
+  ssize_t HttpParser::ParseBody(const char * data, size_t size, HttpSlice * body)
+  {
+    EV_ASSERT(head_parsed_);
+
+    body->data = data;
+    body->size = 0;
+    if (done_)
+      return 0;
+
+    switch (message_.body)
+    {
+      case kHttpBodyLength:
+        {
+          size_t n = size;
+          if (n > remaining_)
+            n = (size_t)remaining_;
+          body->size = n;
+          remaining_ -= n;
+          if (remaining_ == 0)
+            done_ = 1;
+          return (ssize_t)n;
+        }
+
+      case kHttpBodyChunked:
+        return ParseChunked(data, size, body);
+
+      case kHttpBodyEOF:
+        body->size = size;
+        return (ssize_t)size;
+
+      default:
+        return 0;
+    }
+  }
+
+  void HttpParser::SkipBody()
+  {
+    EV_ASSERT(head_parsed_);
+
+    // the connection persists as the headers tell, even without a length
+    if (message_.body == kHttpBodyEOF && !framing_conflict_)
+      message_.keep_alive = KeepAlive(&message_);
+    message_.body = kHttpBodyNone;
+    done_ = 1;
+  }
+
+  int HttpParser::Eof()
+  {
+    if (done_)
+      return kEvOK;
+
+    if (head_parsed_ && message_.body == kHttpBodyEOF)
+    {
+      done_ = 1;
+      return kEvOK;
+    }
+
+    errno = EPROTO;
+    return kEvFailure;
+  }
+}
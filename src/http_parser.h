@@ -0,0 +1,139 @@
+/** @file
+ * @brief incremental HTTP/1.x parser
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_HTTP_PARSER_H
+#define LIBEV_HTTP_PARSER_H
+
+#include "ev.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace libev {
+
+  // bytes in the data being parsed, which are not copied
+  struct HttpSlice
+  {
+    const char * data;
+    size_t size;
+  };
+
+  struct HttpHeader
+  {
+    HttpSlice name;
+    HttpSlice value;// without leading and trailing whitespaces
+  };
+
+  enum HttpParserType
+  {
+    kHttpRequest,
+    kHttpResponse
+  };
+
+  enum HttpBody
+  {
+    kHttpBodyNone,            // no body
+    kHttpBodyLength,          // 'content_length' bytes
+    kHttpBodyChunked,         // chunked transfer coding
+    kHttpBodyEOF              // until the connection is closed(responses only)
+  };
+
+  enum HttpScanner
+  {
+    kHttpScanScalar,          // byte at a time with lookup tables
+    kHttpScanSSE2,            // 16 bytes at a time
+    kHttpScanAVX2             // 32 bytes at a time
+  };
+
+  enum {kHttpMaxHeaders = 64};
+
+  struct HttpMessage
+  {
+    HttpSlice method;         // requests
+    HttpSlice target;         // requests
+    int status;               // responses
+    HttpSlice reason;         // responses
+    int minor_version;        // HTTP/1.'minor_version'
+    HttpHeader headers[kHttpMaxHeaders];
+    int header_count;
+    int body;                 // HttpBody
+    uint64_t content_length;  // kHttpBodyLength
+    int keep_alive;           // the connection can be reused after the message
+  };
+
+  // find the first header named 'name'(case insensitive)
+  // return its value, or 0 if not found
+  const HttpSlice * FindHttpHeader(const HttpMessage * message, const char * name);
+
+  // select the scanner of all parsers(the best one supported by the CPU by default)
+  // before parsing, return kEvFailure if it is not supported
+  int SetHttpScanner(int scanner);
+  int GetHttpScanner();
+
+  // An incremental parser of HTTP/1.0 and HTTP/1.1 messages.
+  // It works on data of the caller(e.g. 'Buffer::Pullup' of a stream's input),
+  // and slices of the message point into the data, so the data must be kept
+  // until the message is handled.
+  // The start line and headers(the head) are parsed once they are complete,
+  // the byte scans of them are vectorized(see HttpScanner).
+  // The body is decoded as it arrives, and pipelined messages follow
+  // after 'done' and 'Reset'.
+  class HttpParser
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(HttpParser);
+
+      int type_;
+      size_t max_head_;
+      size_t scanned_;// bytes searched for the end of the head
+      int head_parsed_;
+      int done_;
+      int framing_conflict_;// both Transfer-Encoding and Content-Length are present
+      int chunk_state_;
+      uint64_t remaining_;// bytes of the body or the current chunk
+      HttpMessage message_;
+
+      // return kEvOK or kEvFailure
+      int ParseStartLine(const char ** p, const char * end);
+      int ParseHeaders(const char ** p, const char * end);
+      int ProcessHeaders();
+      ssize_t ParseChunked(const char * data, size_t size, HttpSlice * body);
+
+    public:
+      // 'type' is HttpParserType
+      explicit HttpParser(int type);
+
+      // parse the next message
+      void Reset();
+      // the max bytes of the head(64KB by default)
+      void SetMaxHeadSize(size_t max_head) {max_head_ = max_head;}
+
+      // parse the head at the beginning of 'data',
+      // 'data' must begin with the same message for every call until the head is parsed.
+      // return the bytes of the head, 0 if it is incomplete,
+      // or kEvFailure(errno is EPROTO, or EMSGSIZE for a too large head)
+      ssize_t ParseHead(const char * data, size_t size);
+      // decode the body from 'data' following the head or the bytes consumed before,
+      // '*body' is set to the body bytes inside 'data', which may be empty.
+      // Call it again with the rest until 'done' or 0 is returned.
+      // return the bytes consumed(including '*body'), 0 if more data is needed,
+      // or kEvFailure(errno is EPROTO)
+      ssize_t ParseBody(const char * data, size_t size, HttpSlice * body);
+      // the body of the response to a HEAD request is not sent
+      void SkipBody();
+      // the connection is closed, which completes a kHttpBodyEOF body
+      // return kEvOK if the message is complete, or kEvFailure(errno is EPROTO)
+      int Eof();
+
+      int head_parsed()const {return head_parsed_;}
+      // the whole message has been parsed
+      int done()const {return done_;}
+      const HttpMessage * message()const {return &message_;}
+  };
+}
+
+#endif
@@ -0,0 +1,104 @@
+/** @file
+ * @brief benchmark the head scanners of the HTTP parser
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "http_parser.h"
+#include "ev.h"
+#include "log.h"
+#include "header.h"
+#include <string>
+
+using namespace libev;
+
+static const char kBrowserRequest[] =
+  "GET /wp-content/uploads/2010/03/hello-kitty-darth-vader-pink.jpg HTTP/1.1\r\n"
+  "Host: www.kittyhell.com\r\n"
+  "User-Agent: Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10.6; ja-JP-mac; rv:1.9.2.3) "
+  "Gecko/20100401 Firefox/3.6.3 Pathtraq/0.9\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: ja,en-us;q=0.7,en;q=0.3\r\n"
+  "Accept-Encoding: gzip,deflate\r\n"
+  "Accept-Charset: Shift_JIS,utf-8;q=0.7,*;q=0.7\r\n"
+  "Keep-Alive: 115\r\n"
+  "Connection: keep-alive\r\n"
+  "Cookie: wp_ozh_wsa_visits=2; wp_ozh_wsa_visit_lasttime=xxxxxxxxxx; "
+  "__utma=xxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.x; "
+  "__utmz=xxxxxxxxx.xxxxxxxxxx.x.x.utmccn=(referral)|utmcsr=reader.livedoor.com|utmcct=/reader/|utmcmd=referral\r\n"
+  "\r\n";
+
+static const char kResponse[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Date: Mon, 23 May 2005 22:38:34 GMT\r\n"
+  "Server: Apache/1.3.3.7 (Unix) (Red-Hat/Linux)\r\n"
+  "Last-Modified: Wed, 08 Jan 2003 23:11:55 GMT\r\n"
+  "ETag: \"3f80f-1b6-3e1cb03b\"\r\n"
+  "Content-Type: text/html; charset=UTF-8\r\n"
+  "Content-Length: 131\r\n"
+  "Accept-Ranges: bytes\r\n"
+  "Cache-Control: private, max-age=0\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+
+static double Now()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+static void Bench(const char * name, int type, const std::string& head, int n)
+{
+  static const char * const kScanners[] = {"scalar", "sse2", "avx2"};
+  HttpParser parser(type);
+  double scalar = 0.0;
+
+  for (int scanner=kHttpScanScalar; scanner<=kHttpScanAVX2; scanner++)
+  {
+    if (SetHttpScanner(scanner) != kEvOK)
+      continue;
+
+    double begin = Now();
+    for (int i=0; i<n; i++)
+    {
+      parser.Reset();
+      EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+    }
+    double elapsed = Now() - begin;
+    if (scanner == kHttpScanScalar)
+      scalar = elapsed;
+
+    printf("%-16s %5d bytes %-6s: %8.1f MB/s, %7.1f ns/message, %5.2fx scalar\n",
+        name, (int)head.size(), kScanners[scanner],
+        (double)head.size() * n / elapsed / 1e6, elapsed * 1e9 / n, scalar / elapsed);
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  int n = 1000000;
+  int best = GetHttpScanner();
+
+  GlobalLog().SetLevel(kWarning);
+
+  if (argc > 1)
+  {
+    n = atoi(argv[1]);
+    EV_VERIFY(n > 0);
+  }
+
+  // a request with a cookie of 4KB, like those of tracking sites
+  std::string cookie_request("GET /search?q=libev HTTP/1.1\r\nHost: www.example.com\r\nCookie: ");
+  for (int i=0; i<128; i++)
+    cookie_request += "key_of_cookie=value_of_cookie; ";
+  cookie_request += "\r\n\r\n";
+
+  Bench("browser request", kHttpRequest, kBrowserRequest, n);
+  Bench("response", kHttpResponse, kResponse, n);
+  Bench("cookie request", kHttpRequest, cookie_request, n / 4);
+
+  EV_VERIFY(SetHttpScanner(best) == kEvOK);
+  return 0;
+}
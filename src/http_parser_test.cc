@@ -0,0 +1,410 @@
+/** @file
+ * @brief test the HTTP parser
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "http_parser.h"
+#include "buffer.h"
+#include "ev.h"
+#include "log.h"
+#include "header.h"
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+static const char kRequest[] =
+  "GET /index.html?q=libev HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language:  zh-CN,zh;q=0.8 \t\r\n"
+  "X-Empty:\r\n"
+  "Cookie: a=1; b=2\r\n"
+  "\r\n";
+
+static std::string ToString(const HttpSlice& slice)
+{
+  return std::string(slice.data, slice.size);
+}
+
+// parse the head fed 'step' bytes at a time
+static ssize_t ParseHead(HttpParser * parser, const std::string& data, size_t step)
+{
+  ssize_t n = 0;
+  for (size_t size=step; n == 0; size+=step)
+  {
+    if (size > data.size())
+      size = data.size();
+    n = parser->ParseHead(data.data(), size);
+    if (size == data.size())
+      break;
+  }
+  return n;
+}
+
+// decode the body fed 'step' bytes at a time, the bytes not consumed are fed again
+static std::string ParseBody(HttpParser * parser, const std::string& data, size_t step)
+{
+  std::string body;
+  size_t consumed = 0, fed = 0;
+  HttpSlice slice;
+
+  while (!parser->done())
+  {
+    fed = (fed + step < data.size())?(fed + step):(data.size());
+    for (;;)
+    {
+      ssize_t n = parser->ParseBody(data.data() + consumed, fed - consumed, &slice);
+      EV_VERIFY(n >= 0);
+      if (n == 0)
+        break;
+      body.append(slice.data, slice.size);
+      consumed += (size_t)n;
+    }
+    if (fed == data.size())
+      break;
+  }
+  EV_VERIFY(consumed == data.size());
+  return body;
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: requests with every scanner");
+
+  std::string data(kRequest);
+  int best = GetHttpScanner();
+
+  for (int scanner=kHttpScanScalar; scanner<=kHttpScanAVX2; scanner++)
+  {
+    if (SetHttpScanner(scanner) != kEvOK)
+    {
+      EV_LOG(kInfo, "scanner %d is not supported", scanner);
+      continue;
+    }
+
+    for (size_t step=1; step<=data.size(); step+=(step < 8)?(1):(37))
+    {
+      HttpParser parser(kHttpRequest);
+      EV_VERIFY(ParseHead(&parser, data, step) == (ssize_t)data.size());
+      EV_VERIFY(parser.head_parsed() && parser.done());
+
+      const HttpMessage * message = parser.message();
+      EV_VERIFY(ToString(message->method) == "GET");
+      EV_VERIFY(ToString(message->target) == "/index.html?q=libev");
+      EV_VERIFY(message->minor_version == 1);
+      EV_VERIFY(message->header_count == 6);
+      EV_VERIFY(ToString(message->headers[0].name) == "Host");
+      EV_VERIFY(ToString(message->headers[0].value) == "www.example.com");
+      EV_VERIFY(ToString(message->headers[3].value) == "zh-CN,zh;q=0.8");
+      EV_VERIFY(ToString(message->headers[4].name) == "X-Empty");
+      EV_VERIFY(message->headers[4].value.size == 0);
+      EV_VERIFY(ToString(*FindHttpHeader(message, "cookie")) == "a=1; b=2");
+      EV_VERIFY(FindHttpHeader(message, "content-length") == 0);
+      EV_VERIFY(message->body == kHttpBodyNone);
+      EV_VERIFY(message->keep_alive);
+      // slices point into the data
+      EV_VERIFY(message->method.data == data.data());
+    }
+  }
+  EV_VERIFY(SetHttpScanner(best) == kEvOK);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: response bodies");
+
+  // Content-Length
+  {
+    std::string head("HTTP/1.1 200 OK\r\nContent-Length: 11\r\n\r\n");
+    for (size_t step=1; step<12; step++)
+    {
+      HttpParser parser(kHttpResponse);
+      EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+      const HttpMessage * message = parser.message();
+      EV_VERIFY(message->status == 200 && ToString(message->reason) == "OK");
+      EV_VERIFY(message->body == kHttpBodyLength && message->content_length == 11);
+      EV_VERIFY(ParseBody(&parser, "hello world", step) == "hello world");
+    }
+  }
+
+  // chunked with extensions and trailers
+  {
+    std::string head("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, Chunked\r\n\r\n");
+    std::string body("5;name=value\r\nhello\r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+        "0\r\nX-Trailer: 1\r\n\r\n");
+    for (size_t step=1; step<=body.size(); step++)
+    {
+      HttpParser parser(kHttpResponse);
+      EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+      EV_VERIFY(parser.message()->body == kHttpBodyChunked);
+      EV_VERIFY(parser.message()->keep_alive);
+      EV_VERIFY(ParseBody(&parser, body, step) == "helloabcdefghijklmnopqrstuvwxyz");
+      EV_VERIFY(parser.done());
+    }
+  }
+
+  // both Transfer-Encoding and Content-Length, the connection is closed after the response
+  {
+    std::string head("HTTP/1.1 200 OK\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n");
+    HttpParser parser(kHttpResponse);
+    EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+    EV_VERIFY(parser.message()->body == kHttpBodyChunked);
+    EV_VERIFY(!parser.message()->keep_alive);
+    EV_VERIFY(ParseBody(&parser, "5\r\nhello\r\n0\r\n\r\n", 1) == "hello");
+
+    head = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\nTransfer-Encoding: gzip\r\n\r\n";
+    parser.Reset();
+    EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+    EV_VERIFY(parser.message()->body == kHttpBodyEOF);
+    parser.SkipBody();
+    EV_VERIFY(!parser.message()->keep_alive);
+  }
+
+  // until EOF
+  {
+    std::string head("HTTP/1.0 200 OK\r\nConnection: keep-alive\r\n\r\n");
+    HttpParser parser(kHttpResponse);
+    HttpSlice body;
+    EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+    EV_VERIFY(parser.message()->body == kHttpBodyEOF);
+    EV_VERIFY(!parser.message()->keep_alive);
+    EV_VERIFY(parser.ParseBody("abc", 3, &body) == 3 && body.size == 3);
+    EV_VERIFY(!parser.done());
+    EV_VERIFY(parser.Eof() == kEvOK && parser.done());
+
+    // but not the response to HEAD
+    parser.Reset();
+    EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+    parser.SkipBody();
+    EV_VERIFY(parser.done() && parser.message()->keep_alive);
+  }
+
+  // no body
+  {
+    std::string head("HTTP/1.1 304 Not Modified\r\nContent-Length: 100\r\n\r\n");
+    HttpParser parser(kHttpResponse);
+    EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+    EV_VERIFY(parser.done() && parser.message()->body == kHttpBodyNone);
+
+    head = "HTTP/1.1 200\r\nContent-Length: 5\r\n\r\nabc";
+    parser.Reset();
+    EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size() - 3);
+    EV_VERIFY(parser.message()->reason.size == 0);
+    EV_VERIFY(parser.Eof() == kEvFailure && errno == EPROTO);
+  }
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: pipelined requests in a buffer");
+
+  // small blocks, so that heads span blocks
+  BlockPool pool(512);
+  Buffer buffer(&pool);
+  HttpParser parser(kHttpRequest);
+  std::vector<std::string> targets, bodies;
+
+  std::string data(kRequest);
+  data += "POST /post HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody"
+    "\r\n"// an extra CRLF after a body
+    "PUT /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n"
+    "GET /close HTTP/1.0\r\n\r\n";
+  EV_VERIFY(buffer.Append(data.data(), data.size()) == kEvOK);
+
+  while (!buffer.empty())
+  {
+    // like the input of a stream
+    size_t size = (buffer.size() < pool.block_size())?(buffer.size()):(pool.block_size());
+    const char * p = buffer.Pullup(size);
+    EV_VERIFY(p);
+    ssize_t n = parser.ParseHead(p, size);
+    EV_VERIFY(n > 0);
+    targets.push_back(ToString(parser.message()->target));
+
+    std::string body;
+    HttpSlice slice;
+    size_t offset = (size_t)n;
+    while (!parser.done())
+    {
+      n = parser.ParseBody(p + offset, size - offset, &slice);
+      EV_VERIFY(n > 0);
+      body.append(slice.data, slice.size);
+      offset += (size_t)n;
+    }
+    bodies.push_back(body);
+    if (targets.size() == 4)
+      EV_VERIFY(!parser.message()->keep_alive);
+
+    buffer.Consume(offset);
+    parser.Reset();
+  }
+
+  EV_VERIFY(targets.size() == 4);
+  EV_VERIFY(targets[0] == "/index.html?q=libev" && bodies[0].empty());
+  EV_VERIFY(targets[1] == "/post" && bodies[1] == "body");
+  EV_VERIFY(targets[2] == "/chunked" && bodies[2] == "abc");
+  EV_VERIFY(targets[3] == "/close" && bodies[3].empty());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test4_Fail(int type, const std::string& data, int error)
+{
+  HttpParser parser(type);
+  errno = 0;
+  EV_VERIFY(parser.ParseHead(data.data(), data.size()) == kEvFailure);
+  EV_VERIFY(errno == error);
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: malformed messages");
+
+  Test4_Fail(kHttpRequest, "GET /\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest, "GET / HTTP/2.0\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest, "G(T / HTTP/1.1\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest, "GET / HTTP/1.1\r\nHost : a\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest, "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest, "GET / HTTP/1.1\r\nHost: a\rb\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest, "GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+      EPROTO);
+  Test4_Fail(kHttpRequest, "GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest, "GET / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", EPROTO);
+  // request smuggling
+  Test4_Fail(kHttpRequest,
+      "POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpRequest,
+      "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n", EPROTO);
+  Test4_Fail(kHttpResponse, "HTTP/1.1 20 OK\r\n\r\n", EPROTO);
+
+  std::string many("GET / HTTP/1.1\r\n");
+  for (int i=0; i<=kHttpMaxHeaders; i++)
+    many += "A: b\r\n";
+  many += "\r\n";
+  Test4_Fail(kHttpRequest, many, EMSGSIZE);
+
+  // too large heads
+  HttpParser parser(kHttpRequest);
+  std::string large("GET / HTTP/1.1\r\nA: ");
+  large.append(100, 'x');
+  parser.SetMaxHeadSize(64);
+  EV_VERIFY(parser.ParseHead(large.data(), 60) == 0);
+  EV_VERIFY(parser.ParseHead(large.data(), large.size()) == kEvFailure && errno == EMSGSIZE);
+
+  // bad chunks
+  std::string head("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+  HttpSlice body;
+  parser.Reset();
+  EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+  EV_VERIFY(parser.ParseBody("x\r\n", 3, &body) == kEvFailure && errno == EPROTO);
+  parser.Reset();
+  EV_VERIFY(parser.ParseHead(head.data(), head.size()) == (ssize_t)head.size());
+  EV_VERIFY(parser.ParseBody("1\r\nabc", 6, &body) == 4);
+  EV_VERIFY(parser.ParseBody("bc", 2, &body) == kEvFailure);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+struct Test5_Result
+{
+  ssize_t n;
+  int error;
+  std::vector<std::string> fields;
+};
+
+static Test5_Result Test5_Parse(const std::string& data)
+{
+  HttpParser parser(kHttpRequest);
+  Test5_Result result;
+
+  errno = 0;
+  result.n = parser.ParseHead(data.data(), data.size());
+  result.error = errno;
+  if (result.n > 0)
+  {
+    const HttpMessage * message = parser.message();
+    result.fields.push_back(ToString(message->method));
+    result.fields.push_back(ToString(message->target));
+    for (int i=0; i<message->header_count; i++)
+    {
+      result.fields.push_back(ToString(message->headers[i].name));
+      result.fields.push_back(ToString(message->headers[i].value));
+    }
+  }
+  return result;
+}
+
+static void Test5()
+{
+  EV_LOG(kInfo, "Test 5: all scanners agree on random heads");
+
+  const char alphabet[] = "aZ09-_!~ \t:;\"(),/@[]{}\x01\x7f\x80\xff\r\n";
+  unsigned int seed = 1;
+  int failed = 0;
+  int best = GetHttpScanner();
+
+  // mostly valid bytes, and sometimes any byte
+#define TEST5_BYTE(valid) \
+  alphabet[rand_r(&seed) % ((rand_r(&seed) % 1024)?(valid):(sizeof(alphabet) - 1))]
+
+  for (int i=0; i<20000; i++)
+  {
+    std::string data("GET /");
+    for (int j=rand_r(&seed)%40; j>0; j--)
+      data.push_back(TEST5_BYTE(8));
+    data += " HTTP/1.1\r\n";
+    for (int h=rand_r(&seed)%4; h>=0; h--)
+    {
+      for (int j=rand_r(&seed)%48; j>=0; j--)
+        data.push_back(TEST5_BYTE(8));
+      data += ": ";
+      for (int j=rand_r(&seed)%70; j>0; j--)
+        data.push_back(TEST5_BYTE(sizeof(alphabet) - 7));
+      data += "\r\n";
+    }
+    data += "\r\n";
+
+    EV_VERIFY(SetHttpScanner(kHttpScanScalar) == kEvOK);
+    Test5_Result expected = Test5_Parse(data);
+    if (expected.n < 0)
+      failed++;
+
+    for (int scanner=kHttpScanSSE2; scanner<=kHttpScanAVX2; scanner++)
+    {
+      if (SetHttpScanner(scanner) != kEvOK)
+        continue;
+      Test5_Result result = Test5_Parse(data);
+      EV_VERIFY(result.n == expected.n);
+      EV_VERIFY(result.error == expected.error);
+      EV_VERIFY(result.fields == expected.fields);
+    }
+  }
+  EV_LOG(kInfo, "%d of 20000 heads are malformed", failed);
+  EV_VERIFY(failed > 0 && failed < 20000);
+  EV_VERIFY(SetHttpScanner(best) == kEvOK);
+#undef TEST5_BYTE
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  Test5();
+  return 0;
+}
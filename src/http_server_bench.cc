@@ -0,0 +1,456 @@
+/** @file
+ * @brief benchmark a keep-alive HTTP server with closed- and open-loop load over loopback
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "acceptor.h"
+#include "reactor_group.h"
+#include "stream.h"
+#include "http_parser.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+static const char kRequest[] =
+  "GET /plaintext HTTP/1.1\r\n"
+  "Host: 127.0.0.1\r\n"
+  "User-Agent: http_server_bench\r\n"
+  "Accept: text/plain\r\n"
+  "\r\n";
+
+static const char kResponse[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Server: libev\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 13\r\n"
+  "\r\n"
+  "Hello, World!";
+
+static const double kWarmup = 0.5;// seconds not measured
+static const int64_t kTickMs = 1;// the timer of the open-loop generator
+
+static double Now()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+/************************************************************************/
+// the server, one reactor thread per loop
+struct ServerLoop;
+
+struct ServerConnection
+{
+  ServerLoop * loop;
+  Stream stream;
+  HttpParser parser;
+  std::string output;
+
+  explicit ServerConnection(BlockPool * pool) : stream(pool), parser(kHttpRequest) {}
+};
+
+struct ServerLoop
+{
+  BlockPool pool;// pools are not thread safe
+  std::set<ServerConnection *> connections;
+};
+
+struct Server
+{
+  ReactorGroup group;
+  AcceptorGroup acceptors;
+  std::map<Reactor *, ServerLoop *> loops;// read only after the group starts
+  struct sockaddr_in addr;
+};
+
+static void ServerClose(ServerConnection * conn)
+{
+  int fd = conn->stream.fd();
+  conn->stream.UnInit();
+  safe_close(fd);
+  conn->loop->connections.erase(conn);
+  delete conn;
+}
+
+static void ServerOnStream(Stream * stream, int event, void * user_data)
+{
+  ServerConnection * conn = (ServerConnection *)user_data;
+  Buffer * input = stream->input();
+  size_t block_size = input->pool()->block_size();
+
+  if (!(event & kStreamRead))
+  {
+    if (event & (kStreamEOF|kStreamError))
+      ServerClose(conn);
+    return;
+  }
+
+  // pipelined requests are responded with one write
+  while (!input->empty())
+  {
+    size_t size = (input->size() < block_size)?(input->size()):(block_size);
+    const char * p = input->Pullup(size);
+    ssize_t n = conn->parser.ParseHead(p, size);
+    if (n == 0)
+      break;
+    // requests with bodies are not expected
+    if (n == kEvFailure || !conn->parser.done())
+    {
+      ServerClose(conn);
+      return;
+    }
+    input->Consume((size_t)n);
+    conn->parser.Reset();
+    conn->output.append(kResponse, sizeof(kResponse) - 1);
+  }
+
+  if (!conn->output.empty())
+  {
+    if (conn->stream.Write(conn->output.data(), conn->output.size()) != kEvOK)
+    {
+      ServerClose(conn);
+      return;
+    }
+    conn->output.clear();
+  }
+}
+
+static void ServerOnAccept(Acceptor * acceptor, int fd,
+    const struct sockaddr * /*addr*/, socklen_t /*addrlen*/, void * user_data)
+{
+  Server * server = (Server *)user_data;
+  ServerLoop * loop = server->loops[acceptor->reactor()];
+  ServerConnection * conn = new ServerConnection(&loop->pool);
+  int on = 1;
+
+  (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  conn->loop = loop;
+  if (conn->stream.Init(acceptor->reactor(), fd, ServerOnStream, conn) != kEvOK)
+  {
+    safe_close(fd);
+    delete conn;
+    return;
+  }
+  loop->connections.insert(conn);
+}
+
+static void ServerStart(Server * server, int threads)
+{
+  socklen_t len = sizeof(server->addr);
+
+  EV_VERIFY(server->group.Init(threads) == kEvOK);
+  for (int i=0; i<server->group.size(); i++)
+    server->loops[server->group.At(i)] = new ServerLoop;
+
+  memset(&server->addr, 0, sizeof(server->addr));
+  server->addr.sin_family = AF_INET;
+  server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EV_VERIFY(server->acceptors.Listen(&server->group, (struct sockaddr *)&server->addr,
+        sizeof(server->addr), ServerOnAccept, server) == kEvOK);
+  EV_VERIFY(getsockname(server->acceptors.At(0)->fd(),
+        (struct sockaddr *)&server->addr, &len) == 0);
+  EV_VERIFY(server->group.Start() == kEvOK);
+}
+
+static void ServerStop(Server * server)
+{
+  EV_VERIFY(server->group.Stop() == kEvOK);
+  server->group.Join();
+  server->acceptors.UnInit();
+
+  std::map<Reactor *, ServerLoop *>::iterator it;
+  for (it=server->loops.begin(); it!=server->loops.end(); ++it)
+  {
+    while (!it->second->connections.empty())
+      ServerClose(*it->second->connections.begin());
+    delete it->second;
+  }
+  server->loops.clear();
+  server->group.UnInit();
+}
+
+/************************************************************************/
+// the load generator, in the main thread
+struct Generator;
+
+struct Client
+{
+  Generator * generator;
+  Stream stream;
+  HttpParser parser;
+  std::deque<double> sent;// when the requests in flight are(or are intended to be) sent
+
+  explicit Client(BlockPool * pool) : stream(pool), parser(kHttpResponse) {}
+};
+
+struct Generator
+{
+  Reactor * reactor;
+  std::vector<Client *> clients;
+  int depth;// requests in flight per connection(closed loop)
+  double rate;// requests per second(open loop), 0 for closed loop
+  double next;// when the next request is intended to be sent(open loop)
+  size_t next_client;
+  double begin;// of the measurement
+  double end;
+  std::vector<double> latencies;// of responses received in ['begin', 'end']
+  int errors;
+  int stopped;
+  std::string requests;// 'depth' requests
+};
+
+static void Send(Client * client, int count, double when)
+{
+  Generator * generator = client->generator;
+
+  if (client->stream.Write(generator->requests.data(),
+        (sizeof(kRequest) - 1) * (size_t)count) != kEvOK)
+  {
+    generator->errors++;
+    return;
+  }
+  for (int i=0; i<count; i++)
+    client->sent.push_back(when);
+}
+
+static void ClientOnStream(Stream * stream, int event, void * user_data)
+{
+  Client * client = (Client *)user_data;
+  Generator * generator = client->generator;
+  Buffer * input = stream->input();
+  size_t block_size = input->pool()->block_size();
+  HttpSlice body;
+  int responses = 0;
+  double now = Now();
+
+  if (!(event & kStreamRead))
+  {
+    if ((event & (kStreamEOF|kStreamError)) && !generator->stopped)
+    {
+      EV_LOG(kError, "the server closes a connection: %s", strerror(stream->error()));
+      generator->errors++;
+    }
+    return;
+  }
+
+  while (!input->empty())
+  {
+    size_t size = (input->size() < block_size)?(input->size()):(block_size);
+    const char * p = input->Pullup(size);
+    ssize_t n;
+
+    if (!client->parser.head_parsed())
+      n = client->parser.ParseHead(p, size);
+    else
+      n = client->parser.ParseBody(p, size, &body);
+    EV_VERIFY(n >= 0);
+    if (n == 0)
+      break;
+    input->Consume((size_t)n);
+    if (!client->parser.done())
+      continue;
+
+    EV_VERIFY(client->parser.message()->status == 200);
+    client->parser.Reset();
+    if (now >= generator->begin && now <= generator->end)
+      generator->latencies.push_back(now - client->sent.front());
+    client->sent.pop_front();
+    responses++;
+  }
+
+  // keep 'depth' requests in flight
+  if (responses && generator->rate == 0 && !generator->stopped)
+    Send(client, responses, now);
+}
+
+static void OnTick(int /*fd*/, int /*event*/, void * user_data)
+{
+  Generator * generator = (Generator *)user_data;
+  double now = Now();
+
+  if (now > generator->end)
+  {
+    generator->stopped = 1;
+    return;
+  }
+
+  // requests are due by the schedule, however late the responses are,
+  // so that the latencies include the queueing(no coordinated omission)
+  if (generator->rate == 0)
+    return;
+  while (generator->next <= now)
+  {
+    Client * client = generator->clients[generator->next_client++ % generator->clients.size()];
+    Send(client, 1, generator->next);
+    generator->next += 1 / generator->rate;
+  }
+}
+
+static double Percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0.0;
+  size_t index = (size_t)(p * (double)(sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+// return requests per second
+static double Bench(const Server * server, int connections, int depth, double rate,
+    double duration)
+{
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Generator generator;
+  Event tick;
+  char name[64];
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  generator.reactor = reactor.get();
+  generator.depth = depth;
+  generator.rate = rate;
+  generator.next_client = 0;
+  generator.errors = 0;
+  generator.stopped = 0;
+  for (int i=0; i<depth; i++)
+    generator.requests.append(kRequest, sizeof(kRequest) - 1);
+
+  for (int i=0; i<connections; i++)
+  {
+    Client * client = new Client(&pool);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+
+    EV_VERIFY(fd != -1);
+    EV_VERIFY(connect(fd, (const struct sockaddr *)&server->addr, sizeof(server->addr)) == 0);
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    client->generator = &generator;
+    EV_VERIFY(client->stream.Init(reactor.get(), fd, ClientOnStream, client) == kEvOK);
+    generator.clients.push_back(client);
+  }
+
+  tick.event = kEvTimer|kEvPersist;
+  tick.interval.tv_sec = 0;
+  tick.interval.tv_nsec = kTickMs * 1000000;
+  tick.callback = OnTick;
+  tick.user_data = &generator;
+  EV_VERIFY(reactor->AddTimer(&tick, kTickMs) == kEvOK);
+
+  double start = Now();
+  generator.begin = start + kWarmup;
+  generator.end = generator.begin + duration;
+  generator.next = start;
+  if (rate == 0)
+  {
+    for (int i=0; i<connections; i++)
+      Send(generator.clients[(size_t)i], depth, start);
+  }
+
+  while (!generator.stopped)
+    (void)reactor->RunOne();
+
+  std::vector<double>& latencies = generator.latencies;
+  std::sort(latencies.begin(), latencies.end());
+  double throughput = (double)latencies.size() / duration;
+
+  if (rate == 0)
+    snprintf(name, sizeof(name), "closed loop, depth %d", depth);
+  else
+    snprintf(name, sizeof(name), "open loop, %.0f req/s", rate);
+  printf("%-28s %4d connections: %9.0f req/s, latency(us) p50 %7.1f p90 %7.1f"
+      " p99 %7.1f p99.9 %7.1f max %7.1f%s\n",
+      name, connections, throughput,
+      Percentile(latencies, 0.5) * 1e6, Percentile(latencies, 0.9) * 1e6,
+      Percentile(latencies, 0.99) * 1e6, Percentile(latencies, 0.999) * 1e6,
+      Percentile(latencies, 1.0) * 1e6, (generator.errors)?(", ERRORS"):(""));
+
+  (void)tick.Del();
+  for (size_t i=0; i<generator.clients.size(); i++)
+  {
+    Client * client = generator.clients[i];
+    int fd = client->stream.fd();
+    client->stream.UnInit();
+    safe_close(fd);
+    delete client;
+  }
+  return throughput;
+}
+
+static void Usage()
+{
+  printf("usage: http_server_bench [-c connections] [-p depth] [-r rate] [-d seconds] [-t threads]\n"
+      "  -c: connections(64 by default)\n"
+      "  -p: requests in flight per connection(closed loop, 1 by default)\n"
+      "  -r: requests per second(open loop, closed loop by default)\n"
+      "  -d: seconds measured after %.1fs warmup(3 by default)\n"
+      "  -t: server threads(1 by default)\n"
+      "without options, closed loops with depth 1 and 16 are measured,\n"
+      "and an open loop at half of the throughput with depth 1\n", kWarmup);
+}
+
+int main(int argc, char ** argv)
+{
+  Server server;
+  int connections = 64, depth = 1, threads = 1;
+  double rate = 0, duration = 3;
+  int opt, custom = 0;
+
+  GlobalLog().SetLevel(kWarning);
+  signal(SIGPIPE, SIG_IGN);
+
+  while ((opt = getopt(argc, argv, "c:p:r:d:t:h")) != -1)
+  {
+    custom = 1;
+    switch (opt)
+    {
+      case 'c':
+        connections = atoi(optarg);
+        break;
+      case 'p':
+        depth = atoi(optarg);
+        break;
+      case 'r':
+        rate = atof(optarg);
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      default:
+        Usage();
+        return 1;
+    }
+  }
+  if (connections <= 0 || depth <= 0 || rate < 0 || duration <= 0 || threads <= 0)
+  {
+    Usage();
+    return 1;
+  }
+
+  ServerStart(&server, threads);
+  if (custom)
+  {
+    (void)Bench(&server, connections, depth, rate, duration);
+  }
+  else
+  {
+    double throughput = Bench(&server, connections, 1, 0, duration);
+    (void)Bench(&server, connections, 16, 0, duration);
+    (void)Bench(&server, connections, 1, throughput / 2, duration);
+  }
+  ServerStop(&server);
+  return 0;
+}
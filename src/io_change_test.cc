@@ -0,0 +1,330 @@
+/** @file
+ * @brief test deferred changes of io events
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+
+using namespace libev;
+
+// count epoll_ctl calls made by the reactor
+static int epoll_ctl_calls;
+
+extern "C" int epoll_ctl(int epfd, int op, int fd, struct epoll_event * event)
+{
+  epoll_ctl_calls++;
+  return (int)syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+
+static const int kTimes = 100;
+static int counter;
+
+struct Test0_Helper
+{
+  Reactor * reactor;
+  Event ev_in;
+  Event ev_out;
+  int fd[2];
+};
+
+static void Test0_InCallback(int fd, int event, void * /*user_data*/)
+{
+  char c;
+
+  EV_VERIFY(event & kEvIn);
+  EV_VERIFY(read(fd, &c, 1) == 1);
+}
+
+static void Test0_OutCallback(int /*fd*/, int event, void * user_data)
+{
+  Test0_Helper * helper = (Test0_Helper *)user_data;
+
+  EV_VERIFY(event & kEvOut);
+  if (++counter < kTimes)
+  {
+    // re-add the non-persistent event
+    EV_VERIFY(helper->reactor->Add(&helper->ev_out) == kEvOK);
+    EV_VERIFY(write(helper->fd[1], "x", 1) == 1);
+  }
+  else
+  {
+    // stop the persistent event
+    EV_VERIFY(helper->ev_in.Del() == kEvOK);
+  }
+}
+
+static void Test0()
+{
+  EV_LOG(kInfo, "Test 0: re-adding events costs no epoll_ctl if the fd stays registered");
+
+  counter = 0;
+  epoll_ctl_calls = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Test0_Helper helper;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  int init_calls = epoll_ctl_calls;
+
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, helper.fd) == 0);
+  helper.reactor = reactor.get();
+  helper.ev_in.fd = helper.fd[0];
+  helper.ev_in.event = kEvIn|kEvPersist;
+  helper.ev_in.callback = Test0_InCallback;
+  helper.ev_in.user_data = &helper;
+  helper.ev_out.fd = helper.fd[0];
+  helper.ev_out.event = kEvOut;
+  helper.ev_out.callback = Test0_OutCallback;
+  helper.ev_out.user_data = &helper;
+
+  EV_VERIFY(reactor->Add(&helper.ev_in) == kEvOK);
+  EV_VERIFY(reactor->Add(&helper.ev_out) == kEvOK);
+  (void)reactor->Run();
+  EV_VERIFY(counter == kTimes);
+  reactor.reset();
+
+  // ADD(EPOLLIN), MOD(EPOLLIN|EPOLLOUT), DEL
+  EV_LOG(kInfo, "epoll_ctl calls: %d", epoll_ctl_calls - init_calls);
+  EV_VERIFY(epoll_ctl_calls - init_calls == 3);
+
+  safe_close(helper.fd[0]);
+  safe_close(helper.fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+struct Test1_Helper
+{
+  Reactor * reactor;
+  Event ev;
+  int fd[2];
+};
+
+static void Test1_Callback(int fd, int event, void * user_data)
+{
+  Test1_Helper * helper = (Test1_Helper *)user_data;
+  char c;
+
+  EV_VERIFY(event & kEvIn);
+  EV_VERIFY(read(fd, &c, 1) == 1);
+
+  if (++counter < kTimes)
+  {
+    // re-add the non-persistent event
+    EV_VERIFY(helper->reactor->Add(&helper->ev) == kEvOK);
+    EV_VERIFY(write(helper->fd[1], "x", 1) == 1);
+  }
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: re-adding a non-persistent event inside its callback costs no epoll_ctl");
+
+  counter = 0;
+  epoll_ctl_calls = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Test1_Helper helper;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  int init_calls = epoll_ctl_calls;
+
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, helper.fd) == 0);
+  helper.reactor = reactor.get();
+  helper.ev.fd = helper.fd[0];
+  helper.ev.event = kEvIn;
+  helper.ev.callback = Test1_Callback;
+  helper.ev.user_data = &helper;
+
+  EV_VERIFY(reactor->Add(&helper.ev) == kEvOK);
+  EV_VERIFY(write(helper.fd[1], "x", 1) == 1);
+  (void)reactor->Run();
+  EV_VERIFY(counter == kTimes);
+  reactor.reset();
+
+  // ADD, and DEL after the last callback not re-adding it
+  EV_LOG(kInfo, "epoll_ctl calls: %d", epoll_ctl_calls - init_calls);
+  EV_VERIFY(epoll_ctl_calls - init_calls == 2);
+
+  safe_close(helper.fd[0]);
+  safe_close(helper.fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+struct Test2_Helper
+{
+  Reactor * reactor;
+  Event ev;
+  Event ev_new;
+  int fd[2];
+};
+
+static void Test2_NewCallback(int fd, int event, void * /*user_data*/)
+{
+  char c;
+
+  EV_LOG(kInfo, "Test2_NewCallback");
+  EV_VERIFY(event & kEvIn);
+  EV_VERIFY(read(fd, &c, 1) == 1);
+  EV_VERIFY(c == 'y');
+  counter++;
+}
+
+static void Test2_Callback(int fd, int event, void * user_data)
+{
+  Test2_Helper * helper = (Test2_Helper *)user_data;
+
+  EV_LOG(kInfo, "Test2_Callback");
+  EV_VERIFY(event & kEvIn);
+  counter++;
+
+  // close the fd and reuse its number inside one loop iteration
+  safe_close(helper->fd[0]);
+  safe_close(helper->fd[1]);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, helper->fd) == 0);
+  EV_VERIFY(helper->fd[0] == fd);
+
+  helper->ev_new.fd = helper->fd[0];
+  helper->ev_new.event = kEvIn;
+  helper->ev_new.callback = Test2_NewCallback;
+  helper->ev_new.user_data = helper;
+  EV_VERIFY(helper->reactor->Add(&helper->ev_new) == kEvOK);
+  EV_VERIFY(write(helper->fd[1], "y", 1) == 1);
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: close an fd and reuse its number inside a callback");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Test2_Helper helper;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, helper.fd) == 0);
+  helper.reactor = reactor.get();
+  helper.ev.fd = helper.fd[0];
+  helper.ev.event = kEvIn;
+  helper.ev.callback = Test2_Callback;
+  helper.ev.user_data = &helper;
+
+  EV_VERIFY(reactor->Add(&helper.ev) == kEvOK);
+  EV_VERIFY(write(helper.fd[1], "x", 1) == 1);
+  (void)reactor->Run();
+  EV_VERIFY(counter == 2);
+
+  reactor.reset();
+  safe_close(helper.fd[0]);
+  safe_close(helper.fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test3_Callback(int /*fd*/, int /*event*/, void * /*user_data*/)
+{
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: adding an unsupported fd fails immediately");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  int fd = open("/dev/null", O_RDONLY);
+  EV_VERIFY(fd != -1);
+  Event ev(fd, kEvIn, Test3_Callback, 0);
+
+  // regular files and /dev/null do not support epoll
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(reactor->Add(&ev) == kEvFailure);
+  EV_VERIFY(errno == EPERM);
+
+  reactor.reset();
+  safe_close(fd);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test4_Callback(int fd, int event, void * user_data)
+{
+  char c;
+
+  EV_VERIFY(event & kEvIn);
+  EV_VERIFY(read(fd, &c, 1) == 1);
+  (*(int *)user_data)++;
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: close an fd right after deleting its event while its file is shared");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  int fd[2];
+  int calls = 0;
+  char buf[8];
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == 0);
+  // the file stays open through 'shared'
+  int shared = dup(fd[0]);
+  EV_VERIFY(shared != -1);
+  int polled = dup(fd[0]);
+  EV_VERIFY(polled != -1);
+  Event ev(polled, kEvIn|kEvPersist, Test4_Callback, &calls);
+
+  EV_VERIFY(reactor->Add(&ev) == kEvOK);
+  EV_VERIFY(write(fd[1], "x", 1) == 1);
+  EV_VERIFY(reactor->Poll() == 1);
+  EV_VERIFY(calls == 1);
+
+  EV_VERIFY(ev.Del() == kEvOK);
+  safe_close(polled);
+  EV_VERIFY(write(fd[1], "y", 1) == 1);
+  EV_VERIFY(reactor->Poll() == 0);
+  EV_VERIFY(reactor->Poll() == 0);
+  EV_VERIFY(calls == 1);
+
+  // a non-persistent event not re-added is unregistered after its callback
+  EV_VERIFY(read(shared, buf, sizeof(buf)) == 1);
+  polled = dup(fd[0]);
+  EV_VERIFY(polled != -1);
+  Event once(polled, kEvIn, Test4_Callback, &calls);
+  EV_VERIFY(reactor->Add(&once) == kEvOK);
+  EV_VERIFY(write(fd[1], "z", 1) == 1);
+  EV_VERIFY(reactor->Poll() == 1);
+  EV_VERIFY(calls == 2);
+  safe_close(polled);
+  // a stale registration would be found ready and unregistered
+  int ctl_calls = epoll_ctl_calls;
+  EV_VERIFY(write(fd[1], "w", 1) == 1);
+  EV_VERIFY(reactor->Poll() == 0);
+  EV_VERIFY(calls == 2);
+  EV_VERIFY(epoll_ctl_calls == ctl_calls);
+
+  reactor.reset();
+  safe_close(shared);
+  safe_close(fd[0]);
+  safe_close(fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test0();
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  return 0;
+}
@@ -0,0 +1,488 @@
+/** @file
+ * @brief refcounted buffer chains of slab blocks
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "iobuf.h"
+#include "ev.h"
+#include "log.h"
+#include "header.h"
+
+namespace libev {
+
+  IOBufPool::IOBufPool(size_t block_size, size_t blocks_per_slab)
+    : block_size_(block_size), blocks_per_slab_(blocks_per_slab),
+    free_(0), free_count_(0), remote_(0), owner_(pthread_self())
+  {
+    EV_ASSERT(block_size_ != 0);
+    EV_ASSERT(blocks_per_slab_ != 0);
+    // keep blocks cache line aligned
+    stride_ = (ev_offsetof(IOBufBlock, data) + block_size_ + 63) & ~(size_t)63;
+  }
+
+  IOBufPool::~IOBufPool()
+  {
+    Reclaim();
+    EV_ASSERT(free_count_ == capacity());
+    for (size_t i=0; i<slabs_.size(); i++)
+      free(slabs_[i]);
+  }
+
+  void IOBufPool::Bind()
+  {
+    owner_ = pthread_self();
+  }
+
+  int IOBufPool::Grow()
+  {
+    char * slab;
+    if (posix_memalign((void **)&slab, 64, stride_ * blocks_per_slab_) != 0)
+      return kEvNoMemory;
+
+    try
+    {
+      slabs_.push_back(slab);// may throw(caught)
+    }
+    catch (...)
+    {
+      free(slab);
+      return kEvNoMemory;
+    }
+
+    for (size_t i=blocks_per_slab_; i>0; i--)
+    {
+      IOBufBlock * block = (IOBufBlock *)(slab + (i - 1) * stride_);
+      block->pool = this;
+      block->next = free_;
+      free_ = block;
+    }
+    free_count_ += blocks_per_slab_;
+    EV_LOG(kDebug, "IOBufPool(%p) has %lu blocks", this, (unsigned long)capacity());
+    return kEvOK;
+  }
+
+  IOBufBlock * IOBufPool::Get()
+  {
+    EV_ASSERT(pthread_equal(owner_, pthread_self()));
+
+    if (free_ == 0)
+    {
+      Reclaim();
+      if (free_ == 0 && Grow() != kEvOK)
+        return 0;
+    }
+
+    IOBufBlock * block = free_;
+    free_ = block->next;
+    free_count_--;
+    block->next = 0;
+    block->refs = 1;
+    block->used = 0;
+    return block;
+  }
+
+  void IOBufPool::Put(IOBufBlock * block)
+  {
+    EV_ASSERT(block->pool == this);
+
+    if (pthread_equal(owner_, pthread_self()))
+    {
+      block->next = free_;
+      free_ = block;
+      free_count_++;
+      return;
+    }
+
+    // push to the lock free list, it is popped only as a whole by 'Reclaim'
+    IOBufBlock * head;
+    do
+    {
+      head = __atomic_load_n(&remote_, __ATOMIC_RELAXED);
+      block->next = head;
+    }
+    while (!__sync_bool_compare_and_swap(&remote_, head, block));
+  }
+
+  void IOBufPool::Reclaim()
+  {
+    IOBufBlock * block = __sync_lock_test_and_set(&remote_, (IOBufBlock *)0);
+    IOBufBlock * next;
+
+    for (; block; block = next)
+    {
+      next = block->next;
+      block->next = free_;
+      free_ = block;
+      free_count_++;
+    }
+  }
+
+
+  /************************************************************************/
+  IOBuf::IOBuf(IOBufPool * pool)
+    : pool_(pool), head_(0), size_(0), spare_count_(0)
+  {
+  }
+
+  IOBuf::~IOBuf()
+  {
+    Clear();
+    ReleaseSpare(0);
+  }
+
+  char * IOBuf::Tail(size_t * size)
+  {
+    if (head_ == segments_.size())
+      return 0;
+
+    Segment * tail = &segments_.back();
+    IOBufBlock * block = tail->block;
+    if (tail->end != block->used || block->used == pool_->block_size()
+        || __atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) != 1)
+      return 0;
+
+    *size = pool_->block_size() - block->used;
+    return block->data + block->used;
+  }
+
+  size_t IOBuf::Find(size_t * offset)const
+  {
+    size_t i = head_;
+    while (*offset && *offset >= segments_[i].end - segments_[i].begin)
+    {
+      *offset -= segments_[i].end - segments_[i].begin;
+      i++;
+    }
+    return i;
+  }
+
+  int IOBuf::Push(IOBufBlock * block, size_t begin, size_t end)
+  {
+    Segment segment;
+    segment.block = block;
+    segment.begin = begin;
+    segment.end = end;
+
+    try
+    {
+      segments_.push_back(segment);// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+    size_ += end - begin;
+    return kEvOK;
+  }
+
+  void IOBuf::ReleaseSpare(int from)
+  {
+    for (int i=from; i<spare_count_; i++)
+      IOBufPool::UnRef(spare_[i]);
+    spare_count_ = from;
+  }
+
+  int IOBuf::Append(const void * data, size_t size)
+  {
+    const char * p = (const char *)data;
+    char * tail;
+    size_t n;
+
+    while (size)
+    {
+      tail = Tail(&n);
+      if (tail == 0)
+      {
+        IOBufBlock * block = pool_->Get();
+        if (block == 0)
+          return kEvNoMemory;
+        if (Push(block, 0, 0) != kEvOK)
+        {
+          IOBufPool::UnRef(block);
+          return kEvNoMemory;
+        }
+        continue;
+      }
+
+      if (n > size)
+        n = size;
+      memcpy(tail, p, n);
+      segments_.back().block->used += n;
+      segments_.back().end += n;
+      size_ += n;
+      p += n;
+      size -= n;
+    }
+    return kEvOK;
+  }
+
+  int IOBuf::Append(const IOBuf& other)
+  {
+    // 'other' may be this
+    size_t begin = other.head_;
+    size_t end = other.segments_.size();
+
+    try
+    {
+      segments_.reserve(segments_.size() + (end - begin));// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+
+    for (size_t i=begin; i<end; i++)
+    {
+      Segment segment = other.segments_[i];
+      IOBufPool::Ref(segment.block);
+      (void)Push(segment.block, segment.begin, segment.end);
+    }
+    return kEvOK;
+  }
+
+  int IOBuf::Slice(size_t offset, size_t size, IOBuf * to)const
+  {
+    EV_ASSERT(offset + size <= size_);
+    if (size == 0)
+      return kEvOK;
+
+    // find the segments
+    size_t first = Find(&offset);
+
+    size_t last = first;
+    size_t n = offset + size;
+    while (n > segments_[last].end - segments_[last].begin)
+    {
+      n -= segments_[last].end - segments_[last].begin;
+      last++;
+    }
+
+    // 'to' may be this
+    try
+    {
+      to->segments_.reserve(to->segments_.size() + (last - first + 1));// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+
+    for (size_t i=first; i<=last && size; i++)
+    {
+      Segment segment = segments_[i];
+      if (i == first)
+        segment.begin += offset;
+      if (segment.end - segment.begin > size)
+        segment.end = segment.begin + size;
+      size -= segment.end - segment.begin;
+      IOBufPool::Ref(segment.block);
+      (void)to->Push(segment.block, segment.begin, segment.end);
+    }
+    return kEvOK;
+  }
+
+  size_t IOBuf::Copy(void * data, size_t size, size_t offset)const
+  {
+    char * p = (char *)data;
+    size_t copied = 0;
+    size_t n;
+
+    if (offset >= size_)
+      return 0;
+
+    for (size_t i=Find(&offset); i<segments_.size() && copied < size; i++)
+    {
+      const Segment& segment = segments_[i];
+      n = segment.end - segment.begin - offset;
+      if (n > size - copied)
+        n = size - copied;
+      memcpy(p + copied, segment.block->data + segment.begin + offset, n);
+      copied += n;
+      offset = 0;
+    }
+    return copied;
+  }
+
+  const char * IOBuf::Peek(size_t offset, size_t size)const
+  {
+    EV_ASSERT(size > 0 && offset + size <= size_);
+    size_t i = Find(&offset);
+    const Segment& segment = segments_[i];
+    if (segment.end - segment.begin - offset < size)
+      return 0;
+    return segment.block->data + segment.begin + offset;
+  }
+
+  void IOBuf::Consume(size_t size)
+  {
+    EV_ASSERT(size <= size_);
+    size_t n;
+
+    while (size)
+    {
+      Segment * segment = &segments_[head_];
+      n = segment->end - segment->begin;
+      if (n > size)
+      {
+        segment->begin += size;
+        size_ -= size;
+        break;
+      }
+
+      size_ -= n;
+      size -= n;
+      if (head_ + 1 == segments_.size())
+      {
+        // keep the last segment for later appending
+        segment->begin = segment->end;
+        break;
+      }
+
+      IOBufPool::UnRef(segment->block);
+      head_++;
+    }
+
+    // drop consumed segments
+    if (head_ >= 16 && head_ * 2 >= segments_.size())
+    {
+      segments_.erase(segments_.begin(), segments_.begin() + head_);
+      head_ = 0;
+    }
+  }
+
+  void IOBuf::Truncate(size_t size)
+  {
+    EV_ASSERT(size <= size_);
+    size_t drop = size_ - size;
+    size_t n;
+
+    while (drop)
+    {
+      Segment * segment = &segments_.back();
+      IOBufBlock * block = segment->block;
+      n = segment->end - segment->begin;
+      if (n > drop || head_ + 1 == segments_.size())
+      {
+        // keep the last segment for later appending
+        if (n > drop)
+          n = drop;
+        // the space may be written again if it is not shared
+        if (segment->end == block->used && __atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) == 1)
+          block->used -= n;
+        segment->end -= n;
+        size_ -= n;
+        return;
+      }
+
+      size_ -= n;
+      drop -= n;
+      IOBufPool::UnRef(block);
+      segments_.pop_back();
+    }
+  }
+
+  void IOBuf::Clear()
+  {
+    for (size_t i=head_; i<segments_.size(); i++)
+      IOBufPool::UnRef(segments_[i].block);
+    segments_.clear();
+    head_ = 0;
+    size_ = 0;
+  }
+
+  int IOBuf::GetIovec(struct iovec * iov, int iovcnt)const
+  {
+    int i = 0;
+    for (size_t j=head_; j<segments_.size() && i < iovcnt; j++)
+    {
+      const Segment& segment = segments_[j];
+      if (segment.end == segment.begin)
+        continue;
+      iov[i].iov_base = (void *)(segment.block->data + segment.begin);
+      iov[i].iov_len = segment.end - segment.begin;
+      i++;
+    }
+    return i;
+  }
+
+  int IOBuf::Prepare(size_t size, struct iovec * iov, int iovcnt)
+  {
+    EV_ASSERT(spare_count_ == 0);
+    EV_ASSERT(iovcnt > 0);
+
+    size_t block_size = pool_->block_size();
+    size_t prepared = 0;
+    size_t n;
+    char * tail;
+    int i = 0;
+
+    if ((tail = Tail(&n)) != 0)
+    {
+      iov[i].iov_base = tail;
+      iov[i].iov_len = n;
+      prepared += n;
+      i++;
+    }
+
+    while (prepared < size && i < iovcnt && spare_count_ < (int)(sizeof(spare_) / sizeof(spare_[0])))
+    {
+      IOBufBlock * block = pool_->Get();
+      if (block == 0)
+      {
+        ReleaseSpare(0);
+        return kEvNoMemory;
+      }
+      spare_[spare_count_++] = block;
+      iov[i].iov_base = block->data;
+      iov[i].iov_len = block_size;
+      prepared += block_size;
+      i++;
+    }
+
+    // so that 'Commit' does not fail
+    try
+    {
+      segments_.reserve(segments_.size() + spare_count_);// may throw(caught)
+    }
+    catch (...)
+    {
+      ReleaseSpare(0);
+      return kEvNoMemory;
+    }
+    return i;
+  }
+
+  void IOBuf::Commit(size_t size)
+  {
+    size_t block_size = pool_->block_size();
+    size_t n;
+    char * tail;
+    int used = 0;
+
+    if ((tail = Tail(&n)) != 0)
+    {
+      if (n > size)
+        n = size;
+      segments_.back().block->used += n;
+      segments_.back().end += n;
+      size_ += n;
+      size -= n;
+    }
+
+    while (size)
+    {
+      EV_ASSERT(used < spare_count_);
+      IOBufBlock * block = spare_[used++];
+      n = (size < block_size)?(size):(block_size);
+      block->used = n;
+      (void)Push(block, 0, n);
+      size -= n;
+    }
+
+    // release spare blocks not written
+    ReleaseSpare(used);
+    spare_count_ = 0;
+  }
+}
@@ -0,0 +1,169 @@
+/** @file
+ * @brief refcounted buffer chains of slab blocks
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_IOBUF_H
+#define LIBEV_IOBUF_H
+
+#include "ev-internal.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <vector>
+
+namespace libev {
+
+  class IOBufPool;
+
+  // a refcounted block, whose data may be shared by many IOBuf
+  struct IOBufBlock
+  {
+    IOBufPool * pool;
+    IOBufBlock * next;// in a free list
+    int refs;// modified atomically
+    size_t used;// bytes written, which are immutable once shared
+    char data[1];
+  };
+
+  // fixed size blocks carved from slabs, which is to be shared by IOBuf of one reactor.
+  // Blocks are got in the owner thread(the constructing thread, or the one calling 'Bind'),
+  // but may be released in any thread:
+  // a block released in other threads is pushed to a lock free list,
+  // and is reclaimed by the owner thread when its own free list is empty.
+  // The pool must outlive all its blocks.
+  class IOBufPool
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(IOBufPool);
+
+      size_t block_size_;
+      size_t stride_;// bytes of a block in a slab
+      size_t blocks_per_slab_;
+      std::vector<char *> slabs_;
+      IOBufBlock * free_;
+      size_t free_count_;
+      IOBufBlock * remote_;// released by other threads, modified atomically
+      pthread_t owner_;
+
+      int Grow();
+
+    public:
+      explicit IOBufPool(size_t block_size = 16384, size_t blocks_per_slab = 64);
+      ~IOBufPool();
+
+      // the calling thread becomes the owner(e.g. the thread running the reactor)
+      void Bind();
+
+      size_t block_size()const {return block_size_;}
+      // the number of blocks carved
+      size_t capacity()const {return slabs_.size() * blocks_per_slab_;}
+      // the number of free blocks of the owner thread,
+      // blocks released by other threads are not counted until reclaimed
+      size_t free_count()const {return free_count_;}
+
+      // return a block with 1 reference, or 0 if no memory
+      IOBufBlock * Get();
+      // it may be called from any thread
+      void Put(IOBufBlock * block);
+      // take back blocks released by other threads
+      void Reclaim();
+
+      static void Ref(IOBufBlock * block)
+      {
+        (void)__sync_add_and_fetch(&block->refs, 1);
+      }
+      // it may be called from any thread
+      static void UnRef(IOBufBlock * block)
+      {
+        if (__sync_sub_and_fetch(&block->refs, 1) == 0)
+          block->pool->Put(block);
+      }
+  };
+
+  // a chain of segments of refcounted blocks.
+  // 'Clone' and 'Slice' share blocks instead of copying data,
+  // so that one message may be sent to many streams,
+  // shared bytes are never written again.
+  // An IOBuf is not thread safe, but its clones may be used and released in other threads.
+  class IOBuf
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(IOBuf);
+
+      struct Segment
+      {
+        IOBufBlock * block;
+        size_t begin;
+        size_t end;
+      };
+
+      IOBufPool * pool_;
+      std::vector<Segment> segments_;
+      size_t head_;// the first segment not consumed
+      size_t size_;
+      IOBufBlock * spare_[4];// blocks prepared by 'Prepare'
+      int spare_count_;
+
+      // return the free space after the last segment, which may be written
+      // if its block is not shared, or 0
+      char * Tail(size_t * size);
+      // return the index of the segment containing 'offset',
+      // '*offset' is set to the offset in the segment
+      size_t Find(size_t * offset)const;
+      // append a segment of 'block', whose reference is taken
+      int Push(IOBufBlock * block, size_t begin, size_t end);
+      void ReleaseSpare(int from);
+
+    public:
+      explicit IOBuf(IOBufPool * pool);
+      ~IOBuf();
+
+      size_t size()const {return size_;}
+      bool empty()const {return size_ == 0;}
+      IOBufPool * pool()const {return pool_;}
+      // the number of segments
+      size_t count()const {return segments_.size() - head_;}
+      // the number of segments stored, including consumed ones not dropped yet
+      size_t segments()const {return segments_.size();}
+
+      // append 'size' bytes of 'data'
+      // return kEvOK or kEvNoMemory
+      int Append(const void * data, size_t size);
+      // append all data of 'other' without copying it
+      // return kEvOK or kEvNoMemory
+      int Append(const IOBuf& other);
+      // append 'size' bytes of 'other' from 'offset' to 'to' without copying them
+      // return kEvOK, or kEvNoMemory
+      int Slice(size_t offset, size_t size, IOBuf * to)const;
+      // append all data to 'to' without copying it
+      int Clone(IOBuf * to)const {return to->Append(*this);}
+
+      // copy at most 'size' bytes from 'offset' to 'data' without consuming them
+      // return the number of bytes copied
+      size_t Copy(void * data, size_t size, size_t offset = 0)const;
+      // return the 'size' bytes from 'offset' if they are contiguous, or 0
+      const char * Peek(size_t offset, size_t size)const;
+      // discard the first 'size' bytes
+      void Consume(size_t size);
+      // discard all but the first 'size' bytes(e.g. to roll back failed appends)
+      void Truncate(size_t size);
+      void Clear();
+
+      // fill at most 'iovcnt' 'iov' with the data(e.g. for writev)
+      // return the number of 'iov' filled
+      int GetIovec(struct iovec * iov, int iovcnt)const;
+
+      // fill 'iov' with free space of at least 'size' bytes(e.g. for readv),
+      // at most 'iovcnt'(<= 4 + 1) 'iov' are filled,
+      // 'Commit' must be called after the space is written.
+      // return the number of 'iov' filled, or kEvNoMemory
+      int Prepare(size_t size, struct iovec * iov, int iovcnt);
+      // 'size' bytes of the space prepared have been written
+      void Commit(size_t size);
+  };
+}
+
+#endif
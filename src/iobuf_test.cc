@@ -0,0 +1,303 @@
+/** @file
+ * @brief test refcounted buffer chains
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "iobuf.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+static std::string ToString(const IOBuf& buf)
+{
+  std::string s(buf.size(), '\0');
+  if (!s.empty())
+    EV_VERIFY(buf.Copy(&s[0], s.size()) == s.size());
+  return s;
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: append, consume and iovec");
+
+  IOBufPool pool(16, 4);
+  std::string data;
+  struct iovec iov[16];
+  int fds[2];
+
+  for (int i=0; i<100; i++)
+    data.push_back((char)('a' + i % 26));
+
+  {
+    IOBuf buf(&pool);
+    EV_VERIFY(buf.Slice(0, 0, &buf) == kEvOK);
+
+    // append across blocks
+    EV_VERIFY(buf.Append(data.data(), data.size()) == kEvOK);
+    EV_VERIFY(buf.size() == data.size());
+    EV_VERIFY(buf.count() == 7);
+    EV_VERIFY(buf.GetIovec(iov, 16) == 7);
+    EV_VERIFY(ToString(buf) == data);
+    EV_VERIFY(pool.capacity() == 8);
+    EV_VERIFY(pool.free_count() == 1);
+
+    // peek and copy from an offset
+    char tmp[30];
+    EV_VERIFY(memcmp(buf.Peek(20, 12), data.data() + 20, 12) == 0);
+    EV_VERIFY(buf.Peek(20, 13) == 0);
+    EV_VERIFY(buf.Copy(tmp, 30, 60) == 30);
+    EV_VERIFY(memcmp(tmp, data.data() + 60, 30) == 0);
+    EV_VERIFY(buf.Copy(tmp, 30, 90) == 10);
+
+    buf.Consume(30);
+    EV_VERIFY(buf.size() == 70);
+    EV_VERIFY(ToString(buf) == data.substr(30));
+    EV_VERIFY(pool.free_count() == 2);
+
+    // write with writev, and read back with readv
+    EV_VERIFY(pipe(fds) == 0);
+    int iovcnt = buf.GetIovec(iov, 16);
+    EV_VERIFY(writev(fds[1], iov, iovcnt) == 70);
+    buf.Consume(70);
+    EV_VERIFY(buf.empty());
+    EV_VERIFY(buf.count() == 1);// the last one is kept for appending
+
+    iovcnt = buf.Prepare(70, iov, 16);
+    EV_VERIFY(iovcnt == 5);// 12 bytes left in the last block, and 4 more blocks
+    EV_VERIFY(readv(fds[0], iov, iovcnt) == 70);
+    buf.Commit(70);
+    EV_VERIFY(buf.size() == 70);
+    EV_VERIFY(ToString(buf) == data.substr(30));
+    safe_close(fds[0]);
+    safe_close(fds[1]);
+
+    // spare blocks not written are returned
+    EV_VERIFY(buf.Prepare(100, iov, 16) > 0);
+    buf.Commit(0);
+    EV_VERIFY(buf.size() == 70);
+  }
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  // truncated segments are released, and the space not shared is reused
+  {
+    IOBuf buf(&pool);
+    EV_VERIFY(buf.Append(data.data(), 20) == kEvOK);
+    EV_VERIFY(buf.Append(data.data(), data.size()) == kEvOK);
+    buf.Truncate(20);
+    EV_VERIFY(buf.size() == 20);
+    EV_VERIFY(ToString(buf) == data.substr(0, 20));
+    EV_VERIFY(pool.free_count() == pool.capacity() - 2);
+    EV_VERIFY(buf.Append(data.data() + 20, 10) == kEvOK);
+    EV_VERIFY(buf.count() == 2);
+    EV_VERIFY(ToString(buf) == data.substr(0, 30));
+    buf.Consume(25);
+    buf.Truncate(0);
+    EV_VERIFY(buf.empty());
+  }
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  // consumed segments are dropped
+  {
+    IOBuf buf(&pool);
+    for (int i=0; i<100; i++)
+    {
+      EV_VERIFY(buf.Append(data.data(), data.size()) == kEvOK);
+      buf.Consume(data.size() - 1);
+    }
+    EV_VERIFY(buf.size() == 100);
+    EV_VERIFY(buf.count() <= 100);
+    EV_VERIFY(buf.segments() <= 2 * buf.count() + 16);
+  }
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  // consumed segments are dropped in a FIFO, where every consume ends in a segment
+  {
+    IOBufPool fifo_pool(64, 16);
+    IOBuf buf(&fifo_pool);
+    for (int i=0; i<100000; i++)
+    {
+      EV_VERIFY(buf.Append(data.data(), 100) == kEvOK);
+      buf.Consume(100);
+      EV_VERIFY(buf.segments() <= 32);
+    }
+    EV_VERIFY(buf.empty());
+  }
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: clone and slice");
+
+  IOBufPool pool(16, 4);
+  std::string data;
+
+  for (int i=0; i<40; i++)
+    data.push_back((char)('A' + i % 26));
+
+  {
+    IOBuf buf(&pool);
+    IOBuf clone(&pool);
+    IOBuf slice(&pool);
+
+    EV_VERIFY(buf.Append(data.data(), data.size()) == kEvOK);
+    size_t free_count = pool.free_count();
+
+    EV_VERIFY(buf.Clone(&clone) == kEvOK);
+    EV_VERIFY(ToString(clone) == data);
+    EV_VERIFY(pool.free_count() == free_count);
+
+    // the shared tail block is not written again
+    EV_VERIFY(buf.Append("0123", 4) == kEvOK);
+    EV_VERIFY(buf.count() == 4);
+    EV_VERIFY(ToString(buf) == data + "0123");
+    EV_VERIFY(ToString(clone) == data);
+
+    // a block is writable again after the clone is released
+    clone.Clear();
+    EV_VERIFY(clone.Append("xyz", 3) == kEvOK);
+    EV_VERIFY(buf.Append("4567", 4) == kEvOK);
+    EV_VERIFY(buf.count() == 4);
+    EV_VERIFY(ToString(buf) == data + "01234567");
+
+    // slices across blocks
+    EV_VERIFY(buf.Slice(10, 20, &slice) == kEvOK);
+    EV_VERIFY(ToString(slice) == data.substr(10, 20));
+    EV_VERIFY(slice.count() == 2);
+    EV_VERIFY(buf.Slice(16, 16, &slice) == kEvOK);
+    EV_VERIFY(slice.count() == 3);
+    EV_VERIFY(ToString(slice) == data.substr(10, 20) + data.substr(16, 16));
+    EV_VERIFY(buf.Slice(44, 4, &slice) == kEvOK);
+    EV_VERIFY(ToString(slice).substr(36) == "4567");
+
+    // to itself
+    EV_VERIFY(slice.Append(slice) == kEvOK);
+    EV_VERIFY(slice.size() == 80);
+    EV_VERIFY(slice.Slice(0, 40, &slice) == kEvOK);
+    EV_VERIFY(slice.size() == 120);
+
+    // the clone survives the original
+    buf.Clear();
+    slice.Consume(80);
+    EV_VERIFY(ToString(slice) == data.substr(10, 20) + data.substr(16, 16) + "4567");
+  }
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: fan out a message");
+
+  IOBufPool pool;
+  std::string message(100000, 'm');
+  std::vector<IOBuf *> subscribers;
+  struct iovec iov[16];
+
+  {
+    IOBuf buf(&pool);
+    EV_VERIFY(buf.Append(message.data(), message.size()) == kEvOK);
+    size_t capacity = pool.capacity();
+
+    for (int i=0; i<10000; i++)
+    {
+      IOBuf * subscriber = new IOBuf(&pool);
+      EV_VERIFY(buf.Clone(subscriber) == kEvOK);
+      subscribers.push_back(subscriber);
+    }
+    // no block is taken
+    EV_VERIFY(pool.capacity() == capacity);
+
+    // the clones point to the same data
+    struct iovec iov2[16];
+    int iovcnt = buf.GetIovec(iov, 16);
+    EV_VERIFY(subscribers[9999]->GetIovec(iov2, 16) == iovcnt);
+    for (int i=0; i<iovcnt; i++)
+      EV_VERIFY(iov[i].iov_base == iov2[i].iov_base && iov[i].iov_len == iov2[i].iov_len);
+  }
+
+  for (size_t i=0; i<subscribers.size(); i++)
+  {
+    EV_VERIFY(ToString(*subscribers[i]) == message);
+    delete subscribers[i];
+  }
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+struct Test4_Helper
+{
+  std::vector<IOBuf *> bufs;
+};
+
+static void * Test4_Thread(void * arg)
+{
+  Test4_Helper * helper = (Test4_Helper *)arg;
+
+  for (size_t i=0; i<helper->bufs.size(); i++)
+  {
+    EV_VERIFY(helper->bufs[i]->size() == 1000);
+    delete helper->bufs[i];
+  }
+  return 0;
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: release in other threads");
+
+  IOBufPool pool(256, 16);
+  Test4_Helper helper[4];
+  pthread_t threads[4];
+  std::string data(1000, 'd');
+
+  for (int i=0; i<4; i++)
+  {
+    for (int j=0; j<100; j++)
+    {
+      IOBuf * buf = new IOBuf(&pool);
+      EV_VERIFY(buf->Append(data.data(), data.size()) == kEvOK);
+      helper[i].bufs.push_back(buf);
+    }
+  }
+
+  // the last references are dropped in other threads
+  for (int i=0; i<4; i++)
+    EV_VERIFY(pthread_create(&threads[i], 0, Test4_Thread, &helper[i]) == 0);
+  for (int i=0; i<4; i++)
+    EV_VERIFY(pthread_join(threads[i], 0) == 0);
+
+  EV_VERIFY(pool.free_count() < pool.capacity());
+  pool.Reclaim();
+  EV_VERIFY(pool.free_count() == pool.capacity());
+
+  // reclaimed blocks are reused
+  size_t capacity = pool.capacity();
+  {
+    IOBuf buf(&pool);
+    for (int i=0; i<100; i++)
+      EV_VERIFY(buf.Append(data.data(), data.size()) == kEvOK);
+  }
+  EV_VERIFY(pool.capacity() == capacity);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  return 0;
+}
@@ -0,0 +1,169 @@
+/** @file
+ * @brief test posting tasks to a reactor from other threads
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <pthread.h>
+
+using namespace libev;
+
+static const int kThreads = 4;
+static const int kTasks = 10000;
+
+struct Test0_Task
+{
+  Reactor * reactor;
+  int thread;
+  int seq;
+};
+
+static int counter;
+static int last_seq[kThreads];
+static pthread_t loop_tid;
+
+static void Test0_Callback(void * user_data)
+{
+  Test0_Task * task = (Test0_Task *)user_data;
+
+  // tasks run in the loop thread, in the order they are posted by one thread
+  EV_VERIFY(pthread_equal(pthread_self(), loop_tid));
+  EV_VERIFY(task->seq == last_seq[task->thread] + 1);
+  last_seq[task->thread] = task->seq;
+
+  if (++counter == kThreads * kTasks)
+    EV_VERIFY(task->reactor->Stop() == kEvOK);
+}
+
+static void * Test0_ThreadFunc(void * arg)
+{
+  Test0_Task * tasks = (Test0_Task *)arg;
+  for (int i=0; i<kTasks; i++)
+    EV_VERIFY(tasks[i].reactor->Post(Test0_Callback, &tasks[i]) == kEvOK);
+  return 0;
+}
+
+static void Test0()
+{
+  EV_LOG(kInfo, "Test 0: post tasks from other threads");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  pthread_t tid[kThreads];
+  Test0_Task * tasks = new Test0_Task[kThreads * kTasks];
+
+  for (int i=0; i<kThreads; i++)
+  {
+    last_seq[i] = -1;
+    for (int j=0; j<kTasks; j++)
+    {
+      tasks[i * kTasks + j].reactor = reactor.get();
+      tasks[i * kTasks + j].thread = i;
+      tasks[i * kTasks + j].seq = j;
+    }
+  }
+
+  loop_tid = pthread_self();
+  EV_VERIFY(reactor->Init() == kEvOK);
+  reactor->Ref();
+
+  for (int i=0; i<kThreads; i++)
+    EV_VERIFY(pthread_create(&tid[i], 0, Test0_ThreadFunc, &tasks[i * kTasks]) == 0);
+
+  (void)reactor->Run();
+
+  for (int i=0; i<kThreads; i++)
+    EV_VERIFY(pthread_join(tid[i], 0) == 0);
+
+  EV_VERIFY(counter == kThreads * kTasks);
+  reactor->Unref();
+  reactor.reset();
+  delete [] tasks;
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test1_Task(void * user_data)
+{
+  EV_LOG(kInfo, "Test1_Task");
+  counter++;
+  (void)user_data;
+}
+
+static void Test1_Callback(int /*fd*/, int /*event*/, void * user_data)
+{
+  EV_LOG(kInfo, "Test1_Callback");
+  Reactor * reactor = (Reactor *)user_data;
+  // tasks posted inside a callback run without any other event
+  EV_VERIFY(reactor->Post(Test1_Task, 0) == kEvOK);
+  EV_VERIFY(reactor->Post(Test1_Task, 0) == kEvOK);
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: post tasks inside a callback");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  timespec timeout;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &timeout) != -1);
+  Event ev(&timeout, Test1_Callback, reactor.get());
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(reactor->Add(&ev) == kEvOK);
+  (void)reactor->Run();
+  EV_VERIFY(counter == 2);
+
+  // tasks posted outside the loop run at the next poll
+  EV_VERIFY(reactor->Post(Test1_Task, 0) == kEvOK);
+  EV_VERIFY(reactor->Poll() == 0);
+  EV_VERIFY(counter == 3);
+
+  reactor.reset();
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static const int kChainedTasks = 4;
+
+static void Test2_Task(void * user_data)
+{
+  Reactor * reactor = (Reactor *)user_data;
+  // post a chain of tasks while uninitializing
+  if (++counter < kChainedTasks)
+    EV_VERIFY(reactor->Post(Test2_Task, reactor) == kEvOK);
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: tasks are run in uninitialization");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(reactor->Post(Test2_Task, reactor.get()) == kEvOK);
+  // the last poll quits early for being interrupted
+  EV_VERIFY(reactor->Stop() == kEvOK);
+  reactor->UnInit();
+  EV_VERIFY(counter == kChainedTasks);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test0();
+  Test1();
+  Test2();
+  return 0;
+}
@@ -0,0 +1,242 @@
+/** @file
+ * @brief token buckets, and the timer resuming IO throttled by them
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "rate_limiter.h"
+#include "log.h"
+#include "header.h"
+#include <math.h>
+
+namespace libev {
+
+  TokenBucket::TokenBucket()
+    : rate_(1.0), burst_(1.0), tokens_(1.0), parent_(0)
+  {
+    timespec_clear(&last_);
+  }
+
+  void TokenBucket::Init(double rate, double burst, TokenBucket * parent)
+  {
+    EV_ASSERT(rate > 0 && burst > 0);
+    rate_ = rate;
+    burst_ = burst;
+    tokens_ = burst;
+    timespec_clear(&last_);
+    parent_ = parent;
+  }
+
+  void TokenBucket::SetRate(double rate, double burst)
+  {
+    EV_ASSERT(rate > 0 && burst > 0);
+    rate_ = rate;
+    burst_ = burst;
+    if (tokens_ > burst_)
+      tokens_ = burst_;
+  }
+
+  void TokenBucket::Refill(const timespec * now)
+  {
+    if (timespec_isset(&last_) && timespec_less(&last_, now))
+    {
+      int64_t elapsed = timespec_to_ns(now) - timespec_to_ns(&last_);
+      tokens_ += (double)elapsed / 1000000000 * rate_;
+      if (tokens_ > burst_)
+        tokens_ = burst_;
+    }
+    if (!timespec_isset(&last_) || timespec_less(&last_, now))
+      last_ = *now;
+  }
+
+  size_t TokenBucket::Available(const timespec * now)
+  {
+    size_t available = 0;
+
+    Refill(now);
+    if (tokens_ >= 1.0)
+      available = (tokens_ < (double)(size_t)-1)?((size_t)tokens_):((size_t)-1);
+
+    if (parent_ && available)
+    {
+      size_t parent = parent_->Available(now);
+      if (parent < available)
+        available = parent;
+    }
+    return available;
+  }
+
+  void TokenBucket::Take(size_t n)
+  {
+    for (TokenBucket * bucket=this; bucket; bucket=bucket->parent_)
+      bucket->tokens_ -= (double)n;
+  }
+
+  int64_t TokenBucket::Delay(const timespec * now, size_t n)
+  {
+    int64_t delay = 0;
+
+    for (TokenBucket * bucket=this; bucket; bucket=bucket->parent_)
+    {
+      double wanted = ((double)n < bucket->burst_)?((double)n):(bucket->burst_);
+      bucket->Refill(now);
+      if (bucket->tokens_ < wanted)
+      {
+        int64_t ms = (int64_t)ceil((wanted - bucket->tokens_) * 1000 / bucket->rate_);
+        if (ms > delay)
+          delay = ms;
+      }
+    }
+    return delay;
+  }
+
+  /************************************************************************/
+  RateLimiter::RateLimiter()
+    : reactor_(0), armed_(0), armed_due_(0), destroyed_(0)
+  {
+  }
+
+  RateLimiter::~RateLimiter()
+  {
+    UnInit();
+  }
+
+  int RateLimiter::Init(Reactor * reactor)
+  {
+    if (reactor == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "RateLimiter(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    timer_.event = kEvTimer;
+    timer_.callback = OnTimer;
+    timer_.user_data = this;
+    reactor_ = reactor;
+    armed_ = 0;
+    return kEvOK;
+  }
+
+  void RateLimiter::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    WaitSet::iterator it;
+    for (it=waits_.begin(); it!=waits_.end(); ++it)
+      it->second->waiting = 0;
+    waits_.clear();
+    if (armed_)
+    {
+      (void)timer_.Del();
+      armed_ = 0;
+    }
+    reactor_ = 0;
+
+    // tell the callback invoker that the limiter is gone
+    DestroyedGuard::Destroy(&destroyed_);
+  }
+
+  int64_t RateLimiter::NowMs()const
+  {
+    const timespec * now = reactor_->Now();
+    return (int64_t)now->tv_sec * 1000 + now->tv_nsec / 1000000;
+  }
+
+  void RateLimiter::Arm()
+  {
+    if (waits_.empty())
+    {
+      if (armed_)
+      {
+        (void)timer_.Del();
+        armed_ = 0;
+      }
+      return;
+    }
+
+    int64_t due = waits_.begin()->first;
+    if (armed_ && armed_due_ == due)
+      return;
+
+    if (armed_)
+      (void)timer_.Del();
+    int64_t ms = due - NowMs();
+    armed_ = (reactor_->AddTimer(&timer_, (ms > 0)?(ms):((int64_t)0)) == kEvOK);
+    armed_due_ = due;
+    if (!armed_)
+      EV_LOG(kError, "RateLimiter(%p) fails to add the timer", this);
+  }
+
+  int RateLimiter::Wait(RateWait * wait, int64_t ms)
+  {
+    if (wait == 0 || wait->callback == 0 || ms < 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_ == 0)
+    {
+      EV_LOG(kError, "RateLimiter(%p) is not initialized", this);
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    Cancel(wait);
+    int64_t due = NowMs() + ms;
+    try
+    {
+      waits_.insert(std::make_pair(due, wait));// may throw(caught)
+    }
+    catch (...)
+    {
+      Arm();
+      return kEvNoMemory;
+    }
+    wait->due = due;
+    wait->waiting = 1;
+    Arm();
+    return kEvOK;
+  }
+
+  void RateLimiter::Cancel(RateWait * wait)
+  {
+    if (reactor_ == 0 || !wait->waiting)
+      return;
+
+    waits_.erase(std::make_pair(wait->due, wait));
+    wait->waiting = 0;
+    Arm();
+  }
+
+  void RateLimiter::OnTimer(int /*fd*/, int event, void * user_data)
+  {
+    RateLimiter * limiter = (RateLimiter *)user_data;
+
+    if (event & kEvCanceled)
+      return;
+
+    limiter->armed_ = 0;
+    int64_t now = limiter->NowMs();
+    while (!limiter->waits_.empty() && limiter->waits_.begin()->first <= now)
+    {
+      RateWait * wait = limiter->waits_.begin()->second;
+      limiter->waits_.erase(limiter->waits_.begin());
+      wait->waiting = 0;
+
+      DestroyedGuard destroyed(&limiter->destroyed_);
+      wait->callback(wait->user_data);
+      if (destroyed.Leave())
+        return;
+    }
+    limiter->Arm();
+  }
+}
@@ -0,0 +1,118 @@
+/** @file
+ * @brief token buckets, and the timer resuming IO throttled by them
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_RATE_LIMITER_H
+#define LIBEV_RATE_LIMITER_H
+
+#include "ev.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <set>
+#include <utility>
+
+namespace libev {
+
+  // A token bucket refilled at 'rate' tokens(e.g. bytes or connections) per second,
+  // holding at most 'burst' tokens.
+  // Tokens are also taken from its parent(e.g. a bucket shared by the connections
+  // of a tenant), so the stricter one limits.
+  // A bucket and its ancestors must be used in one thread.
+  class TokenBucket
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(TokenBucket);
+
+      double rate_;
+      double burst_;
+      double tokens_;// negative if taken in debt
+      timespec last_;// when 'tokens_' is refilled, 0 if never
+      TokenBucket * parent_;
+
+      void Refill(const timespec * now);
+
+    public:
+      TokenBucket();
+
+      // it is full at first, 'rate' and 'burst' must be positive
+      void Init(double rate, double burst, TokenBucket * parent = 0);
+      // change the rate, the tokens are kept
+      void SetRate(double rate, double burst);
+
+      // the whole tokens available in it and its ancestors at 'now'(e.g. 'Reactor::Now')
+      size_t Available(const timespec * now);
+      // take 'n' tokens from it and its ancestors, which may go into debt
+      void Take(size_t n);
+      // milliseconds until 'n' tokens are available in it and its ancestors,
+      // 'n' is at most the burst of each of them
+      int64_t Delay(const timespec * now, size_t n);
+
+      double rate()const {return rate_;}
+      double burst()const {return burst_;}
+      TokenBucket * parent()const {return parent_;}
+  };
+
+  typedef void (*rate_callback)(void * user_data);
+
+  // an object throttled by a rate limiter, e.g. a member of a stream
+  struct RateWait
+  {
+    rate_callback callback;
+    void * user_data;
+
+    // private to RateLimiter
+    int64_t due;// ms of the monotonic clock
+    int waiting;
+
+    RateWait() : callback(0), user_data(0), due(0), waiting(0) {}
+  };
+
+  // A rate limiter resumes throttled objects of a reactor when their buckets
+  // are expected to have tokens again. All of them share one timer,
+  // which is armed for the earliest one, instead of one timer per object.
+  // The limiter must outlive the objects using it.
+  // The limiter may be deleted inside its callback.
+  class RateLimiter
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(RateLimiter);
+
+      typedef std::set<std::pair<int64_t, RateWait *> > WaitSet;
+
+      Reactor * reactor_;
+      Event timer_;
+      int armed_;
+      int64_t armed_due_;// the due 'timer_' is armed for
+      WaitSet waits_;
+      int * destroyed_;// set to 1 if the limiter is destroyed inside its callback
+
+      static void OnTimer(int fd, int event, void * user_data);
+
+      int64_t NowMs()const;
+      // arm 'timer_' for the earliest wait
+      void Arm();
+
+    public:
+      RateLimiter();
+      ~RateLimiter();
+
+      int Init(Reactor * reactor);
+      // pending waits are dropped without callbacks
+      void UnInit();
+
+      // invoke 'wait->callback' after 'ms' milliseconds,
+      // a pending 'wait' is rescheduled
+      int Wait(RateWait * wait, int64_t ms);
+      // cancel a pending 'wait' without invoking its callback
+      void Cancel(RateWait * wait);
+
+      Reactor * reactor()const {return reactor_;}
+      // the number of pending waits
+      size_t waiting()const {return waits_.size();}
+  };
+}
+
+#endif
@@ -0,0 +1,386 @@
+/** @file
+ * @brief test token buckets and rate limiters
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "rate_limiter.h"
+#include "acceptor.h"
+#include "stream.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <vector>
+
+using namespace libev;
+
+static int64_t NowMs()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static timespec After(const timespec * t, int64_t ms)
+{
+  timespec after = *t;
+  after.tv_sec += (time_t)(ms / 1000);
+  after.tv_nsec += (long)(ms % 1000) * 1000000;
+  timespec_fix(&after);
+  return after;
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: token buckets");
+
+  TokenBucket bucket, parent, child;
+  timespec t0 = {100, 0};
+  timespec t1 = After(&t0, 10);
+
+  bucket.Init(1000, 100);
+  EV_VERIFY(bucket.Available(&t0) == 100);
+  EV_VERIFY(bucket.Delay(&t0, 100) == 0);
+  bucket.Take(100);
+  EV_VERIFY(bucket.Available(&t0) == 0);
+  EV_VERIFY(bucket.Available(&t1) == 10);
+  EV_VERIFY(bucket.Delay(&t1, 50) == 40);
+  // at most the burst is waited for
+  EV_VERIFY(bucket.Delay(&t1, 500) == 90);
+  // in debt
+  bucket.Take(30);
+  EV_VERIFY(bucket.Available(&t1) == 0);
+  EV_VERIFY(bucket.Delay(&t1, 1) == 21);
+  // no more than the burst
+  timespec t2 = After(&t1, 10000);
+  EV_VERIFY(bucket.Available(&t2) == 100);
+  // time does not go back
+  EV_VERIFY(bucket.Available(&t1) == 100);
+
+  // the parent is stricter
+  parent.Init(100, 10);
+  child.Init(1000, 100, &parent);
+  EV_VERIFY(child.Available(&t0) == 10);
+  child.Take(10);
+  EV_VERIFY(child.Available(&t0) == 0);
+  EV_VERIFY(parent.Available(&t0) == 0);
+  EV_VERIFY(child.Delay(&t0, 5) == 50);
+  EV_VERIFY(child.Available(&t1) == 1);
+
+  // the child is stricter
+  parent.Init(1000, 100);
+  child.Init(100, 10, &parent);
+  EV_VERIFY(child.Available(&t0) == 10);
+  child.Take(10);
+  EV_VERIFY(parent.Available(&t0) == 90);
+  EV_VERIFY(child.Delay(&t0, 10) == 100);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static const int kWaits = 50;
+static std::vector<int> fired;
+static RateWait waits[kWaits];
+static int64_t dues[kWaits];
+
+static void Test2_Callback(void * user_data)
+{
+  fired.push_back((int)(intptr_t)user_data);
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: rate limiters");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  RateLimiter limiter;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(limiter.Init(reactor.get()) == kEvOK);
+  EV_VERIFY(limiter.Init(reactor.get()) == kEvExists);
+
+  for (int i=0; i<kWaits; i++)
+  {
+    waits[i].callback = Test2_Callback;
+    waits[i].user_data = (void *)(intptr_t)i;
+    dues[i] = (i * 7) % kWaits + 1;
+    EV_VERIFY(limiter.Wait(&waits[i], dues[i]) == kEvOK);
+  }
+  EV_VERIFY(limiter.waiting() == kWaits);
+  // all waits share one timer
+  EV_VERIFY(reactor->Load() == 1);
+
+  // cancel one, and reschedule another
+  limiter.Cancel(&waits[0]);
+  limiter.Cancel(&waits[0]);
+  dues[1] = 100;
+  EV_VERIFY(limiter.Wait(&waits[1], dues[1]) == kEvOK);
+  EV_VERIFY(limiter.waiting() == kWaits - 1);
+
+  EV_VERIFY(reactor->Run() >= 0);
+  EV_VERIFY(limiter.waiting() == 0);
+  EV_VERIFY((int)fired.size() == kWaits - 1);
+  for (size_t i=0; i<fired.size(); i++)
+  {
+    EV_VERIFY(fired[i] != 0);
+    if (i)
+      EV_VERIFY(dues[fired[i-1]] <= dues[fired[i]]);
+  }
+  EV_VERIFY(fired.back() == 1);
+
+  // pending waits are dropped
+  EV_VERIFY(limiter.Wait(&waits[0], 10) == kEvOK);
+  limiter.UnInit();
+  EV_VERIFY(!waits[0].waiting);
+  EV_VERIFY(reactor->Load() == 0);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static const size_t kBlockSize = 4096;
+static const size_t kTenantRate = 256 * 1024;
+static const size_t kTenantBytes = 64 * 1024;
+static const int kTenantStreams = 2;
+
+struct Test3_Helper
+{
+  size_t read;
+  int eofs;
+};
+
+static void Test3_Callback(Stream * stream, int event, void * user_data)
+{
+  Test3_Helper * helper = (Test3_Helper *)user_data;
+
+  if (event & kStreamRead)
+  {
+    helper->read += stream->input()->size();
+    stream->input()->Clear();
+  }
+  if (event & kStreamEOF)
+    helper->eofs++;
+  EV_VERIFY(!(event & kStreamError));
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: limit reading of a tenant");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool(kBlockSize);
+  RateLimiter limiter;
+  TokenBucket tenant;
+  TokenBucket buckets[kTenantStreams];
+  Stream * streams[kTenantStreams];
+  int fds[kTenantStreams][2];
+  Test3_Helper helper = {0, 0};
+  std::vector<char> data(kTenantBytes / kTenantStreams, 'x');
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(limiter.Init(reactor.get()) == kEvOK);
+  tenant.Init(kTenantRate, 16 * 1024);
+  for (int i=0; i<kTenantStreams; i++)
+  {
+    EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) == 0);
+    EV_VERIFY(write(fds[i][1], &data[0], data.size()) == (ssize_t)data.size());
+    EV_VERIFY(shutdown(fds[i][1], SHUT_WR) == 0);
+
+    buckets[i].Init(1024 * 1024, 16 * 1024, &tenant);
+    streams[i] = new Stream(&pool);
+    EV_VERIFY(streams[i]->SetRateLimit(&buckets[i], 0, 0) == kEvFailure);
+    EV_VERIFY(streams[i]->SetRateLimit(&buckets[i], 0, &limiter) == kEvOK);
+    EV_VERIFY(streams[i]->Init(reactor.get(), fds[i][0], Test3_Callback, &helper) == kEvOK);
+  }
+
+  int64_t begin = NowMs();
+  EV_VERIFY(reactor->Run() >= 0);
+  int64_t elapsed = NowMs() - begin;
+
+  EV_LOG(kInfo, "%d bytes are read in %d ms", (int)helper.read, (int)elapsed);
+  EV_VERIFY(helper.read == kTenantBytes);
+  EV_VERIFY(helper.eofs == kTenantStreams);
+  // the burst is read at once, the rest at the rate of the tenant
+  EV_VERIFY(elapsed >= (int64_t)((kTenantBytes - 16 * 1024) * 1000 / kTenantRate) - 10);
+  EV_VERIFY(elapsed < 5000);
+  EV_VERIFY(limiter.waiting() == 0);
+
+  for (int i=0; i<kTenantStreams; i++)
+  {
+    delete streams[i];
+    safe_close(fds[i][0]);
+    safe_close(fds[i][1]);
+  }
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static const size_t kWriteRate = 256 * 1024;
+static const size_t kWriteBytes = 64 * 1024;
+static const size_t kFileBytes = 32 * 1024;
+
+struct Test4_Helper
+{
+  Event ev;
+  size_t read;
+  int eof;
+};
+
+static void Test4_OnRead(int fd, int /*event*/, void * user_data)
+{
+  Test4_Helper * helper = (Test4_Helper *)user_data;
+  char buf[8192];
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    helper->read += (size_t)n;
+  if (n == 0)
+  {
+    helper->eof = 1;
+    EV_VERIFY(helper->ev.Del() == kEvOK);
+  }
+}
+
+static int file_sent;
+
+static void Test4_Callback(Stream * stream, int event, void * /*user_data*/)
+{
+  if (event & kStreamFileSent)
+  {
+    file_sent++;
+    EV_VERIFY(stream->Shutdown() == kEvOK);
+  }
+  EV_VERIFY(!(event & kStreamError));
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: limit writing");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool(kBlockSize);
+  RateLimiter limiter;
+  TokenBucket bucket;
+  Stream stream(&pool);
+  Test4_Helper helper;
+  int fds[2];
+  std::vector<char> data(kWriteBytes, 'y');
+  FILE * file = tmpfile();
+
+  EV_VERIFY(file);
+  EV_VERIFY(fwrite(&data[0], 1, kFileBytes, file) == kFileBytes);
+  EV_VERIFY(fflush(file) == 0);
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(limiter.Init(reactor.get()) == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  EV_VERIFY(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+
+  helper.ev.fd = fds[1];
+  helper.ev.event = kEvIn|kEvPersist;
+  helper.ev.callback = Test4_OnRead;
+  helper.ev.user_data = &helper;
+  helper.read = 0;
+  helper.eof = 0;
+  EV_VERIFY(reactor->Add(&helper.ev) == kEvOK);
+
+  bucket.Init(kWriteRate, 16 * 1024);
+  EV_VERIFY(stream.Init(reactor.get(), fds[0], Test4_Callback, 0) == kEvOK);
+  EV_VERIFY(stream.SetRateLimit(0, &bucket, &limiter) == kEvOK);
+
+  int64_t begin = NowMs();
+  // the burst is written directly
+  EV_VERIFY(stream.Write(&data[0], kWriteBytes) == kEvOK);
+  EV_VERIFY(stream.output()->size() == kWriteBytes - 16 * 1024);
+  EV_VERIFY(stream.SendFile(fileno(file), 0, kFileBytes) == kEvOK);
+  // the peer does not write, so no EOF stops reading of 'stream'
+  while (!helper.eof)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  int64_t elapsed = NowMs() - begin;
+
+  EV_LOG(kInfo, "%d bytes are written in %d ms", (int)helper.read, (int)elapsed);
+  EV_VERIFY(helper.read == kWriteBytes + kFileBytes);
+  EV_VERIFY(file_sent == 1);
+  EV_VERIFY(elapsed >= (int64_t)((kWriteBytes + kFileBytes - 16 * 1024) * 1000 / kWriteRate) - 10);
+  EV_VERIFY(elapsed < 5000);
+
+  stream.UnInit();
+  EV_VERIFY(limiter.waiting() == 0);
+  safe_close(fds[0]);
+  safe_close(fds[1]);
+  fclose(file);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static const int kClients = 6;
+static const int kAcceptRate = 20;
+static const int kAcceptBurst = 2;
+static int accepted;
+
+static void Test5_Callback(Acceptor * acceptor, int fd,
+    const struct sockaddr * /*addr*/, socklen_t /*addrlen*/, void * /*user_data*/)
+{
+  safe_close(fd);
+  if (++accepted == kClients)
+    acceptor->UnInit();
+}
+
+static void Test5()
+{
+  EV_LOG(kInfo, "Test 5: limit accepting");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  RateLimiter limiter;
+  TokenBucket bucket;
+  Acceptor acceptor;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  std::vector<int> clients;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(limiter.Init(reactor.get()) == kEvOK);
+  EV_VERIFY(acceptor.Listen(reactor.get(), (struct sockaddr *)&addr, sizeof(addr),
+        Test5_Callback, 0) == kEvOK);
+  bucket.Init(kAcceptRate, kAcceptBurst);
+  EV_VERIFY(acceptor.SetRateLimit(&bucket, &limiter) == kEvOK);
+
+  // connections wait in the backlog
+  EV_VERIFY(getsockname(acceptor.fd(), (struct sockaddr *)&addr, &len) == 0);
+  for (int i=0; i<kClients; i++)
+  {
+    EV_VERIFY((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    EV_VERIFY(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    clients.push_back(fd);
+  }
+
+  int64_t begin = NowMs();
+  EV_VERIFY(reactor->Run() >= 0);
+  int64_t elapsed = NowMs() - begin;
+
+  EV_LOG(kInfo, "%d connections are accepted in %d ms", accepted, (int)elapsed);
+  EV_VERIFY(accepted == kClients);
+  EV_VERIFY(elapsed >= (kClients - kAcceptBurst) * 1000 / kAcceptRate - 10);
+  EV_VERIFY(elapsed < 5000);
+  EV_VERIFY(limiter.waiting() == 0);
+
+  for (size_t i=0; i<clients.size(); i++)
+    safe_close(clients[i]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  Test5();
+  return 0;
+}
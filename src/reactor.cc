@@ -8,15 +8,16 @@
 #include "ev.h"
 #include "log.h"
 #include "heap.h"
+#include "timer_wheel.h"
+#include "backend.h"
 #include "interrupter.h"
+#include "task_queue.h"
 #include "header.h"
 #include <vector>
 
 namespace libev {
 
-  static const int kEpollSize = 20480;
-  static const int kEpollEventsSize = 32;
-  static const int kEpollEventsMaxSize = 10240;
+  static const int kIOEventsSize = 32;
 
   class ReactorImpl
   {
@@ -30,25 +31,42 @@ namespace libev {
       int sig_ev_refcount_[_NSIG];
 
       // members about timer events
-      int timerfd_;
       Heap min_time_heap_;
+      TimerWheel timer_wheel_;
+      int use_timer_wheel_;// kEvTimerWheel
+      timespec timer_deadline_;// the deadline the backend timer is armed at, 0 if not armed
+      timespec timer_slack_;// timers may expire 'timer_slack_' later
+      timespec now_;// the monotonic clock cached once per iteration
 
       // members about io events
       struct IOEvent
       {
         Event * event_in;
         Event * event_out;
-        IOEvent() : event_in(0), event_out(0) {}
+        int registered;// events registered to the backend, 0 if the fd is not registered
+        int changed;// the fd is in 'changes_'
+        IOEvent() : event_in(0), event_out(0), registered(0), changed(0) {}
       };
-      int epfd_;
       std::vector<IOEvent> fd_2_io_ev_;// fd to IOEvent array
-      std::vector<epoll_event> ep_ev_;// for epoll_wait
+      std::vector<int> changes_;// fds whose events are changed but not flushed to the backend
+      // the fd left with no events by cleaning up 'unregister_ev_' before its callback,
+      // which is unregistered after the callback unless 'unregister_ev_' is re-added, or -1
+      int unregister_fd_;
+      const Event * unregister_ev_;
+
+      // the backend polling fds and the timer
+      Backend * backend_;
 
       // common members
       List ev_list_;// event list
       List sig_ev_list_;// signal event list
       List active_ev_list_;// active event list
       Interrupter interrupter_;
+      TaskQueue task_queue_;
+      volatile int wakeup_pending_;// the reactor is awake or an interruption is pending
+      volatile int stop_pending_;// 'Stop' has been called
+      int ev_count_;// the number of events in 'ev_list_' and 'sig_ev_list_'
+      int refcount_;// references that keep 'Run' from quitting for no events
 
       // temporary members helping invoke callback
       int ev_cleaned_;// the event is cleaned
@@ -57,15 +75,38 @@ namespace libev {
     private:
       void AddSignalRef(int signum);
       void ReleaseSignalRef(int signum);
+      // arm the backend timer at 'deadline' plus 'timer_slack_'
+      // if it is earlier than 'timer_deadline_'
+      void ArmTimer(const timespec * deadline);
+      // arm the backend timer for the next timer after the backend timer expires
       void ScheduleTimer();
+      int InTimerWheel(const Event * ev)const
+      {
+        return use_timer_wheel_ || (ev->event & kEvWheel);
+      }
       void ResizeIOEvent(int fd);
+      // the epoll events that 'io_event' is interested in
+      static int GetEpollEvents(const IOEvent * io_event);
+      // kEvErrQueue is set in any event of 'io_event'
+      static int IsErrQueuePolled(const IOEvent * io_event)
+      {
+        return (io_event->event_in && (io_event->event_in->event & kEvErrQueue))
+          || (io_event->event_out && (io_event->event_out->event & kEvErrQueue));
+      }
+      // record that events of 'fd' are changed
+      void AddChange(int fd);
+      // flush changes in 'changes_' to the backend, right before waiting
+      void FlushChanges();
+      // activate 'ev' with kEvErr
+      void ActivateError(Event * ev);
 
       // add/del 'ev' to/from 'ev_list_' or 'sig_ev_list_' according to its type
       void AddToList(Event * ev);
       void DelFromList(Event * ev);
       // setup/cleanup 'ev'(mainly affairs about system) according to its type
       int Setup(Event * ev);
-      void CleanUp(Event * ev);
+      // if 'deferred', an fd left with no events is unregistered after the callback of 'ev'
+      void CleanUp(Event * ev, int deferred = 0);
       // cancel 'ev' inside callback
       void CancelInsideCB(Event * ev);
       // cancel 'ev' outside callback
@@ -76,8 +117,22 @@ namespace libev {
       // invoke callback of 'ev'
       void InvokeCallback(Event * ev);
 
+      // a repeating timer(kEvTimer|kEvPersist with interval)
+      static int IsRepeating(const Event * ev)
+      {
+        return (ev->event & kEvPersist) && timespec_isset(&ev->interval);
+      }
+      // advance the timeout of an expired repeating timer after 'now'
+      // return the number of expired intervals
+      static int Reschedule(Event * ev, int64_t now_ns);
+
       void OnSignalReadable();
-      void OnTimerReadable();
+      // activate the expired timer 'ev', whose callback is to be invoked 'times' times
+      void ActivateTimer(Event * ev, int times);
+      void OnTimerExpired();
+
+      // run and free all posted tasks
+      void RunTasks();
 
       // poll and execute ready events
       // if 'limit' > 0, execute at most 'limit' ready events
@@ -91,7 +146,7 @@ namespace libev {
       ReactorImpl();
       ~ReactorImpl();
 
-      int Init();
+      int Init(int flags);
       void UnInit();
 
       int Add(Event * ev);
@@ -101,6 +156,18 @@ namespace libev {
       int Poll(int limit);
       int Run(int limit);
       int Stop();
+      int Post(ev_task_callback callback, void * user_data);
+
+      void Ref();
+      void Unref();
+      int Load()const;
+
+      int SetTimerWheelTick(const timespec * tick);
+      int SetTimerSlack(const timespec * slack);
+
+      const timespec * Now()const {return &now_;}
+      void UpdateNow();
+      int AddTimer(Event * ev, const timespec * after);
   };
 
 
@@ -142,21 +209,30 @@ namespace libev {
     }
   }
 
-  void ReactorImpl::ScheduleTimer()
+  void ReactorImpl::ArmTimer(const timespec * deadline)
   {
-    if (min_time_heap_.empty())
+    // With the same slack for all timers, the latest wakeup satisfying all of them
+    // is the nearest deadline plus the slack,
+    // and all timers whose deadlines have passed expire in one batch then.
+    timespec latest = *deadline;
+    timespec_addto(&latest, &timer_slack_);
+
+    if (timespec_isset(&timer_deadline_) && timespec_le(&timer_deadline_, &latest))
       return;
 
-    const Event * ev = min_time_heap_.top();
+    timer_deadline_ = latest;
+    backend_->SetTimer(&latest);
+  }
 
-    itimerspec timerspec;
-    timerspec.it_value = ev->timeout;
-    timerspec.it_interval.tv_sec = 0;
-    timerspec.it_interval.tv_nsec = 0;
+  void ReactorImpl::ScheduleTimer()
+  {
+    timespec deadline;
 
-    EV_LOG(kDebug, "timerfd_settime: seconds=%ld nanoseconds=%ld",
-        (long)timerspec.it_value.tv_sec, (long)timerspec.it_value.tv_nsec);
-    EV_VERIFY(timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &timerspec, 0) != -1);
+    timespec_clear(&timer_deadline_);
+    if (!min_time_heap_.empty())
+      ArmTimer(&min_time_heap_.top()->timeout);
+    if (timer_wheel_.next(&deadline))
+      ArmTimer(&deadline);
   }
 
   void ReactorImpl::ResizeIOEvent(int fd)
@@ -171,15 +247,103 @@ namespace libev {
 
     while (new_size <= sfd)
       new_size <<= 1;//double the size of 'fd_2_io_ev_'
+    // every fd is recorded in 'changes_' at most once,
+    // so 'AddChange' never reallocates 'changes_'
+    changes_.reserve(new_size);// may throw(caught)
     fd_2_io_ev_.resize(new_size);// may throw(caught)
   }
 
+  int ReactorImpl::GetEpollEvents(const IOEvent * io_event)
+  {
+    int events = 0;
+
+    if (io_event->event_in)
+    {
+      events |= EPOLLIN;
+      if (io_event->event_in->event & kEvET)
+        events |= EPOLLET;
+    }
+    if (io_event->event_out)
+    {
+      events |= EPOLLOUT;
+      if (io_event->event_out->event & kEvET)
+        events |= EPOLLET;
+    }
+    return events;
+  }
+
+  void ReactorImpl::AddChange(int fd)
+  {
+    IOEvent * io_event = &fd_2_io_ev_[(size_t)fd];
+    if (io_event->changed)
+      return;
+
+    EV_ASSERT(changes_.size() < changes_.capacity());
+    changes_.push_back(fd);
+    io_event->changed = 1;
+  }
+
+  void ReactorImpl::ActivateError(Event * ev)
+  {
+    if (!ev->IsActive())
+    {
+      ev->real_event = kEvErr;
+      ev->AddToActive(&active_ev_list_);
+    }
+    else
+    {
+      ev->real_event |= kEvErr;
+    }
+    EV_LOG(kDebug, "IO Event(%p) is active", ev);
+  }
+
+  void ReactorImpl::FlushChanges()
+  {
+    for (size_t i=0; i<changes_.size(); i++)
+    {
+      int fd = changes_[i];
+      IOEvent * io_event = &fd_2_io_ev_[(size_t)fd];
+      int events = GetEpollEvents(io_event);
+
+      EV_ASSERT(io_event->changed);
+      io_event->changed = 0;
+
+      // changes cancel out, or the fd has been unregistered by 'CleanUp'
+      if (events == io_event->registered)
+        continue;
+
+      // only modifications are deferred, 'events' is not 0
+      EV_ASSERT(events && io_event->registered);
+      if (backend_->Ctl(fd, io_event->registered, events) == kEvOK)
+      {
+        io_event->registered = events;
+      }
+      else
+      {
+        io_event->registered = 0;
+
+        // report the failure to the events
+        Event * event_in = io_event->event_in;
+        Event * event_out = io_event->event_out;
+        if (event_out == event_in)
+          event_out = 0;
+        if (event_in)
+          ActivateError(event_in);
+        if (event_out)
+          ActivateError(event_out);
+      }
+    }
+
+    changes_.clear();
+  }
+
   void ReactorImpl::AddToList(Event * ev)
   {
     if (ev->event & kEvSignal)
       ev->AddToList(&sig_ev_list_);
     else
       ev->AddToList(&ev_list_);
+    ev_count_++;
   }
 
   void ReactorImpl::DelFromList(Event * ev)
@@ -188,6 +352,7 @@ namespace libev {
       ev->DelFromList(&sig_ev_list_);
     else
       ev->DelFromList(&ev_list_);
+    ev_count_--;
   }
 
   int ReactorImpl::Setup(Event * ev)
@@ -200,17 +365,28 @@ namespace libev {
     {
       ev->fd = -1;
 
-      try
+      if (InTimerWheel(ev))
       {
-        min_time_heap_.push(ev);
+        timespec deadline;
+        if (timer_wheel_.empty())
+          timer_wheel_.reset(&now_);
+        timer_wheel_.push(ev, &deadline);
+        ArmTimer(&deadline);
       }
-      catch (...)
+      else
       {
-        return kEvNoMemory;
-      }
+        try
+        {
+          min_time_heap_.push(ev);
+        }
+        catch (...)
+        {
+          return kEvNoMemory;
+        }
 
-      if (ev->fd == 0)
-        ScheduleTimer();
+        if (ev->fd == 0)
+          ArmTimer(&ev->timeout);
+      }
     }
     else if (ev->event & kEvIO)
     {
@@ -236,41 +412,42 @@ namespace libev {
         return kEvExists;
       }
 
-      int op = EPOLL_CTL_ADD;
-      int events = 0;
-      if (ev->event & kEvET)
-        events |= EPOLLET;
-
-      if (io_event->event_in)
-      {
-        events |= EPOLLIN;
-        op = EPOLL_CTL_MOD;
-      }
-      if (io_event->event_out)
-      {
-        events |= EPOLLOUT;
-        op = EPOLL_CTL_MOD;
-      }
-      if (ev->event & kEvIn)
-        events |= EPOLLIN;
-      if (ev->event & kEvOut)
-        events |= EPOLLOUT;
-
-      epoll_event epev;
-      epev.data.u64 = 0;// suppress valgrind warnings
-      epev.data.fd = fd;
-      epev.events = (uint32_t)events;
-      EV_LOG(kDebug, "epoll_ctl: op=%d fd=%d", op, fd);
-      if (epoll_ctl(epfd_, op, fd, &epev) == -1)
+      if (fd == unregister_fd_)
       {
-        EV_LOG(kError, "epoll_ctl: %s", strerror(errno));
-        return kEvFailure;
+        unregister_fd_ = -1;
+        if (ev != unregister_ev_)
+        {
+          // the callback may have closed the fd and reused its number,
+          // so only the event re-added keeps the registration
+          (void)backend_->Ctl(fd, io_event->registered, 0);
+          io_event->registered = 0;
+        }
       }
 
       if (ev->event & kEvIn)
         io_event->event_in = ev;
       if (ev->event & kEvOut)
         io_event->event_out = ev;
+
+      if (io_event->registered == 0)
+      {
+        // register a new fd right now to report failures
+        int events = GetEpollEvents(io_event);
+        if (backend_->Ctl(fd, 0, events) != kEvOK)
+        {
+          if (ev->event & kEvIn)
+            io_event->event_in = 0;
+          if (ev->event & kEvOut)
+            io_event->event_out = 0;
+          return kEvFailure;
+        }
+        io_event->registered = events;
+      }
+      else
+      {
+        // defer modifications until the next wait
+        AddChange(fd);
+      }
     }
 
     ev->real_event = 0;
@@ -280,7 +457,7 @@ namespace libev {
     return kEvOK;
   }
 
-  void ReactorImpl::CleanUp(Event * ev)
+  void ReactorImpl::CleanUp(Event * ev, int deferred)
   {
     int fd = ev->fd;
 
@@ -290,48 +467,44 @@ namespace libev {
     }
     else if (ev->event & kEvTimer)
     {
-      // nothing to do
+      // the timer is pending
+      if (fd != -1)
+      {
+        if (InTimerWheel(ev))
+          timer_wheel_.erase(ev);
+        else
+          min_time_heap_.erase(ev);
+      }
     }
     else if (ev->event & kEvIO)
     {
       IOEvent * io_event = &fd_2_io_ev_[(size_t)fd];
-      int op = EPOLL_CTL_DEL;
-      int events = 0;
-      int del_in = 1, del_out = 1;
 
       if (ev->event & kEvIn)
-        events |= EPOLLIN;
+        io_event->event_in = 0;
       if (ev->event & kEvOut)
-        events |= EPOLLOUT;
+        io_event->event_out = 0;
 
-      // 'ev->event' has only one flag: kEvIn or kEvOut
-      if ((events & (EPOLLIN|EPOLLOUT)) != (EPOLLIN|EPOLLOUT))
+      if (io_event->event_in || io_event->event_out)
       {
-        if ((events & EPOLLIN) && io_event->event_out)
-        {
-          del_out = 0;
-          events = EPOLLOUT;
-          op = EPOLL_CTL_MOD;
-        }
-        else if ((events & EPOLLOUT) && io_event->event_in)
-        {
-          del_in = 0;
-          events = EPOLLIN;
-          op = EPOLL_CTL_MOD;
-        }
+        // defer modifications until the next wait
+        AddChange(fd);
+      }
+      else if (io_event->registered && deferred)
+      {
+        // the callback may re-add 'ev', which costs no syscall
+        unregister_fd_ = fd;
+        unregister_ev_ = ev;
+      }
+      else if (io_event->registered)
+      {
+        // unregister the fd right now, for it may be closed right after 'Del'
+        // while its file is still open elsewhere(e.g. dup-ed, forked or passed to another process),
+        // and the file would stay polled.
+        // It fails if the fd has been closed, which has unregistered it unless its file is shared.
+        (void)backend_->Ctl(fd, io_event->registered, 0);
+        io_event->registered = 0;
       }
-
-      epoll_event epev;
-      epev.data.u64 = 0;// suppress valgrind warnings
-      epev.events = (uint32_t)events;
-      epev.data.fd = fd;
-      EV_LOG(kDebug, "epoll_ctl: op=%d fd=%d", op, fd);
-      EV_VERIFY(epoll_ctl(epfd_, op, fd, &epev) != -1);
-
-      if (del_in)
-        io_event->event_in = 0;
-      if (del_out)
-        io_event->event_out = 0;
     }
 
     ev->reactor = 0;
@@ -397,7 +570,8 @@ namespace libev {
     DelFromList(ev);
     // now 'ev' is a free event, which can be destroyed
 
-    int perist = ev->event & kEvPersist;
+    int perist = (ev->event & kEvPersist)
+      && (!(ev->event & kEvTimer) || IsRepeating(ev));
     int canceled = (ev->real_event & kEvCanceled);
     int put_back = perist && !canceled;
 
@@ -408,7 +582,7 @@ namespace libev {
       if (canceled)
         EV_LOG(kDebug, "Event(%p) has been canceled", ev);
 
-      CleanUp(ev);
+      CleanUp(ev, 1);
       ev_cleaned_ = 1;
     }
     else
@@ -417,8 +591,18 @@ namespace libev {
     }
     ev_canceled_ = 0;
 
+    int unregister_fd = unregister_fd_;
     ev->flags |= kInCallback;
     ev->callback(ev->fd, ev->real_event, ev->user_data);
+    if (unregister_fd != -1 && unregister_fd == unregister_fd_)
+    {
+      // 'ev' is not re-added, and the fd still has no events
+      unregister_fd_ = -1;
+      IOEvent * io_event = &fd_2_io_ev_[(size_t)unregister_fd];
+      // It fails if the callback has closed the fd.
+      (void)backend_->Ctl(unregister_fd, io_event->registered, 0);
+      io_event->registered = 0;
+    }
     if /*lint --e(774,845) */(!put_back || ev_canceled_)
       return;
     ev->flags &= ~kInCallback;
@@ -480,36 +664,64 @@ namespace libev {
     }// for
   }
 
-  void ReactorImpl::OnTimerReadable()
+  int ReactorImpl::Reschedule(Event * ev, int64_t now_ns)
   {
-    int result;
-    uint64_t expire;
+    int64_t timeout = timespec_to_ns(&ev->timeout);
+    int64_t interval = timespec_to_ns(&ev->interval);
+    int64_t times = (now_ns - timeout) / interval + 1;
+
+    timeout += times * interval;
+    ev->timeout.tv_sec = (time_t)(timeout / 1000000000);
+    ev->timeout.tv_nsec = (long)(timeout % 1000000000);
+
+    if (times > 1)
+      EV_LOG(kDebug, "Timer Event(%p) missed %d intervals", ev, (int)(times - 1));
+    if ((ev->event & kEvSkipMissed) || times > INT_MAX)
+      return 1;
+    return (int)times;
+  }
 
-    for (;;)
+  void ReactorImpl::ActivateTimer(Event * ev, int times)
+  {
+    if (!ev->IsActive())
     {
-      do result = read(timerfd_, &expire, sizeof(expire));
-      while (result == -1 && errno == EINTR);
-
-      if (result == -1 && errno == EAGAIN)
-        break;
+      ev->real_event = ev->event;
+      ev->triggered_times = times;
+      ev->AddToActive(&active_ev_list_);
+    }
+    else
+    {
+      // canceled, or a repeating timer not invoked yet
+      ev->real_event |= ev->event;
+      if (!(ev->event & kEvSkipMissed))
+        ev->triggered_times += times;
     }
 
-    timespec now;
-    EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+    EV_LOG(kDebug, "Timer Event(%p) is active", ev);
+  }
 
+  void ReactorImpl::OnTimerExpired()
+  {
+    const timespec& now = now_;
     Event * ev;
+    int64_t now_ns = timespec_to_ns(&now);
     while (!min_time_heap_.empty())
     {
-      ev = min_time_heap_.top();
-
-      if (timespec_le(&ev->timeout, &now))
+      if (min_time_heap_.top_deadline() <= now_ns)
       {
-        min_time_heap_.pop();
-
-        ev->real_event = ev->event;
-        ev->AddToActive(&active_ev_list_);
-
-        EV_LOG(kDebug, "Timer Event(%p) is active", ev);
+        ev = min_time_heap_.top();
+        if (IsRepeating(ev))
+        {
+          // reschedule in place
+          int times = Reschedule(ev, now_ns);
+          min_time_heap_.adjust_top();
+          ActivateTimer(ev, times);
+        }
+        else
+        {
+          min_time_heap_.pop();
+          ActivateTimer(ev, 1);
+        }
       }
       else
       {
@@ -517,22 +729,61 @@ namespace libev {
       }
     }
 
+    if (!timer_wheel_.empty())
+    {
+      timespec deadline;
+      timer_wheel_.advance(&now);
+      while ((ev = timer_wheel_.pop()) != 0)
+      {
+        if (IsRepeating(ev))
+        {
+          int times = Reschedule(ev, now_ns);
+          timer_wheel_.push(ev, &deadline);
+          ActivateTimer(ev, times);
+        }
+        else
+        {
+          ActivateTimer(ev, 1);
+        }
+      }
+    }
+
     ScheduleTimer();
   }
 
+  void ReactorImpl::RunTasks()
+  {
+    TaskNode * node = task_queue_.pop_all();
+    TaskNode * next;
+
+    while (node)
+    {
+      next = node->next;
+      node->callback(node->user_data);
+      delete node;
+      node = next;
+    }
+  }
+
   int ReactorImpl::PollImpl(int limit, int blocking)
   {
     EV_ASSERT(limit >= 0);
 
     int number = 0;
     int i, result;
-    int epevents_size = (int)ep_ev_.size();
+    const epoll_event * results;
     ListNode * node;
     Event * ev;
-    int timeout = (blocking)?(-1):(0);
+    int interrupted;
+    int timer_expired;
 
+    UpdateNow();
     for (;;)
     {
+      // 0.run posted tasks
+      if (!task_queue_.empty())
+        RunTasks();
+
       // 1.handle active events in 'active_ev_list_'
       while (!active_ev_list_.empty())
       {
@@ -548,33 +799,50 @@ namespace libev {
       }
 
       // 2.check to quit in blocking mode
-      if (blocking && ev_list_.empty() && sig_ev_list_.empty())
+      if (blocking && ev_list_.empty() && sig_ev_list_.empty() && refcount_ == 0
+          && task_queue_.empty())
       {
         EV_LOG(kDebug, "Event loop quits for no events");
         return number;
       }
 
-      // 3.epoll_wait
-      EV_LOG(kDebug, "epoll_wait");
-      do result = epoll_wait(epfd_, &ep_ev_[0], epevents_size, timeout);
-      while (result == -1 && errno == EINTR);
-      EV_LOG(kDebug, "after epoll_wait");
+      // 3.wait for ready fds
+      if (backend_ == 0)
+      {
+        errno = EBADF;
+        return kEvFailure;
+      }
+      FlushChanges();
+      // From now on, 'Post' must wake the reactor up.
+      // If any task has been posted or any event is active, do not block.
+      (void)__sync_fetch_and_and(&wakeup_pending_, 0);
+      result = backend_->Wait(blocking && task_queue_.empty() && active_ev_list_.empty(),
+          &timer_expired);
+      (void)__sync_fetch_and_or(&wakeup_pending_, 1);
 
       if (result == -1)
         return kEvFailure;
 
       EV_ASSERT(result >= 0);
 
+      // sample the clock once per iteration
+      UpdateNow();
+      if (timer_expired)
+        OnTimerExpired();
+
+      interrupted = 0;
+      results = backend_->events();
       for (i=0; i<result; i++)
       {
-        int fd = ep_ev_[(size_t)i].data.fd;
-        int events = (int)ep_ev_[(size_t)i].events;
+        int fd = results[i].data.fd;
+        int events = (int)results[i].events;
 
         if (fd == interrupter_.fd())
         {
-          // interrupted
+          // interrupted by 'Stop', or woken up by 'Post'
           interrupter_.Reset();
-          return number;
+          if (__sync_fetch_and_and(&stop_pending_, 0))
+            interrupted = 1;
         }
         else if (fd == sigfd_)
         {
@@ -582,12 +850,6 @@ namespace libev {
           EV_ASSERT(events & EPOLLIN);
           OnSignalReadable();
         }
-        else if (fd == timerfd_)
-        {
-          // timer
-          EV_ASSERT(events & EPOLLIN);
-          OnTimerReadable();
-        }
         else
         {
           // io
@@ -598,12 +860,27 @@ namespace libev {
 
           io_event = &fd_2_io_ev_[(size_t)fd];
 
-          if (events & (EPOLLERR|EPOLLHUP))
+          if ((events & (EPOLLERR|EPOLLHUP)) == EPOLLERR && IsErrQueuePolled(io_event))
+          {
+            // the error queue is readable, which is not fatal
+            real_event |= kEvErrQueue;
+            if (events & EPOLLIN)
+              real_event |= kEvIn;
+            if (events & EPOLLOUT)
+              real_event |= kEvOut;
+
+            if (io_event->event_in
+                && ((events & EPOLLIN) || (io_event->event_in->event & kEvErrQueue)))
+              event_in = io_event->event_in;
+            if (io_event->event_out
+                && ((events & EPOLLOUT) || (io_event->event_out->event & kEvErrQueue)))
+              event_out = io_event->event_out;
+          }
+          else if (events & (EPOLLERR|EPOLLHUP))
           {
             event_in = io_event->event_in;
             event_out = io_event->event_out;
             real_event |= kEvErr;
-            EV_ASSERT(event_in || event_out);
           }
           else
           {
@@ -611,16 +888,27 @@ namespace libev {
             {
               event_in = io_event->event_in;
               real_event |= kEvIn;
-              EV_ASSERT(event_in);
             }
             if (events & EPOLLOUT)
             {
               event_out = io_event->event_out;
               real_event |= kEvOut;
-              EV_ASSERT(event_out);
             }
           }
 
+          if (event_in == 0 && event_out == 0)
+          {
+            // a stale registration, e.g. the fd was closed before its events were deleted
+            // while its file is still open elsewhere
+            if (io_event->event_in == 0 && io_event->event_out == 0)
+            {
+              EV_LOG(kWarning, "fd(%d) is ready but has no events, unregister it", fd);
+              if (backend_->Ctl(fd, events, 0) == kEvOK)
+                io_event->registered = 0;
+            }
+            continue;
+          }
+
           if (event_in)
           {
             event_in->real_event = real_event;
@@ -636,30 +924,27 @@ namespace libev {
         }
       }
 
-      // 4.check to quit in non-blocking mode
-      if (!blocking && result == 0 && active_ev_list_.empty())
+      if (interrupted)
       {
-        EV_LOG(kDebug, "Event loop quits for no new ready events");
+        EV_LOG(kDebug, "Event loop quits for being interrupted");
         return number;
       }
 
-      // 5.check and resize 'ep_ev_' to make epoll_wait get more results
-      if (result == epevents_size && epevents_size < kEpollEventsMaxSize)
+      // 4.check to quit in non-blocking mode
+      if (!blocking && result == 0 && active_ev_list_.empty() && task_queue_.empty())
       {
-        epevents_size *= 2;
-        try
-        {
-          ep_ev_.resize((size_t)epevents_size);// may throw(caught)
-        }
-        catch (...)
-        {
-        }
+        EV_LOG(kDebug, "Event loop quits for no new ready events");
+        return number;
       }
     }// for
   }
 
-  ReactorImpl::ReactorImpl() : sigfd_(-1), timerfd_(-1), epfd_(-1)
+  ReactorImpl::ReactorImpl() : sigfd_(-1), use_timer_wheel_(0),
+    unregister_fd_(-1), unregister_ev_(0), backend_(0), wakeup_pending_(1), stop_pending_(0), ev_count_(0), refcount_(0)
   {
+    timespec_clear(&timer_deadline_);
+    timespec_clear(&timer_slack_);
+    timespec_clear(&now_);
     EV_VERIFY(sigprocmask(0, 0, &old_sigset_) != -1);
   }
 
@@ -669,7 +954,7 @@ namespace libev {
     EV_VERIFY(sigprocmask(SIG_SETMASK, &old_sigset_, 0) != -1);
   }
 
-  int ReactorImpl::Init()
+  int ReactorImpl::Init(int flags)
   {
     if (sigfd_ != -1)
     {
@@ -677,10 +962,20 @@ namespace libev {
       return kEvFailure;
     }
 
+    if ((flags & kEvBackendAuto) == 0)
+    {
+      EV_LOG(kError, "No backend is selected");
+      errno = EINVAL;
+      return kEvFailure;
+    }
+    use_timer_wheel_ = flags & kEvTimerWheel;
+    timespec_clear(&timer_deadline_);
+    UpdateNow();
+
     try
     {
-      fd_2_io_ev_.resize(kEpollEventsSize);// may throw(caught)
-      ep_ev_.resize(kEpollEventsSize);// may throw(caught)
+      fd_2_io_ev_.resize(kIOEventsSize);// may throw(caught)
+      changes_.reserve(kIOEventsSize);// may throw(caught)
     }
     catch (...)
     {
@@ -688,53 +983,54 @@ namespace libev {
     }
 
 
-    sigemptyset(&sigset_);
-    sigfd_ = signalfd(-1, &sigset_, SFD_CLOEXEC|SFD_NONBLOCK);
-    if (sigfd_ == -1)
+    // prefer io_uring if selected, and fall back to epoll if also selected
+    if (flags & kEvBackendIOUring)
     {
-      EV_LOG(kError, "signalfd: %s", strerror(errno));
-      return kEvFailure;
+      backend_ = NewIOUringBackend();
+      if (backend_ && backend_->Init() != kEvOK)
+      {
+        delete backend_;
+        backend_ = 0;
+      }
+      if (backend_ == 0 && (flags & kEvBackendEpoll))
+        EV_LOG(kWarning, "io_uring is not available, fall back to epoll");
     }
-    for (int i=0; i<_NSIG; i++)
+    if (backend_ == 0 && (flags & kEvBackendEpoll))
     {
-      sig_ev_refcount_[i] = 0;
+      backend_ = NewEpollBackend(flags);
+      if (backend_ && backend_->Init() != kEvOK)
+      {
+        delete backend_;
+        backend_ = 0;
+      }
     }
-
-
-    timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
-    if (timerfd_ == -1)
+    if (backend_ == 0)
     {
-      safe_close(sigfd_);
-      sigfd_ = -1;
-      EV_LOG(kError, "timerfd_create: %s", strerror(errno));
+      EV_LOG(kError, "No backend is available");
       return kEvFailure;
     }
+    EV_LOG(kDebug, "Reactor uses %s", backend_->name());
 
 
-    epfd_ = epoll_create(kEpollSize);
-    if (epfd_ == -1)
+    sigemptyset(&sigset_);
+    sigfd_ = signalfd(-1, &sigset_, SFD_CLOEXEC|SFD_NONBLOCK);
+    if (sigfd_ == -1)
     {
-      safe_close(timerfd_);
-      timerfd_ = -1;
-      safe_close(sigfd_);
-      sigfd_ = -1;
-      EV_LOG(kError, "epoll_create: %s", strerror(errno));
+      delete backend_;
+      backend_ = 0;
+      EV_LOG(kError, "signalfd: %s", strerror(errno));
       return kEvFailure;
     }
-    // close after execve
-    if (fcntl(epfd_, F_SETFD, 1) == -1)
+    for (int i=0; i<_NSIG; i++)
     {
-      EV_LOG(kWarning, "fcntl: %s", strerror(errno));
-      // ignore the failure of fcntl
+      sig_ev_refcount_[i] = 0;
     }
 
 
     if (interrupter_.Init() != kEvOK)
     {
-      safe_close(epfd_);
-      epfd_ = -1;
-      safe_close(timerfd_);
-      timerfd_ = -1;
+      delete backend_;
+      backend_ = 0;
       safe_close(sigfd_);
       sigfd_ = -1;
       return kEvFailure;
@@ -742,29 +1038,15 @@ namespace libev {
     interrupter_.Reset();
 
 
-    epoll_event epev[3];
-    epev[0].data.u64 = 0;// suppress valgrind warnings
-    epev[0].data.fd = sigfd_;
-    epev[1].data.u64 = 0;
-    epev[1].data.fd = timerfd_;
-    epev[2].data.u64 = 0;
-    epev[2].data.fd = interrupter_.fd();
-
-    for (int i=0; i<3; i++)
+    if (backend_->Ctl(sigfd_, 0, EPOLLIN|EPOLLET) != kEvOK
+        || backend_->Ctl(interrupter_.fd(), 0, EPOLLIN|EPOLLET) != kEvOK)
     {
-      epev[i].events = EPOLLIN|EPOLLET;
-      if (epoll_ctl(epfd_, EPOLL_CTL_ADD, epev[i].data.fd, &epev[i]) == -1)
-      {
-        interrupter_.UnInit();
-        safe_close(epfd_);
-        epfd_ = -1;
-        safe_close(timerfd_);
-        timerfd_ = -1;
-        safe_close(sigfd_);
-        sigfd_ = -1;
-        EV_LOG(kError, "epoll_ctl: %s", strerror(errno));
-        return kEvFailure;
-      }
+      interrupter_.UnInit();
+      delete backend_;
+      backend_ = 0;
+      safe_close(sigfd_);
+      sigfd_ = -1;
+      return kEvFailure;
     }
 
     return kEvOK;
@@ -774,20 +1056,15 @@ namespace libev {
   {
     CancelAll();
     (void)Poll(0);
+    // run tasks left by the last poll, e.g. it quits early for a pending 'Stop',
+    // and tasks posted by them, and free their nodes
+    while (!task_queue_.empty())
+      RunTasks();
 
     interrupter_.UnInit();
 
-    if (epfd_ != -1)
-    {
-      safe_close(epfd_);
-      epfd_ = -1;
-    }
-
-    if (timerfd_ != -1)
-    {
-      safe_close(timerfd_);
-      timerfd_ = -1;
-    }
+    delete backend_;
+    backend_ = 0;
 
     if (sigfd_ != -1)
     {
@@ -796,7 +1073,8 @@ namespace libev {
     }
 
     std::vector<IOEvent>().swap(fd_2_io_ev_);
-    std::vector<epoll_event>().swap(ep_ev_);
+    std::vector<int>().swap(changes_);
+    unregister_fd_ = -1;
   }
 
   int ReactorImpl::Add(Event * ev)
@@ -904,14 +1182,116 @@ namespace libev {
 
   int ReactorImpl::Stop()
   {
+    (void)__sync_fetch_and_or(&stop_pending_, 1);
     return interrupter_.Interrupt();
   }
 
+  int ReactorImpl::Post(ev_task_callback callback, void * user_data)
+  {
+    if (callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    TaskNode * node;
+    try
+    {
+      node = new TaskNode;// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+    node->callback = callback;
+    node->user_data = user_data;
+    task_queue_.push(node);
+
+    // only the first post after the reactor goes to wait wakes it up
+    if (__sync_fetch_and_or(&wakeup_pending_, 1) == 0)
+      return interrupter_.Interrupt();
+    return kEvOK;
+  }
+
+  void ReactorImpl::Ref()
+  {
+    refcount_++;
+  }
+
+  void ReactorImpl::Unref()
+  {
+    EV_ASSERT(refcount_ > 0);
+    refcount_--;
+  }
+
+  int ReactorImpl::Load()const
+  {
+    return *(volatile const int *)&ev_count_;
+  }
+
+  int ReactorImpl::SetTimerWheelTick(const timespec * tick)
+  {
+    if (tick == 0 || !timespec_isset(tick) || tick->tv_sec < 0
+        || tick->tv_nsec < 0 || tick->tv_nsec >= 1000000000)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (!timer_wheel_.empty())
+    {
+      EV_LOG(kError, "Timing wheel is not empty");
+      return kEvExists;
+    }
+
+    timer_wheel_.set_tick(tick);
+    return kEvOK;
+  }
+
+  void ReactorImpl::UpdateNow()
+  {
+    EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now_) != -1);
+  }
+
+  int ReactorImpl::AddTimer(Event * ev, const timespec * after)
+  {
+    if (ev == 0 || after == 0 || after->tv_sec < 0
+        || after->tv_nsec < 0 || after->tv_nsec >= 1000000000)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    // 'timeout' of an added event must not be modified
+    if (ev->IsInList() || ev->IsActive() || ev->reactor)
+    {
+      EV_LOG(kError, "Event(%p) has been added before", ev);
+      return kEvExists;
+    }
+
+    ev->timeout = now_;
+    timespec_addto(&ev->timeout, after);
+    return Add(ev);
+  }
+
+  int ReactorImpl::SetTimerSlack(const timespec * slack)
+  {
+    if (slack == 0 || slack->tv_sec < 0 || slack->tv_nsec < 0 || slack->tv_nsec >= 1000000000)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    // it takes effect from the next arming
+    timer_slack_ = *slack;
+    return kEvOK;
+  }
+
 
   /************************************************************************/
   Reactor::Reactor() {impl_ = new ReactorImpl;}// may throw(uncaught)
   Reactor::~Reactor() {delete impl_;}
-  int Reactor::Init() {return impl_->Init();}
+  int Reactor::Init(int flags) {return impl_->Init(flags);}
   void Reactor::UnInit() {impl_->UnInit();}
   int Reactor::Add(Event * ev) {return impl_->Add(ev);}
   int Reactor::Del(Event * ev) {return impl_->Del(ev);}
@@ -923,6 +1303,22 @@ namespace libev {
   int Reactor::Run() {return Run(0);}
   int Reactor::Run(int limit) {return impl_->Run(limit);}
   int Reactor::Stop() {return impl_->Stop();}
+  int Reactor::Post(ev_task_callback callback, void * user_data) {return impl_->Post(callback, user_data);}
+  void Reactor::Ref() {impl_->Ref();}
+  void Reactor::Unref() {impl_->Unref();}
+  int Reactor::Load()const {return impl_->Load();}
+  int Reactor::SetTimerWheelTick(const timespec * tick) {return impl_->SetTimerWheelTick(tick);}
+  int Reactor::SetTimerSlack(const timespec * slack) {return impl_->SetTimerSlack(slack);}
+  const timespec * Reactor::Now()const {return impl_->Now();}
+  void Reactor::UpdateNow() {impl_->UpdateNow();}
+  int Reactor::AddTimer(Event * ev, const timespec * after) {return impl_->AddTimer(ev, after);}
+  int Reactor::AddTimer(Event * ev, int64_t ms)
+  {
+    timespec after;
+    after.tv_sec = (time_t)(ms / 1000);
+    after.tv_nsec = (long)(ms % 1000) * 1000000;
+    return impl_->AddTimer(ev, &after);
+  }
 
 
   /************************************************************************/
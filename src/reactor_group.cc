@@ -0,0 +1,215 @@
+/** @file
+ * @brief a group of reactors, each of which runs in its own thread
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "reactor_group.h"
+#include "log.h"
+#include "header.h"
+#include <pthread.h>
+#include <sched.h>
+
+namespace libev {
+
+  struct ReactorGroup::Loop
+  {
+    Reactor reactor;
+    pthread_t tid;
+    int cpu;// the CPU to be pinned to, -1 for no pinning
+    int started;
+  };
+
+  void * ReactorGroup::ThreadFunc(void * arg)
+  {
+    Loop * loop = (Loop *)arg;
+
+    if (loop->cpu >= 0)
+    {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(loop->cpu, &cpuset);
+      int result = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+      if (result != 0)
+        EV_LOG(kWarning, "pthread_setaffinity_np: %s", strerror(result));
+      // ignore the failure of pthread_setaffinity_np
+    }
+
+    EV_LOG(kDebug, "Reactor(%p) is running on CPU(%d)", &loop->reactor, loop->cpu);
+    (void)loop->reactor.Run();
+    EV_LOG(kDebug, "Reactor(%p) quits", &loop->reactor);
+    return 0;
+  }
+
+  ReactorGroup::ReactorGroup() : pin_(1), started_(0)
+  {
+  }
+
+  ReactorGroup::~ReactorGroup()
+  {
+    UnInit();
+  }
+
+  int ReactorGroup::Init(int size, int pin, int flags)
+  {
+    if (!loops_.empty())
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0)
+      cpus = 1;
+    if (size <= 0)
+      size = (int)cpus;
+    pin_ = pin;
+
+    int ret;
+    for (int i=0; i<size; i++)
+    {
+      Loop * loop = 0;
+      try
+      {
+        loop = new Loop;// may throw(caught)
+        loops_.push_back(loop);// may throw(caught)
+      }
+      catch (...)
+      {
+        delete loop;
+        UnInit();
+        return kEvNoMemory;
+      }
+
+      loop->cpu = (pin_)?(int)(i % cpus):(-1);
+      loop->started = 0;
+
+      if ((ret = loop->reactor.Init(flags)) != kEvOK)
+      {
+        UnInit();
+        return ret;
+      }
+      // keep the loop running until 'Stop'
+      loop->reactor.Ref();
+    }
+
+    return kEvOK;
+  }
+
+  void ReactorGroup::UnInit()
+  {
+    if (started_)
+    {
+      (void)Stop();
+      Join();
+    }
+
+    for (size_t i=0; i<loops_.size(); i++)
+      delete loops_[i];
+    loops_.clear();
+  }
+
+  Reactor * ReactorGroup::At(int index)
+  {
+    EV_ASSERT(index >= 0 && index < size());
+    return &loops_[(size_t)index]->reactor;
+  }
+
+  Reactor * ReactorGroup::LeastLoaded()
+  {
+    return At(LeastLoadedIndex());
+  }
+
+  int ReactorGroup::LeastLoadedIndex()const
+  {
+    EV_ASSERT(!loops_.empty());
+
+    int index = 0;
+    int min_load = loops_[0]->reactor.Load();
+    for (size_t i=1; i<loops_.size(); i++)
+    {
+      int load = loops_[i]->reactor.Load();
+      if (load < min_load)
+      {
+        min_load = load;
+        index = (int)i;
+      }
+    }
+    return index;
+  }
+
+  int ReactorGroup::Add(Event * ev, int index)
+  {
+    if (loops_.empty() || index >= size())
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (index < 0)
+      index = LeastLoadedIndex();
+    return At(index)->Add(ev);
+  }
+
+  int ReactorGroup::Start()
+  {
+    if (loops_.empty() || started_)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    started_ = 1;
+    for (size_t i=0; i<loops_.size(); i++)
+    {
+      Loop * loop = loops_[i];
+      int result = pthread_create(&loop->tid, 0, ThreadFunc, loop);
+      if (result != 0)
+      {
+        EV_LOG(kError, "pthread_create: %s", strerror(result));
+        (void)Stop();
+        Join();
+        errno = result;
+        return kEvFailure;
+      }
+      loop->started = 1;
+    }
+
+    return kEvOK;
+  }
+
+  int ReactorGroup::Stop()
+  {
+    int ret = kEvOK;
+    for (size_t i=0; i<loops_.size(); i++)
+    {
+      if (loops_[i]->reactor.Stop() != kEvOK)
+        ret = kEvFailure;
+    }
+    return ret;
+  }
+
+  void ReactorGroup::Join()
+  {
+    for (size_t i=0; i<loops_.size(); i++)
+    {
+      Loop * loop = loops_[i];
+      if (loop->started)
+      {
+        EV_VERIFY(pthread_join(loop->tid, 0) == 0);
+        loop->started = 0;
+      }
+    }
+    started_ = 0;
+  }
+
+  int ReactorGroup::Run()
+  {
+    int ret;
+    if ((ret = Start()) != kEvOK)
+      return ret;
+    Join();
+    return kEvOK;
+  }
+}
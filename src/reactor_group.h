@@ -0,0 +1,65 @@
+/** @file
+ * @brief a group of reactors, each of which runs in its own thread
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_REACTOR_GROUP_H
+#define LIBEV_REACTOR_GROUP_H
+
+#include "ev.h"
+#include <vector>
+
+namespace libev {
+
+  class ReactorGroup
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(ReactorGroup);
+
+      struct Loop;
+      std::vector<Loop *> loops_;
+      int pin_;
+      int started_;
+
+      static void * ThreadFunc(void * arg);
+
+    public:
+      ReactorGroup();
+      ~ReactorGroup();
+
+      // create 'size' reactors, one reactor per online CPU if 'size' <= 0
+      // if 'pin' is non-zero, the i-th loop thread is pinned to CPU (i % CPU number)
+      // 'flags' is passed to 'Reactor::Init'
+      int Init(int size = 0, int pin = 1, int flags = kEvBackendEpoll);
+      void UnInit();
+
+      // the number of reactors
+      int size()const {return (int)loops_.size();}
+      // the 'index'-th reactor
+      Reactor * At(int index);
+      // the reactor with the fewest events
+      Reactor * LeastLoaded();
+      // the index of the reactor with the fewest events
+      int LeastLoadedIndex()const;
+
+      // add 'ev' to the 'index'-th reactor,
+      // or to the least loaded one if 'index' < 0.
+      // It must be called before 'Start',
+      // or inside a callback running on the target reactor.
+      // From other threads, 'Post' a task that adds 'ev' to the target reactor.
+      int Add(Event * ev, int index = -1);
+
+      // start one thread per reactor, each of which runs 'Reactor::Run'
+      int Start();
+      // stop all reactors, it may be called from any thread
+      int Stop();
+      // wait for all threads started by 'Start' to quit
+      void Join();
+      // 'Start' and then 'Join'
+      int Run();
+  };
+}
+
+#endif
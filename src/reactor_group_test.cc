@@ -0,0 +1,129 @@
+/** @file
+ * @brief test reactor group
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "ev.h"
+#include "log.h"
+#include "reactor_group.h"
+#include "header.h"
+#include <pthread.h>
+
+using namespace libev;
+
+static const int kLoops = 4;
+static const int kConnections = 8;
+
+static int counter;
+
+struct Test0_Helper
+{
+  ReactorGroup * group;
+  Event ev;
+  int fd[2];
+  pthread_t tid;
+};
+
+static void Test0_Callback(int fd, int event, void * user_data)
+{
+  Test0_Helper * helper = (Test0_Helper *)user_data;
+  char c;
+
+  EV_VERIFY(event & kEvIn);
+  EV_VERIFY(read(fd, &c, 1) == 1);
+  helper->tid = pthread_self();
+  EV_LOG(kInfo, "Test0_Callback fd=%d", fd);
+
+  if (__sync_add_and_fetch(&counter, 1) == kConnections)
+    EV_VERIFY(helper->group->Stop() == kEvOK);
+}
+
+static void Test0()
+{
+  EV_LOG(kInfo, "Test 0: place fds on the least loaded reactors");
+
+  counter = 0;
+
+  ReactorGroup group;
+  Test0_Helper helper[kConnections];
+
+  EV_VERIFY(group.Init(kLoops) == kEvOK);
+  EV_VERIFY(group.size() == kLoops);
+
+  for (int i=0; i<kConnections; i++)
+  {
+    EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, helper[i].fd) == 0);
+    helper[i].group = &group;
+    helper[i].ev.fd = helper[i].fd[0];
+    helper[i].ev.event = kEvIn;
+    helper[i].ev.callback = Test0_Callback;
+    helper[i].ev.user_data = &helper[i];
+    EV_VERIFY(group.Add(&helper[i].ev) == kEvOK);
+  }
+
+  // fds are spread evenly
+  for (int i=0; i<kLoops; i++)
+    EV_VERIFY(group.At(i)->Load() == kConnections / kLoops);
+
+  EV_VERIFY(group.Start() == kEvOK);
+  for (int i=0; i<kConnections; i++)
+    EV_VERIFY(write(helper[i].fd[1], "x", 1) == 1);
+  group.Join();
+
+  EV_VERIFY(counter == kConnections);
+  for (int i=0; i<kLoops; i++)
+    EV_VERIFY(group.At(i)->Load() == 0);
+
+  // the events ran in one thread per reactor
+  int threads = 0;
+  for (int i=0; i<kConnections; i++)
+  {
+    int j;
+    for (j=0; j<i; j++)
+    {
+      if (pthread_equal(helper[i].tid, helper[j].tid))
+        break;
+    }
+    if (j == i)
+      threads++;
+  }
+  EV_VERIFY(threads == kLoops);
+
+  group.UnInit();
+  for (int i=0; i<kConnections; i++)
+  {
+    safe_close(helper[i].fd[0]);
+    safe_close(helper[i].fd[1]);
+  }
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: idle reactors keep running until stopped");
+
+  ReactorGroup group;
+  EV_VERIFY(group.Init(kLoops, 0) == kEvOK);
+  EV_VERIFY(group.Start() == kEvOK);
+  sleep(1);
+  EV_VERIFY(group.Stop() == kEvOK);
+  group.Join();
+
+  // restart
+  EV_VERIFY(group.Start() == kEvOK);
+  EV_VERIFY(group.Stop() == kEvOK);
+  group.Join();
+  group.UnInit();
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test0();
+  Test1();
+  return 0;
+}
@@ -0,0 +1,250 @@
+/** @file
+ * @brief relay data between two sockets with splice
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "relay.h"
+#include "log.h"
+#include "header.h"
+
+namespace libev {
+
+  static const size_t kMaxSplice = 1024 * 1024;// bytes per splice into a pipe
+
+  static int SetNonblock(int fd)
+  {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      EV_LOG(kError, "fcntl: %s", strerror(errno));
+      return kEvFailure;
+    }
+    return kEvOK;
+  }
+
+  Relay::Relay()
+    : reactor_(0), pipe_size_(0), callback_(0), user_data_(0), destroyed_(0)
+  {
+    for (int i=0; i<2; i++)
+    {
+      dirs_[i].from = dirs_[i].to = -1;
+      dirs_[i].pipe[0] = dirs_[i].pipe[1] = -1;
+      dirs_[i].piped = 0;
+      dirs_[i].eof = dirs_[i].shut = 0;
+      dirs_[i].bytes = 0;
+    }
+  }
+
+  Relay::~Relay()
+  {
+    UnInit();
+  }
+
+  int Relay::Init(Reactor * reactor, int a, int b, relay_callback callback, void * user_data)
+  {
+    if (reactor == 0 || a < 0 || b < 0 || a == b || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "Relay(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    if (SetNonblock(a) != kEvOK || SetNonblock(b) != kEvOK)
+      return kEvFailure;
+
+    int fds[2] = {a, b};
+    for (int i=0; i<2; i++)
+    {
+      Direction * dir = &dirs_[i];
+      dir->from = fds[i];
+      dir->to = fds[1 - i];
+      dir->piped = 0;
+      dir->eof = 0;
+      dir->shut = 0;
+      dir->bytes = 0;
+      if (pipe2(dir->pipe, O_NONBLOCK|O_CLOEXEC) == -1)
+      {
+        EV_LOG(kError, "pipe2: %s", strerror(errno));
+        goto fail;
+      }
+      if (pipe_size_ && fcntl(dir->pipe[1], F_SETPIPE_SZ, (int)pipe_size_) == -1)
+        EV_LOG(kWarning, "fcntl(F_SETPIPE_SZ): %s", strerror(errno));
+
+      ev_[i].fd = fds[i];
+      ev_[i].event = kEvIn|kEvOut|kEvET|kEvPersist;
+      ev_[i].callback = OnEvent;
+      ev_[i].user_data = this;
+    }
+
+    int ret;
+    if ((ret = reactor->Add(&ev_[0])) != kEvOK)
+      goto fail_ret;
+    if ((ret = reactor->Add(&ev_[1])) != kEvOK)
+    {
+      (void)ev_[0].Del();
+      goto fail_ret;
+    }
+
+    reactor_ = reactor;
+    callback_ = callback;
+    user_data_ = user_data;
+    return kEvOK;
+
+fail:
+    ret = kEvFailure;
+fail_ret:
+    int error = errno;
+    Stop();
+    errno = error;
+    return ret;
+  }
+
+  void Relay::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    Stop();
+    reactor_ = 0;
+
+    // tell the callback invoker that the relay is gone
+    DestroyedGuard::Destroy(&destroyed_);
+  }
+
+  void Relay::Stop()
+  {
+    for (int i=0; i<2; i++)
+    {
+      Direction * dir = &dirs_[i];
+      (void)ev_[i].Del();
+      if (dir->pipe[0] != -1)
+      {
+        (void)safe_close(dir->pipe[0]);
+        (void)safe_close(dir->pipe[1]);
+        dir->pipe[0] = dir->pipe[1] = -1;
+      }
+      dir->piped = 0;
+    }
+  }
+
+  void Relay::SetPipeSize(size_t size)
+  {
+    pipe_size_ = size;
+  }
+
+  int Relay::Pump(Direction * dir)
+  {
+    ssize_t n;
+    int progress;
+
+    do
+    {
+      progress = 0;
+
+      // fill the pipe, which stops at EOF, or when the source is drained or the pipe is full
+      if (!dir->eof)
+      {
+        do n = splice(dir->from, 0, dir->pipe[1], 0, kMaxSplice,
+            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        while (n == -1 && errno == EINTR);
+
+        if (n > 0)
+        {
+          dir->piped += (size_t)n;
+          progress = 1;
+        }
+        else if (n == 0)
+        {
+          dir->eof = 1;
+        }
+        else if (errno != EAGAIN)
+        {
+          return kEvFailure;
+        }
+      }
+
+      // drain the pipe to the sink
+      if (dir->piped)
+      {
+        do n = splice(dir->pipe[0], 0, dir->to, 0, dir->piped,
+            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        while (n == -1 && errno == EINTR);
+
+        if (n > 0)
+        {
+          dir->piped -= (size_t)n;
+          dir->bytes += (uint64_t)n;
+          progress = 1;
+        }
+        else if (n == -1 && errno != EAGAIN)
+        {
+          return kEvFailure;
+        }
+      }
+    }
+    while (progress);
+
+    // propagate EOF
+    if (dir->eof && dir->piped == 0 && !dir->shut)
+    {
+      EV_LOG(kDebug, "Relay(%p) propagates EOF from fd %d to fd %d", this, dir->from, dir->to);
+      if (shutdown(dir->to, SHUT_WR) == -1 && errno != ENOTCONN)
+        return kEvFailure;
+      dir->shut = 1;
+    }
+    return kEvOK;
+  }
+
+  void Relay::Finish(int error)
+  {
+    if (error)
+      EV_LOG(kDebug, "Relay(%p) failed: %s", this, strerror(error));
+    Stop();
+
+    DestroyedGuard destroyed(&destroyed_);
+    callback_(this, error, user_data_);
+    if (destroyed.Leave())
+      return;
+  }
+
+  void Relay::OnEvent(int fd, int event, void * user_data)
+  {
+    Relay * relay = (Relay *)user_data;
+
+    if (event & kEvCanceled)
+      return;
+
+    // data may move in both directions whenever 'fd' is readable or writable
+    for (int i=0; i<2; i++)
+    {
+      if (relay->Pump(&relay->dirs_[i]) != kEvOK)
+      {
+        relay->Finish(errno);
+        return;
+      }
+    }
+
+    if (event & kEvErr)
+    {
+      int error = 0;
+      socklen_t len = sizeof(error);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+      if (error)
+      {
+        relay->Finish(error);
+        return;
+      }
+    }
+
+    if (relay->dirs_[0].shut && relay->dirs_[1].shut)
+      relay->Finish(0);
+  }
+}
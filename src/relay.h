@@ -0,0 +1,87 @@
+/** @file
+ * @brief relay data between two sockets with splice
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_RELAY_H
+#define LIBEV_RELAY_H
+
+#include "ev.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace libev {
+
+  class Relay;
+  // 'error' is 0 if both directions have been closed, the relay stops
+  typedef void (*relay_callback)(Relay * relay, int error, void * user_data);
+
+  // A relay pairs two connected sockets(e.g. of a layer-4 proxy),
+  // and moves data of each direction with splice through a pipe of its own,
+  // so that the data is not copied to user space.
+  // Each socket is polled for kEvIn and kEvOut with one edge triggered event,
+  // so that it is registered once.
+  // A direction stops reading while its pipe is full, which pushes its sender back
+  // through the socket buffer, without blocking the other direction.
+  // EOF of a direction is propagated by shutting down writing of the other socket
+  // after its pipe is drained.
+  // The process should ignore SIGPIPE, which may be raised by splice.
+  // The relay may be deleted inside its callback.
+  class Relay
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(Relay);
+
+      struct Direction
+      {
+        int from;
+        int to;
+        int pipe[2];
+        size_t piped;// bytes in 'pipe'
+        int eof;// EOF has been read from 'from'
+        int shut;// writing of 'to' has been shut down
+        uint64_t bytes;// bytes relayed
+      };
+
+      Reactor * reactor_;
+      Event ev_[2];
+      Direction dirs_[2];// 0: from 'a' to 'b', 1: from 'b' to 'a'
+      size_t pipe_size_;
+      relay_callback callback_;
+      void * user_data_;
+      int * destroyed_;// set to 1 if the relay is destroyed inside its callback
+
+      static void OnEvent(int fd, int event, void * user_data);
+
+      // move data of 'dir' until its source is drained or its sink would block
+      // return kEvOK or kEvFailure
+      int Pump(Direction * dir);
+      // stop polling, and close the pipes
+      void Stop();
+      // stop and invoke the callback
+      void Finish(int error);
+
+    public:
+      Relay();
+      ~Relay();
+
+      // 'a' and 'b' are set to be nonblocking and polled by 'reactor',
+      // the relay does not own them
+      int Init(Reactor * reactor, int a, int b, relay_callback callback, void * user_data);
+      // data in the pipes is dropped
+      void UnInit();
+
+      // set the capacity of the pipes(F_SETPIPE_SZ) of later 'Init',
+      // 0 for the system default(64KB usually)
+      void SetPipeSize(size_t size);
+
+      Reactor * reactor()const {return reactor_;}
+      // bytes relayed from 'a' to 'b', and from 'b' to 'a'
+      uint64_t a_to_b()const {return dirs_[0].bytes;}
+      uint64_t b_to_a()const {return dirs_[1].bytes;}
+  };
+}
+
+#endif
@@ -0,0 +1,240 @@
+/** @file
+ * @brief benchmark Relay against relaying with read/write over the loopback
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "relay.h"
+#include "stream.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+
+using namespace libev;
+
+static const size_t kChunkSize = 64 * 1024;
+static const size_t kCopySize = 64 * 1024;// the buffer of the copying relay
+
+// relay from 'from' to 'to' with read/write through a user buffer
+struct CopyRelay
+{
+  int from;
+  int to;
+  Event ev_from;
+  Event ev_to;
+  char buf[kCopySize];
+  size_t begin;
+  size_t end;
+  int eof;
+};
+
+static void CopyPump(int /*fd*/, int event, void * user_data)
+{
+  CopyRelay * relay = (CopyRelay *)user_data;
+  ssize_t n;
+  int progress;
+
+  if (event & kEvCanceled)
+    return;
+
+  do
+  {
+    progress = 0;
+    if (!relay->eof && relay->end < kCopySize)
+    {
+      n = read(relay->from, relay->buf + relay->end, kCopySize - relay->end);
+      if (n > 0)
+      {
+        relay->end += (size_t)n;
+        progress = 1;
+      }
+      else if (n == 0)
+      {
+        relay->eof = 1;
+      }
+      else
+      {
+        EV_VERIFY(errno == EAGAIN);
+      }
+    }
+
+    if (relay->begin < relay->end)
+    {
+      n = write(relay->to, relay->buf + relay->begin, relay->end - relay->begin);
+      if (n > 0)
+      {
+        relay->begin += (size_t)n;
+        if (relay->begin == relay->end)
+          relay->begin = relay->end = 0;
+        progress = 1;
+      }
+      else
+      {
+        EV_VERIFY(errno == EAGAIN);
+      }
+    }
+  }
+  while (progress);
+
+  if (relay->eof && relay->begin == relay->end)
+  {
+    (void)relay->ev_from.Del();
+    (void)relay->ev_to.Del();
+    EV_VERIFY(shutdown(relay->to, SHUT_WR) == 0);
+  }
+}
+
+struct BenchHelper
+{
+  Stream * sender;
+  size_t size;
+  size_t sent;
+  size_t received;
+};
+
+static double Now()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+static void SendMore(BenchHelper * helper)
+{
+  static char buf[kChunkSize];
+
+  while (helper->sent < helper->size && helper->sender->output()->size() <= 4 * kChunkSize)
+  {
+    EV_VERIFY(helper->sender->Write(buf, sizeof(buf)) == kEvOK);
+    helper->sent += sizeof(buf);
+  }
+  if (helper->sent == helper->size)
+    EV_VERIFY(helper->sender->Shutdown() == kEvOK);
+}
+
+static void SenderCallback(Stream * /*stream*/, int event, void * user_data)
+{
+  BenchHelper * helper = (BenchHelper *)user_data;
+
+  if (event & kStreamLowWater)
+    SendMore(helper);
+  else if (event & (kStreamError|kStreamEOF))
+    EV_VERIFY(0);
+}
+
+static void ReceiverCallback(Stream * stream, int event, void * user_data)
+{
+  BenchHelper * helper = (BenchHelper *)user_data;
+
+  EV_VERIFY((event & kStreamError) == 0);
+  if (event & kStreamRead)
+  {
+    helper->received += stream->input()->size();
+    stream->input()->Consume(stream->input()->size());
+  }
+  if (event & kStreamEOF)
+  {
+    // close the other direction of the relay
+    EV_VERIFY(helper->received == helper->size);
+    EV_VERIFY(stream->Shutdown() == kEvOK);
+    stream->UnInit();
+    helper->sender->UnInit();
+  }
+}
+
+static void RelayCallback(Relay * relay, int error, void * /*user_data*/)
+{
+  EV_VERIFY(error == 0);
+  relay->UnInit();
+}
+
+// sender -> (a, relay, b) -> receiver
+static void Bench(const char * name, size_t size, bool use_splice)
+{
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Stream sender(&pool);
+  Stream receiver(&pool);
+  Relay relay;
+  ScopedPtr<CopyRelay> copy(new CopyRelay);
+  BenchHelper helper;
+  double begin, elapsed;
+  int client[2], server[2];
+
+  helper.sender = &sender;
+  helper.size = size;
+  helper.sent = 0;
+  helper.received = 0;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  TcpPair(client);
+  TcpPair(server);
+  EV_VERIFY(sender.Init(reactor.get(), client[0], SenderCallback, &helper) == kEvOK);
+  EV_VERIFY(receiver.Init(reactor.get(), server[1], ReceiverCallback, &helper) == kEvOK);
+  sender.SetWatermarks(kChunkSize, 4 * kChunkSize);
+
+  if (use_splice)
+  {
+    EV_VERIFY(relay.Init(reactor.get(), client[1], server[0], RelayCallback, 0) == kEvOK);
+  }
+  else
+  {
+    copy->from = client[1];
+    copy->to = server[0];
+    copy->begin = copy->end = 0;
+    copy->eof = 0;
+    EV_VERIFY(fcntl(copy->from, F_SETFL, O_NONBLOCK) == 0);
+    EV_VERIFY(fcntl(copy->to, F_SETFL, O_NONBLOCK) == 0);
+    copy->ev_from.fd = copy->from;
+    copy->ev_from.event = kEvIn|kEvET|kEvPersist;
+    copy->ev_from.callback = CopyPump;
+    copy->ev_from.user_data = copy.get();
+    copy->ev_to.fd = copy->to;
+    copy->ev_to.event = kEvOut|kEvET|kEvPersist;
+    copy->ev_to.callback = CopyPump;
+    copy->ev_to.user_data = copy.get();
+    EV_VERIFY(reactor->Add(&copy->ev_from) == kEvOK);
+    EV_VERIFY(reactor->Add(&copy->ev_to) == kEvOK);
+  }
+
+  begin = Now();
+  SendMore(&helper);
+  (void)reactor->Run();
+  elapsed = Now() - begin;
+
+  EV_VERIFY(helper.received == size);
+  printf("%-12s %6lu MB: %8.1f MB/s\n", name, (unsigned long)(size >> 20),
+      (double)size / (1 << 20) / elapsed);
+
+  relay.UnInit();
+  reactor.reset();
+  safe_close(client[0]);
+  safe_close(client[1]);
+  safe_close(server[0]);
+  safe_close(server[1]);
+}
+
+int main(int argc, char ** argv)
+{
+  size_t size = 256;// MB
+
+  GlobalLog().SetLevel(kWarning);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (argc > 1)
+  {
+    size = (size_t)atoi(argv[1]);
+    EV_VERIFY(size > 0);
+  }
+  size <<= 20;
+
+  for (int i=0; i<3; i++)
+  {
+    Bench("read/write", size, false);
+    Bench("splice", size, true);
+  }
+  return 0;
+}
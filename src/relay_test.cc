@@ -0,0 +1,264 @@
+/** @file
+ * @brief test relays
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "relay.h"
+#include "stream.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+#include <string>
+
+using namespace libev;
+
+static std::string RandomData(size_t size)
+{
+  std::string data(size, '\0');
+  for (size_t i=0; i<size; i++)
+    data[i] = (char)rand();
+  return data;
+}
+
+// an endpoint: the client or the server behind the relay
+struct Peer
+{
+  std::string received;
+  int eof;
+  int error;
+};
+
+static void PeerCallback(Stream * stream, int event, void * user_data)
+{
+  Peer * peer = (Peer *)user_data;
+  Buffer * input = stream->input();
+
+  if (event & kStreamRead)
+  {
+    while (!input->empty())
+    {
+      size_t size = input->size();
+      if (size > input->pool()->block_size())
+        size = input->pool()->block_size();
+      peer->received.append(input->Pullup(size), size);
+      input->Consume(size);
+    }
+  }
+  if (event & kStreamEOF)
+    peer->eof = 1;
+  if (event & kStreamError)
+    peer->error = stream->error();
+}
+
+struct RelayResult
+{
+  int done;
+  int error;
+};
+
+static void RelayCallback(Relay * relay, int error, void * user_data)
+{
+  RelayResult * result = (RelayResult *)user_data;
+
+  EV_VERIFY(relay->reactor());
+  result->done++;
+  result->error = error;
+}
+
+// client <-> (a, relay, b) <-> server
+struct Topology
+{
+  int client_fds[2];// client, a
+  int server_fds[2];// b, server
+  BlockPool pool;
+  Stream client;
+  Stream server;
+  Peer client_peer;
+  Peer server_peer;
+  Relay relay;
+  RelayResult result;
+
+  Topology() : client(&pool), server(&pool)
+  {
+    client_peer.eof = client_peer.error = 0;
+    server_peer.eof = server_peer.error = 0;
+    result.done = result.error = 0;
+  }
+
+  void Init(Reactor * reactor)
+  {
+    TcpPair(client_fds);
+    TcpPair(server_fds);
+    EV_VERIFY(client.Init(reactor, client_fds[0], PeerCallback, &client_peer) == kEvOK);
+    EV_VERIFY(server.Init(reactor, server_fds[1], PeerCallback, &server_peer) == kEvOK);
+    EV_VERIFY(relay.Init(reactor, client_fds[1], server_fds[0], RelayCallback, &result) == kEvOK);
+  }
+
+  ~Topology()
+  {
+    relay.UnInit();
+    client.UnInit();
+    server.UnInit();
+    safe_close(client_fds[0]);
+    safe_close(client_fds[1]);
+    safe_close(server_fds[0]);
+    safe_close(server_fds[1]);
+  }
+};
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: relay both directions");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Topology t;
+  std::string request = RandomData(4 * 1024 * 1024);
+  std::string response = RandomData(1024 * 1024 + 1);
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  t.Init(reactor.get());
+  EV_VERIFY(t.relay.Init(reactor.get(), 100, 101, RelayCallback, 0) == kEvExists);
+
+  EV_VERIFY(t.client.Write(request.data(), request.size()) == kEvOK);
+  EV_VERIFY(t.client.Shutdown() == kEvOK);
+  EV_VERIFY(t.server.Write(response.data(), response.size()) == kEvOK);
+  EV_VERIFY(t.server.Shutdown() == kEvOK);
+
+  while (t.result.done == 0)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  while (!t.client_peer.eof || !t.server_peer.eof)
+    EV_VERIFY(reactor->RunOne() >= 0);
+
+  EV_VERIFY(t.result.done == 1);
+  EV_VERIFY(t.result.error == 0);
+  EV_VERIFY(t.server_peer.received == request);
+  EV_VERIFY(t.client_peer.received == response);
+  EV_VERIFY(t.relay.a_to_b() == request.size());
+  EV_VERIFY(t.relay.b_to_a() == response.size());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: propagate half-close");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Topology t;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  t.Init(reactor.get());
+
+  EV_VERIFY(t.client.Write("ping", 4) == kEvOK);
+  EV_VERIFY(t.client.Shutdown() == kEvOK);
+  while (!t.server_peer.eof)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(t.server_peer.received == "ping");
+  EV_VERIFY(t.result.done == 0);
+
+  // the other direction still works
+  EV_VERIFY(t.server.Write("pong", 4) == kEvOK);
+  while (t.client_peer.received.size() < 4)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(t.client_peer.received == "pong");
+  EV_VERIFY(t.result.done == 0);
+
+  EV_VERIFY(t.server.Shutdown() == kEvOK);
+  while (t.result.done == 0 || !t.client_peer.eof)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(t.result.error == 0);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test3_OnTimer(int /*fd*/, int /*event*/, void * user_data)
+{
+  *(int *)user_data = 1;
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: backpressure of a direction");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Topology t;
+  std::string request = RandomData(16 * 1024 * 1024);
+  Event timer;
+  int expired = 0;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  t.relay.SetPipeSize(4096);
+  t.Init(reactor.get());
+
+  // the server does not read
+  EV_VERIFY(t.server.Write("hello", 5) == kEvOK);
+  EV_VERIFY(t.server.input()->empty());
+  t.server.UnInit();
+  EV_VERIFY(t.client.Write(request.data(), request.size()) == kEvOK);
+
+  timer.event = kEvTimer;
+  timer.callback = Test3_OnTimer;
+  timer.user_data = &expired;
+  EV_VERIFY(reactor->AddTimer(&timer, (int64_t)100) == kEvOK);
+  while (!expired || t.client_peer.received.size() < 5)
+    EV_VERIFY(reactor->RunOne() >= 0);
+
+  // the client is pushed back, while the other direction is not blocked
+  EV_LOG(kInfo, "%lu bytes are relayed, %lu bytes are pushed back",
+      (unsigned long)t.relay.a_to_b(), (unsigned long)t.client.output()->size());
+  EV_VERIFY(t.client_peer.received == "hello");
+  EV_VERIFY(t.relay.a_to_b() < request.size());
+  EV_VERIFY(t.client.output()->size() > 0);
+  EV_VERIFY(t.result.done == 0);
+
+  // the server reads all
+  EV_VERIFY(t.server.Init(reactor.get(), t.server_fds[1], PeerCallback, &t.server_peer) == kEvOK);
+  while (t.server_peer.received.size() < request.size())
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_VERIFY(t.server_peer.received == request);
+  EV_VERIFY(t.client.output()->empty());
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: a reset");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Topology t;
+  struct linger linger;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  t.Init(reactor.get());
+
+  // the server resets the connection
+  t.server.UnInit();
+  linger.l_onoff = 1;
+  linger.l_linger = 0;
+  EV_VERIFY(setsockopt(t.server_fds[1], SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) == 0);
+  safe_close(t.server_fds[1]);
+  EV_VERIFY((t.server_fds[1] = open("/dev/null", O_RDONLY|O_CLOEXEC)) != -1);
+
+  while (t.result.done == 0)
+    EV_VERIFY(reactor->RunOne() >= 0);
+  EV_LOG(kInfo, "the relay fails: %s", strerror(t.result.error));
+  EV_VERIFY(t.result.error != 0);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  signal(SIGPIPE, SIG_IGN);
+  srand(0);
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  return 0;
+}
@@ -0,0 +1,873 @@
+/** @file
+ * @brief asynchronous DNS stub resolver
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "resolver.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <algorithm>
+
+namespace libev {
+
+  enum
+  {
+    kTypeA = 1,
+    kTypeCNAME = 5,
+    kTypeSOA = 6,
+    kTypeAAAA = 28,
+    kClassIN = 1,
+
+    kFlagResponse = 0x8000,
+    kFlagTruncated = 0x0200,
+    kFlagRecursionDesired = 0x0100,
+    kRcodeMask = 0x000f,
+    kRcodeNoError = 0,
+    kRcodeNameError = 3
+  };
+
+  static const size_t kHeaderSize = 12;
+  static const size_t kMaxName = 253;
+  static const size_t kMaxLabel = 63;
+  static const size_t kMaxPacket = 4096;// in case the server sends more than 512 bytes
+  static const int kMaxRead = 64;// responses per readiness
+  static const int kMaxJumps = 64;// compression pointers per name
+  static const uint32_t kMaxTtl = 86400;
+  static const uint32_t kMaxNegativeTtl = 300;
+  static const int64_t kDefaultTimeout = 1000;
+  static const int kDefaultTries = 3;
+  static const size_t kDefaultMaxCache = 1024;
+
+  static uint16_t Get16(const unsigned char * p)
+  {
+    return (uint16_t)((p[0] << 8) | p[1]);
+  }
+
+  static uint32_t Get32(const unsigned char * p)
+  {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+  }
+
+  static void Put16(std::vector<unsigned char> * packet, unsigned int value)
+  {
+    packet->push_back((unsigned char)(value >> 8));// may throw
+    packet->push_back((unsigned char)value);// may throw
+  }
+
+  // lowercase 'name' without the trailing dot
+  // return 0 if it is not a valid domain name
+  static int NormalizeName(const char * name, std::string * normalized)
+  {
+    size_t len = strlen(name);
+    size_t label = 0;
+
+    if (len && name[len-1] == '.')
+      len--;
+    if (len == 0 || len > kMaxName)
+      return 0;
+
+    normalized->resize(len);// may throw
+    for (size_t i=0; i<len; i++)
+    {
+      char c = name[i];
+      if (c == '.')
+      {
+        if (label == 0)
+          return 0;
+        label = 0;
+      }
+      else if (++label > kMaxLabel)
+      {
+        return 0;
+      }
+
+      if (c >= 'A' && c <= 'Z')
+        c = (char)(c - 'A' + 'a');
+      (*normalized)[i] = c;
+    }
+    return label != 0;
+  }
+
+  static std::string CacheKey(int type, const std::string& name)
+  {
+    return ((type == kTypeA)?("4"):("6")) + name;// may throw
+  }
+
+  static void EncodeQuery(const std::string& name, int type, uint16_t id,
+      std::vector<unsigned char> * packet)
+  {
+    packet->clear();
+    packet->reserve(kHeaderSize + name.size() + 6);// may throw
+    Put16(packet, id);
+    Put16(packet, kFlagRecursionDesired);
+    Put16(packet, 1);// questions
+    Put16(packet, 0);
+    Put16(packet, 0);
+    Put16(packet, 0);
+
+    size_t begin = 0;
+    for (;;)
+    {
+      size_t end = name.find('.', begin);
+      if (end == std::string::npos)
+        end = name.size();
+      packet->push_back((unsigned char)(end - begin));// may throw
+      packet->insert(packet->end(), name.begin() + (ptrdiff_t)begin,
+          name.begin() + (ptrdiff_t)end);// may throw
+      if (end == name.size())
+        break;
+      begin = end + 1;
+    }
+    packet->push_back(0);// may throw
+    Put16(packet, (unsigned int)type);
+    Put16(packet, kClassIN);
+  }
+
+  // read the name at '*offset' into 'name'(lowercased) if it is not 0,
+  // and move '*offset' past the name
+  // return 0 if the name is malformed
+  static int ReadName(const unsigned char * packet, size_t size, size_t * offset,
+      std::string * name)
+  {
+    size_t pos = *offset;
+    int jumps = 0;
+
+    for (;;)
+    {
+      if (pos >= size)
+        return 0;
+
+      unsigned int len = packet[pos];
+      if (len == 0)
+      {
+        pos++;
+        break;
+      }
+
+      if ((len & 0xc0) == 0xc0)
+      {
+        // a compression pointer
+        if (pos + 1 >= size || ++jumps > kMaxJumps)
+          return 0;
+        if (jumps == 1)
+          *offset = pos + 2;
+        pos = ((len & 0x3f) << 8) | packet[pos+1];
+        continue;
+      }
+
+      if ((len & 0xc0) || pos + 1 + len > size)
+        return 0;
+
+      if (name)
+      {
+        if (!name->empty())
+          name->push_back('.');// may throw
+        for (size_t i=pos+1; i<pos+1+len; i++)
+        {
+          char c = (char)packet[i];
+          if (c >= 'A' && c <= 'Z')
+            c = (char)(c - 'A' + 'a');
+          name->push_back(c);// may throw
+        }
+        if (name->size() > kMaxName)
+          return 0;
+      }
+      pos += 1 + len;
+    }
+
+    if (jumps == 0)
+      *offset = pos;
+    return 1;
+  }
+
+  // the first nameserver of /etc/resolv.conf, or 127.0.0.1 like glibc
+  static socklen_t ReadResolvConf(struct sockaddr_storage * addr)
+  {
+    struct sockaddr_in * in = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)addr;
+    char line[256], server[64];
+
+    memset(addr, 0, sizeof(*addr));
+    FILE * fp = fopen("/etc/resolv.conf", "re");
+    if (fp)
+    {
+      while (fgets(line, sizeof(line), fp))
+      {
+        if (sscanf(line, " nameserver %63s", server) != 1)
+          continue;
+
+        if (inet_pton(AF_INET, server, &in->sin_addr) == 1)
+        {
+          (void)fclose(fp);
+          in->sin_family = AF_INET;
+          in->sin_port = htons(53);
+          return sizeof(*in);
+        }
+
+        if (inet_pton(AF_INET6, server, &in6->sin6_addr) == 1)
+        {
+          (void)fclose(fp);
+          in6->sin6_family = AF_INET6;
+          in6->sin6_port = htons(53);
+          return sizeof(*in6);
+        }
+      }
+      (void)fclose(fp);
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in->sin_port = htons(53);
+    return sizeof(*in);
+  }
+
+  static uint32_t RandomSeed()
+  {
+    uint32_t seed = 0;
+    int fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+    if (fd != -1)
+    {
+      if (read(fd, &seed, sizeof(seed)) != (ssize_t)sizeof(seed))
+        seed = 0;
+      (void)safe_close(fd);
+    }
+
+    if (seed == 0)
+    {
+      timespec now;
+      (void)clock_gettime(CLOCK_MONOTONIC, &now);
+      seed = (uint32_t)now.tv_nsec ^ ((uint32_t)getpid() << 16);
+    }
+    return (seed)?(seed):(1);
+  }
+
+  static bool IPv4First(const HostAddress& a, const HostAddress& b)
+  {
+    return a.family == AF_INET && b.family != AF_INET;
+  }
+
+  socklen_t HostAddressToSockaddr(const HostAddress * address, unsigned short port,
+      struct sockaddr_storage * addr)
+  {
+    memset(addr, 0, sizeof(*addr));
+    if (address->family == AF_INET)
+    {
+      struct sockaddr_in * in = (struct sockaddr_in *)addr;
+      in->sin_family = AF_INET;
+      in->sin_port = htons(port);
+      in->sin_addr = address->addr.v4;
+      return sizeof(*in);
+    }
+
+    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)addr;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    in6->sin6_addr = address->addr.v6;
+    return sizeof(*in6);
+  }
+
+  /************************************************************************/
+  Resolver::Resolver()
+    : reactor_(0), fd_(-1), next_id_(0), random_(1),
+    timeout_(kDefaultTimeout), tries_(kDefaultTries), max_cache_(kDefaultMaxCache),
+    destroyed_(0)
+  {
+  }
+
+  Resolver::~Resolver()
+  {
+    UnInit();
+  }
+
+  int Resolver::Init(Reactor * reactor, const struct sockaddr * server, socklen_t addrlen)
+  {
+    struct sockaddr_storage conf;
+
+    if (reactor == 0 || (server && addrlen > sizeof(conf)))
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "Resolver(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    if (server == 0)
+    {
+      addrlen = ReadResolvConf(&conf);
+      server = (struct sockaddr *)&conf;
+    }
+
+    int fd = socket(server->sa_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+      EV_LOG(kError, "socket: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    // only responses from the server are received, from a random local port
+    if (connect(fd, server, addrlen) == -1)
+    {
+      int error = errno;
+      EV_LOG(kError, "connect: %s", strerror(errno));
+      (void)safe_close(fd);
+      errno = error;
+      return kEvFailure;
+    }
+
+    ev_.fd = fd;
+    ev_.event = kEvIn|kEvPersist;
+    ev_.callback = OnRead;
+    ev_.user_data = this;
+
+    int ret;
+    if ((ret = reactor->Add(&ev_)) != kEvOK)
+    {
+      (void)safe_close(fd);
+      return ret;
+    }
+
+    reactor_ = reactor;
+    fd_ = fd;
+    random_ = RandomSeed();
+    return kEvOK;
+  }
+
+  void Resolver::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    std::map<ResolveId, Lookup *> lookups;
+    std::map<std::string, Query *>::iterator it;
+
+    (void)ev_.Del();
+    for (it=queries_.begin(); it!=queries_.end(); ++it)
+    {
+      (void)it->second->timer.Del();
+      delete it->second;
+    }
+    queries_.clear();
+    ids_.clear();
+    cache_.clear();
+    lookups.swap(lookups_);
+    (void)safe_close(fd_);
+    reactor_ = 0;
+    fd_ = -1;
+
+    // tell the callback invoker that the resolver is gone
+    DestroyedGuard::Destroy(&destroyed_);
+
+    // the resolver may be deleted by these callbacks, so only 'lookups' is touched
+    std::map<ResolveId, Lookup *>::iterator l;
+    for (l=lookups.begin(); l!=lookups.end(); ++l)
+    {
+      l->second->callback(ECANCELED, 0, 0, l->second->user_data);
+      delete l->second;
+    }
+  }
+
+  uint16_t Resolver::NextId()
+  {
+    uint16_t id;
+
+    // unpredictable ids(xorshift) against spoofed responses, and not in use
+    do
+    {
+      random_ ^= random_ << 13;
+      random_ ^= random_ >> 17;
+      random_ ^= random_ << 5;
+      id = (uint16_t)(random_ >> 16);
+    } while (ids_.find(id) != ids_.end());
+    return id;
+  }
+
+  const Resolver::CacheEntry * Resolver::FindCache(const std::string& key)
+  {
+    std::map<std::string, CacheEntry>::iterator it = cache_.find(key);
+    if (it == cache_.end())
+      return 0;
+
+    if (!timespec_less(reactor_->Now(), &it->second.expire))
+    {
+      cache_.erase(it);
+      return 0;
+    }
+    return &it->second;
+  }
+
+  void Resolver::AddCache(const std::string& key, int error,
+      const std::vector<HostAddress>& addresses, uint32_t ttl)
+  {
+    if (max_cache_ == 0)
+      return;
+
+    try
+    {
+      if (cache_.size() >= max_cache_ && cache_.find(key) == cache_.end())
+      {
+        // drop expired entries, or an arbitrary one
+        std::map<std::string, CacheEntry>::iterator it;
+        for (it=cache_.begin(); it!=cache_.end();)
+        {
+          if (timespec_less(reactor_->Now(), &it->second.expire))
+            ++it;
+          else
+            cache_.erase(it++);
+        }
+        if (cache_.size() >= max_cache_)
+          cache_.erase(cache_.begin());
+      }
+
+      CacheEntry& entry = cache_[key];// may throw(caught)
+      entry.error = error;
+      entry.addresses = addresses;// may throw(caught)
+      entry.expire = *reactor_->Now();
+      entry.expire.tv_sec += (time_t)ttl;
+    }
+    catch (...)
+    {
+      cache_.erase(key);
+    }
+  }
+
+  void Resolver::Merge(Lookup * lookup, int error, const std::vector<HostAddress>& addresses)
+  {
+    try
+    {
+      lookup->addresses.insert(lookup->addresses.end(),
+          addresses.begin(), addresses.end());// may throw(caught)
+    }
+    catch (...)
+    {
+      error = ENOMEM;
+    }
+
+    // a failure is more informative than a missing name of the other family
+    if (error && (lookup->error == 0 || lookup->error == EHOSTUNREACH))
+      lookup->error = error;
+  }
+
+  int Resolver::Complete(Lookup * lookup)
+  {
+    ScopedPtr<Lookup> guard(lookup);
+    std::vector<HostAddress>& addresses = lookup->addresses;
+    int error = lookup->error;
+
+    if (!addresses.empty())
+    {
+      error = 0;
+      std::stable_sort(addresses.begin(), addresses.end(), IPv4First);
+    }
+    else if (error == 0)
+    {
+      error = EHOSTUNREACH;
+    }
+
+    DestroyedGuard destroyed(&destroyed_);
+    lookup->callback(error, (addresses.empty())?(0):(&addresses[0]),
+        (int)addresses.size(), lookup->user_data);
+    return destroyed.Leave();
+  }
+
+  int Resolver::Join(const std::string& key, const std::string& name, int type, ResolveId id)
+  {
+    std::map<std::string, Query *>::iterator it = queries_.find(key);
+    if (it != queries_.end())
+    {
+      try
+      {
+        it->second->lookups.push_back(id);// may throw(caught)
+      }
+      catch (...)
+      {
+        return kEvNoMemory;
+      }
+      return kEvOK;
+    }
+
+    if (ids_.size() > 0xffff)
+    {
+      errno = EAGAIN;
+      return kEvFailure;
+    }
+
+    Query * query = 0;
+    try
+    {
+      query = new Query;// may throw(caught)
+      query->key = key;// may throw(caught)
+      query->name = name;// may throw(caught)
+      query->type = type;
+      query->id = NextId();
+      query->tries = 0;
+      query->lookups.push_back(id);// may throw(caught)
+      EncodeQuery(name, type, query->id, &query->packet);// may throw(caught)
+      queries_[key] = query;// may throw(caught)
+      ids_[query->id] = query;// may throw(caught)
+    }
+    catch (...)
+    {
+      if (query)
+      {
+        it = queries_.find(key);
+        if (it != queries_.end() && it->second == query)
+          queries_.erase(it);
+        delete query;
+      }
+      return kEvNoMemory;
+    }
+
+    query->resolver = this;
+    query->timer.event = kEvTimer;
+    query->timer.callback = OnTimeout;
+    query->timer.user_data = query;
+
+    int ret;
+    if ((ret = Send(query)) != kEvOK)
+    {
+      queries_.erase(key);
+      ids_.erase(query->id);
+      delete query;
+    }
+    return ret;
+  }
+
+  int Resolver::Send(Query * query)
+  {
+    ssize_t n;
+
+    query->tries++;
+    do n = send(fd_, &query->packet[0], query->packet.size(), 0);
+    while (n == -1 && errno == EINTR);
+
+    // a lost query is resent by the timer
+    if (n == -1)
+      EV_LOG(kWarning, "send: %s", strerror(errno));
+    return reactor_->AddTimer(&query->timer, timeout_);
+  }
+
+  int Resolver::Resolve(const char * name, int family, resolve_callback callback,
+      void * user_data, ResolveId * id)
+  {
+    if (reactor_ == 0 || name == 0 || callback == 0
+        || (family != AF_INET && family != AF_INET6 && family != AF_UNSPEC))
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (id)
+      *id = 0;
+
+    Lookup * lookup = 0;
+    std::string normalized;
+    std::string keys[2];
+    int types[2];
+    int queries = 0;
+
+    try
+    {
+      lookup = new Lookup;// may throw(caught)
+      lookup->pending = 0;
+      lookup->error = 0;
+      lookup->callback = callback;
+      lookup->user_data = user_data;
+
+      HostAddress address;
+      memset(&address, 0, sizeof(address));
+      if (inet_pton(AF_INET, name, &address.addr.v4) == 1)
+        address.family = AF_INET;
+      else if (inet_pton(AF_INET6, name, &address.addr.v6) == 1)
+        address.family = AF_INET6;
+
+      if (address.family)
+      {
+        // a numeric address of another family resolves to nothing
+        if (family == AF_UNSPEC || family == address.family)
+          lookup->addresses.push_back(address);// may throw(caught)
+      }
+      else
+      {
+        if (!NormalizeName(name, &normalized))// may throw(caught)
+        {
+          delete lookup;
+          errno = EINVAL;
+          return kEvFailure;
+        }
+
+        if (family != AF_INET6)
+          types[queries++] = kTypeA;
+        if (family != AF_INET)
+          types[queries++] = kTypeAAAA;
+
+        int uncached = 0;
+        for (int i=0; i<queries; i++)
+        {
+          std::string key = CacheKey(types[i], normalized);// may throw(caught)
+          const CacheEntry * entry = FindCache(key);
+          if (entry)
+          {
+            Merge(lookup, entry->error, entry->addresses);
+          }
+          else
+          {
+            types[uncached] = types[i];
+            keys[uncached].swap(key);
+            uncached++;
+          }
+        }
+        queries = uncached;
+      }
+    }
+    catch (...)
+    {
+      delete lookup;
+      return kEvNoMemory;
+    }
+
+    if (queries == 0)
+    {
+      (void)Complete(lookup);
+      return kEvOK;
+    }
+
+    ResolveId lookup_id = ++next_id_;
+    if (lookup_id == 0)
+      lookup_id = ++next_id_;
+
+    try
+    {
+      lookups_[lookup_id] = lookup;// may throw(caught)
+    }
+    catch (...)
+    {
+      delete lookup;
+      return kEvNoMemory;
+    }
+    lookup->pending = queries;
+
+    for (int i=0; i<queries; i++)
+    {
+      int ret;
+      if ((ret = Join(keys[i], normalized, types[i], lookup_id)) != kEvOK)
+      {
+        Cancel(lookup_id);
+        return ret;
+      }
+    }
+
+    if (id)
+      *id = lookup_id;
+    return kEvOK;
+  }
+
+  void Resolver::Cancel(ResolveId id)
+  {
+    // the query goes on, and its answer is cached
+    std::map<ResolveId, Lookup *>::iterator it = lookups_.find(id);
+    if (it == lookups_.end())
+      return;
+
+    delete it->second;
+    lookups_.erase(it);
+  }
+
+  int Resolver::Finish(Query * query, int error, const std::vector<HostAddress>& addresses,
+      uint32_t ttl)
+  {
+    std::vector<ResolveId> lookups;
+
+    queries_.erase(query->key);
+    ids_.erase(query->id);
+    (void)query->timer.Del();
+    lookups.swap(query->lookups);
+    if (ttl)
+      AddCache(query->key, error, addresses, ttl);
+    delete query;
+
+    for (size_t i=0; i<lookups.size(); i++)
+    {
+      // canceled lookups are gone
+      std::map<ResolveId, Lookup *>::iterator it = lookups_.find(lookups[i]);
+      if (it == lookups_.end())
+        continue;
+
+      Lookup * lookup = it->second;
+      Merge(lookup, error, addresses);
+      if (--lookup->pending)
+        continue;
+
+      lookups_.erase(it);
+      if (Complete(lookup))
+        return 1;
+    }
+    return 0;
+  }
+
+  int Resolver::OnResponse(const unsigned char * packet, size_t size)
+  {
+    if (size < kHeaderSize)
+      return 0;
+
+    std::map<uint16_t, Query *>::iterator it = ids_.find(Get16(packet));
+    if (it == ids_.end())
+    {
+      EV_LOG(kDebug, "Resolver(%p) received an unexpected response", this);
+      return 0;
+    }
+
+    Query * query = it->second;
+    unsigned int flags = Get16(packet + 2);
+    unsigned int answers = Get16(packet + 6);
+    unsigned int authorities = Get16(packet + 8);
+    std::vector<HostAddress> addresses;
+    std::string name;
+    size_t offset = kHeaderSize;
+    uint32_t ttl = kMaxTtl;
+    uint32_t negative_ttl = 0;
+
+    try
+    {
+      // the question must be echoed, or the response is forged or broken
+      if (!(flags & kFlagResponse) || Get16(packet + 4) != 1
+          || !ReadName(packet, size, &offset, &name)// may throw(caught)
+          || offset + 4 > size
+          || name != query->name
+          || Get16(packet + offset) != query->type
+          || Get16(packet + offset + 2) != kClassIN)
+      {
+        EV_LOG(kDebug, "Resolver(%p) received a mismatched response", this);
+        return 0;
+      }
+      offset += 4;
+
+      for (unsigned int i=0; i<answers+authorities; i++)
+      {
+        // the records after a malformed one are ignored
+        if (!ReadName(packet, size, &offset, 0) || offset + 10 > size)
+          break;
+
+        unsigned int type = Get16(packet + offset);
+        unsigned int klass = Get16(packet + offset + 2);
+        uint32_t record_ttl = Get32(packet + offset + 4);
+        size_t rdlength = Get16(packet + offset + 8);
+        const unsigned char * rdata = packet + offset + 10;
+
+        offset += 10 + rdlength;
+        if (offset > size)
+          break;
+        if (klass != kClassIN)
+          continue;
+
+        if (i < answers)
+        {
+          // CNAME records lead to the addresses, which are valid as long as them
+          if (type == kTypeCNAME)
+          {
+            ttl = std::min(ttl, record_ttl);
+          }
+          else if (type == (unsigned int)query->type)
+          {
+            HostAddress address;
+            memset(&address, 0, sizeof(address));
+            if (type == kTypeA && rdlength == 4)
+            {
+              address.family = AF_INET;
+              memcpy(&address.addr.v4, rdata, 4);
+            }
+            else if (type == kTypeAAAA && rdlength == 16)
+            {
+              address.family = AF_INET6;
+              memcpy(&address.addr.v6, rdata, 16);
+            }
+            else
+            {
+              continue;
+            }
+            addresses.push_back(address);// may throw(caught)
+            ttl = std::min(ttl, record_ttl);
+          }
+        }
+        else if (type == kTypeSOA && rdlength >= 22)
+        {
+          // the SOA MINIMUM field limits negative caching
+          negative_ttl = std::min(record_ttl, Get32(rdata + rdlength - 4));
+          negative_ttl = std::min(negative_ttl, kMaxNegativeTtl);
+        }
+      }
+    }
+    catch (...)
+    {
+      return Finish(query, ENOMEM, std::vector<HostAddress>(), 0);
+    }
+
+    unsigned int rcode = flags & kRcodeMask;
+    if (rcode == kRcodeNoError && !addresses.empty())
+    {
+      // a truncated answer may miss some addresses, which is not cached
+      return Finish(query, 0, addresses, (flags & kFlagTruncated)?(0):(ttl));
+    }
+
+    if (rcode == kRcodeNameError || (rcode == kRcodeNoError && !(flags & kFlagTruncated)))
+      return Finish(query, EHOSTUNREACH, addresses, negative_ttl);
+
+    if (rcode == kRcodeNoError)
+      return Finish(query, EMSGSIZE, addresses, 0);
+
+    EV_LOG(kWarning, "Resolver(%p) query of %s failed, rcode=%u",
+        this, query->name.c_str(), rcode);
+    return Finish(query, ECONNREFUSED, addresses, 0);
+  }
+
+  void Resolver::OnRead(int /*fd*/, int event, void * user_data)
+  {
+    Resolver * resolver = (Resolver *)user_data;
+    unsigned char packet[kMaxPacket];
+    ssize_t n;
+
+    if (event & kEvCanceled)
+      return;
+
+    for (int i=0; i<kMaxRead; i++)
+    {
+      do n = recv(resolver->fd_, packet, sizeof(packet), 0);
+      while (n == -1 && errno == EINTR);
+
+      if (n == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return;
+
+        // e.g. ECONNREFUSED by ICMP, the queries are resent by their timers
+        EV_LOG(kDebug, "recv: %s", strerror(errno));
+        continue;
+      }
+
+      if (resolver->OnResponse(packet, (size_t)n))
+        return;
+    }
+  }
+
+  void Resolver::OnTimeout(int /*fd*/, int event, void * user_data)
+  {
+    Query * query = (Query *)user_data;
+    Resolver * resolver = query->resolver;
+
+    if (event & kEvCanceled)
+      return;
+
+    if (query->tries < resolver->tries_ && resolver->Send(query) == kEvOK)
+      return;
+
+    EV_LOG(kDebug, "Resolver(%p) query of %s timed out", resolver, query->name.c_str());
+    (void)resolver->Finish(query, ETIMEDOUT, std::vector<HostAddress>(), 0);
+  }
+}
@@ -0,0 +1,161 @@
+/** @file
+ * @brief asynchronous DNS stub resolver
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_RESOLVER_H
+#define LIBEV_RESOLVER_H
+
+#include "ev.h"
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace libev {
+
+  struct HostAddress
+  {
+    int family;// AF_INET or AF_INET6
+    union
+    {
+      struct in_addr v4;
+      struct in6_addr v6;
+    } addr;
+  };
+
+  // fill 'addr' with 'address' and 'port'(in host byte order)
+  // return the length of 'addr'
+  socklen_t HostAddressToSockaddr(const HostAddress * address, unsigned short port,
+      struct sockaddr_storage * addr);
+
+  // 'error' is 0 if at least one address is resolved, or
+  //   EHOSTUNREACH: the name does not exist, or has no address of the family
+  //   ETIMEDOUT: the server does not respond
+  //   ECONNREFUSED: the server fails or refuses the query
+  //   EMSGSIZE: the response is truncated without any address
+  //   ECANCELED: the resolver is uninitialized
+  // 'addresses' are valid only inside the callback,
+  // IPv4 addresses come before IPv6 addresses for AF_UNSPEC
+  typedef void (*resolve_callback)(int error, const HostAddress * addresses, int count,
+      void * user_data);
+
+  // 0 means the lookup is completed inside 'Resolve'
+  typedef unsigned long ResolveId;
+
+  // A stub resolver sending A/AAAA queries over UDP to one recursive server,
+  // so that resolving never blocks the reactor.
+  // Unanswered queries are resent by timers, and fail after several tries.
+  // Answers are cached until their TTL expires, and negative answers
+  // are cached by the SOA record(RFC 2308).
+  // Concurrent lookups of the same name share one query.
+  // Numeric addresses and cached names are resolved inside 'Resolve'.
+  // The resolver may be deleted inside its callback.
+  class Resolver
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(Resolver);
+
+      struct Lookup
+      {
+        int pending;// queries not answered
+        int error;
+        std::vector<HostAddress> addresses;
+        resolve_callback callback;
+        void * user_data;
+      };
+
+      struct Query
+      {
+        Resolver * resolver;
+        std::string key;// in 'queries_' and 'cache_'
+        std::string name;
+        int type;// A or AAAA
+        uint16_t id;
+        int tries;
+        Event timer;
+        std::vector<unsigned char> packet;
+        std::vector<ResolveId> lookups;
+      };
+
+      struct CacheEntry
+      {
+        int error;// 0 or EHOSTUNREACH
+        std::vector<HostAddress> addresses;
+        timespec expire;
+      };
+
+      Reactor * reactor_;
+      int fd_;// connected to the server
+      Event ev_;
+      std::map<ResolveId, Lookup *> lookups_;
+      std::map<std::string, Query *> queries_;
+      std::map<uint16_t, Query *> ids_;
+      std::map<std::string, CacheEntry> cache_;
+      ResolveId next_id_;
+      uint32_t random_;// the state of query ids
+      int64_t timeout_;// ms
+      int tries_;
+      size_t max_cache_;
+      int * destroyed_;// set to 1 if the resolver is destroyed inside its callback
+
+      static void OnRead(int fd, int event, void * user_data);
+      static void OnTimeout(int fd, int event, void * user_data);
+
+      uint16_t NextId();
+      // find a fresh cache entry of 'key'
+      const CacheEntry * FindCache(const std::string& key);
+      void AddCache(const std::string& key, int error,
+          const std::vector<HostAddress>& addresses, uint32_t ttl);
+      // join the query of 'key', or start one
+      // return kEvOK or kEvNoMemory
+      int Join(const std::string& key, const std::string& name, int type, ResolveId id);
+      // (re)send the query and arm its timer
+      int Send(Query * query);
+      // handle a response, return 1 if the resolver is destroyed
+      int OnResponse(const unsigned char * packet, size_t size);
+      // complete the query and its lookups, return 1 if the resolver is destroyed
+      int Finish(Query * query, int error, const std::vector<HostAddress>& addresses,
+          uint32_t ttl);
+      // add the answer of a query to the lookup
+      static void Merge(Lookup * lookup, int error, const std::vector<HostAddress>& addresses);
+      // run the callback of a detached lookup and delete it,
+      // return 1 if the resolver is destroyed
+      int Complete(Lookup * lookup);
+
+    public:
+      Resolver();
+      ~Resolver();
+
+      // query 'server', or the first nameserver of /etc/resolv.conf if it is 0
+      int Init(Reactor * reactor, const struct sockaddr * server = 0, socklen_t addrlen = 0);
+      // pending lookups are completed with ECANCELED
+      void UnInit();
+
+      // the timeout of every try(1000ms by default)
+      void SetTimeout(int64_t ms) {timeout_ = ms;}
+      // the number of tries of every query(3 by default)
+      void SetTries(int tries) {tries_ = tries;}
+      // the max number of cached names(1024 by default)
+      void SetMaxCache(size_t max_cache) {max_cache_ = max_cache;}
+      void ClearCache() {cache_.clear();}
+
+      // resolve 'name' to addresses of 'family'(AF_INET, AF_INET6 or AF_UNSPEC),
+      // '*id' is set to cancel the lookup, or 0 if 'callback' has been invoked
+      int Resolve(const char * name, int family, resolve_callback callback, void * user_data,
+          ResolveId * id = 0);
+      // cancel a pending lookup without invoking its callback
+      void Cancel(ResolveId id);
+
+      Reactor * reactor()const {return reactor_;}
+      // the number of queries waiting for responses
+      size_t pending()const {return queries_.size();}
+      size_t cached()const {return cache_.size();}
+  };
+}
+
+#endif
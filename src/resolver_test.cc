@@ -0,0 +1,506 @@
+/** @file
+ * @brief test the asynchronous resolver with a fake DNS server
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "resolver.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+/************************************************************************/
+// the fake DNS server on 127.0.0.1
+struct FakeServer
+{
+  int fd;
+  struct sockaddr_in addr;
+  Event ev;
+  int queries;// the number of queries received
+  int spoof;// send a response with a wrong id before the right one
+};
+
+static void Put16(std::string * packet, unsigned int value)
+{
+  packet->push_back((char)(value >> 8));
+  packet->push_back((char)value);
+}
+
+static void Put32(std::string * packet, uint32_t value)
+{
+  Put16(packet, value >> 16);
+  Put16(packet, value & 0xffff);
+}
+
+// an answer record of the question name(compressed)
+static void PutAddress(std::string * packet, const char * address, uint32_t ttl)
+{
+  unsigned char buf[16];
+  int v4 = inet_pton(AF_INET, address, buf) == 1;
+
+  if (!v4)
+    EV_VERIFY(inet_pton(AF_INET6, address, buf) == 1);
+  Put16(packet, 0xc00c);
+  Put16(packet, (v4)?(1):(28));
+  Put16(packet, 1);
+  Put32(packet, ttl);
+  Put16(packet, (v4)?(4):(16));
+  packet->append((const char *)buf, (v4)?(4):(16));
+}
+
+// the SOA record of the authority section
+static void PutSOA(std::string * packet, uint32_t ttl, uint32_t minimum)
+{
+  Put16(packet, 0xc00c);
+  Put16(packet, 6);
+  Put16(packet, 1);
+  Put32(packet, ttl);
+  Put16(packet, 22);
+  packet->push_back(0);// MNAME
+  packet->push_back(0);// RNAME
+  for (int i=0; i<4; i++)
+    Put32(packet, 1);
+  Put32(packet, minimum);
+}
+
+// answer the question like a zone:
+//   www.example.com     A 192.0.2.1, 192.0.2.2, AAAA 2001:db8::1
+//   alias.example.com   CNAME www.example.com
+//   short.example.com   A 192.0.2.3 for 1 second
+//   v4only.example.com  A 192.0.2.4
+//   fail.example.com    SERVFAIL
+//   timeout.example.com no response
+//   others              NXDOMAIN
+static int Answer(const std::string& name, int type, std::string * response)
+{
+  int rcode = 0;
+  int answers = 0;
+  int authorities = 0;
+  std::string records;
+
+  if (name == "timeout.example.com")
+    return 0;
+
+  if (name == "www.example.com" || name == "alias.example.com")
+  {
+    if (name == "alias.example.com")
+    {
+      // alias.example.com CNAME www.example.com, and the addresses of www.example.com
+      Put16(&records, 0xc00c);
+      Put16(&records, 5);
+      Put16(&records, 1);
+      Put32(&records, 30);
+      Put16(&records, 2);
+      Put16(&records, 0xc00c + 6);// "example.com" in the question
+      answers++;
+    }
+
+    if (type == 1)
+    {
+      PutAddress(&records, "192.0.2.1", 60);
+      PutAddress(&records, "192.0.2.2", 60);
+      answers += 2;
+    }
+    else
+    {
+      PutAddress(&records, "2001:db8::1", 60);
+      answers++;
+    }
+  }
+  else if (name == "short.example.com" && type == 1)
+  {
+    PutAddress(&records, "192.0.2.3", 1);
+    answers++;
+  }
+  else if (name == "v4only.example.com")
+  {
+    if (type == 1)
+    {
+      PutAddress(&records, "192.0.2.4", 60);
+      answers++;
+    }
+    else
+    {
+      // NODATA
+      PutSOA(&records, 60, 30);
+      authorities++;
+    }
+  }
+  else if (name == "fail.example.com")
+  {
+    rcode = 2;// SERVFAIL
+  }
+  else
+  {
+    rcode = 3;// NXDOMAIN
+    PutSOA(&records, 60, 30);
+    authorities++;
+  }
+
+  (*response)[2] = (char)0x81;// QR, RD
+  (*response)[3] = (char)(0x80 | rcode);// RA
+  (*response)[6] = 0;
+  (*response)[7] = (char)answers;
+  (*response)[8] = 0;
+  (*response)[9] = (char)authorities;
+  response->append(records);
+  return 1;
+}
+
+static void FakeServer_OnQuery(int fd, int event, void * user_data)
+{
+  FakeServer * server = (FakeServer *)user_data;
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  char buf[512];
+  ssize_t n;
+
+  if (event & kEvCanceled)
+    return;
+
+  while ((n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen)) > 0)
+  {
+    std::string name;
+    size_t offset = 12;
+
+    server->queries++;
+    while (offset < (size_t)n && buf[offset])
+    {
+      if (!name.empty())
+        name.push_back('.');
+      name.append(buf + offset + 1, (size_t)buf[offset]);
+      offset += 1 + (size_t)buf[offset];
+    }
+    offset++;
+    int type = ((unsigned char)buf[offset] << 8) | (unsigned char)buf[offset+1];
+    offset += 4;
+
+    // the header and the question
+    std::string response(buf, offset);
+    if (!Answer(name, type, &response))
+      continue;
+
+    if (server->spoof)
+    {
+      std::string forged(response);
+      forged[0] = (char)~forged[0];
+      forged.append(16, '\0');
+      EV_VERIFY(sendto(fd, forged.data(), forged.size(), 0,
+            (struct sockaddr *)&from, fromlen) == (ssize_t)forged.size());
+    }
+    EV_VERIFY(sendto(fd, response.data(), response.size(), 0,
+          (struct sockaddr *)&from, fromlen) == (ssize_t)response.size());
+    fromlen = sizeof(from);
+  }
+}
+
+static void FakeServer_Init(FakeServer * server, Reactor * reactor)
+{
+  socklen_t len = sizeof(server->addr);
+
+  memset(&server->addr, 0, sizeof(server->addr));
+  server->addr.sin_family = AF_INET;
+  server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EV_VERIFY((server->fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK, 0)) != -1);
+  EV_VERIFY(bind(server->fd, (struct sockaddr *)&server->addr, sizeof(server->addr)) == 0);
+  EV_VERIFY(getsockname(server->fd, (struct sockaddr *)&server->addr, &len) == 0);
+  server->queries = 0;
+  server->spoof = 0;
+
+  server->ev.fd = server->fd;
+  server->ev.event = kEvIn|kEvPersist;
+  server->ev.callback = FakeServer_OnQuery;
+  server->ev.user_data = server;
+  EV_VERIFY(reactor->Add(&server->ev) == kEvOK);
+}
+
+static void FakeServer_UnInit(FakeServer * server)
+{
+  (void)server->ev.Del();
+  safe_close(server->fd);
+}
+
+/************************************************************************/
+struct Result
+{
+  int done;
+  int error;
+  std::vector<std::string> addresses;
+};
+
+static void Test_Callback(int error, const HostAddress * addresses, int count, void * user_data)
+{
+  Result * result = (Result *)user_data;
+  char buf[INET6_ADDRSTRLEN];
+
+  result->done++;
+  result->error = error;
+  result->addresses.clear();
+  for (int i=0; i<count; i++)
+  {
+    EV_VERIFY(inet_ntop(addresses[i].family, &addresses[i].addr, buf, sizeof(buf)));
+    result->addresses.push_back(buf);
+  }
+}
+
+static void Wait(Reactor * reactor, const Result * result)
+{
+  while (!result->done)
+    (void)reactor->RunOne();
+}
+
+static void Resolve(Resolver * resolver, const char * name, int family, Result * result)
+{
+  result->done = 0;
+  result->error = -1;
+  result->addresses.clear();
+  EV_VERIFY(resolver->Resolve(name, family, Test_Callback, result) == kEvOK);
+  Wait(resolver->reactor(), result);
+  EV_VERIFY(result->done == 1);
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: resolve A and AAAA records");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Resolver resolver;
+  FakeServer server;
+  Result result;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  FakeServer_Init(&server, reactor.get());
+  EV_VERIFY(resolver.Init(reactor.get(), (struct sockaddr *)&server.addr,
+        sizeof(server.addr)) == kEvOK);
+
+  Resolve(&resolver, "www.example.com", AF_INET, &result);
+  EV_VERIFY(result.error == 0);
+  EV_VERIFY(result.addresses.size() == 2);
+  EV_VERIFY(result.addresses[0] == "192.0.2.1");
+  EV_VERIFY(result.addresses[1] == "192.0.2.2");
+
+  Resolve(&resolver, "WWW.Example.COM.", AF_INET6, &result);
+  EV_VERIFY(result.error == 0);
+  EV_VERIFY(result.addresses.size() == 1);
+  EV_VERIFY(result.addresses[0] == "2001:db8::1");
+  EV_VERIFY(server.queries == 2);
+
+  // following CNAME, and responses of wrong ids are ignored
+  server.spoof = 1;
+  Resolve(&resolver, "alias.example.com", AF_UNSPEC, &result);
+  EV_VERIFY(result.error == 0);
+  EV_VERIFY(result.addresses.size() == 3);
+  EV_VERIFY(result.addresses[0] == "192.0.2.1");
+  EV_VERIFY(result.addresses[2] == "2001:db8::1");
+  EV_VERIFY(server.queries == 4);
+
+  // numeric addresses need no query
+  Resolve(&resolver, "10.0.0.1", AF_UNSPEC, &result);
+  EV_VERIFY(result.error == 0);
+  EV_VERIFY(result.addresses.size() == 1 && result.addresses[0] == "10.0.0.1");
+  Resolve(&resolver, "::1", AF_INET, &result);
+  EV_VERIFY(result.error == EHOSTUNREACH);
+  EV_VERIFY(server.queries == 4);
+
+  EV_VERIFY(resolver.Resolve("bad..example.com", AF_INET, Test_Callback, &result) == kEvFailure);
+  EV_VERIFY(errno == EINVAL);
+
+  struct sockaddr_storage addr;
+  HostAddress address;
+  address.family = AF_INET;
+  address.addr.v4.s_addr = htonl(INADDR_LOOPBACK);
+  EV_VERIFY(HostAddressToSockaddr(&address, 80, &addr) == sizeof(struct sockaddr_in));
+  EV_VERIFY(((struct sockaddr_in *)&addr)->sin_port == htons(80));
+
+  resolver.UnInit();
+  FakeServer_UnInit(&server);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static int Test2_TimerFired;
+
+static void Test2_Timer(int /*fd*/, int /*event*/, void * /*user_data*/)
+{
+  Test2_TimerFired = 1;
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: coalesce lookups and cache answers");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Resolver resolver;
+  FakeServer server;
+  Result results[3];
+  ResolveId id;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  FakeServer_Init(&server, reactor.get());
+  EV_VERIFY(resolver.Init(reactor.get(), (struct sockaddr *)&server.addr,
+        sizeof(server.addr)) == kEvOK);
+
+  // concurrent lookups share one query
+  for (int i=0; i<3; i++)
+  {
+    results[i].done = 0;
+    EV_VERIFY(resolver.Resolve("www.example.com", AF_INET, Test_Callback, &results[i], &id)
+        == kEvOK);
+    EV_VERIFY(id != 0);
+  }
+  EV_VERIFY(resolver.pending() == 1);
+  for (int i=0; i<3; i++)
+  {
+    Wait(reactor.get(), &results[i]);
+    EV_VERIFY(results[i].error == 0 && results[i].addresses.size() == 2);
+  }
+  EV_VERIFY(server.queries == 1);
+
+  // cached answers are returned inside 'Resolve'
+  results[0].done = 0;
+  EV_VERIFY(resolver.Resolve("www.example.com", AF_INET, Test_Callback, &results[0], &id)
+      == kEvOK);
+  EV_VERIFY(results[0].done == 1 && id == 0);
+  EV_VERIFY(results[0].addresses.size() == 2);
+  EV_VERIFY(server.queries == 1);
+
+  // until the TTL expires
+  Resolve(&resolver, "short.example.com", AF_INET, &results[0]);
+  EV_VERIFY(results[0].addresses.size() == 1 && results[0].addresses[0] == "192.0.2.3");
+  Resolve(&resolver, "short.example.com", AF_INET, &results[0]);
+  EV_VERIFY(server.queries == 2);
+
+  Event timer;
+  timer.event = kEvTimer;
+  timer.callback = Test2_Timer;
+  Test2_TimerFired = 0;
+  EV_VERIFY(reactor->AddTimer(&timer, 1100) == kEvOK);
+  while (!Test2_TimerFired)
+    (void)reactor->RunOne();
+
+  Resolve(&resolver, "short.example.com", AF_INET, &results[0]);
+  EV_VERIFY(results[0].addresses.size() == 1);
+  EV_VERIFY(server.queries == 3);
+  Resolve(&resolver, "www.example.com", AF_INET, &results[0]);
+  EV_VERIFY(server.queries == 3);
+
+  resolver.UnInit();
+  FakeServer_UnInit(&server);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: failures");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Resolver resolver;
+  FakeServer server;
+  Result result;
+  ResolveId id;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  FakeServer_Init(&server, reactor.get());
+  EV_VERIFY(resolver.Init(reactor.get(), (struct sockaddr *)&server.addr,
+        sizeof(server.addr)) == kEvOK);
+  resolver.SetTimeout(50);
+  resolver.SetTries(2);
+
+  // negative answers are cached by SOA
+  Resolve(&resolver, "nowhere.example.com", AF_INET, &result);
+  EV_VERIFY(result.error == EHOSTUNREACH && result.addresses.empty());
+  Resolve(&resolver, "nowhere.example.com", AF_INET, &result);
+  EV_VERIFY(result.error == EHOSTUNREACH);
+  EV_VERIFY(server.queries == 1);
+
+  Resolve(&resolver, "v4only.example.com", AF_INET6, &result);
+  EV_VERIFY(result.error == EHOSTUNREACH);
+  Resolve(&resolver, "v4only.example.com", AF_UNSPEC, &result);
+  EV_VERIFY(result.error == 0 && result.addresses.size() == 1);
+  EV_VERIFY(server.queries == 3);
+
+  Resolve(&resolver, "fail.example.com", AF_INET, &result);
+  EV_VERIFY(result.error == ECONNREFUSED);
+  Resolve(&resolver, "fail.example.com", AF_INET, &result);
+  EV_VERIFY(server.queries == 5);
+
+  // tried twice
+  Resolve(&resolver, "timeout.example.com", AF_INET, &result);
+  EV_VERIFY(result.error == ETIMEDOUT);
+  EV_VERIFY(server.queries == 7);
+
+  // canceled lookups are not called back, but the answer is cached
+  result.done = 0;
+  EV_VERIFY(resolver.Resolve("www.example.com", AF_INET, Test_Callback, &result, &id) == kEvOK);
+  resolver.Cancel(id);
+  while (resolver.pending())
+    (void)reactor->RunOne();
+  EV_VERIFY(result.done == 0);
+  EV_VERIFY(resolver.cached() == 4);
+
+  // pending lookups are completed by 'UnInit'
+  EV_VERIFY(resolver.Resolve("timeout.example.com", AF_INET, Test_Callback, &result) == kEvOK);
+  resolver.UnInit();
+  EV_VERIFY(result.done == 1 && result.error == ECANCELED);
+  FakeServer_UnInit(&server);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static Result Test4_Results[2];
+
+static void Test4_Callback(int error, const HostAddress * addresses, int count, void * user_data)
+{
+  Resolver ** resolver = (Resolver **)user_data;
+
+  Test_Callback(error, addresses, count, &Test4_Results[0]);
+  delete *resolver;
+  *resolver = 0;
+}
+
+static void Test4()
+{
+  EV_LOG(kInfo, "Test 4: delete the resolver inside its callback");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Resolver * resolver = new Resolver;
+  FakeServer server;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  FakeServer_Init(&server, reactor.get());
+  EV_VERIFY(resolver->Init(reactor.get(), (struct sockaddr *)&server.addr,
+        sizeof(server.addr)) == kEvOK);
+
+  Test4_Results[0].done = 0;
+  Test4_Results[1].done = 0;
+  EV_VERIFY(resolver->Resolve("www.example.com", AF_INET, Test4_Callback, &resolver) == kEvOK);
+  EV_VERIFY(resolver->Resolve("www.example.com", AF_INET, Test_Callback, &Test4_Results[1])
+      == kEvOK);
+  while (resolver)
+    (void)reactor->RunOne();
+
+  EV_VERIFY(Test4_Results[0].done == 1 && Test4_Results[0].error == 0);
+  EV_VERIFY(Test4_Results[1].done == 1 && Test4_Results[1].error == ECANCELED);
+  FakeServer_UnInit(&server);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  return 0;
+}
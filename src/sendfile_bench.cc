@@ -0,0 +1,157 @@
+/** @file
+ * @brief benchmark Stream::SendFile against reading a file and writing it to a stream
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "stream.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+
+using namespace libev;
+
+static const size_t kChunkSize = 64 * 1024;
+
+struct BenchHelper
+{
+  Stream * sender;
+  Stream * receiver;
+  int file_fd;
+  size_t file_size;
+  size_t offset;// bytes of the file read by the copying sender
+  size_t received;
+};
+
+static double Now()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+// read the file into a user buffer, and write it until the high watermark is reached
+static void CopyMore(BenchHelper * helper)
+{
+  char buf[kChunkSize];
+  ssize_t n;
+
+  while (helper->offset < helper->file_size
+      && helper->sender->output()->size() <= 4 * kChunkSize)
+  {
+    n = pread(helper->file_fd, buf, sizeof(buf), (off_t)helper->offset);
+    EV_VERIFY(n > 0);
+    EV_VERIFY(helper->sender->Write(buf, (size_t)n) == kEvOK);
+    helper->offset += (size_t)n;
+  }
+}
+
+static void SenderCallback(Stream * /*stream*/, int event, void * user_data)
+{
+  BenchHelper * helper = (BenchHelper *)user_data;
+
+  if (event & kStreamLowWater)
+    CopyMore(helper);
+  else if (event & kStreamError)
+    EV_VERIFY(0);
+}
+
+static void ReceiverCallback(Stream * stream, int event, void * user_data)
+{
+  BenchHelper * helper = (BenchHelper *)user_data;
+
+  if (event & kStreamRead)
+  {
+    helper->received += stream->input()->size();
+    stream->input()->Consume(stream->input()->size());
+    if (helper->received == helper->file_size)
+    {
+      stream->UnInit();
+      helper->sender->UnInit();
+    }
+  }
+  else
+  {
+    EV_VERIFY(0);
+  }
+}
+
+static void Bench(const char * name, int file_fd, size_t file_size, bool use_sendfile)
+{
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Stream sender(&pool);
+  Stream receiver(&pool);
+  BenchHelper helper;
+  double begin, elapsed;
+  int fd[2];
+
+  helper.sender = &sender;
+  helper.receiver = &receiver;
+  helper.file_fd = file_fd;
+  helper.file_size = file_size;
+  helper.offset = 0;
+  helper.received = 0;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  TcpPair(fd);
+  EV_VERIFY(sender.Init(reactor.get(), fd[0], SenderCallback, &helper) == kEvOK);
+  EV_VERIFY(receiver.Init(reactor.get(), fd[1], ReceiverCallback, &helper) == kEvOK);
+  sender.SetWatermarks(kChunkSize, 4 * kChunkSize);
+
+  begin = Now();
+  if (use_sendfile)
+    EV_VERIFY(sender.SendFile(file_fd, 0, file_size) == kEvOK);
+  else
+    CopyMore(&helper);
+  (void)reactor->Run();
+  elapsed = Now() - begin;
+
+  EV_VERIFY(helper.received == file_size);
+  printf("%-12s %6lu MB: %8.1f MB/s\n", name, (unsigned long)(file_size >> 20),
+      (double)file_size / (1 << 20) / elapsed);
+
+  reactor.reset();
+  safe_close(fd[0]);
+  safe_close(fd[1]);
+}
+
+int main(int argc, char ** argv)
+{
+  size_t file_size = 64;// MB
+  char path[] = "/tmp/sendfile_bench.XXXXXX";
+  char buf[kChunkSize];
+  int file_fd;
+
+  GlobalLog().SetLevel(kWarning);
+  srand(0);
+
+  if (argc > 1)
+  {
+    file_size = (size_t)atoi(argv[1]);
+    EV_VERIFY(file_size > 0);
+  }
+  file_size <<= 20;
+
+  file_fd = mkstemp(path);
+  EV_VERIFY(file_fd != -1);
+  EV_VERIFY(unlink(path) == 0);
+  for (size_t i=0; i<sizeof(buf); i++)
+    buf[i] = (char)rand();
+  for (size_t i=0; i<file_size; i+=sizeof(buf))
+    EV_VERIFY(write(file_fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+
+  // warm the page cache
+  Bench("read/write", file_fd, file_size, false);
+  for (int i=0; i<3; i++)
+  {
+    Bench("read/write", file_fd, file_size, false);
+    Bench("sendfile", file_fd, file_size, true);
+  }
+
+  safe_close(file_fd);
+  return 0;
+}
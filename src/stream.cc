@@ -0,0 +1,1008 @@
+/** @file
+ * @brief buffered stream on a nonblocking fd
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "stream.h"
+#include "log.h"
+#include "header.h"
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+namespace libev {
+
+  static const int kIovecSize = 64;// iovecs per writev
+  static const int kMaxReads = 16;// readv calls per readable event
+  static const size_t kMaxSendFile = 1024 * 1024;// bytes per sendfile/splice
+
+  Stream::Stream(BlockPool * pool)
+    : reactor_(0), fd_(-1), is_socket_(0),
+    input_(pool), output_(pool), callback_(0), user_data_(0),
+    low_water_(0), high_water_((size_t)-1), above_high_water_(0),
+    reading_(0), writing_(0), shutdown_(0), eof_(0), error_(0), destroyed_(0),
+    output_after_ranges_(0), piped_(0), zerocopy_(0), zerocopy_id_(0),
+    read_bucket_(0), write_bucket_(0), limiter_(0), read_throttled_(0), write_throttled_(0)
+  {
+    pipe_[0] = pipe_[1] = -1;
+    read_wait_.callback = OnReadRefill;
+    read_wait_.user_data = this;
+    write_wait_.callback = OnWriteRefill;
+    write_wait_.user_data = this;
+  }
+
+  Stream::~Stream()
+  {
+    UnInit();
+  }
+
+  int Stream::Init(Reactor * reactor, int fd, stream_callback callback, void * user_data)
+  {
+    if (reactor == 0 || fd < 0 || callback == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (reactor_)
+    {
+      EV_LOG(kError, "Stream(%p) has been initialized", this);
+      return kEvExists;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      EV_LOG(kError, "fcntl: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+      EV_LOG(kError, "fstat: %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    ev_in_.fd = fd;
+    ev_in_.event = kEvIn|kEvPersist;
+    ev_in_.callback = OnIn;
+    ev_in_.user_data = this;
+    ev_out_.fd = fd;
+    ev_out_.event = kEvOut|kEvPersist;
+    ev_out_.callback = OnOut;
+    ev_out_.user_data = this;
+
+    int ret;
+    if ((ret = reactor->Add(&ev_in_)) != kEvOK)
+      return ret;
+
+    reactor_ = reactor;
+    fd_ = fd;
+    is_socket_ = S_ISSOCK(st.st_mode);
+    callback_ = callback;
+    user_data_ = user_data;
+    above_high_water_ = 0;
+    reading_ = 1;
+    writing_ = 0;
+    shutdown_ = 0;
+    eof_ = 0;
+    error_ = 0;
+    zerocopy_ = 0;
+    zerocopy_id_ = 0;
+    return kEvOK;
+  }
+
+  void Stream::UnInit()
+  {
+    if (reactor_ == 0)
+      return;
+
+    // user memory is released after the stream is gone
+    std::deque<Unreleased> unreleased;
+    std::deque<Range> ranges;
+    unreleased.swap(unreleased_);
+    ranges.swap(ranges_);
+
+    Stop();
+    input_.Clear();
+    output_.Clear();
+    output_after_ranges_ = 0;
+    if (pipe_[0] != -1)
+    {
+      safe_close(pipe_[0]);
+      safe_close(pipe_[1]);
+      pipe_[0] = pipe_[1] = -1;
+    }
+    piped_ = 0;
+    reactor_ = 0;
+    fd_ = -1;
+
+    // tell the callback invoker that the stream is gone
+    DestroyedGuard::Destroy(&destroyed_);
+
+    for (size_t i=0; i<unreleased.size(); i++)
+      unreleased[i].release(unreleased[i].data, unreleased[i].size, unreleased[i].user_data);
+    for (size_t i=0; i<ranges.size(); i++)
+    {
+      if (ranges[i].fd == -1)
+        ranges[i].release(ranges[i].data, (size_t)ranges[i].offset + ranges[i].count,
+            ranges[i].user_data);
+    }
+  }
+
+  void Stream::Stop()
+  {
+    if (reading_)
+    {
+      (void)ev_in_.Del();
+      reading_ = 0;
+    }
+    if (writing_)
+    {
+      (void)ev_out_.Del();
+      writing_ = 0;
+    }
+    if (read_throttled_)
+    {
+      limiter_->Cancel(&read_wait_);
+      read_throttled_ = 0;
+    }
+    if (write_throttled_)
+    {
+      limiter_->Cancel(&write_wait_);
+      write_throttled_ = 0;
+    }
+  }
+
+  size_t Stream::ReadQuota()
+  {
+    if (read_bucket_ == 0)
+      return (size_t)-1;
+    return read_bucket_->Available(reactor_->Now());
+  }
+
+  size_t Stream::WriteQuota()
+  {
+    if (write_bucket_ == 0)
+      return (size_t)-1;
+    return write_bucket_->Available(reactor_->Now());
+  }
+
+  void Stream::ThrottleRead()
+  {
+    if (reading_)
+    {
+      (void)ev_in_.Del();
+      reading_ = 0;
+    }
+
+    // resume when a block can be read
+    int64_t ms = read_bucket_->Delay(reactor_->Now(), input_.pool()->block_size());
+    if (limiter_->Wait(&read_wait_, (ms > 0)?(ms):(1)) == kEvOK)
+      read_throttled_ = 1;
+    else
+      OnReadRefill(this);
+  }
+
+  void Stream::ThrottleWrite()
+  {
+    if (writing_)
+    {
+      (void)ev_out_.Del();
+      writing_ = 0;
+    }
+
+    int64_t ms = write_bucket_->Delay(reactor_->Now(), output_.pool()->block_size());
+    if (limiter_->Wait(&write_wait_, (ms > 0)?(ms):(1)) == kEvOK)
+      write_throttled_ = 1;
+    else
+      OnWriteRefill(this);
+  }
+
+  void Stream::OnReadRefill(void * user_data)
+  {
+    Stream * stream = (Stream *)user_data;
+
+    stream->read_throttled_ = 0;
+    if (!stream->reading_ && !stream->eof_ && !stream->error_)
+    {
+      if (stream->reactor_->Add(&stream->ev_in_) == kEvOK)
+        stream->reading_ = 1;
+      else
+        EV_LOG(kError, "Stream(%p) fails to resume reading", stream);
+    }
+  }
+
+  void Stream::OnWriteRefill(void * user_data)
+  {
+    Stream * stream = (Stream *)user_data;
+
+    stream->write_throttled_ = 0;
+    if (!stream->writing_ && !stream->error_ && stream->pending())
+    {
+      if (stream->reactor_->Add(&stream->ev_out_) == kEvOK)
+        stream->writing_ = 1;
+      else
+        EV_LOG(kError, "Stream(%p) fails to resume writing", stream);
+    }
+  }
+
+  int Stream::SetRateLimit(TokenBucket * read, TokenBucket * write, RateLimiter * limiter)
+  {
+    if ((read || write) && limiter == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    // resume with the new limits
+    read_bucket_ = read;
+    write_bucket_ = write;
+    if (read_throttled_)
+    {
+      limiter_->Cancel(&read_wait_);
+      OnReadRefill(this);
+    }
+    if (write_throttled_)
+    {
+      limiter_->Cancel(&write_wait_);
+      OnWriteRefill(this);
+    }
+    limiter_ = limiter;
+    return kEvOK;
+  }
+
+  void Stream::Fail(int error)
+  {
+    EV_LOG(kDebug, "Stream(%p) failed: %s", this, strerror(error));
+    error_ = error;
+    Stop();
+    (void)Invoke(kStreamError);
+  }
+
+  int Stream::Invoke(int event)
+  {
+    DestroyedGuard destroyed(&destroyed_);
+    callback_(this, event, user_data_);
+    return destroyed.Leave();
+  }
+
+  int Stream::Release(const Unreleased& unreleased)
+  {
+    DestroyedGuard destroyed(&destroyed_);
+    unreleased.release(unreleased.data, unreleased.size, unreleased.user_data);
+    return destroyed.Leave();
+  }
+
+  int Stream::ReleaseCompleted()
+  {
+    while (!unreleased_.empty())
+    {
+      Unreleased unreleased = unreleased_.front();
+      if (unreleased.completed != unreleased.end_id - unreleased.first_id)
+        break;
+      unreleased_.pop_front();
+      if (Release(unreleased))
+        return 1;
+    }
+    return 0;
+  }
+
+  uint32_t Stream::CountCompleted(uint32_t first_id, uint32_t end_id, uint32_t lo, uint32_t hi)
+  {
+    int32_t sends = (int32_t)(end_id - first_id);
+    // ids wrap around, compare them relative to 'first_id'
+    int32_t begin = (int32_t)(lo - first_id);
+    int32_t end = (int32_t)(hi - first_id);
+
+    if (begin < 0)
+      begin = 0;
+    if (end >= sends)
+      end = sends - 1;
+    if (end >= begin)
+      return (uint32_t)(end - begin + 1);
+    return 0;
+  }
+
+  void Stream::Complete(uint32_t lo, uint32_t hi)
+  {
+    EV_LOG(kDebug, "Stream(%p) zero-copy sends [%u, %u] completed", this, lo, hi);
+
+    for (size_t i=0; i<unreleased_.size(); i++)
+    {
+      Unreleased * unreleased = &unreleased_[i];
+      unreleased->completed += CountCompleted(unreleased->first_id, unreleased->end_id, lo, hi);
+    }
+
+    // the range being sent, whose earlier sends may complete before its last one
+    if (!ranges_.empty())
+    {
+      Range * range = &ranges_.front();
+      if (range->fd == -1 && range->offset)
+        range->completed += CountCompleted(range->first_id, zerocopy_id_, lo, hi);
+    }
+  }
+
+  int Stream::ReadErrQueue()
+  {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr * cmsg;
+    struct sock_extended_err * err;
+    ssize_t n;
+
+    for (;;)
+    {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      do n = recvmsg(fd_, &msg, MSG_ERRQUEUE);
+      while (n == -1 && errno == EINTR);
+
+      if (n == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return kEvOK;
+        return kEvFailure;
+      }
+
+      for (cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg))
+      {
+        if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+            && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+          continue;
+
+        err = (struct sock_extended_err *)(void *)CMSG_DATA(cmsg);
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+          continue;
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+          EV_LOG(kDebug, "Stream(%p) zero-copy sends were copied by the kernel", this);
+        Complete(err->ee_info, err->ee_data);
+      }
+    }
+  }
+
+  ssize_t Stream::WriteIovec(const struct iovec * iov, int iovcnt)
+  {
+    ssize_t n;
+
+    if (is_socket_)
+    {
+      // no SIGPIPE
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = (struct iovec *)iov;
+      msg.msg_iovlen = (size_t)iovcnt;
+      do n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+      while (n == -1 && errno == EINTR);
+    }
+    else
+    {
+      do n = writev(fd_, iov, iovcnt);
+      while (n == -1 && errno == EINTR);
+    }
+    return n;
+  }
+
+  ssize_t Stream::WriteOutput(size_t limit)
+  {
+    struct iovec iov[kIovecSize];
+    int iovcnt = output_.GetIovec(iov, kIovecSize);
+    size_t total = 0;
+
+    for (int i=0; i<iovcnt; i++)
+    {
+      if (iov[i].iov_len >= limit - total)
+      {
+        iov[i].iov_len = limit - total;
+        iovcnt = i + 1;
+      }
+      total += iov[i].iov_len;
+    }
+
+    ssize_t n = WriteIovec(iov, iovcnt);
+    if (n > 0)
+      output_.Consume((size_t)n);
+    return n;
+  }
+
+  ssize_t Stream::SpliceFileRange(Range * range, size_t limit)
+  {
+    ssize_t n;
+
+    if (pipe_[0] == -1 && pipe2(pipe_, O_NONBLOCK|O_CLOEXEC) == -1)
+      return -1;
+
+    // fill the pipe
+    if (piped_ < range->count)
+    {
+      loff_t offset = range->offset + (off_t)piped_;
+      do n = splice(range->fd, &offset, pipe_[1], 0, range->count - piped_,
+          SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+      while (n == -1 && errno == EINTR);
+
+      if (n == 0)
+      {
+        // the file is shorter than the range
+        errno = EIO;
+        return -1;
+      }
+      if (n > 0)
+        piped_ += (size_t)n;
+      else if (errno != EAGAIN || piped_ == 0)
+        return -1;
+    }
+
+    // drain the pipe to the fd
+    do n = splice(pipe_[0], 0, fd_, 0, (piped_ < limit)?(piped_):(limit),
+        SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    while (n == -1 && errno == EINTR);
+    if (n > 0)
+      piped_ -= (size_t)n;
+    return n;
+  }
+
+  ssize_t Stream::SendFileRange(Range * range, size_t limit)
+  {
+    size_t count = (range->count < kMaxSendFile)?(range->count):(kMaxSendFile);
+    if (count > limit)
+      count = limit;
+    ssize_t n = -1;
+
+    if (piped_ == 0)
+    {
+      do n = sendfile(fd_, range->fd, &range->offset, count);
+      while (n == -1 && errno == EINTR);
+
+      if (n == 0)
+      {
+        // the file is shorter than the range
+        errno = EIO;
+        return -1;
+      }
+      if (n > 0)
+      {
+        range->count -= (size_t)n;
+        return n;
+      }
+    }
+
+    if (piped_ || errno == EINVAL || errno == ENOSYS)
+    {
+      // sendfile does not support 'range->fd', splice through a pipe
+      n = SpliceFileRange(range, limit);
+      if (n > 0)
+      {
+        range->offset += (off_t)n;
+        range->count -= (size_t)n;
+      }
+    }
+    return n;
+  }
+
+  int Stream::Flush(int * files_sent)
+  {
+    ssize_t n;
+
+    *files_sent = 0;
+    while (pending())
+    {
+      // the caller throttles writing if nothing is allowed
+      size_t quota = WriteQuota();
+      if (quota == 0)
+        return kEvOK;
+
+      if (ranges_.empty())
+        n = WriteOutput((output_.size() < quota)?(output_.size()):(quota));
+      else if (ranges_.front().before)
+        n = WriteOutput((ranges_.front().before < quota)?(ranges_.front().before):(quota));
+      else if (ranges_.front().fd != -1)
+        n = SendFileRange(&ranges_.front(), quota);
+      else
+        n = SendMemoryRange(&ranges_.front(), quota);
+
+      if (n == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return kEvOK;
+        return kEvFailure;
+      }
+      if (write_bucket_)
+        write_bucket_->Take((size_t)n);
+
+      if (ranges_.empty())
+        continue;
+
+      Range * range = &ranges_.front();
+      if (range->before)
+      {
+        range->before -= (size_t)n;
+        continue;
+      }
+      if (range->count)
+        continue;
+
+      if (range->fd != -1)
+      {
+        (*files_sent)++;
+      }
+      else
+      {
+        // to be released after its zero-copy sends have completed
+        Unreleased unreleased;
+        unreleased.data = range->data;
+        unreleased.size = (size_t)range->offset;
+        unreleased.release = range->release;
+        unreleased.user_data = range->user_data;
+        unreleased.first_id = range->first_id;
+        unreleased.end_id = zerocopy_id_;
+        unreleased.completed = range->completed;
+        try
+        {
+          unreleased_.push_back(unreleased);// may throw(caught)
+        }
+        catch (...)
+        {
+          errno = ENOMEM;
+          return kEvFailure;
+        }
+      }
+
+      ranges_.pop_front();
+      if (ranges_.empty())
+        output_after_ranges_ = 0;
+    }
+    return kEvOK;
+  }
+
+  ssize_t Stream::SendMemoryRange(Range * range, size_t limit)
+  {
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = (void *)(range->data + range->offset);
+    iov.iov_len = (range->count < limit)?(range->count):(limit);
+    if (range->offset == 0)
+    {
+      range->first_id = zerocopy_id_;
+      range->completed = 0;
+    }
+
+#ifdef MSG_ZEROCOPY
+    if (zerocopy_)
+    {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      do n = sendmsg(fd_, &msg, MSG_NOSIGNAL|MSG_ZEROCOPY);
+      while (n == -1 && errno == EINTR);
+
+      if (n != -1)
+        zerocopy_id_++;
+      else if (errno == ENOBUFS)
+        n = WriteIovec(&iov, 1);// out of the option memory for notifications, copy it
+    }
+    else
+#endif
+    {
+      n = WriteIovec(&iov, 1);
+    }
+
+    if (n > 0)
+    {
+      range->offset += (off_t)n;
+      range->count -= (size_t)n;
+    }
+    return n;
+  }
+
+  void Stream::OnIn(int /*fd*/, int event, void * user_data)
+  {
+    Stream * stream = (Stream *)user_data;
+    Buffer * input = &stream->input_;
+    struct iovec iov[2];
+    int iovcnt;
+    size_t capacity, total = 0;
+    ssize_t n;
+    int eof = 0, error = 0;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      stream->reading_ = 0;
+      return;
+    }
+
+    if (stream->zerocopy_ && (event & (kEvErrQueue|kEvErr)))
+    {
+      if (stream->ReadErrQueue() != kEvOK)
+      {
+        stream->Fail(errno);
+        return;
+      }
+      if (stream->ReleaseCompleted())
+        return;
+
+      if (event & kEvErrQueue)
+      {
+        // EPOLLERR is also raised by a pending socket error
+        socklen_t len = sizeof(error);
+        if (getsockopt(stream->fd_, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+          error = errno;
+        if (error)
+        {
+          stream->Fail(error);
+          return;
+        }
+        if (!(event & kEvIn))
+          return;
+      }
+    }
+
+    if (stream->eof_)
+      return;
+
+    size_t quota = stream->ReadQuota();
+    if (quota == 0)
+    {
+      stream->ThrottleRead();
+      return;
+    }
+
+    for (int i=0; i<kMaxReads && quota; i++)
+    {
+      size_t block_size = input->pool()->block_size();
+      iovcnt = input->Prepare((block_size < quota)?(block_size):(quota), iov, 2);
+      if (iovcnt == kEvNoMemory)
+      {
+        error = ENOMEM;
+        break;
+      }
+
+      // read no more than 'quota'
+      capacity = 0;
+      for (int j=0; j<iovcnt; j++)
+      {
+        if (iov[j].iov_len >= quota - capacity)
+        {
+          iov[j].iov_len = quota - capacity;
+          iovcnt = j + 1;
+        }
+        capacity += iov[j].iov_len;
+      }
+
+      do n = readv(stream->fd_, iov, iovcnt);
+      while (n == -1 && errno == EINTR);
+
+      if (n > 0)
+      {
+        input->Commit((size_t)n);
+        total += (size_t)n;
+        quota -= (size_t)n;
+        if (stream->read_bucket_)
+          stream->read_bucket_->Take((size_t)n);
+        // drained
+        if ((size_t)n < capacity)
+          break;
+        continue;
+      }
+
+      input->Commit(0);
+      if (n == 0)
+      {
+        eof = 1;
+      }
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (event & kEvErr)
+        {
+          socklen_t len = sizeof(error);
+          if (getsockopt(stream->fd_, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error == 0)
+            error = EIO;
+        }
+      }
+      else
+      {
+        error = errno;
+      }
+      break;
+    }
+
+    if (total && stream->Invoke(kStreamRead))
+      return;
+
+    if (error)
+    {
+      stream->Fail(error);
+    }
+    else if (eof)
+    {
+      EV_LOG(kDebug, "Stream(%p) reaches EOF", stream);
+      if (stream->reading_)
+      {
+        (void)stream->ev_in_.Del();
+        stream->reading_ = 0;
+        if (stream->zerocopy_)
+        {
+          // keep polling the error queue, edge triggered not to poll EOF again
+          stream->ev_in_.event |= kEvET;
+          if (stream->reactor_->Add(&stream->ev_in_) == kEvOK)
+            stream->reading_ = 1;
+        }
+      }
+      stream->eof_ = 1;
+      (void)stream->Invoke(kStreamEOF);
+    }
+  }
+
+  void Stream::OnOut(int /*fd*/, int event, void * user_data)
+  {
+    Stream * stream = (Stream *)user_data;
+
+    if (event & kEvCanceled)
+    {
+      // the reactor is cleaning up
+      stream->writing_ = 0;
+      return;
+    }
+
+    int files_sent;
+    if (stream->Flush(&files_sent) != kEvOK)
+    {
+      stream->Fail(errno);
+      return;
+    }
+
+    while (files_sent--)
+    {
+      if (stream->Invoke(kStreamFileSent))
+        return;
+    }
+
+    if (stream->ReleaseCompleted())
+      return;
+
+    if (!stream->pending())
+    {
+      // nothing pending, stop polling kEvOut
+      (void)stream->ev_out_.Del();
+      stream->writing_ = 0;
+
+      if (stream->shutdown_ == 1)
+      {
+        (void)shutdown(stream->fd_, SHUT_WR);
+        stream->shutdown_ = 2;
+      }
+    }
+    else if (stream->write_bucket_ && stream->WriteQuota() == 0)
+    {
+      stream->ThrottleWrite();
+    }
+
+    if (stream->above_high_water_ && stream->output_.size() <= stream->low_water_)
+    {
+      stream->above_high_water_ = 0;
+      (void)stream->Invoke(kStreamLowWater);
+    }
+  }
+
+  int Stream::Write(const void * data, size_t size)
+  {
+    if (reactor_ == 0 || error_ || shutdown_)
+    {
+      errno = EPIPE;
+      return kEvFailure;
+    }
+
+    const char * p = (const char *)data;
+    size_t quota = (pending() || write_throttled_)?(0):(WriteQuota());
+    if (quota)
+    {
+      // try writing directly, without polling kEvOut
+      struct iovec iov;
+      iov.iov_base = (void *)p;
+      iov.iov_len = (size < quota)?(size):(quota);
+      ssize_t n = WriteIovec(&iov, 1);
+      if (n == -1)
+      {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+          error_ = errno;
+          Stop();
+          return kEvFailure;
+        }
+        n = 0;
+      }
+      if (write_bucket_)
+        write_bucket_->Take((size_t)n);
+      p += n;
+      size -= (size_t)n;
+    }
+
+    if (size == 0)
+      return kEvOK;
+
+    if (output_.Append(p, size) != kEvOK)
+      return kEvNoMemory;
+    if (!ranges_.empty())
+      output_after_ranges_ += size;
+
+    if (!writing_ && !write_throttled_)
+    {
+      int ret;
+      if ((ret = reactor_->Add(&ev_out_)) != kEvOK)
+        return ret;
+      writing_ = 1;
+    }
+
+    if (!above_high_water_ && output_.size() > high_water_)
+    {
+      above_high_water_ = 1;
+      (void)Invoke(kStreamHighWater);
+    }
+    return kEvOK;
+  }
+
+  int Stream::Shutdown()
+  {
+    if (reactor_ == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (shutdown_)
+      return kEvOK;
+
+    if (pending())
+    {
+      shutdown_ = 1;
+      return kEvOK;
+    }
+
+    shutdown_ = 2;
+    if (shutdown(fd_, SHUT_WR) == -1)
+      return kEvFailure;
+    return kEvOK;
+  }
+
+  int Stream::SendFile(int file_fd, off_t offset, size_t count)
+  {
+    if (reactor_ == 0 || error_ || shutdown_)
+    {
+      errno = EPIPE;
+      return kEvFailure;
+    }
+
+    if (file_fd < 0 || offset < 0 || count == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    Range range;
+    range.fd = file_fd;
+    range.offset = offset;
+    range.count = count;
+    range.data = 0;
+    range.release = 0;
+    range.user_data = 0;
+    range.first_id = 0;
+    range.completed = 0;
+    return QueueRange(range);
+  }
+
+  int Stream::EnableZeroCopy()
+  {
+    if (reactor_ == 0 || error_)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    if (zerocopy_)
+      return kEvOK;
+
+#ifdef SO_ZEROCOPY
+    if (!is_socket_)
+    {
+      errno = ENOTSOCK;
+      return kEvFailure;
+    }
+
+    int on = 1;
+    if (setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1)
+    {
+      EV_LOG(kError, "setsockopt(SO_ZEROCOPY): %s", strerror(errno));
+      return kEvFailure;
+    }
+
+    // completions are read from the error queue by 'OnIn'
+    if (reading_)
+    {
+      (void)ev_in_.Del();
+      reading_ = 0;
+    }
+    ev_in_.event |= kEvErrQueue;
+    if (eof_)
+      ev_in_.event |= kEvET;
+
+    int ret;
+    if ((ret = reactor_->Add(&ev_in_)) != kEvOK)
+      return ret;
+    reading_ = 1;
+    zerocopy_ = 1;
+    return kEvOK;
+#else
+    errno = EOPNOTSUPP;
+    return kEvFailure;
+#endif
+  }
+
+  int Stream::WriteZeroCopy(const void * data, size_t size,
+      release_callback release, void * user_data)
+  {
+    if (reactor_ == 0 || error_ || shutdown_)
+    {
+      errno = EPIPE;
+      return kEvFailure;
+    }
+
+    if (data == 0 || size == 0 || release == 0)
+    {
+      errno = EINVAL;
+      return kEvFailure;
+    }
+
+    Range range;
+    range.fd = -1;
+    range.offset = 0;
+    range.count = size;
+    range.data = (const char *)data;
+    range.release = release;
+    range.user_data = user_data;
+    range.first_id = 0;
+    range.completed = 0;
+    return QueueRange(range);
+  }
+
+  int Stream::QueueRange(const Range& range)
+  {
+    size_t output_after_ranges = output_after_ranges_;
+
+    try
+    {
+      ranges_.push_back(range);// may throw(caught)
+    }
+    catch (...)
+    {
+      return kEvNoMemory;
+    }
+    ranges_.back().before = (ranges_.size() == 1)?(output_.size()):(output_after_ranges_);
+    output_after_ranges_ = 0;
+
+    // sent when kEvOut is ready
+    if (!writing_ && !write_throttled_)
+    {
+      int ret;
+      if ((ret = reactor_->Add(&ev_out_)) != kEvOK)
+      {
+        ranges_.pop_back();
+        output_after_ranges_ = output_after_ranges;
+        return ret;
+      }
+      writing_ = 1;
+    }
+    return kEvOK;
+  }
+
+  void Stream::SetWatermarks(size_t low, size_t high)
+  {
+    EV_ASSERT(low <= high);
+    low_water_ = low;
+    high_water_ = high;
+  }
+}
@@ -0,0 +1,207 @@
+/** @file
+ * @brief buffered stream on a nonblocking fd
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_STREAM_H
+#define LIBEV_STREAM_H
+
+#include "ev.h"
+#include "buffer.h"
+#include "rate_limiter.h"
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+
+namespace libev {
+
+  // events passed to stream_callback
+  enum StreamEvent
+  {
+    kStreamRead = 0x01,       // new data has been read into 'input'
+    kStreamEOF = 0x02,        // the peer has closed, reading stops
+    kStreamError = 0x04,      // an error occurred(refer to 'error'), the stream stops
+    kStreamHighWater = 0x08,  // 'output' has grown above the high watermark
+    kStreamLowWater = 0x10,   // 'output' has drained to the low watermark after kStreamHighWater
+    kStreamFileSent = 0x20    // a file range of 'SendFile' has been sent, in order
+  };
+
+  class Stream;
+  typedef void (*stream_callback)(Stream * stream, int event, void * user_data);
+  // 'data' of 'Stream::WriteZeroCopy' is no longer used by the stream and the kernel
+  typedef void (*release_callback)(const void * data, size_t size, void * user_data);
+
+  // A stream reads all available data into 'input' and writes 'output'
+  // with scatter-gather IO. kEvOut is polled only while 'output' is not empty.
+  // The stream may be deleted inside its callback.
+  class Stream
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(Stream);
+
+      Reactor * reactor_;
+      int fd_;
+      int is_socket_;
+      Event ev_in_;
+      Event ev_out_;
+      Buffer input_;
+      Buffer output_;
+      stream_callback callback_;
+      void * user_data_;
+
+      size_t low_water_;
+      size_t high_water_;
+      int above_high_water_;// kStreamHighWater has been reported
+      int reading_;// 'ev_in_' is added
+      int writing_;// 'ev_out_' is added
+      int shutdown_;// 1: shut down writing after 'output' is drained, 2: shut down
+      int eof_;// EOF has been read, 'ev_in_' only polls the error queue
+      int error_;
+      int * destroyed_;// set to 1 if the stream is destroyed inside its callback
+
+      // ranges of files('SendFile') or user memory('WriteZeroCopy')
+      // to be sent after 'before' bytes of 'output_'
+      struct Range
+      {
+        int fd;// the file, or -1 for user memory
+        off_t offset;// the file offset, or bytes of user memory sent
+        size_t count;// bytes not sent
+        size_t before;
+        const char * data;
+        release_callback release;
+        void * user_data;
+        uint32_t first_id;// the zero-copy id of its first send
+        uint32_t completed;// the number of its sends completed
+      };
+      std::deque<Range> ranges_;
+      size_t output_after_ranges_;// bytes of 'output_' queued after the last range
+      int pipe_[2];// for splice if sendfile is not supported
+      size_t piped_;// bytes in 'pipe_'
+
+      // user memory sent but not released
+      struct Unreleased
+      {
+        const char * data;
+        size_t size;
+        release_callback release;
+        void * user_data;
+        uint32_t first_id;// zero-copy ids of its sends are ['first_id', 'end_id')
+        uint32_t end_id;
+        uint32_t completed;// the number of its sends completed
+      };
+      std::deque<Unreleased> unreleased_;
+      int zerocopy_;// SO_ZEROCOPY is enabled
+      uint32_t zerocopy_id_;// the id of the next send with MSG_ZEROCOPY
+
+      TokenBucket * read_bucket_;
+      TokenBucket * write_bucket_;
+      RateLimiter * limiter_;
+      RateWait read_wait_;// resumes reading when 'read_bucket_' is refilled
+      RateWait write_wait_;
+      int read_throttled_;// 'ev_in_' is deleted until 'read_wait_' is invoked
+      int write_throttled_;
+
+      static void OnIn(int fd, int event, void * user_data);
+      static void OnOut(int fd, int event, void * user_data);
+      static void OnReadRefill(void * user_data);
+      static void OnWriteRefill(void * user_data);
+
+      // return 1 if the stream is destroyed
+      int Invoke(int event);
+      // invoke the release callback of 'unreleased'
+      // return 1 if the stream is destroyed
+      int Release(const Unreleased& unreleased);
+      // release user memory whose sends have all completed, in order
+      // return 1 if the stream is destroyed
+      int ReleaseCompleted();
+      // read completions of zero-copy sends from the error queue
+      // return kEvOK or kEvFailure
+      int ReadErrQueue();
+      // the sends with zero-copy ids ['lo', 'hi'] have completed
+      void Complete(uint32_t lo, uint32_t hi);
+      // the number of sends with zero-copy ids ['first_id', 'end_id') in ['lo', 'hi']
+      static uint32_t CountCompleted(uint32_t first_id, uint32_t end_id, uint32_t lo, uint32_t hi);
+      // queue 'range' after the data queued
+      int QueueRange(const Range& range);
+      // write 'output' and ranges until they are drained or the fd would block,
+      // '*files_sent' is the number of file ranges sent
+      // return kEvOK or kEvFailure
+      int Flush(int * files_sent);
+      // write at most 'limit' bytes of 'output_'
+      // return bytes written, or -1
+      ssize_t WriteOutput(size_t limit);
+      // send at most 'limit' bytes of the first range
+      // return bytes sent, or -1
+      ssize_t SendFileRange(Range * range, size_t limit);
+      ssize_t SpliceFileRange(Range * range, size_t limit);
+      ssize_t SendMemoryRange(Range * range, size_t limit);
+      int pending()const {return !output_.empty() || !ranges_.empty();}
+      // write 'iovcnt' 'iov', return bytes written or -1
+      ssize_t WriteIovec(const struct iovec * iov, int iovcnt);
+      // bytes allowed to be read or written now
+      size_t ReadQuota();
+      size_t WriteQuota();
+      // stop polling until the bucket is refilled
+      void ThrottleRead();
+      void ThrottleWrite();
+      // stop polling
+      void Stop();
+      // stop and report kStreamError
+      void Fail(int error);
+
+    public:
+      explicit Stream(BlockPool * pool);
+      ~Stream();
+
+      // 'fd' is set to be nonblocking and polled by 'reactor',
+      // the stream does not own 'fd'
+      int Init(Reactor * reactor, int fd, stream_callback callback, void * user_data);
+      void UnInit();
+
+      // queue 'data' to be written, and write it right now if nothing is pending.
+      // The callback may be invoked with kStreamHighWater before it returns.
+      int Write(const void * data, size_t size);
+      // shut down writing after 'output' is drained
+      int Shutdown();
+
+      // queue 'count' bytes of 'file_fd' from 'offset' to be sent after the data queued,
+      // by sendfile, or splice through a pipe if sendfile does not support 'file_fd'.
+      // kStreamFileSent is reported when it is sent.
+      // 'file_fd' must be kept open until then, and the stream does not own it.
+      int SendFile(int file_fd, off_t offset, size_t count);
+
+      // send later writes of 'WriteZeroCopy' with MSG_ZEROCOPY(Linux 4.14 or later),
+      // only for TCP sockets. Zero-copy pays off for large writes only(e.g. >= 16KB).
+      int EnableZeroCopy();
+      int zerocopy()const {return zerocopy_;}
+      // queue 'size' bytes of 'data' to be sent after the data queued, without copying.
+      // 'data' must be kept unchanged until 'release' is invoked,
+      // which is after the kernel has completed its zero-copy sends,
+      // or right after it is sent if zero-copy is not enabled,
+      // or when the stream is uninitialized.
+      int WriteZeroCopy(const void * data, size_t size, release_callback release, void * user_data);
+
+      // kStreamHighWater is reported when 'output' grows above 'high',
+      // and kStreamLowWater when it drains to 'low' later.
+      // By default, 'high' is unlimited and 'low' is 0.
+      void SetWatermarks(size_t low, size_t high);
+
+      // limit bytes read per second by 'read', and bytes written by 'write'(0: unlimited).
+      // Polling kEvIn or kEvOut is suspended while its bucket is empty,
+      // and resumed by the timer of 'limiter', which must be of the same reactor.
+      // Buckets may be shared by streams(e.g. of a tenant) of the reactor,
+      // or have a shared parent.
+      int SetRateLimit(TokenBucket * read, TokenBucket * write, RateLimiter * limiter);
+
+      int fd()const {return fd_;}
+      Reactor * reactor()const {return reactor_;}
+      Buffer * input() {return &input_;}
+      Buffer * output() {return &output_;}
+      // the errno of kStreamError
+      int error()const {return error_;}
+  };
+}
+
+#endif
@@ -0,0 +1,514 @@
+/** @file
+ * @brief test buffers and streams
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "stream.h"
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+#include "test_util.h"
+#include <string>
+#include <vector>
+
+using namespace libev;
+
+static void Test0()
+{
+  EV_LOG(kInfo, "Test 0: buffer");
+
+  BlockPool pool(16);
+  Buffer buffer(&pool);
+  std::string data, out;
+  struct iovec iov[8];
+  char tmp[100];
+
+  for (int i=0; i<100; i++)
+    data.push_back((char)('a' + i % 26));
+
+  // append and read across blocks
+  EV_VERIFY(buffer.Append(data.data(), data.size()) == kEvOK);
+  EV_VERIFY(buffer.size() == data.size());
+  EV_VERIFY(buffer.GetIovec(iov, 8) == 7);
+  EV_VERIFY(buffer.Copy(tmp, sizeof(tmp)) == data.size());
+  EV_VERIFY(memcmp(tmp, data.data(), data.size()) == 0);
+
+  buffer.Consume(10);
+  EV_VERIFY(buffer.Read(tmp, 20) == 20);
+  EV_VERIFY(memcmp(tmp, data.data() + 10, 20) == 0);
+  EV_VERIFY(buffer.size() == 70);
+
+  // prepare and commit free space
+  int iovcnt = buffer.Prepare(40, iov, 8);
+  EV_VERIFY(iovcnt > 0);
+  size_t left = 40;
+  for (int i=0; i<iovcnt && left; i++)
+  {
+    size_t n = (iov[i].iov_len < left)?(iov[i].iov_len):(left);
+    memcpy(iov[i].iov_base, data.data() + (40 - left), n);
+    left -= n;
+  }
+  EV_VERIFY(left == 0);
+  buffer.Commit(40);
+  EV_VERIFY(buffer.size() == 110);
+
+  out.resize(buffer.size());
+  EV_VERIFY(buffer.Read(&out[0], out.size()) == 110);
+  EV_VERIFY(out.compare(0, 70, data, 30, 70) == 0);
+  EV_VERIFY(out.compare(70, 40, data, 0, 40) == 0);
+  EV_VERIFY(buffer.empty());
+
+  // pull up bytes spanning blocks
+  EV_VERIFY(buffer.Append(data.data(), 40) == kEvOK);
+  buffer.Consume(10);
+  EV_VERIFY(buffer.Pullup(5) != 0);
+  EV_VERIFY(memcmp(buffer.Pullup(5), data.data() + 10, 5) == 0);
+  EV_VERIFY(buffer.GetIovec(iov, 8) == 3);
+  EV_VERIFY(memcmp(buffer.Pullup(16), data.data() + 10, 16) == 0);
+  EV_VERIFY(buffer.Pullup(17) == 0);
+  EV_VERIFY(buffer.GetIovec(iov, 8) == 3);
+  buffer.Consume(16);
+  EV_VERIFY(memcmp(buffer.Pullup(14), data.data() + 26, 14) == 0);
+  EV_VERIFY(buffer.GetIovec(iov, 8) == 1);
+  EV_VERIFY(buffer.size() == 14);
+  EV_VERIFY(buffer.Append(data.data(), 10) == kEvOK);
+  out.resize(buffer.size());
+  EV_VERIFY(buffer.Read(&out[0], out.size()) == 24);
+  EV_VERIFY(out.compare(0, 14, data, 26, 14) == 0);
+  EV_VERIFY(out.compare(14, 10, data, 0, 10) == 0);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static const size_t kDataSize = 8 * 1024 * 1024;
+
+struct Test1_Helper
+{
+  Stream * writer;
+  Stream * reader;
+  std::string data;
+  size_t written;
+  size_t read;
+  int high;
+  int low;
+  int eof;
+};
+
+static void Test1_WriteMore(Test1_Helper * helper)
+{
+  // write until the high watermark is reached
+  while (helper->written < helper->data.size() && !helper->high)
+  {
+    size_t n = 4096;
+    if (n > helper->data.size() - helper->written)
+      n = helper->data.size() - helper->written;
+    EV_VERIFY(helper->writer->Write(&helper->data[helper->written], n) == kEvOK);
+    helper->written += n;
+  }
+
+  if (helper->written == helper->data.size())
+    EV_VERIFY(helper->writer->Shutdown() == kEvOK);
+}
+
+static void Test1_WriterCallback(Stream * stream, int event, void * user_data)
+{
+  Test1_Helper * helper = (Test1_Helper *)user_data;
+
+  if (event & kStreamHighWater)
+  {
+    EV_VERIFY(stream->output()->size() > 64 * 1024);
+    helper->high++;
+  }
+  else if (event & kStreamLowWater)
+  {
+    EV_VERIFY(stream->output()->size() <= 16 * 1024);
+    helper->low++;
+    helper->high = 0;
+    Test1_WriteMore(helper);
+  }
+  else
+  {
+    EV_VERIFY(0);
+  }
+}
+
+static void Test1_ReaderCallback(Stream * stream, int event, void * user_data)
+{
+  Test1_Helper * helper = (Test1_Helper *)user_data;
+  char buf[4096];
+  size_t n;
+
+  if (event & kStreamRead)
+  {
+    while ((n = stream->input()->Read(buf, sizeof(buf))) != 0)
+    {
+      EV_VERIFY(helper->read + n <= helper->data.size());
+      EV_VERIFY(memcmp(buf, &helper->data[helper->read], n) == 0);
+      helper->read += n;
+    }
+  }
+  else if (event & kStreamEOF)
+  {
+    helper->eof = 1;
+    // delete inside the callback
+    stream->UnInit();
+    helper->writer->UnInit();
+  }
+  else
+  {
+    EV_VERIFY(0);
+  }
+}
+
+static void Test1()
+{
+  EV_LOG(kInfo, "Test 1: stream with watermarks");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Stream writer(&pool);
+  Stream reader(&pool);
+  Test1_Helper helper;
+  int fd[2];
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == 0);
+
+  helper.writer = &writer;
+  helper.reader = &reader;
+  helper.data.resize(kDataSize);
+  for (size_t i=0; i<kDataSize; i++)
+    helper.data[i] = (char)rand();
+  helper.written = 0;
+  helper.read = 0;
+  helper.high = 0;
+  helper.low = 0;
+  helper.eof = 0;
+
+  EV_VERIFY(writer.Init(reactor.get(), fd[0], Test1_WriterCallback, &helper) == kEvOK);
+  EV_VERIFY(reader.Init(reactor.get(), fd[1], Test1_ReaderCallback, &helper) == kEvOK);
+  writer.SetWatermarks(16 * 1024, 64 * 1024);
+
+  Test1_WriteMore(&helper);
+  (void)reactor->Run();
+
+  EV_LOG(kInfo, "low watermark reported %d times", helper.low);
+  EV_VERIFY(helper.low > 0);
+  EV_VERIFY(helper.read == kDataSize);
+  EV_VERIFY(helper.eof);
+
+  reactor.reset();
+  safe_close(fd[0]);
+  safe_close(fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static int epoll_ctl_calls;
+
+extern "C" int epoll_ctl(int epfd, int op, int fd, struct epoll_event * event)
+{
+  epoll_ctl_calls++;
+  return (int)syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+
+static const int kMessages = 1000;
+static int counter;
+
+static void Test2_Callback(Stream * stream, int event, void * /*user_data*/)
+{
+  char buf[16];
+
+  EV_VERIFY(event & kStreamRead);
+  while (stream->input()->size() >= 5)
+  {
+    EV_VERIFY(stream->input()->Read(buf, 5) == 5);
+    EV_VERIFY(memcmp(buf, "hello", 5) == 0);
+    if (++counter == kMessages)
+    {
+      stream->UnInit();
+      return;
+    }
+    // echo
+    EV_VERIFY(stream->Write("hello", 5) == kEvOK);
+  }
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: small writes cost no epoll_ctl");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Stream a(&pool);
+  Stream b(&pool);
+  int fd[2];
+
+  counter = 0;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == 0);
+  EV_VERIFY(a.Init(reactor.get(), fd[0], Test2_Callback, 0) == kEvOK);
+  EV_VERIFY(b.Init(reactor.get(), fd[1], Test2_Callback, 0) == kEvOK);
+
+  epoll_ctl_calls = 0;
+  EV_VERIFY(a.Write("hello", 5) == kEvOK);
+  (void)reactor->RunOne();
+  while (counter < kMessages)
+    (void)reactor->RunOne();
+
+  // writes go directly to the socket, kEvOut is never polled,
+  // the only call unregisters the stream uninitialized inside its callback
+  EV_LOG(kInfo, "epoll_ctl calls: %d", epoll_ctl_calls);
+  EV_VERIFY(epoll_ctl_calls == 1);
+
+  a.UnInit();
+  b.UnInit();
+  reactor.reset();
+  safe_close(fd[0]);
+  safe_close(fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+struct Test3_Helper
+{
+  Stream * writer;
+  std::string expected;
+  std::string received;
+  int files_sent;
+  int eof;
+};
+
+static void Test3_WriterCallback(Stream * /*stream*/, int event, void * user_data)
+{
+  Test3_Helper * helper = (Test3_Helper *)user_data;
+  EV_VERIFY(event == kStreamFileSent);
+  helper->files_sent++;
+}
+
+static void Test3_ReaderCallback(Stream * stream, int event, void * user_data)
+{
+  Test3_Helper * helper = (Test3_Helper *)user_data;
+  char buf[4096];
+  size_t n;
+
+  if (event & kStreamRead)
+  {
+    while ((n = stream->input()->Read(buf, sizeof(buf))) != 0)
+      helper->received.append(buf, n);
+  }
+  else if (event & kStreamEOF)
+  {
+    helper->eof = 1;
+    stream->UnInit();
+    helper->writer->UnInit();
+  }
+  else
+  {
+    EV_VERIFY(0);
+  }
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: file ranges interleaved with writes");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Stream writer(&pool);
+  Stream reader(&pool);
+  Test3_Helper helper;
+  std::string file;
+  char path[] = "/tmp/stream_test.XXXXXX";
+  int fd[2];
+  int file_fd;
+
+  for (size_t i=0; i<kDataSize; i++)
+    file.push_back((char)rand());
+  file_fd = mkstemp(path);
+  EV_VERIFY(file_fd != -1);
+  EV_VERIFY(unlink(path) == 0);
+  EV_VERIFY(write(file_fd, file.data(), file.size()) == (ssize_t)file.size());
+
+  helper.writer = &writer;
+  helper.files_sent = 0;
+  helper.eof = 0;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  EV_VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == 0);
+  EV_VERIFY(writer.Init(reactor.get(), fd[0], Test3_WriterCallback, &helper) == kEvOK);
+  EV_VERIFY(reader.Init(reactor.get(), fd[1], Test3_ReaderCallback, &helper) == kEvOK);
+
+  // head, the whole file, middle, a part of the file, tail
+  EV_VERIFY(writer.Write("head", 4) == kEvOK);
+  EV_VERIFY(writer.SendFile(file_fd, 0, file.size()) == kEvOK);
+  EV_VERIFY(writer.Write("middle", 6) == kEvOK);
+  EV_VERIFY(writer.SendFile(file_fd, 100, 1000) == kEvOK);
+  EV_VERIFY(writer.SendFile(file_fd, 5000, 10) == kEvOK);
+  EV_VERIFY(writer.Write("tail", 4) == kEvOK);
+  EV_VERIFY(writer.Shutdown() == kEvOK);
+  EV_VERIFY(writer.SendFile(file_fd, 0, 1) == kEvFailure);
+  helper.expected = "head" + file + "middle" + file.substr(100, 1000)
+    + file.substr(5000, 10) + "tail";
+
+  (void)reactor->Run();
+
+  EV_VERIFY(helper.eof);
+  EV_VERIFY(helper.files_sent == 3);
+  EV_VERIFY(helper.received == helper.expected);
+
+  reactor.reset();
+  safe_close(fd[0]);
+  safe_close(fd[1]);
+  safe_close(file_fd);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+
+static const int kZeroCopyBuffers = 8;
+static const size_t kZeroCopySize = 256 * 1024;
+
+struct Test4_Helper
+{
+  Stream * writer;
+  std::string expected;
+  std::string received;
+  int released;
+  int released_by_kernel;
+  int eof;
+  int timeout;
+};
+
+static void Test4_Release(const void * data, size_t size, void * user_data)
+{
+  Test4_Helper * helper = (Test4_Helper *)user_data;
+
+  EV_VERIFY(size == kZeroCopySize);
+  helper->released++;
+  if (helper->writer->reactor())
+    helper->released_by_kernel++;
+  // the kernel is done with it, scribbling must not corrupt the data sent
+  memset((void *)data, 0, size);
+}
+
+static void Test4_ReaderCallback(Stream * stream, int event, void * user_data)
+{
+  Test4_Helper * helper = (Test4_Helper *)user_data;
+  char buf[4096];
+  size_t n;
+
+  if (event & kStreamRead)
+  {
+    while ((n = stream->input()->Read(buf, sizeof(buf))) != 0)
+      helper->received.append(buf, n);
+  }
+  else if (event & kStreamEOF)
+  {
+    helper->eof = 1;
+    stream->UnInit();
+  }
+  else
+  {
+    EV_VERIFY(0);
+  }
+}
+
+static void Test4_WriterCallback(Stream * /*stream*/, int /*event*/, void * /*user_data*/)
+{
+  EV_VERIFY(0);
+}
+
+static void Test4_Timer(int /*fd*/, int /*event*/, void * user_data)
+{
+  // give up waiting for the completions
+  Test4_Helper * helper = (Test4_Helper *)user_data;
+  helper->timeout = 1;
+}
+
+// 'sndbuf': SO_SNDBUF of the writer, or 0 for the default,
+// a small one makes every buffer take several sends
+static void Test4(int sndbuf)
+{
+  EV_LOG(kInfo, "Test 4: zero-copy writes(%s send buffer)", (sndbuf)?"small":"default");
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  BlockPool pool;
+  Stream writer(&pool);
+  Stream reader(&pool);
+  Test4_Helper helper;
+  std::vector<std::string> buffers((size_t)kZeroCopyBuffers);
+  Event timer;
+  int fd[2];
+
+  helper.writer = &writer;
+  helper.released = 0;
+  helper.released_by_kernel = 0;
+  helper.eof = 0;
+  helper.timeout = 0;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  TcpPair(fd);
+  if (sndbuf)
+    EV_VERIFY(setsockopt(fd[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+  EV_VERIFY(writer.Init(reactor.get(), fd[0], Test4_WriterCallback, &helper) == kEvOK);
+  EV_VERIFY(reader.Init(reactor.get(), fd[1], Test4_ReaderCallback, &helper) == kEvOK);
+  int zerocopy = writer.EnableZeroCopy() == kEvOK;
+  if (!zerocopy)
+    EV_LOG(kWarning, "zero-copy is not supported: %s", strerror(errno));
+
+  for (size_t i=0; i<buffers.size(); i++)
+  {
+    buffers[i].resize(kZeroCopySize);
+    for (size_t j=0; j<kZeroCopySize; j++)
+      buffers[i][j] = (char)rand();
+
+    EV_VERIFY(writer.Write("copied", 6) == kEvOK);
+    EV_VERIFY(writer.WriteZeroCopy(&buffers[i][0], kZeroCopySize, Test4_Release, &helper) == kEvOK);
+    helper.expected += "copied" + buffers[i];
+  }
+  EV_VERIFY(writer.Shutdown() == kEvOK);
+
+  // wait for EOF and the completions
+  timer.event = kEvTimer;
+  timer.callback = Test4_Timer;
+  timer.user_data = &helper;
+  EV_VERIFY(reactor->AddTimer(&timer, 5000) == kEvOK);
+
+  while ((!helper.eof || helper.released < kZeroCopyBuffers) && !helper.timeout)
+    (void)reactor->RunOne();
+  (void)timer.Del();
+  writer.UnInit();
+
+  EV_LOG(kInfo, "%d buffers released by the kernel", helper.released_by_kernel);
+  EV_VERIFY(helper.eof);
+  EV_VERIFY(helper.received == helper.expected);
+  EV_VERIFY(helper.released == kZeroCopyBuffers);
+  // completions of all sends are counted, not only those after the last send of a buffer
+  if (zerocopy)
+    EV_VERIFY(helper.released_by_kernel == kZeroCopyBuffers);
+
+  reactor.reset();
+  safe_close(fd[0]);
+  safe_close(fd[1]);
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  Test0();
+  Test1();
+  Test2();
+  Test3();
+  Test4(0);
+  Test4(16 * 1024);
+  return 0;
+}
@@ -0,0 +1,70 @@
+/** @file
+ * @brief intrusive lock-free multiple producers single consumer task queue
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_TASK_QUEUE_H
+#define LIBEV_TASK_QUEUE_H
+
+#include "ev.h"
+
+namespace libev {
+
+  struct TaskNode
+  {
+    TaskNode * next;
+    ev_task_callback callback;
+    void * user_data;
+  };
+
+  class TaskQueue
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(TaskQueue);
+
+      // producers push onto a lock-free stack,
+      // the consumer takes the whole stack at a time and reverses it
+      TaskNode * volatile head_;
+
+    public:
+      TaskQueue() : head_(0) {}
+
+      bool empty()const
+      {
+        return head_ == 0;
+      }
+
+      // may be called from any thread
+      void push(TaskNode * node)
+      {
+        TaskNode * head;
+        do
+        {
+          head = head_;
+          node->next = head;
+        } while (!__sync_bool_compare_and_swap(&head_, head, node));
+      }
+
+      // must be called from the consumer thread only
+      // return all nodes in FIFO order as a singly linked list
+      TaskNode * pop_all()
+      {
+        TaskNode * node = __sync_lock_test_and_set(&head_, (TaskNode *)0);
+        TaskNode * prev = 0;
+        TaskNode * next;
+
+        while (node)
+        {
+          next = node->next;
+          node->next = prev;
+          prev = node;
+          node = next;
+        }
+        return prev;
+      }
+  };
+}
+
+#endif
@@ -0,0 +1,57 @@
+/** @file
+ * @brief helpers shared by tests and benchmarks
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_TEST_UTIL_H
+#define LIBEV_TEST_UTIL_H
+
+#include "log.h"
+#include "header.h"
+#include <string>
+#include <vector>
+
+namespace libev {
+
+  // connect a pair of TCP sockets over the loopback
+  inline void TcpPair(int fd[2])
+  {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listener;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    EV_VERIFY((listener = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    EV_VERIFY(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    EV_VERIFY(listen(listener, 1) == 0);
+    EV_VERIFY(getsockname(listener, (struct sockaddr *)&addr, &len) == 0);
+    EV_VERIFY((fd[0] = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    EV_VERIFY(connect(fd[0], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    EV_VERIFY((fd[1] = accept(listener, 0, 0)) != -1);
+    safe_close(listener);
+  }
+
+  // 'size' bytes of a pattern determined by 'seed'
+  inline std::string Payload(size_t size, int seed)
+  {
+    std::string data(size, '\0');
+    for (size_t i=0; i<size; i++)
+      data[i] = (char)(seed + i * 7);
+    return data;
+  }
+
+  // close and clear 'fds'
+  inline void CloseAll(std::vector<int> * fds)
+  {
+    for (size_t i=0; i<fds->size(); i++)
+      safe_close((*fds)[i]);
+    fds->clear();
+  }
+}
+
+#endif
@@ -0,0 +1,111 @@
+/** @file
+ * @brief benchmark timers in the min heap and the timing wheel
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+
+using namespace libev;
+
+static int counter;
+
+static void Callback(int /*fd*/, int /*event*/, void * /*user_data*/)
+{
+  counter++;
+}
+
+static double Now()
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1000000000;
+}
+
+// set 'ts' to 'usec' microseconds later than 'base'
+static void After(const timespec * base, long usec, timespec * ts)
+{
+  *ts = *base;
+  ts->tv_nsec += usec * 1000;
+  ts->tv_sec += ts->tv_nsec / 1000000000;
+  ts->tv_nsec %= 1000000000;
+}
+
+static void AddTimers(Reactor * reactor, Event * ev, int n, int event,
+    long min_usec, long max_usec)
+{
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+
+  for (int i=0; i<n; i++)
+  {
+    ev[i].fd = -1;
+    ev[i].event = event;
+    ev[i].callback = Callback;
+    ev[i].user_data = 0;
+    After(&now, min_usec + rand() % (max_usec - min_usec), &ev[i].timeout);
+    EV_VERIFY(reactor->Add(&ev[i]) == kEvOK);
+  }
+}
+
+static void Bench(const char * name, int flags, int n)
+{
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event * ev = new Event[n];
+  double begin, add, del, expire;
+
+  EV_VERIFY(reactor->Init(flags) == kEvOK);
+
+  // far timers, which are added and deleted but never expire(idle timeouts)
+  begin = Now();
+  AddTimers(reactor.get(), ev, n, kEvTimer, 10000000, 70000000);// 10s ~ 70s
+  add = Now() - begin;
+
+  begin = Now();
+  for (int i=0; i<n; i++)
+    EV_VERIFY(ev[i].Del() == kEvOK);
+  del = Now() - begin;
+
+  // near timers, which expire together
+  counter = 0;
+  AddTimers(reactor.get(), ev, n, kEvTimer, 1, 20000);// 0 ~ 20ms
+  usleep(30000);
+  begin = Now();
+  while (counter < n)
+    (void)reactor->RunOne();
+  expire = Now() - begin;
+
+  printf("%-6s %8d timers: add %8.1f ns/op, del %8.1f ns/op, expire %8.1f ns/op\n",
+      name, n, add * 1e9 / n, del * 1e9 / n, expire * 1e9 / n);
+
+  reactor.reset();
+  delete [] ev;
+}
+
+int main(int argc, char ** argv)
+{
+  static const int kSizes[] = {1000, 100000, 1000000};
+
+  GlobalLog().SetLevel(kWarning);
+  srand(0);
+
+  if (argc > 1)
+  {
+    int n = atoi(argv[1]);
+    EV_VERIFY(n > 0);
+    Bench("heap", kEvBackendEpoll, n);
+    Bench("wheel", kEvBackendEpoll|kEvTimerWheel, n);
+    return 0;
+  }
+
+  for (size_t i=0; i<sizeof(kSizes)/sizeof(kSizes[0]); i++)
+  {
+    Bench("heap", kEvBackendEpoll, kSizes[i]);
+    Bench("wheel", kEvBackendEpoll|kEvTimerWheel, kSizes[i]);
+  }
+  return 0;
+}
@@ -9,9 +9,19 @@
 #include "log.h"
 #include "scoped_ptr.h"
 #include "header.h"
+#include <sys/epoll.h>
 
 using namespace libev;
 
+// count epoll_wait calls made by the reactor, one per iteration of its loop
+static int epoll_wait_calls;
+
+extern "C" int epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout)
+{
+  epoll_wait_calls++;
+  return epoll_pwait(epfd, events, maxevents, timeout, 0);
+}
+
 struct Test0_Helper
 {
   Event * ev;
@@ -71,8 +81,205 @@ static void Test0()
   EV_LOG(kInfo, "\n\n");
 }
 
+static const int kSlackTimers = 10;
+static int counter;
+static timespec last_timeout;
+
+static void Test1_Callback(int /*fd*/, int /*event*/, void * user_data)
+{
+  int slack = *(const int *)user_data;
+  timespec now;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+
+  // all timers expire in one batch after the last timeout
+  if (slack)
+    EV_VERIFY(timespec_le(&last_timeout, &now));
+  counter++;
+}
+
+static void Test1(int flags, int slack)
+{
+  EV_LOG(kInfo, "Test 1: timers within the slack share one wakeup(%s)",
+      (slack)?"slack":"no slack");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event ev[kSlackTimers];
+  timespec slack_ts = {0, 5000000};// 5ms
+  timespec timeout;
+
+  EV_VERIFY(reactor->Init(flags) == kEvOK);
+  if (slack)
+    EV_VERIFY(reactor->SetTimerSlack(&slack_ts) == kEvOK);
+
+  // 10ms ~ 13.6ms
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &timeout) != -1);
+  timeout.tv_nsec += 10000000;
+  for (int i=0; i<kSlackTimers; i++)
+  {
+    timespec_fix(&timeout);
+    ev[i].timeout = timeout;
+    ev[i].event = kEvTimer;
+    ev[i].callback = Test1_Callback;
+    ev[i].user_data = &slack;
+    EV_VERIFY(reactor->Add(&ev[i]) == kEvOK);
+    last_timeout = timeout;
+    timeout.tv_nsec += 400000;
+  }
+
+  epoll_wait_calls = 0;
+  (void)reactor->Run();
+  EV_VERIFY(counter == kSlackTimers);
+  EV_LOG(kInfo, "epoll_wait calls: %d", epoll_wait_calls);
+  // one wakeup with the slack, and the reactor quits without waiting again
+  if (slack)
+    EV_VERIFY(epoll_wait_calls == 1);
+  else
+    EV_VERIFY(epoll_wait_calls > 1);
+  reactor.reset();
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static const int kRepeatTimes = 12;
+static timespec times[kRepeatTimes];
+static Reactor * test2_reactor;
+
+static void Test2_Callback(int /*fd*/, int event, void * user_data)
+{
+  Event * ev = (Event *)user_data;
+  timespec now;
+
+  EV_VERIFY(event & kEvTimer);
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  // 'timeout' is the next timeout after the time of this iteration,
+  // the clock itself may have passed it while missed intervals are caught up
+  EV_VERIFY(timespec_less(test2_reactor->Now(), &ev->timeout));
+  times[counter] = now;
+
+  if (counter == 0)
+  {
+    // miss 10 intervals
+    usleep(10500);
+  }
+  if (++counter == kRepeatTimes)
+    EV_VERIFY(ev->Del() == kEvOK);
+}
+
+static long Elapsed(const timespec * begin, const timespec * end)
+{
+  return (long)(end->tv_sec - begin->tv_sec) * 1000000 + (end->tv_nsec - begin->tv_nsec) / 1000;
+}
+
+static void Test2(int flags, int event)
+{
+  EV_LOG(kInfo, "Test 2: repeating timers(%s)",
+      (event & kEvSkipMissed)?"skip missed intervals":"catch up");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event ev;
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &ev.timeout) != -1);
+  ev.interval.tv_sec = 0;
+  ev.interval.tv_nsec = 1000000;// 1ms
+  timespec_addto(&ev.timeout, &ev.interval);
+  ev.event = event;
+  ev.callback = Test2_Callback;
+  ev.user_data = &ev;
+
+  EV_VERIFY(reactor->Init(flags) == kEvOK);
+  test2_reactor = reactor.get();
+  EV_VERIFY(reactor->Add(&ev) == kEvOK);
+  (void)reactor->Run();
+  EV_VERIFY(counter == kRepeatTimes);
+  reactor.reset();
+
+  long elapsed = Elapsed(&times[1], &times[kRepeatTimes-1]);
+  EV_LOG(kInfo, "elapsed: %ldus", elapsed);
+  if (event & kEvSkipMissed)
+  {
+    // the missed intervals are skipped, the later ones are 1ms apart
+    EV_VERIFY(elapsed >= 9000);
+  }
+  else
+  {
+    // the missed intervals are caught up at once
+    EV_VERIFY(Elapsed(&times[1], &times[10]) < 2000);
+  }
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test3_Callback(int /*fd*/, int event, void * user_data)
+{
+  Reactor * reactor = (Reactor *)user_data;
+  static timespec last_now;
+
+  // the cached clock is not earlier than the timeouts,
+  // and is the same for timers expiring in one batch
+  EV_VERIFY(event & kEvTimer);
+  if (counter == 1)
+    EV_VERIFY(timespec_equal(&last_now, reactor->Now()));
+  last_now = *reactor->Now();
+  counter++;
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: add timers relative to the cached clock");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event ev[2];
+  timespec after = {0, 5000000};// 5ms
+  timespec begin;
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  begin = *reactor->Now();
+  for (int i=0; i<2; i++)
+  {
+    ev[i].event = kEvTimer;
+    ev[i].callback = Test3_Callback;
+    ev[i].user_data = reactor.get();
+  }
+  EV_VERIFY(reactor->AddTimer(&ev[0], 5) == kEvOK);
+  EV_VERIFY(reactor->AddTimer(&ev[1], &after) == kEvOK);
+  EV_VERIFY(timespec_equal(&ev[0].timeout, &ev[1].timeout));
+  timespec_addto(&begin, &after);
+  EV_VERIFY(timespec_equal(&ev[0].timeout, &begin));
+  // an added timer can not be added again
+  EV_VERIFY(reactor->AddTimer(&ev[0], 5) == kEvExists);
+  // 'after' must be normalized
+  Event invalid;
+  invalid.event = kEvTimer;
+  invalid.callback = Test3_Callback;
+  timespec invalid_after = {0, 1000000000};
+  EV_VERIFY(reactor->AddTimer(&invalid, &invalid_after) == kEvFailure && errno == EINVAL);
+  invalid_after.tv_nsec = -1;
+  EV_VERIFY(reactor->AddTimer(&invalid, &invalid_after) == kEvFailure && errno == EINVAL);
+
+  (void)reactor->Run();
+  EV_VERIFY(counter == 2);
+  EV_VERIFY(timespec_le(&begin, reactor->Now()));
+  reactor.reset();
+
+  EV_LOG(kInfo, "\n\n");
+}
+
 int main()
 {
   Test0();
+  Test1(kEvBackendEpoll, 0);
+  Test1(kEvBackendEpoll, 1);
+  Test1(kEvBackendEpoll|kEvTimerWheel, 0);
+  Test1(kEvBackendEpoll|kEvTimerWheel, 1);
+  Test2(kEvBackendEpoll, kEvTimer|kEvPersist);
+  Test2(kEvBackendEpoll, kEvTimer|kEvPersist|kEvSkipMissed);
+  Test2(kEvBackendEpoll|kEvTimerWheel, kEvTimer|kEvPersist);
+  Test2(kEvBackendEpoll|kEvTimerWheel, kEvTimer|kEvPersist|kEvSkipMissed);
+  Test3();
   return 0;
 }
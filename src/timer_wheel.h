@@ -0,0 +1,300 @@
+/** @file
+ * @brief intrusive hierarchical timing wheel
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#ifndef LIBEV_TIMER_WHEEL_H
+#define LIBEV_TIMER_WHEEL_H
+
+#include "ev.h"
+#include "log.h"
+#include "header.h"
+
+namespace libev {
+
+  // Timers are hashed into slots by their expiration ticks.
+  // The root level has 256 slots of 1 tick,
+  // each of the other 4 levels has 64 slots of 64 times the ticks of the lower level,
+  // so the wheel covers 2^32 ticks, and farther timers are hashed to the last slot.
+  // Timers of upper levels are cascaded to lower levels when the wheel turns.
+  // push and erase are O(1).
+  // Timers never expire earlier than their timeouts, but may expire 1 tick later.
+  class TimerWheel
+  {
+    private:
+      DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+
+      enum
+      {
+        kLevels = 5,
+        kRootBits = 8,
+        kRootSize = 1 << kRootBits,
+        kLevelBits = 6,
+        kLevelSize = 1 << kLevelBits,
+        kSlots = kRootSize + (kLevels - 1) * kLevelSize,
+        kExpired = kLevels// Event.fd of expired timers
+      };
+
+      List slots_[kSlots];
+      List expired_;// expired timers that are not popped
+      size_t count_[kLevels + 1];// the number of timers in each level and 'expired_'
+      size_t size_;
+      uint64_t tick_ns_;// nanoseconds per tick
+      uint64_t current_;// the next tick to be processed
+
+    private:
+      static uint64_t to_ns(const timespec * ts)
+      {
+        return (uint64_t)timespec_to_ns(ts);
+      }
+
+      static int shift(size_t level)
+      {
+        return kRootBits + (int)(level - 1) * kLevelBits;
+      }
+
+      List * slot(size_t level, uint64_t tick)
+      {
+        if (level == 0)
+          return &slots_[tick & (kRootSize - 1)];
+        return &slots_[kRootSize + (level - 1) * kLevelSize
+          + ((tick >> shift(level)) & (kLevelSize - 1))];
+      }
+
+      // the first tick not earlier than the timeout of 'node'
+      uint64_t expires(const Event * node)const
+      {
+        uint64_t tick = (to_ns(&node->timeout) + tick_ns_ - 1) / tick_ns_;
+        return (tick < current_)?(current_):(tick);
+      }
+
+      void link(Event * node, uint64_t tick)
+      {
+        EV_ASSERT(tick >= current_);
+        uint64_t delta = tick - current_;
+        size_t level = 0;
+
+        if (delta >= kRootSize)
+        {
+          for (level=1; level<kLevels-1; level++)
+          {
+            if (delta < ((uint64_t)1 << (shift(level) + kLevelBits)))
+              break;
+          }
+          if (delta >= ((uint64_t)1 << (shift(level) + kLevelBits)))
+            tick = current_ + ((uint64_t)1 << (shift(level) + kLevelBits)) - 1;
+        }
+
+        slot(level, tick)->push_back(&node->_timer);
+        node->fd = (int)level;
+        count_[level]++;
+      }
+
+      void unlink(Event * node)
+      {
+        List::erase(&node->_timer);
+        count_[(size_t)node->fd]--;
+      }
+
+      // re-hash timers in the slot of 'level' to lower levels
+      void cascade(size_t level)
+      {
+        List * list = slot(level, current_);
+        Event * node;
+
+        while (!list->empty())
+        {
+          node = ev_container_of(list->front(), Event, _timer);
+          unlink(node);
+          link(node, expires(node));
+        }
+      }
+
+      // the tick of timeout of the next timer in 'level', or 0 if 'level' is empty
+      uint64_t next(size_t level)
+      {
+        if (count_[level] == 0)
+          return 0;
+
+        if (level == 0)
+        {
+          for (uint64_t tick=current_; tick<current_+kRootSize; tick++)
+          {
+            if (!slot(0, tick)->empty())
+              return tick;
+          }
+        }
+        else
+        {
+          // timers in upper levels are cascaded at the beginning of their slots
+          uint64_t mask = ((uint64_t)1 << shift(level)) - 1;
+          uint64_t tick = (current_ + mask) & ~mask;
+          for (int i=0; i<kLevelSize; i++, tick+=mask+1)
+          {
+            if (!slot(level, tick)->empty())
+              return tick;
+          }
+        }
+
+        EV_ASSERT(0);
+        return 0;
+      }
+
+      void to_timespec(uint64_t tick, timespec * ts)const
+      {
+        uint64_t ns = tick * tick_ns_;
+        ts->tv_sec = (time_t)(ns / 1000000000);
+        ts->tv_nsec = (long)(ns % 1000000000);
+      }
+
+    public:
+      TimerWheel() : size_(0), tick_ns_(1000000), current_(0)
+      {
+        for (size_t i=0; i<=kLevels; i++)
+          count_[i] = 0;
+      }
+
+      bool empty()const
+      {
+        return size_ == 0;
+      }
+
+      size_t size()const
+      {
+        return size_;
+      }
+
+      // 'tick' must be set when the wheel is empty
+      void set_tick(const timespec * tick)
+      {
+        EV_ASSERT(empty());
+        tick_ns_ = to_ns(tick);
+        EV_ASSERT(tick_ns_ != 0);
+      }
+
+      // turn the wheel to 'now', only when the wheel is empty
+      void reset(const timespec * now)
+      {
+        EV_ASSERT(empty());
+        current_ = to_ns(now) / tick_ns_;
+      }
+
+      // push 'node', and set 'deadline' to the time when the wheel must be turned for it
+      void push(Event * node, timespec * deadline)
+      {
+        EV_ASSERT(timespec_isset(&node->timeout));
+        EV_ASSERT(node->fd == -1);
+
+        uint64_t tick = expires(node);
+        link(node, tick);
+        size_++;
+        to_timespec(tick, deadline);
+      }
+
+      void erase(Event * node)
+      {
+        EV_ASSERT(node->fd != -1);
+        EV_ASSERT(!empty());
+
+        unlink(node);
+        size_--;
+        node->fd = -1;
+      }
+
+      // turn the wheel to 'now', timers expired are to be popped by 'pop'
+      void advance(const timespec * now)
+      {
+        uint64_t target = to_ns(now) / tick_ns_;
+        size_t level;
+        Event * node;
+
+        while (current_ <= target)
+        {
+          if (count_[0] == 0)
+          {
+            // skip to the next cascade of the lowest non-empty level
+            for (level=1; level<kLevels; level++)
+            {
+              if (count_[level])
+                break;
+            }
+            if (level == kLevels)
+            {
+              current_ = target + 1;
+              break;
+            }
+
+            uint64_t mask = ((uint64_t)1 << shift(level)) - 1;
+            if (current_ & mask)
+            {
+              if ((current_ | mask) + 1 > target)
+              {
+                current_ = target + 1;
+                break;
+              }
+              current_ = (current_ | mask) + 1;
+            }
+          }
+
+          if ((current_ & (kRootSize - 1)) == 0)
+          {
+            for (level=1; level<kLevels; level++)
+            {
+              cascade(level);
+              if ((current_ >> shift(level)) & (kLevelSize - 1))
+                break;
+            }
+          }
+
+          List * list = slot(0, current_);
+          while (!list->empty())
+          {
+            node = ev_container_of(list->front(), Event, _timer);
+            unlink(node);
+            expired_.push_back(&node->_timer);
+            node->fd = kExpired;
+            count_[kExpired]++;
+          }
+
+          current_++;
+        }
+      }
+
+      // pop an expired timer, return 0 if there is none
+      Event * pop()
+      {
+        if (expired_.empty())
+          return 0;
+
+        Event * node = ev_container_of(expired_.front(), Event, _timer);
+        erase(node);
+        return node;
+      }
+
+      // set 'deadline' to the time when the wheel must be turned next time
+      // return 0 if there is no timer
+      int next(timespec * deadline)
+      {
+        uint64_t tick = 0, tmp;
+
+        if (size_ == count_[kExpired])
+          return 0;
+
+        for (size_t level=0; level<kLevels; level++)
+        {
+          tmp = next(level);
+          if (tmp && (tick == 0 || tmp < tick))
+            tick = tmp;
+        }
+
+        EV_ASSERT(tick);
+        to_timespec(tick, deadline);
+        return 1;
+      }
+  };
+
+}
+
+#endif
@@ -0,0 +1,181 @@
+/** @file
+ * @brief test timers in the timing wheel
+ * @author zhangyafeikimi@gmail.com
+ * @date
+ * @version
+ *
+ */
+#include "ev.h"
+#include "log.h"
+#include "scoped_ptr.h"
+#include "header.h"
+
+using namespace libev;
+
+static const int kTimers = 1000;
+static int counter;
+static int canceled;
+
+// set 'ts' to 'usec' microseconds later
+static void After(timespec * ts, long usec)
+{
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, ts) != -1);
+  ts->tv_nsec += usec * 1000;
+  ts->tv_sec += ts->tv_nsec / 1000000000;
+  ts->tv_nsec %= 1000000000;
+}
+
+static void Callback(int /*fd*/, int event, void * user_data)
+{
+  const timespec * timeout = (const timespec *)user_data;
+  timespec now;
+
+  if (event & kEvCanceled)
+  {
+    canceled++;
+    return;
+  }
+
+  // timers never expire early
+  EV_VERIFY(event & kEvTimer);
+  EV_VERIFY(clock_gettime(CLOCK_MONOTONIC, &now) != -1);
+  EV_VERIFY(timespec_le(timeout, &now));
+  counter++;
+}
+
+static void Init(Event * ev, int event, long usec)
+{
+  ev->fd = -1;
+  ev->event = event;
+  ev->callback = Callback;
+  ev->user_data = &ev->timeout;
+  After(&ev->timeout, usec);
+}
+
+static void Test0()
+{
+  EV_LOG(kInfo, "Test 0: timers in the wheel");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event * ev = new Event[kTimers];
+
+  EV_VERIFY(reactor->Init(kEvBackendEpoll|kEvTimerWheel) == kEvOK);
+  for (int i=0; i<kTimers; i++)
+  {
+    Init(&ev[i], kEvTimer, rand() % 50000);// 0 ~ 50ms
+    EV_VERIFY(reactor->Add(&ev[i]) == kEvOK);
+  }
+
+  (void)reactor->Run();
+  EV_VERIFY(counter == kTimers);
+
+  reactor.reset();
+  delete [] ev;
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test1(int flags)
+{
+  EV_LOG(kInfo, "Test 1: delete pending timers");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event * ev = new Event[kTimers];
+
+  EV_VERIFY(reactor->Init(flags) == kEvOK);
+  for (int i=0; i<kTimers; i++)
+  {
+    Init(&ev[i], kEvTimer, rand() % 50000);// 0 ~ 50ms
+    EV_VERIFY(reactor->Add(&ev[i]) == kEvOK);
+  }
+  for (int i=0; i<kTimers; i+=2)
+    EV_VERIFY(ev[i].Del() == kEvOK);
+
+  (void)reactor->Run();
+  EV_VERIFY(counter == kTimers / 2);
+
+  reactor.reset();
+  delete [] ev;
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test2()
+{
+  EV_LOG(kInfo, "Test 2: timers are cascaded from upper levels");
+
+  counter = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event * ev = new Event[kTimers];
+  timespec tick = {0, 10000};// 10us
+
+  // 100 ~ 20000 ticks, in level 0, 1, 2
+  EV_VERIFY(reactor->Init(kEvBackendEpoll|kEvTimerWheel) == kEvOK);
+  // the tick must be normalized
+  timespec invalid_tick = {0, 1000000000};
+  EV_VERIFY(reactor->SetTimerWheelTick(&invalid_tick) == kEvFailure && errno == EINVAL);
+  EV_VERIFY(reactor->SetTimerWheelTick(&tick) == kEvOK);
+  for (int i=0; i<kTimers; i++)
+  {
+    Init(&ev[i], kEvTimer, 1000 + rand() % 199000);// 1ms ~ 200ms
+    EV_VERIFY(reactor->Add(&ev[i]) == kEvOK);
+  }
+  // the tick can not be changed now
+  EV_VERIFY(reactor->SetTimerWheelTick(&tick) == kEvExists);
+
+  (void)reactor->Run();
+  EV_VERIFY(counter == kTimers);
+
+  reactor.reset();
+  delete [] ev;
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+static void Test3()
+{
+  EV_LOG(kInfo, "Test 3: timers in the heap and the wheel, canceling pending timers");
+
+  counter = 0;
+  canceled = 0;
+
+  ScopedPtr<Reactor> reactor(new Reactor);
+  Event * ev = new Event[kTimers];
+
+  EV_VERIFY(reactor->Init() == kEvOK);
+  for (int i=0; i<kTimers; i++)
+  {
+    Init(&ev[i], (i % 2)?(kEvTimer|kEvWheel):(kEvTimer), rand() % 50000);// 0 ~ 50ms
+    EV_VERIFY(reactor->Add(&ev[i]) == kEvOK);
+  }
+  for (int i=0; i<kTimers; i+=4)
+  {
+    EV_VERIFY(ev[i].Cancel() == kEvOK);
+    EV_VERIFY(ev[i+1].Cancel() == kEvOK);
+  }
+
+  (void)reactor->Run();
+  EV_VERIFY(canceled == kTimers / 2);
+  EV_VERIFY(counter == kTimers / 2);
+
+  reactor.reset();
+  delete [] ev;
+
+  EV_LOG(kInfo, "\n\n");
+}
+
+int main()
+{
+  srand((unsigned int)time(0));
+  Test0();
+  Test1(kEvBackendEpoll);
+  Test1(kEvBackendEpoll|kEvTimerWheel);
+  Test2();
+  Test3();
+  return 0;
+}